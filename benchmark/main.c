@@ -0,0 +1,593 @@
+#if defined(_WIN32) && !defined(_CRT_SECURE_NO_WARNINGS)
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifdef _MSC_VER
+#if !defined(__clang__)
+#pragma warning(disable : 5105)
+#endif
+#endif
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wnonportable-system-include-path"
+#if __has_warning("-Wunsafe-buffer-usage")
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#endif
+#endif
+
+#include <rpmalloc.h>
+#include <thread.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+//! Random or fixed size blocks with scattered free/alloc and cross-thread handoff (the documented benchmark)
+#define MODE_RANDOM 0
+#define MODE_FIXED 1
+//! Producer threads allocate batches that paired consumer threads free
+#define MODE_PRODUCER_CONSUMER 2
+//! Blocks grown by realloc from min to max size, crossing into huge blocks for large max sizes
+#define MODE_HUGE_REALLOC 3
+//! Random size blocks allocated from one first class heap per thread, released with rpmalloc_heap_free_all. There
+//  is no cross-thread handoff since heaps are not thread safe
+#define MODE_FIRST_CLASS_HEAP 4
+#define MODE_COUNT 5
+
+#if !RPMALLOC_FIRST_CLASS_HEAPS
+typedef struct heap_t rpmalloc_heap_t;
+#define rpmalloc_heap_alloc(heap, size) rpmalloc(size)
+#define rpmalloc_heap_free(heap, block) rpfree(block)
+#define rpmalloc_heap_free_all(heap) ((void)(heap))
+#endif
+
+#define DISTRIBUTION_EVEN 0
+#define DISTRIBUTION_LINEAR 1
+#define DISTRIBUTION_EXPONENTIAL 2
+
+//! Number of precomputed random sizes per thread
+#define SIZE_TABLE_COUNT 8192
+//! Every n:th operation is timed for the latency histogram, timing every operation would dominate the result
+#define LATENCY_SAMPLE_RATE 16
+//! Latency histogram has 8 buckets per power of two nanoseconds, giving 12.5% resolution
+#define LATENCY_BUCKET_COUNT 512
+
+typedef struct benchmark_block_t benchmark_block_t;
+typedef struct benchmark_thread_t benchmark_thread_t;
+
+//! Header written into blocks handed off to another thread
+struct benchmark_block_t {
+	benchmark_block_t* next;
+	size_t size;
+};
+
+struct benchmark_thread_t {
+	//! Thread index
+	size_t index;
+	//! Thread blocks are handed off to
+	benchmark_thread_t* target;
+	//! Blocks handed off to this thread, lock free stack of chains
+	atomic_uintptr_t incoming;
+	//! Blocks handed off to this thread but not yet freed, used to throttle producers
+	atomic_size_t pending;
+	//! Number of sequences this thread has handed off all blocks for
+	atomic_uint produced;
+	//! Random generator state and position in the size table
+	uint64_t random;
+	size_t size_index;
+	//! Number of sequences completed, used to synchronize at sequence ends
+	unsigned int sequence;
+	//! Slots for the scattered free/alloc pattern
+	void** block;
+	size_t* block_size;
+	size_t* size_table;
+	//! Requested bytes not yet flushed to the global counter
+	long long requested_delta;
+	//! Operations performed and sampled latencies
+	unsigned long long ops;
+	unsigned long long latency[LATENCY_BUCKET_COUNT];
+	uintptr_t handle;
+};
+
+static unsigned int benchmark_mode;
+static unsigned int benchmark_distribution;
+static size_t benchmark_thread_count;
+static size_t benchmark_cross_rate;
+static size_t benchmark_loop_count;
+static size_t benchmark_block_count;
+static size_t benchmark_op_count;
+static size_t benchmark_min_size;
+static size_t benchmark_max_size;
+
+static atomic_llong benchmark_requested;
+static atomic_llong benchmark_requested_peak;
+static atomic_uint benchmark_sequence_barrier;
+
+static uint64_t
+timer_current(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * (1000000000.0 / (double)frequency.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static size_t
+process_peak_rss(void) {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return (size_t)counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+#if defined(__APPLE__)
+	return (size_t)usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static uint64_t
+random_next(benchmark_thread_t* thread) {
+	// xorshift64*
+	uint64_t x = thread->random;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	thread->random = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t
+random_size(benchmark_thread_t* thread) {
+	size_t range = benchmark_max_size - benchmark_min_size + 1;
+	uint64_t value = random_next(thread);
+	if (benchmark_distribution == DISTRIBUTION_LINEAR) {
+		// Minimum of two uniform values has a density falling off linearly with size
+		uint64_t other = random_next(thread);
+		if (other < value)
+			value = other;
+		return benchmark_min_size + (size_t)((value >> 11) % range);
+	}
+	if (benchmark_distribution == DISTRIBUTION_EXPONENTIAL) {
+		// Each halving of the range is half as likely, a piecewise approximation of exponential falloff
+		size_t top = range;
+		while ((top > 1) && (value & 1)) {
+			top >>= 1;
+			value >>= 1;
+		}
+		size_t bottom = top >> 1;
+		return benchmark_min_size + bottom + (size_t)((random_next(thread) >> 11) % (top - bottom));
+	}
+	return benchmark_min_size + (size_t)((value >> 11) % range);
+}
+
+static size_t
+next_size(benchmark_thread_t* thread) {
+	size_t size = thread->size_table[thread->size_index++];
+	if (thread->size_index == SIZE_TABLE_COUNT)
+		thread->size_index = 0;
+	return size;
+}
+
+static size_t
+latency_bucket(uint64_t ns) {
+	if (ns < 8)
+		return (size_t)ns;
+	unsigned int msb = 3;
+	while (ns >> (msb + 1))
+		++msb;
+	size_t bucket = 8 + ((size_t)(msb - 3) * 8) + (size_t)((ns >> (msb - 3)) & 7);
+	return (bucket < LATENCY_BUCKET_COUNT) ? bucket : (LATENCY_BUCKET_COUNT - 1);
+}
+
+static uint64_t
+latency_bucket_value(size_t bucket) {
+	if (bucket < 8)
+		return bucket;
+	size_t msb = ((bucket - 8) / 8) + 3;
+	return (uint64_t)(8 + ((bucket - 8) % 8)) << (msb - 3);
+}
+
+static void
+requested_flush(benchmark_thread_t* thread) {
+	long long current = atomic_fetch_add_explicit(&benchmark_requested, thread->requested_delta, memory_order_relaxed) +
+	                    thread->requested_delta;
+	thread->requested_delta = 0;
+	long long peak = atomic_load_explicit(&benchmark_requested_peak, memory_order_relaxed);
+	while (current > peak) {
+		if (atomic_compare_exchange_weak_explicit(&benchmark_requested_peak, &peak, current, memory_order_relaxed,
+		                                          memory_order_relaxed))
+			break;
+	}
+}
+
+//! Write one byte in every page of the range so the resident size reflects the requested bytes
+static void
+block_touch(void* block, size_t offset, size_t size) {
+	for (; offset < size; offset += 4096)
+		((volatile char*)block)[offset] = 1;
+	((volatile char*)block)[size - 1] = 1;
+}
+
+//! Allocate a block, timing every LATENCY_SAMPLE_RATE:th operation
+static void*
+benchmark_alloc(benchmark_thread_t* thread, rpmalloc_heap_t* heap, size_t size) {
+	void* block;
+	if ((thread->ops++ % LATENCY_SAMPLE_RATE) == 0) {
+		uint64_t start = timer_current();
+		block = heap ? rpmalloc_heap_alloc(heap, size) : rpmalloc(size);
+		++thread->latency[latency_bucket(timer_current() - start)];
+	} else {
+		block = heap ? rpmalloc_heap_alloc(heap, size) : rpmalloc(size);
+	}
+	block_touch(block, 0, size);
+	thread->requested_delta += (long long)size;
+	return block;
+}
+
+static void
+benchmark_free(benchmark_thread_t* thread, rpmalloc_heap_t* heap, void* block, size_t size) {
+	if ((thread->ops++ % LATENCY_SAMPLE_RATE) == 0) {
+		uint64_t start = timer_current();
+		heap ? rpmalloc_heap_free(heap, block) : rpfree(block);
+		++thread->latency[latency_bucket(timer_current() - start)];
+	} else {
+		heap ? rpmalloc_heap_free(heap, block) : rpfree(block);
+	}
+	thread->requested_delta -= (long long)size;
+}
+
+static void*
+benchmark_realloc(benchmark_thread_t* thread, void* block, size_t size, size_t old_size) {
+	void* result;
+	if ((thread->ops++ % LATENCY_SAMPLE_RATE) == 0) {
+		uint64_t start = timer_current();
+		result = rprealloc(block, size);
+		++thread->latency[latency_bucket(timer_current() - start)];
+	} else {
+		result = rprealloc(block, size);
+	}
+	block_touch(result, old_size, size);
+	thread->requested_delta += (long long)size - (long long)old_size;
+	return result;
+}
+
+static void
+handoff_push(benchmark_thread_t* target, benchmark_block_t* first, benchmark_block_t* last, size_t count) {
+	atomic_fetch_add_explicit(&target->pending, count, memory_order_relaxed);
+	uintptr_t head = atomic_load_explicit(&target->incoming, memory_order_relaxed);
+	do {
+		last->next = (benchmark_block_t*)head;
+	} while (!atomic_compare_exchange_weak_explicit(&target->incoming, &head, (uintptr_t)first, memory_order_release,
+	                                                memory_order_relaxed));
+}
+
+//! Free all blocks handed off to this thread, returns number of blocks freed
+static size_t
+handoff_drain(benchmark_thread_t* thread) {
+	benchmark_block_t* block =
+	    (benchmark_block_t*)atomic_exchange_explicit(&thread->incoming, 0, memory_order_acquire);
+	size_t count = 0;
+	while (block) {
+		benchmark_block_t* next = block->next;
+		benchmark_free(thread, 0, block, block->size);
+		block = next;
+		++count;
+	}
+	if (count)
+		atomic_fetch_sub_explicit(&thread->pending, count, memory_order_relaxed);
+	return count;
+}
+
+//! Allocate op count blocks and hand them off to the target thread
+static void
+handoff_batch(benchmark_thread_t* thread) {
+	benchmark_block_t* first = 0;
+	benchmark_block_t* last = 0;
+	for (size_t iop = 0; iop < benchmark_op_count; ++iop) {
+		size_t size = next_size(thread);
+		benchmark_block_t* block = benchmark_alloc(thread, 0, size);
+		block->size = size;
+		block->next = first;
+		first = block;
+		if (!last)
+			last = block;
+	}
+	if (first)
+		handoff_push(thread->target, first, last, benchmark_op_count);
+}
+
+//! Wait until all threads reach the barrier, draining handed off blocks while waiting
+static void
+sequence_barrier(benchmark_thread_t* thread) {
+	atomic_fetch_add_explicit(&benchmark_sequence_barrier, 1, memory_order_acq_rel);
+	unsigned int target = ++thread->sequence * (unsigned int)benchmark_thread_count;
+	while (atomic_load_explicit(&benchmark_sequence_barrier, memory_order_acquire) < target) {
+		if (!handoff_drain(thread))
+			thread_yield();
+		requested_flush(thread);
+	}
+	handoff_drain(thread);
+}
+
+static void
+sequence_scattered(benchmark_thread_t* thread, rpmalloc_heap_t* heap) {
+	for (size_t iblock = 0; iblock < benchmark_block_count; ++iblock) {
+		size_t size = next_size(thread);
+		thread->block[iblock] = benchmark_alloc(thread, heap, size);
+		thread->block_size[iblock] = size;
+	}
+	requested_flush(thread);
+	for (size_t iloop = 0; iloop < benchmark_loop_count; ++iloop) {
+		// Free and reallocate blocks scattered across the entire set of slots
+		for (size_t iop = 0; iop < benchmark_op_count; ++iop) {
+			size_t slot = (size_t)(random_next(thread) >> 11) % benchmark_block_count;
+			if (thread->block[slot])
+				benchmark_free(thread, heap, thread->block[slot], thread->block_size[slot]);
+			thread->block[slot] = 0;
+		}
+		for (size_t iop = 0; iop < benchmark_op_count; ++iop) {
+			size_t slot = (size_t)(random_next(thread) >> 11) % benchmark_block_count;
+			if (thread->block[slot])
+				benchmark_free(thread, heap, thread->block[slot], thread->block_size[slot]);
+			size_t size = next_size(thread);
+			thread->block[slot] = benchmark_alloc(thread, heap, size);
+			thread->block_size[slot] = size;
+		}
+		if (!heap) {
+			if (benchmark_cross_rate && ((iloop % benchmark_cross_rate) == 0))
+				handoff_batch(thread);
+			handoff_drain(thread);
+		}
+		requested_flush(thread);
+	}
+	if (heap) {
+		// Releasing everything at once is the point of a first class heap
+		uint64_t start = timer_current();
+		rpmalloc_heap_free_all(heap);
+		++thread->latency[latency_bucket(timer_current() - start)];
+		++thread->ops;
+		for (size_t iblock = 0; iblock < benchmark_block_count; ++iblock) {
+			if (thread->block[iblock])
+				thread->requested_delta -= (long long)thread->block_size[iblock];
+			thread->block[iblock] = 0;
+		}
+	} else {
+		for (size_t iblock = 0; iblock < benchmark_block_count; ++iblock) {
+			if (thread->block[iblock])
+				benchmark_free(thread, 0, thread->block[iblock], thread->block_size[iblock]);
+			thread->block[iblock] = 0;
+		}
+	}
+	requested_flush(thread);
+}
+
+static void
+sequence_producer_consumer(benchmark_thread_t* thread) {
+	int is_producer = !(thread->index & 1);
+	if (is_producer) {
+		for (size_t iloop = 0; iloop < benchmark_loop_count; ++iloop) {
+			// Throttle so a slow consumer does not let the queue grow without bound
+			while ((thread->target != thread) &&
+			       (atomic_load_explicit(&thread->target->pending, memory_order_relaxed) > benchmark_block_count))
+				thread_yield();
+			handoff_batch(thread);
+			requested_flush(thread);
+			if (thread->target == thread) {
+				handoff_drain(thread);
+				requested_flush(thread);
+			}
+		}
+		atomic_store_explicit(&thread->produced, thread->sequence + 1, memory_order_release);
+	} else {
+		benchmark_thread_t* producer = thread - 1;
+		while (atomic_load_explicit(&producer->produced, memory_order_acquire) <= thread->sequence) {
+			if (!handoff_drain(thread))
+				thread_yield();
+			requested_flush(thread);
+		}
+	}
+	handoff_drain(thread);
+	requested_flush(thread);
+}
+
+static void
+sequence_huge_realloc(benchmark_thread_t* thread) {
+	size_t step = (benchmark_max_size - benchmark_min_size) / (benchmark_op_count ? benchmark_op_count : 1);
+	if (!step)
+		step = 1;
+	for (size_t iloop = 0; iloop < benchmark_loop_count; ++iloop) {
+		size_t size = benchmark_min_size;
+		void* block = benchmark_alloc(thread, 0, size);
+		while (size < benchmark_max_size) {
+			size_t next_size = size + step;
+			if (next_size > benchmark_max_size)
+				next_size = benchmark_max_size;
+			block = benchmark_realloc(thread, block, next_size, size);
+			size = next_size;
+			requested_flush(thread);
+		}
+		benchmark_free(thread, 0, block, size);
+		requested_flush(thread);
+	}
+}
+
+static void
+benchmark_thread(void* arg) {
+	benchmark_thread_t* thread = arg;
+	rpmalloc_thread_initialize();
+
+	rpmalloc_heap_t* heap = 0;
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (benchmark_mode == MODE_FIRST_CLASS_HEAP)
+		heap = rpmalloc_heap_acquire();
+#endif
+
+	// Two loop sequences per thread run, with a full free in between
+	for (unsigned int isequence = 0; isequence < 2; ++isequence) {
+		if (benchmark_mode == MODE_PRODUCER_CONSUMER)
+			sequence_producer_consumer(thread);
+		else if (benchmark_mode == MODE_HUGE_REALLOC)
+			sequence_huge_realloc(thread);
+		else
+			sequence_scattered(thread, heap);
+		// Blocks handed off by other threads must be freed before the next sequence begins
+		sequence_barrier(thread);
+		requested_flush(thread);
+	}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (heap)
+		rpmalloc_heap_release(heap);
+#endif
+	rpmalloc_thread_finalize();
+}
+
+static int
+benchmark_usage(const char* name) {
+	fprintf(stderr,
+	        "Usage: %s <num threads> <mode> <distribution> <cross-thread rate> <loop count> <block count> <op count> "
+	        "<min size> <max size>\n"
+	        "  mode: 0 random size, 1 fixed size, 2 producer-consumer, 3 huge realloc growth, 4 first class heaps\n"
+	        "  distribution: 0 even, 1 linear falloff, 2 exponential falloff\n",
+	        name);
+	return -1;
+}
+
+int
+main(int argc, char** argv) {
+	size_t arg[9] = {2, MODE_RANDOM, DISTRIBUTION_EVEN, 2, 2000, 50000, 5000, 16, 1000};
+	for (int iarg = 1; iarg < argc; ++iarg) {
+		char* end = 0;
+		if ((iarg > 9) || !argv[iarg][0])
+			return benchmark_usage(argv[0]);
+		arg[iarg - 1] = (size_t)strtoull(argv[iarg], &end, 10);
+		if (*end)
+			return benchmark_usage(argv[0]);
+	}
+	benchmark_thread_count = arg[0] ? arg[0] : 1;
+	benchmark_mode = (unsigned int)arg[1];
+	benchmark_distribution = (unsigned int)arg[2];
+	benchmark_cross_rate = arg[3];
+	benchmark_loop_count = arg[4];
+	benchmark_block_count = arg[5] ? arg[5] : 1;
+	benchmark_op_count = arg[6];
+	// Blocks handed off to other threads carry a small header
+	benchmark_min_size = (arg[7] < sizeof(benchmark_block_t)) ? sizeof(benchmark_block_t) : arg[7];
+	benchmark_max_size = (arg[8] < benchmark_min_size) ? benchmark_min_size : arg[8];
+	if ((benchmark_mode >= MODE_COUNT) || (benchmark_distribution > DISTRIBUTION_EXPONENTIAL))
+		return benchmark_usage(argv[0]);
+	if (benchmark_op_count > benchmark_block_count)
+		benchmark_op_count = benchmark_block_count;
+#if !RPMALLOC_FIRST_CLASS_HEAPS
+	if (benchmark_mode == MODE_FIRST_CLASS_HEAP) {
+		fprintf(stderr, "First class heaps require RPMALLOC_FIRST_CLASS_HEAPS=1\n");
+		return -1;
+	}
+#endif
+
+	rpmalloc_initialize(0);
+
+	benchmark_thread_t* thread = calloc(benchmark_thread_count, sizeof(benchmark_thread_t));
+	for (size_t ithread = 0; ithread < benchmark_thread_count; ++ithread) {
+		benchmark_thread_t* current = thread + ithread;
+		current->index = ithread;
+		size_t target = ithread + 1;
+		if (benchmark_mode == MODE_PRODUCER_CONSUMER)
+			target = (!(ithread & 1) && (target < benchmark_thread_count)) ? target : ithread;
+		current->target = thread + (target % benchmark_thread_count);
+		current->random = 0x9E3779B97F4A7C15ULL * (ithread + 1);
+		current->block = calloc(benchmark_block_count, sizeof(void*));
+		current->block_size = calloc(benchmark_block_count, sizeof(size_t));
+		current->size_table = malloc(SIZE_TABLE_COUNT * sizeof(size_t));
+		for (size_t isize = 0; isize < SIZE_TABLE_COUNT; ++isize)
+			current->size_table[isize] =
+			    (benchmark_mode == MODE_FIXED) ? benchmark_min_size : random_size(current);
+	}
+
+	thread_arg* run_arg = calloc(benchmark_thread_count, sizeof(thread_arg));
+	// Threads are terminated and restarted between the two runs to measure cold and warm thread starts
+	uint64_t start = timer_current();
+	for (unsigned int irun = 0; irun < 2; ++irun) {
+		for (size_t ithread = 0; ithread < benchmark_thread_count; ++ithread) {
+			run_arg[ithread].fn = benchmark_thread;
+			run_arg[ithread].arg = thread + ithread;
+			thread[ithread].handle = thread_run(run_arg + ithread);
+		}
+		for (size_t ithread = 0; ithread < benchmark_thread_count; ++ithread)
+			thread_join(thread[ithread].handle);
+	}
+	double seconds = (double)(timer_current() - start) / 1000000000.0;
+
+	unsigned long long ops = 0;
+	unsigned long long latency[LATENCY_BUCKET_COUNT] = {0};
+	unsigned long long samples = 0;
+	for (size_t ithread = 0; ithread < benchmark_thread_count; ++ithread) {
+		ops += thread[ithread].ops;
+		for (size_t ibucket = 0; ibucket < LATENCY_BUCKET_COUNT; ++ibucket) {
+			latency[ibucket] += thread[ithread].latency[ibucket];
+			samples += thread[ithread].latency[ibucket];
+		}
+	}
+
+	const double percentile[3] = {0.5, 0.99, 0.999};
+	uint64_t percentile_ns[3] = {0};
+	unsigned long long accumulated = 0;
+	size_t ipercentile = 0;
+	for (size_t ibucket = 0; (ibucket < LATENCY_BUCKET_COUNT) && (ipercentile < 3); ++ibucket) {
+		accumulated += latency[ibucket];
+		while ((ipercentile < 3) && ((double)accumulated >= percentile[ipercentile] * (double)samples))
+			percentile_ns[ipercentile++] = latency_bucket_value(ibucket);
+	}
+
+	size_t peak_rss = process_peak_rss();
+	long long peak_requested = atomic_load_explicit(&benchmark_requested_peak, memory_order_relaxed);
+
+	printf("rpmalloc-benchmark %u threads, mode %u, distribution %u, cross-thread rate %u, %u loops, %u blocks, "
+	       "%u ops, [%u, %u] bytes\n",
+	       (unsigned int)benchmark_thread_count, benchmark_mode, benchmark_distribution,
+	       (unsigned int)benchmark_cross_rate, (unsigned int)benchmark_loop_count,
+	       (unsigned int)benchmark_block_count, (unsigned int)benchmark_op_count, (unsigned int)benchmark_min_size,
+	       (unsigned int)benchmark_max_size);
+	printf("Operations:      %llu\n", ops);
+	printf("Ops/sec:         %.0f\n", seconds > 0 ? (double)ops / seconds : 0.0);
+	printf("Latency p50:     %llu ns\n", (unsigned long long)percentile_ns[0]);
+	printf("Latency p99:     %llu ns\n", (unsigned long long)percentile_ns[1]);
+	printf("Latency p999:    %llu ns\n", (unsigned long long)percentile_ns[2]);
+	printf("Peak requested:  %lld KiB\n", peak_requested / 1024);
+	printf("Peak RSS:        %llu KiB\n", (unsigned long long)(peak_rss / 1024));
+	if (peak_requested > 0)
+		printf("Overhead:        %.1f%%\n", 100.0 * ((double)peak_rss - (double)peak_requested) / (double)peak_requested);
+
+	for (size_t ithread = 0; ithread < benchmark_thread_count; ++ithread) {
+		free(thread[ithread].block);
+		free(thread[ithread].block_size);
+		free(thread[ithread].size_table);
+	}
+	free(run_arg);
+	free(thread);
+
+	rpmalloc_finalize();
+	return 0;
+}
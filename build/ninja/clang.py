@@ -458,6 +458,8 @@ class ClangToolchain(toolchain.Toolchain):
       localvariables += [('sysroot', self.android.make_sysroot_path(arch))]
     if 'defines' in variables:
       localvariables += [('cmoreflags', ['-D' + define for define in variables['defines']])]
+    if 'cxxstd' in variables:
+      localvariables += [('cxxflags', [flag for flag in self.cxxflags if not flag.startswith('-std=')] + ['-std=c++' + variables['cxxstd']])]
     return localvariables
 
   def ar_variables(self, config, arch, targettype, variables):
@@ -269,6 +269,9 @@ class GCCToolchain(toolchain.Toolchain):
       localvariables += [('cconfigflags', cconfigflags)]
     if 'defines' in variables:
       localvariables += [('cmoreflags', ['-D' + define for define in variables['defines']])]
+    if 'cxxstd' in variables:
+      cxxstd = ('-std=c++' if self.target.is_macos() or self.target.is_ios() else '-std=gnu++') + variables['cxxstd']
+      localvariables += [('cxxflags', [flag for flag in self.cxxflags if not flag.startswith('-std=')] + [cxxstd])]
     return localvariables
 
   def ar_variables(self, config, arch, targettype, variables):
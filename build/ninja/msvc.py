@@ -354,6 +354,8 @@ class MSVCToolchain(toolchain.Toolchain):
       for define in variables['defines']:
         definelist += ['/D', '"' + define + '"']
       localvariables += [('cmoreflags', definelist)]
+    if 'cxxstd' in variables:
+      localvariables += [('cxxflags', [flag for flag in self.cxxflags if not flag.startswith('/std:c++')] + ['/std:c++' + variables['cxxstd']])]
     return localvariables
 
   def ar_variables(self, config, arch, targettype, variables):
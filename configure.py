@@ -12,9 +12,14 @@ import generator
 generator = generator.Generator(project = 'rpmalloc', variables = [('bundleidentifier', 'com.maniccoder.rpmalloc.$(binname)')])
 
 rpmalloc_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc', sources = ['rpmalloc.c'])
-rpmalloc_test_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-test', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=1', 'ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+rpmalloc_test_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-test', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=1', 'ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'ENABLE_SAMPLING=1', 'ENABLE_EVENT_LOG=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+rpmalloc_test_nostats_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-test-nostats', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=1', 'ENABLE_ASSERTS=1', 'ENABLE_SAMPLING=1', 'ENABLE_EVENT_LOG=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+rpmalloc_benchmark_lib = generator.lib(module = 'rpmalloc', libname = 'rpmalloc-benchmark', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_OVERRIDE=0', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
 
 if not generator.target.is_android() and not generator.target.is_ios():
 	rpmalloc_so = generator.sharedlib(module = 'rpmalloc', libname = 'rpmalloc', sources = ['rpmalloc.c'], variables = {'defines': ['ENABLE_DYNAMIC_LINK=1']})
 
-	generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test', implicit_deps = [rpmalloc_test_lib], libs = ['rpmalloc-test'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+	generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test', implicit_deps = [rpmalloc_test_lib], libs = ['rpmalloc-test'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'ENABLE_SAMPLING=1', 'ENABLE_EVENT_LOG=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+	generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test-nostats', implicit_deps = [rpmalloc_test_nostats_lib], libs = ['rpmalloc-test-nostats'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'ENABLE_SAMPLING=1', 'ENABLE_EVENT_LOG=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1']})
+	generator.bin(module = 'test', sources = ['thread.c', 'main.c', 'main-override.cc'], binname = 'rpmalloc-test-cxx17', implicit_deps = [rpmalloc_test_lib], libs = ['rpmalloc-test'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['ENABLE_ASSERTS=1', 'ENABLE_STATISTICS=1', 'ENABLE_SAMPLING=1', 'ENABLE_EVENT_LOG=1', 'RPMALLOC_FIRST_CLASS_HEAPS=1'], 'cxxstd': '17'})
+	generator.bin(module = 'benchmark', sources = ['main.c', os.path.join('..', 'test', 'thread.c')], binname = 'rpmalloc-benchmark', implicit_deps = [rpmalloc_benchmark_lib], libs = ['rpmalloc-benchmark'], includepaths = ['rpmalloc', 'test'], variables = {'defines': ['RPMALLOC_FIRST_CLASS_HEAPS=1']})
@@ -0,0 +1,280 @@
+/* rpallocator.h  -  Memory allocator  -  Public Domain  -  2016-2024 Mattias Jansson
+ *
+ * This library provides a cross-platform lock free thread caching malloc
+ * implementation in C11. The latest source code is always available at
+ *
+ * https://github.com/mjansson/rpmalloc
+ *
+ * This library is put in the public domain; you can redistribute it and/or
+ * modify it without any restrictions.
+ *
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <rpmalloc.h>
+
+#if (__cplusplus >= 201703L || _MSVC_LANG >= 201703L) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define RPMALLOC_HAS_MEMORY_RESOURCE 1
+#endif
+#endif
+#ifndef RPMALLOC_HAS_MEMORY_RESOURCE
+#define RPMALLOC_HAS_MEMORY_RESOURCE 0
+#endif
+
+#if !RPMALLOC_FIRST_CLASS_HEAPS
+//! Heap type, binding to a heap requires first class heaps (RPMALLOC_FIRST_CLASS_HEAPS=1) so the heap is always null
+typedef struct heap_t rpmalloc_heap_t;
+#endif
+
+namespace rp {
+
+namespace detail {
+
+//! Alignment of all blocks, larger alignments use the aligned entry points
+static constexpr std::size_t block_alignment = 16;
+
+//! Allocate a block from the given heap, or the thread heap if null
+inline void*
+allocate(rpmalloc_heap_t* heap, std::size_t alignment, std::size_t size) noexcept {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (heap)
+		return (alignment > block_alignment) ? rpmalloc_heap_aligned_alloc(heap, alignment, size)
+		                                     : rpmalloc_heap_alloc(heap, size);
+#else
+	(void)sizeof(heap);
+#endif
+	return (alignment > block_alignment) ? rpaligned_alloc(alignment, size) : rpmalloc(size);
+}
+
+//! Free a block of the given alignment and size, from any heap
+inline void
+deallocate(void* ptr, std::size_t alignment, std::size_t size) noexcept {
+	if (alignment > block_alignment)
+		rpfree_aligned_sized(ptr, alignment, size);
+	else
+		rpfree_sized(ptr, size);
+}
+
+}  // namespace detail
+
+//! Allocator meeting the standard Allocator requirements, allocating from the given first class heap or the thread
+//  heap if none. Copies share the heap, so a container and all its rebound node allocators allocate from the same
+//  heap and the whole container can be dropped with rpmalloc_heap_free_all without running destructors. The heap
+//  moves with the container on assignment and swap
+template <typename T>
+class allocator {
+public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+	typedef std::false_type is_always_equal;
+
+	allocator() noexcept : heap_(nullptr) {
+	}
+
+	explicit allocator(rpmalloc_heap_t* heap) noexcept : heap_(heap) {
+	}
+
+	template <typename U>
+	allocator(const allocator<U>& other) noexcept : heap_(other.heap()) {
+	}
+
+	T*
+	allocate(std::size_t count) {
+		if (count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		void* ptr = detail::allocate(heap_, alignof(T), count * sizeof(T));
+		if (!ptr)
+			throw std::bad_alloc();
+		return static_cast<T*>(ptr);
+	}
+
+	void
+	deallocate(T* ptr, std::size_t count) noexcept {
+		detail::deallocate(ptr, alignof(T), count * sizeof(T));
+	}
+
+	//! Heap the allocator allocates from, null for the thread heap
+	rpmalloc_heap_t*
+	heap() const noexcept {
+		return heap_;
+	}
+
+private:
+	rpmalloc_heap_t* heap_;
+};
+
+template <typename T, typename U>
+inline bool
+operator==(const allocator<T>& lhs, const allocator<U>& rhs) noexcept {
+	return lhs.heap() == rhs.heap();
+}
+
+template <typename T, typename U>
+inline bool
+operator!=(const allocator<T>& lhs, const allocator<U>& rhs) noexcept {
+	return lhs.heap() != rhs.heap();
+}
+
+//! Pool of objects of a single type, caching free blocks to hand out without going through the allocator. The block
+//  size is rounded to the block granularity at compile time, so the pool refills with a single batch allocation of a
+//  constant size and returns surplus blocks with a single batch free instead of looking up the size class for every
+//  object. Like a heap, a pool must only be used by one thread at a time. Blocks of the pool can be freed with rpfree
+//  or dropped with rpmalloc_heap_free_all on the heap of the pool, but only after calling release on the pool
+template <typename T, std::size_t BatchCount = 64>
+class object_pool {
+public:
+	static_assert(alignof(T) <= detail::block_alignment, "Over-aligned types must use rp::allocator");
+	static_assert(BatchCount > 0, "Batch count must be positive");
+
+	//! Size of the blocks of the pool
+	static constexpr std::size_t block_size =
+	    (sizeof(T) + detail::block_alignment - 1) & ~(detail::block_alignment - 1);
+
+	object_pool() noexcept : heap_(nullptr), count_(0) {
+	}
+
+	explicit object_pool(rpmalloc_heap_t* heap) noexcept : heap_(heap), count_(0) {
+	}
+
+	object_pool(const object_pool&) = delete;
+	object_pool&
+	operator=(const object_pool&) = delete;
+
+	~object_pool() {
+		release();
+	}
+
+	//! Allocate an uninitialized block for an object
+	T*
+	allocate() {
+		if (!count_) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+			if (heap_)
+				count_ = rpmalloc_heap_batch_alloc(heap_, block_size, BatchCount, block_);
+			else
+#endif
+				count_ = rpmalloc_batch_alloc(block_size, BatchCount, block_);
+			if (!count_)
+				throw std::bad_alloc();
+		}
+		return static_cast<T*>(block_[--count_]);
+	}
+
+	//! Return a block allocated from the pool, the object must already be destroyed
+	void
+	deallocate(T* ptr) noexcept {
+		if (!ptr)
+			return;
+		if (count_ == 2 * BatchCount) {
+			count_ -= BatchCount;
+			rpfree_batch(block_ + count_, BatchCount);
+		}
+		block_[count_++] = ptr;
+	}
+
+	//! Allocate a block and construct an object in it
+	template <typename... Args>
+	T*
+	create(Args&&... args) {
+		T* ptr = allocate();
+		try {
+			return ::new (static_cast<void*>(ptr)) T(std::forward<Args>(args)...);
+		} catch (...) {
+			deallocate(ptr);
+			throw;
+		}
+	}
+
+	//! Destroy an object created by the pool and return its block
+	void
+	destroy(T* ptr) noexcept {
+		if (!ptr)
+			return;
+		ptr->~T();
+		deallocate(ptr);
+	}
+
+	//! Free the cached blocks of the pool
+	void
+	release() noexcept {
+		rpfree_batch(block_, count_);
+		count_ = 0;
+	}
+
+	//! Heap the pool allocates from, null for the thread heap
+	rpmalloc_heap_t*
+	heap() const noexcept {
+		return heap_;
+	}
+
+private:
+	rpmalloc_heap_t* heap_;
+	std::size_t count_;
+	void* block_[2 * BatchCount];
+};
+
+#if RPMALLOC_HAS_MEMORY_RESOURCE
+
+//! Polymorphic memory resource allocating from the given first class heap or the thread heap if none. Resources
+//  compare equal only to themselves, use thread_resource for a shared resource allocating from the thread heap
+class memory_resource : public std::pmr::memory_resource {
+public:
+	memory_resource() noexcept : heap_(nullptr) {
+	}
+
+	explicit memory_resource(rpmalloc_heap_t* heap) noexcept : heap_(heap) {
+	}
+
+	//! Heap the resource allocates from, null for the thread heap
+	rpmalloc_heap_t*
+	heap() const noexcept {
+		return heap_;
+	}
+
+protected:
+	void*
+	do_allocate(std::size_t bytes, std::size_t alignment) override {
+		void* ptr = detail::allocate(heap_, alignment, bytes);
+		if (!ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	void
+	do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override {
+		detail::deallocate(ptr, alignment, bytes);
+	}
+
+	bool
+	do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+
+private:
+	rpmalloc_heap_t* heap_;
+};
+
+//! Get the memory resource allocating from the thread heap
+inline memory_resource*
+thread_resource() noexcept {
+	static memory_resource resource;
+	return &resource;
+}
+
+#endif
+
+}  // namespace rp
+
+#endif
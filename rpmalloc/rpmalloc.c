@@ -12,6 +12,7 @@
  */
 
 #include "rpmalloc.h"
+#include "rpmalloc_inline.h"
 
 #include <errno.h>
 #include <string.h>
@@ -62,6 +63,7 @@ static DWORD fls_key;
 #include <sched.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 static pthread_key_t pthread_key;
 #ifdef __FreeBSD__
 #include <sys/sysctl.h>
@@ -83,6 +85,13 @@ madvise(caddr_t, size_t, int);
 
 #if defined(__linux__) || defined(__ANDROID__)
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#if defined(__GLIBC__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#endif
 #if !defined(PR_SET_VMA)
 #define PR_SET_VMA 0x53564d41
 #define PR_SET_VMA_ANON_NAME 0
@@ -150,6 +159,34 @@ madvise(caddr_t, size_t, int);
 //! Enable statistics
 #define ENABLE_STATISTICS 0
 #endif
+#ifndef ENABLE_GLOBAL_CACHE
+//! Enable global cache of free pages and spans shared between heaps
+#define ENABLE_GLOBAL_CACHE 1
+#endif
+#ifndef ENABLE_HUGE_CACHE
+//! Enable global cache of recently freed huge blocks
+#define ENABLE_HUGE_CACHE 1
+#endif
+#ifndef HUGE_CACHE_SIZE_LIMIT
+//! Maximum number of bytes of freed huge blocks kept in the huge cache
+#define HUGE_CACHE_SIZE_LIMIT (256 * 1024 * 1024)
+#endif
+#ifndef ENABLE_NUMA
+//! Enable support for NUMA aware heaps and memory mapping, which must also be enabled in the configuration
+#define ENABLE_NUMA 1
+#endif
+#ifndef ENABLE_SAMPLING
+//! Enable sampling heap profiler, see sample_interval in the configuration and rpmalloc_dump_samples
+#define ENABLE_SAMPLING 0
+#endif
+#ifndef ENABLE_PROBES
+//! Enable static tracepoints (USDT) at the allocator slow paths, if sys/sdt.h is available
+#define ENABLE_PROBES 1
+#endif
+#ifndef ENABLE_EVENT_LOG
+//! Enable per heap log of recent slow path events, see rpmalloc_thread_events
+#define ENABLE_EVENT_LOG 0
+#endif
 
 ////////////
 ///
@@ -170,6 +207,9 @@ madvise(caddr_t, size_t, int);
 #define MEDIUM_SIZE_CLASS_COUNT 24
 #define LARGE_SIZE_CLASS_COUNT 20
 #define SIZE_CLASS_COUNT (SMALL_SIZE_CLASS_COUNT + MEDIUM_SIZE_CLASS_COUNT + LARGE_SIZE_CLASS_COUNT)
+//! Number of size class lookup buckets, one for each granularity step up to 8KiB and then eight for each power of two
+//! up to the large block size limit
+#define SIZE_CLASS_BUCKET_COUNT (513 + 10 * 8)
 
 #define SMALL_PAGE_SIZE_SHIFT 16
 #define SMALL_PAGE_SIZE (1 << SMALL_PAGE_SIZE_SHIFT)
@@ -184,6 +224,117 @@ madvise(caddr_t, size_t, int);
 #define SPAN_SIZE (256 * 1024 * 1024)
 #define SPAN_MASK (~((uintptr_t)(SPAN_SIZE - 1)))
 
+//! Zero allocations from this size and up are cleared with non-temporal stores, avoiding evicting the working set
+//! from the caches for memory exceeding the share of last level cache typically available to a core
+#define ZERO_STREAM_THRESHOLD (8 * 1024 * 1024)
+
+#define GLOBAL_CACHE_SHARD_COUNT 8
+
+#define HUGE_CACHE_BUCKET_COUNT 8
+#define HUGE_CACHE_BUCKET_LIMIT 4
+
+#define NUMA_NODE_LIMIT 64
+
+//! Maximum number of heaps in per processor heap mode, processors beyond the limit share heaps
+#define CPU_HEAP_LIMIT 256
+//! Owner thread of unlocked heaps in per processor heap mode and of released heaps, never matching a thread ID. A zero
+//! owner would make the heap owned by any thread if first class heaps are enabled
+#define CPU_HEAP_UNOWNED ((uintptr_t)-1)
+
+//! Heaps are page aligned and user space addresses fit in 48 bits, so the heap queues hold the heap pointer shifted up
+//! 16 bits with a 28 bit tag in the low bits to avoid ABA problems
+#define HEAP_QUEUE_POINTER_SHIFT 16
+#define HEAP_QUEUE_TAG_MASK 0x0FFFFFFFULL
+
+#if ENABLE_NUMA && (PLATFORM_WINDOWS || (defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)))
+#define OS_HAS_NUMA 1
+#else
+#define OS_HAS_NUMA 0
+#endif
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+#define OS_HAS_THP 1
+#else
+#define OS_HAS_THP 0
+#endif
+
+#if defined(_SYS_RSEQ_H) && defined(__has_builtin)
+#if __has_builtin(__builtin_thread_pointer)
+#define OS_HAS_RSEQ 1
+#endif
+#endif
+#ifndef OS_HAS_RSEQ
+#define OS_HAS_RSEQ 0
+#endif
+
+#if ENABLE_SAMPLING && PLATFORM_POSIX && defined(__has_include)
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define OS_HAS_BACKTRACE 1
+#endif
+#endif
+#ifndef OS_HAS_BACKTRACE
+#define OS_HAS_BACKTRACE 0
+#endif
+
+#if ENABLE_PROBES && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define OS_HAS_SDT 1
+#endif
+#endif
+#ifndef OS_HAS_SDT
+#define OS_HAS_SDT 0
+#endif
+
+//! Decommitted memory reads as zero when committed again with VirtualFree and with madvise on Linux, other systems
+//! might keep the content of pages not yet reclaimed
+#if ENABLE_DECOMMIT && (PLATFORM_WINDOWS || defined(__linux__))
+#define OS_DECOMMIT_ZEROES 1
+#else
+#define OS_DECOMMIT_ZEROES 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define ARCH_HAS_STREAM_STORE 1
+#else
+#define ARCH_HAS_STREAM_STORE 0
+#endif
+
+//! Number of slots in the per heap buffer of blocks freed to pages owned by other heaps, must be a power of two
+#define REMOTE_FREE_SLOT_COUNT 16
+//! Number of blocks buffered for a single page before the chain is flushed to the page
+#define REMOTE_FREE_BLOCK_LIMIT 64
+
+//! Maximum number of free pages decommitted in one batch, sorted by address to coalesce adjacent pages
+#define PAGE_DECOMMIT_BATCH_LIMIT 16
+
+//! Granularity of memory commits while bump allocating through an arena span
+#define ARENA_COMMIT_GRANULARITY SMALL_PAGE_SIZE
+
+//! Number of slots in the table of live heap samples, must be a power of two. The table is filled to at most three
+//! quarters, further samples are dropped until sampled blocks are freed
+#define SAMPLE_TABLE_SIZE 16384
+//! Maximum number of stack frames captured for a heap sample
+#define SAMPLE_FRAME_LIMIT 32
+
+//! Number of slow path events kept in the event log of each heap, must be a power of two
+#define EVENT_LOG_SIZE 64
+
+#if PLATFORM_POSIX
+#define OS_HAS_SHARED_MEMORY 1
+#else
+#define OS_HAS_SHARED_MEMORY 0
+#endif
+
+//! Magic number identifying the header of an initialized shared memory region
+#define SHARED_REGION_MAGIC 0x72706d616c6c6f63ULL
+//! Size reserved for the header at the start of a shared memory region, a multiple of the huge page size
+#define SHARED_REGION_HEADER_SIZE (2 * 1024 * 1024)
+//! Maximum number of free address ranges tracked in a shared memory region
+#define SHARED_REGION_RANGE_LIMIT 1024
+
 ////////////
 ///
 /// Utility macros
@@ -239,13 +390,135 @@ typedef struct rpmalloc_statistics_t {
 	atomic_size_t page_decommit;
 	atomic_size_t page_active;
 	atomic_size_t page_active_peak;
+	atomic_size_t page_mapped_total;
+	atomic_size_t page_unmapped_total;
+	atomic_size_t huge_alloc;
+	atomic_size_t huge_alloc_peak;
 	atomic_size_t heap_count;
 } rpmalloc_statistics_t;
 
 static rpmalloc_statistics_t global_statistics;
 
+//! Add to a global statistics counter and update the corresponding high water mark
+static void
+global_statistics_add_peak(atomic_size_t* counter, atomic_size_t* peak, size_t value) {
+	size_t current = atomic_fetch_add_explicit(counter, value, memory_order_relaxed) + value;
+	size_t current_peak = atomic_load_explicit(peak, memory_order_relaxed);
+	while (current > current_peak) {
+		if (atomic_compare_exchange_weak_explicit(peak, &current_peak, current, memory_order_relaxed,
+		                                          memory_order_relaxed))
+			break;
+	}
+}
+
+//! Increase a heap statistics counter
+#define heap_stat_inc(heap, counter) (++(heap)->stats.counter)
+//! Decrease a heap statistics counter
+#define heap_stat_dec(heap, counter) (--(heap)->stats.counter)
+//! Add to a heap statistics counter
+#define heap_stat_add(heap, counter, value) ((heap)->stats.counter += (size_t)(value))
+//! Increase a heap statistics counter and update the corresponding high water mark
+#define heap_stat_inc_peak(heap, counter, peak)           \
+	do {                                                  \
+		if (++(heap)->stats.counter > (heap)->stats.peak) \
+			(heap)->stats.peak = (heap)->stats.counter;   \
+	} while (0)
+//! Record a block allocation in the given size class
+#define heap_stat_alloc(heap, class_idx)                                                             \
+	do {                                                                                             \
+		heap_stat_inc(heap, size_use[class_idx].alloc_total);                                        \
+		heap_stat_inc_peak(heap, size_use[class_idx].alloc_current, size_use[class_idx].alloc_peak); \
+	} while (0)
+//! Record a number of block allocations in the given size class
+#define heap_stat_alloc_count(heap, class_idx, count)                                                       \
+	do {                                                                                                    \
+		heap_stat_add(heap, size_use[class_idx].alloc_total, count);                                        \
+		heap_stat_add(heap, size_use[class_idx].alloc_current, count);                                      \
+		if ((heap)->stats.size_use[class_idx].alloc_current > (heap)->stats.size_use[class_idx].alloc_peak) \
+			(heap)->stats.size_use[class_idx].alloc_peak = (heap)->stats.size_use[class_idx].alloc_current; \
+	} while (0)
+//! Record a number of block deallocations in the given size class
+#define heap_stat_free(heap, class_idx, count)                      \
+	do {                                                            \
+		heap_stat_add(heap, size_use[class_idx].free_total, count); \
+		(heap)->stats.size_use[class_idx].alloc_current -= (count); \
+	} while (0)
+//! Record adoption of a deferred free list from other threads in the given size class
+#define heap_stat_adopt(heap, class_idx, count)                            \
+	do {                                                                   \
+		heap_stat_free(heap, class_idx, count);                            \
+		heap_stat_add(heap, size_use[class_idx].free_thread_total, count); \
+		heap_stat_inc(heap, size_use[class_idx].thread_free_adopt);        \
+	} while (0)
+//! Record a number of allocations of the given requested size in the size lookup bucket of the size
+#define heap_stat_request(heap, size, count)                                      \
+	do {                                                                          \
+		if ((size) <= LARGE_BLOCK_SIZE_LIMIT) {                                   \
+			uint32_t bucket_idx = get_size_class_bucket(size);                    \
+			heap_stat_add(heap, size_request[bucket_idx].alloc_total, count);     \
+			if ((size) > (heap)->stats.size_request[bucket_idx].size_max)         \
+				(heap)->stats.size_request[bucket_idx].size_max = (size_t)(size); \
+		}                                                                         \
+	} while (0)
+
+#else
+
+#define heap_stat_inc(heap, counter) \
+	do {                             \
+	} while (0)
+#define heap_stat_dec(heap, counter) \
+	do {                             \
+	} while (0)
+#define heap_stat_add(heap, counter, value) \
+	do {                                    \
+	} while (0)
+#define heap_stat_inc_peak(heap, counter, peak) \
+	do {                                        \
+	} while (0)
+#define heap_stat_alloc(heap, class_idx) \
+	do {                                 \
+	} while (0)
+#define heap_stat_alloc_count(heap, class_idx, count) \
+	do {                                              \
+	} while (0)
+#define heap_stat_free(heap, class_idx, count) \
+	do {                                       \
+	} while (0)
+#define heap_stat_adopt(heap, class_idx, count) \
+	do {                                        \
+	} while (0)
+#define heap_stat_request(heap, size, count) \
+	do {                                     \
+	} while (0)
+
+#endif
+
+////////////
+///
+/// Tracing
+///
+//////
+
+#if OS_HAS_SDT
+//! Fire a static tracepoint of the rpmalloc provider, a single nop instruction unless a tracer is attached
+#define rpmalloc_probe(name, arg0, arg1, arg2, arg3) DTRACE_PROBE4(rpmalloc, name, arg0, arg1, arg2, arg3)
 #else
+#define rpmalloc_probe(name, arg0, arg1, arg2, arg3) \
+	do {                                             \
+	} while (0)
+#endif
 
+#if ENABLE_EVENT_LOG
+//! Fire the tracepoint of a heap slow path event and record the event in the heap event log
+#define heap_trace(heap, name, type, size_class, page_type, size)      \
+	do {                                                               \
+		rpmalloc_probe(name, (heap)->id, size_class, page_type, size); \
+		heap_event_record(heap, type, size_class, page_type, size);    \
+	} while (0)
+#else
+//! Fire the tracepoint of a heap slow path event
+#define heap_trace(heap, name, type, size_class, page_type, size) \
+	rpmalloc_probe(name, (heap)->id, size_class, page_type, size)
 #endif
 
 ////////////
@@ -331,6 +604,33 @@ wait_spin(void) {
 #define memset_const(x, y, s) memset(x, y, s)
 #endif
 
+//! Zero a memory block, using non-temporal stores for large blocks
+static void
+memory_zero(void* ptr, size_t size) {
+#if ARCH_HAS_STREAM_STORE
+	if (size >= ZERO_STREAM_THRESHOLD) {
+		// Stream whole cache lines and clear the unaligned head and tail with regular stores
+		char* start = (char*)ptr;
+		char* end = start + size;
+		char* line_start = (char*)(((uintptr_t)start + 63) & ~(uintptr_t)63);
+		char* line_end = (char*)((uintptr_t)end & ~(uintptr_t)63);
+		__m128i zero = _mm_setzero_si128();
+		memset(start, 0, (size_t)(line_start - start));
+		for (char* line = line_start; line < line_end; line += 64) {
+			_mm_stream_si128((__m128i*)(void*)line, zero);
+			_mm_stream_si128((__m128i*)(void*)(line + 16), zero);
+			_mm_stream_si128((__m128i*)(void*)(line + 32), zero);
+			_mm_stream_si128((__m128i*)(void*)(line + 48), zero);
+		}
+		memset(line_end, 0, (size_t)(end - line_end));
+		// Order the streaming stores before any later store publishing the block
+		_mm_sfence();
+		return;
+	}
+#endif
+	memset(ptr, 0, size);
+}
+
 ////////////
 ///
 /// Data types
@@ -347,6 +647,8 @@ typedef struct page_t page_t;
 typedef struct block_t block_t;
 //! Size class for a memory block
 typedef struct size_class_t size_class_t;
+//! Buffered chain of blocks freed to a page owned by another heap
+typedef struct remote_free_t remote_free_t;
 
 //! Memory page type
 typedef enum page_type_t {
@@ -370,6 +672,18 @@ struct block_t {
 	block_t* next;
 };
 
+//! Chain of blocks freed to a page owned by another heap, flushed to the page with a single CAS
+struct remote_free_t {
+	//! Owning page of the blocks
+	page_t* page;
+	//! First block in chain
+	block_t* block;
+	//! Last block in chain
+	block_t* last_block;
+	//! Number of blocks in chain
+	uint32_t count;
+};
+
 //! A page contains blocks of a given size
 struct page_t {
 	//! Size class of blocks
@@ -390,10 +704,14 @@ struct page_t {
 	uint32_t is_free : 1;
 	//! Flag set if blocks are zero initialied
 	uint32_t is_zero : 1;
+	//! Flag set if only blocks inside the decommit range are zero initialized
+	uint32_t is_zero_partial : 1;
 	//! Flag set if memory pages have been decommitted
 	uint32_t is_decommitted : 1;
 	//! Flag set if containing aligned blocks
 	uint32_t has_aligned_block : 1;
+	//! Flag set if page is in a span advised to use transparent huge pages
+	uint32_t is_thp : 1;
 	//! Fast combination flag for either huge, fully allocated or has aligned blocks
 	uint32_t generic_free : 1;
 	//! Local free list count
@@ -404,8 +722,12 @@ struct page_t {
 	heap_t* heap;
 	//! Next page in list
 	page_t* next;
-	//! Previous page in list
-	page_t* prev;
+	union {
+		//! Previous page in list
+		page_t* prev;
+		//! Time stamp in milliseconds when page was put in heap free list
+		uintptr_t free_time;
+	};
 	//! Multithreaded free list, block index is in low 32 bit, list count is high 32 bit
 	atomic_ullong thread_free;
 };
@@ -416,8 +738,13 @@ struct span_t {
 	page_t page;
 	//! Owning heap
 	heap_t* heap;
-	//! Page address mask
-	uintptr_t page_address_mask;
+	union {
+		//! Page address mask
+		uintptr_t page_address_mask;
+		//! Size of the memory still committed in the span while queued for deferred release, when no pages are in
+		//! use and the page address mask is no longer needed
+		uintptr_t release_committed_size;
+	};
 	//! Number of pages initialized
 	uint32_t page_initialized;
 	//! Number of pages in use
@@ -428,6 +755,12 @@ struct span_t {
 	page_type_t page_type;
 	//! Offset to start of mapped memory region
 	uint32_t offset;
+	//! Flag set if memory of pages not yet initialized is zero, except the first memory page of the span
+	uint32_t is_zero : 1;
+	//! NUMA node the memory pages are bound to
+	uint32_t numa_node : 29;
+	//! Transparent huge page policy the reserved address range has been advised with
+	uint32_t thp_policy : 2;
 	//! Mapped size
 	uint64_t mapped_size;
 	//! Next span in list
@@ -438,6 +771,10 @@ struct span_t {
 struct heap_t {
 	//! Owning thread ID
 	uintptr_t owner_thread;
+#if ENABLE_SAMPLING
+	//! Number of bytes left to allocate until the next heap sample
+	int64_t sample_countdown;
+#endif
 	//! Heap local free list for small size classes
 	block_t* local_free[SIZE_CLASS_COUNT];
 	//! Available non-full pages for each size class
@@ -446,6 +783,8 @@ struct heap_t {
 	page_t* page_free[3];
 	//! Free but still committed page count for each page tyoe
 	uint32_t page_free_commit_count[3];
+	//! Full pages for each page type
+	page_t* page_full[3];
 	//! Multithreaded free list
 	atomic_uintptr_t thread_free[3];
 	//! Available partially initialized spans for each page type
@@ -454,21 +793,141 @@ struct heap_t {
 	span_t* span_used[4];
 	//! Next heap in queue
 	heap_t* next;
-	//! Previous heap in queue
-	heap_t* prev;
+	//! Next heap in list of all allocated heaps
+	heap_t* list_next;
 	//! Heap ID
 	uint32_t id;
 	//! Finalization state flag
 	uint32_t finalize;
+	//! Flag set if first class heap
+	uint32_t first_class;
+	//! NUMA node of heap
+	uint32_t numa_node;
+	//! Lock for heap shared by threads in per processor heap mode
+	atomic_uint lock;
+	//! Last memory pressure epoch handled by the heap
+	uint32_t pressure_epoch;
 	//! Memory map region offset
 	uint32_t offset;
 	//! Memory map size
 	size_t mapped_size;
+	//! Buffered blocks freed by this heap to pages owned by other heaps
+	remote_free_t remote_free[REMOTE_FREE_SLOT_COUNT];
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	//! Next free address for bump allocation in the current arena span
+	uintptr_t arena_current;
+	//! End of committed memory in the current arena span
+	uintptr_t arena_commit;
+	//! Spans used for arena allocations, current span first
+	span_t* arena_span;
+	//! Memory committed for pages, huge blocks and arenas of a first class heap
+	size_t memory_committed;
+	//! Soft and hard limit of committed memory of a first class heap, zero if not limited
+	size_t memory_soft_limit;
+	size_t memory_hard_limit;
+	//! Flag set while the committed memory of a first class heap is above the soft limit
+	uint32_t memory_pressure;
+#endif
+#if ENABLE_SAMPLING
+	//! Random generator state for heap sample intervals, zero until the first interval is drawn
+	uint64_t sample_random;
+#endif
+#if ENABLE_STATISTICS
+	//! Thread statistics, kept last to not affect layout of hot heap data
+	rpmalloc_thread_statistics_t stats;
+#endif
+#if ENABLE_EVENT_LOG
+	//! Total number of events recorded, the next event is stored at this count modulo the log size
+	uint32_t event_count;
+	//! Log of recent slow path events, kept last to not affect layout of hot heap data
+	rpmalloc_event_t event[EVENT_LOG_SIZE];
+#endif
 };
 
 _Static_assert(sizeof(page_t) <= PAGE_HEADER_SIZE, "Invalid page header size");
 _Static_assert(sizeof(span_t) <= SPAN_HEADER_SIZE, "Invalid span header size");
+#if ENABLE_STATISTICS
+_Static_assert(offsetof(heap_t, stats) <= 4096, "Invalid heap size");
+#elif ENABLE_EVENT_LOG
+_Static_assert(offsetof(heap_t, event_count) <= 4096, "Invalid heap size");
+#else
 _Static_assert(sizeof(heap_t) <= 4096, "Invalid heap size");
+#endif
+_Static_assert(SIZE_CLASS_COUNT <= 128, "Size class statistics array too small");
+_Static_assert(SIZE_CLASS_COUNT == RPMALLOC_SIZE_CLASS_COUNT_MAX, "Invalid size class table limit");
+_Static_assert(SIZE_CLASS_BUCKET_COUNT <= 593, "Size request statistics array too small");
+
+#if ENABLE_SAMPLING
+//! Live heap sample
+typedef struct heap_sample_t {
+	//! Sampled block, null if the table slot is empty
+	void* block;
+	//! Requested size
+	size_t size;
+	//! Number of captured stack frames
+	size_t frame_count;
+	//! Return addresses of the captured stack frames, innermost first
+	void* frame[SAMPLE_FRAME_LIMIT];
+} heap_sample_t;
+#endif
+
+//! Global cache shard of free pages and spans, shared between all heaps
+typedef struct RPMALLOC_CACHE_ALIGNED global_cache_t {
+	//! Lock for cache shard
+	atomic_uint lock;
+	//! Number of free pages of each page type
+	atomic_uint page_count[3];
+	//! Number of free spans
+	atomic_uint span_count;
+	//! Free pages of each page type
+	page_t* page[3];
+	//! Free spans
+	span_t* span;
+} global_cache_t;
+
+//! Global cache of freed huge spans, bucketed by power of two size ranges starting at the large block size limit
+typedef struct RPMALLOC_CACHE_ALIGNED global_huge_cache_t {
+	//! Lock for cache
+	atomic_uint lock;
+	//! Number of spans in each bucket
+	uint32_t span_count[HUGE_CACHE_BUCKET_COUNT];
+	//! Total size of all spans
+	atomic_size_t size;
+	//! Free spans in each bucket
+	span_t* span[HUGE_CACHE_BUCKET_COUNT];
+} global_huge_cache_t;
+
+//! Queue of spans waiting to be unmapped by the deferred release
+typedef struct RPMALLOC_CACHE_ALIGNED global_release_t {
+	//! Queued spans, linked by the next span pointer
+	atomic_uintptr_t span;
+	//! Total mapped size of all queued spans
+	atomic_size_t size;
+} global_release_t;
+
+//! Free address range in a shared memory region
+typedef struct shared_range_t {
+	//! Offset of the range from the start of the region
+	size_t offset;
+	//! Size of the range
+	size_t size;
+} shared_range_t;
+
+//! Header at the start of a shared memory region, which is mapped at the same address in all attached processes
+typedef struct shared_region_t {
+	//! Magic number, set once the region is initialized
+	uint64_t magic;
+	//! Address of the region in all attached processes
+	uintptr_t base;
+	//! Size of the region
+	size_t size;
+	//! Lock for the free ranges, shared between processes
+	atomic_uint lock;
+	//! Number of free ranges
+	uint32_t range_count;
+	//! Free ranges sorted by offset, never adjacent
+	shared_range_t range[SHARED_REGION_RANGE_LIMIT];
+} shared_region_t;
 
 ////////////
 ///
@@ -480,12 +939,16 @@ _Static_assert(sizeof(heap_t) <= 4096, "Invalid heap size");
 static RPMALLOC_CACHE_ALIGNED heap_t global_heap_fallback;
 //! Default heap
 static heap_t* global_heap_default = &global_heap_fallback;
-//! Available heaps
-static heap_t* global_heap_queue;
-//! In use heaps
-static heap_t* global_heap_used;
-//! Lock for heap queue
-static atomic_uintptr_t global_heap_lock;
+//! Available heaps for each NUMA node, as tagged pointers to the first heap in queue
+static atomic_ullong global_heap_queue[NUMA_NODE_LIMIT];
+//! Heaps released by threads for each NUMA node, which might still own pages, as tagged pointers to the first heap
+static atomic_ullong global_heap_orphan_queue[NUMA_NODE_LIMIT];
+//! All allocated heaps
+static atomic_uintptr_t global_heap_list;
+//! Heaps for each processor in per processor heap mode
+static atomic_uintptr_t global_cpu_heap[CPU_HEAP_LIMIT];
+//! Number of heaps in per processor heap mode
+static uint32_t global_cpu_heap_count;
 //! Heap ID counter
 static atomic_uint global_heap_id = 1;
 //! Initialized flag
@@ -494,10 +957,33 @@ static int global_rpmalloc_initialized;
 static rpmalloc_interface_t* global_memory_interface;
 //! Default memory interface
 static rpmalloc_interface_t global_memory_interface_default;
+//! Shared memory interface
+static rpmalloc_interface_t global_memory_interface_shared;
+//! Memory map function of the last initialization
+static void* (*global_memory_map)(size_t size, size_t alignment, size_t* offset, size_t* mapped_size);
 //! Current configuration
 static rpmalloc_config_t global_config = {0};
 //! Main thread ID
 static uintptr_t global_main_thread_id;
+//! Memory mapped and committed through the default memory interface, in bytes
+static atomic_size_t global_memory_mapped;
+static atomic_size_t global_memory_committed;
+//! Incremented when committed memory exceeds the soft limit, heaps noticing a new epoch decommit their free pages
+static atomic_uint global_memory_pressure_epoch;
+//! Flag set while committed memory is above the soft limit, to signal memory pressure once per crossing
+static atomic_uint global_memory_pressure;
+#if ENABLE_SAMPLING
+//! Heap holding all sampled blocks, locked for each sampled allocation and free. Blocks are told apart as sampled
+//! by their page belonging to this heap, which keeps the free fast path unaware of sampling
+static atomic_uintptr_t global_sample_heap;
+//! Table of live heap samples keyed by block address with linear probing, protected by the sample heap lock
+static heap_sample_t* global_sample_table;
+//! Number of live heap samples in the table
+static size_t global_sample_count;
+//! Memory map offset and size of the heap sample table
+static size_t global_sample_table_offset;
+static size_t global_sample_table_mapped_size;
+#endif
 
 //! Size classes
 #define SCLASS(n) \
@@ -506,7 +992,7 @@ static uintptr_t global_main_thread_id;
 	{ (n * SMALL_GRANULARITY), (MEDIUM_PAGE_SIZE - PAGE_HEADER_SIZE) / (n * SMALL_GRANULARITY) }
 #define LCLASS(n) \
 	{ (n * SMALL_GRANULARITY), (LARGE_PAGE_SIZE - PAGE_HEADER_SIZE) / (n * SMALL_GRANULARITY) }
-static const size_class_t global_size_class[SIZE_CLASS_COUNT] = {
+static const size_class_t global_size_class_default[SIZE_CLASS_COUNT] = {
     SCLASS(1),      SCLASS(1),      SCLASS(2),      SCLASS(3),      SCLASS(4),      SCLASS(5),      SCLASS(6),
     SCLASS(7),      SCLASS(8),      SCLASS(9),      SCLASS(10),     SCLASS(11),     SCLASS(12),     SCLASS(13),
     SCLASS(14),     SCLASS(15),     SCLASS(16),     SCLASS(17),     SCLASS(18),     SCLASS(19),     SCLASS(20),
@@ -525,18 +1011,71 @@ static const size_class_t global_size_class[SIZE_CLASS_COUNT] = {
     LCLASS(81920),  LCLASS(98304),  LCLASS(114688), LCLASS(131072), LCLASS(163840), LCLASS(196608), LCLASS(229376),
     LCLASS(262144), LCLASS(327680), LCLASS(393216), LCLASS(458752), LCLASS(524288)};
 
+//! Size classes in use, either the default size classes or a custom size class table given in the configuration
+static size_class_t global_size_class[SIZE_CLASS_COUNT];
+//! Lowest size class with a block size fitting the smallest size in each size class lookup bucket
+static uint8_t global_size_class_bucket[SIZE_CLASS_BUCKET_COUNT];
+//! First size class using medium pages and first size class using large pages
+static uint32_t global_size_class_page_limit[2];
+//! Block sizes of the custom size class table in use
+static unsigned int global_size_class_table[SIZE_CLASS_COUNT];
+
 //! Threshold number of pages for when free pages are decommitted
 static uint32_t global_page_free_overflow[4] = {16, 8, 2, 0};
 
 //! Number of pages to retain when free page threshold overflows
 static uint32_t global_page_free_retain[4] = {4, 2, 1, 0};
 
+//! Page size for each page type
+static const size_t global_page_type_size[3] = {SMALL_PAGE_SIZE, MEDIUM_PAGE_SIZE, LARGE_PAGE_SIZE};
+//! Page address mask for each page type
+static const uintptr_t global_page_type_mask[3] = {SMALL_PAGE_MASK, MEDIUM_PAGE_MASK, LARGE_PAGE_MASK};
+
+#if ENABLE_GLOBAL_CACHE
+//! Global cache shards
+static global_cache_t global_cache[GLOBAL_CACHE_SHARD_COUNT];
+
+//! Maximum number of free pages of each page type in each global cache shard
+static uint32_t global_cache_page_limit[3] = {256, 32, 4};
+
+//! Maximum number of free spans in each global cache shard
+static uint32_t global_cache_span_limit = 2;
+#endif
+
+#if ENABLE_HUGE_CACHE
+//! Huge span cache
+static global_huge_cache_t global_huge_cache;
+#endif
+
+//! Spans queued for deferred release
+static global_release_t global_release;
+
+#if !PLATFORM_WINDOWS
+//! Background thread unmapping the spans queued for deferred release
+static pthread_t global_release_thread;
+//! Lock protecting the release thread state, held when signalling the release thread
+static pthread_mutex_t global_release_lock = PTHREAD_MUTEX_INITIALIZER;
+//! Signal waking the release thread when spans are queued or the thread should stop
+static pthread_cond_t global_release_signal = PTHREAD_COND_INITIALIZER;
+//! Flag set while the release thread is running, read without the lock when queueing spans
+static atomic_uint global_release_thread_active;
+//! Flag set to make the release thread exit
+static int global_release_thread_stop;
+#endif
+
 //! OS huge page support
 static int os_huge_pages;
 //! OS memory map granularity
 static size_t os_map_granularity;
 //! OS memory page size
 static size_t os_page_size;
+//! OS NUMA node count, only set above one if NUMA awareness is enabled
+static uint32_t os_numa_node_count = 1;
+//! OS transparent huge page size
+static size_t os_thp_size = 2 * 1024 * 1024;
+
+//! Shared memory region attached by this process
+static shared_region_t* global_shared_region;
 
 ////////////
 ///
@@ -554,12 +1093,56 @@ static size_t os_page_size;
 #endif
 static _Thread_local heap_t* global_thread_heap TLS_MODEL = &global_heap_fallback;
 
+#if RPMALLOC_INLINE_FAST_PATH
+//! Inline fast path state of the current thread, see rpmalloc_inline.h
+__thread rpmalloc_inline_state_t rpmalloc_inline_state TLS_MODEL;
+
+_Static_assert(offsetof(page_t, block_used) == offsetof(rpmalloc_inline_page_t, block_used), "Invalid inline page");
+_Static_assert(offsetof(page_t, local_free_count) == offsetof(rpmalloc_inline_page_t, local_free_count),
+               "Invalid inline page");
+_Static_assert(offsetof(page_t, local_free) == offsetof(rpmalloc_inline_page_t, local_free), "Invalid inline page");
+_Static_assert(offsetof(page_t, heap) == offsetof(rpmalloc_inline_page_t, heap), "Invalid inline page");
+_Static_assert(RPMALLOC_INLINE_SIZE_LIMIT == SMALL_GRANULARITY * 64, "Invalid inline size limit");
+_Static_assert(RPMALLOC_INLINE_PAGE_SIZE == SMALL_PAGE_SIZE, "Invalid inline page size");
+#endif
+
 static heap_t*
-heap_allocate(int first_class);
+heap_allocate(int first_class, uint32_t numa_node);
+
+static uint32_t
+os_numa_node_current(void);
 
 static void
 heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count);
 
+static void
+heap_memory_shed(heap_t* heap);
+
+static void
+heap_page_free_decay(heap_t* heap, uint32_t page_type, uint32_t current_time);
+
+static void
+heap_release_span(heap_t* heap, span_t* span, int cache_span);
+
+static int
+global_release_drain(void);
+
+#if ENABLE_EVENT_LOG
+static void
+heap_event_record(heap_t* heap, uint32_t type, uint32_t size_class, uint32_t page_type, size_t size);
+#endif
+
+#if ENABLE_SAMPLING
+static void*
+heap_allocate_block_sampled(heap_t* heap, size_t size, size_t alignment, unsigned int zero);
+
+static void
+heap_sample_deallocate_block(heap_t* sample_heap, void* block);
+
+static void
+heap_sample_move(heap_t* sample_heap, void* block, void* new_block);
+#endif
+
 //! Fast thread ID
 static inline uintptr_t
 get_thread_id(void) {
@@ -599,10 +1182,39 @@ get_thread_id(void) {
 	*/
 }
 
+//! Enable the inline fast path for the given thread heap if the configuration allows it, see rpmalloc_inline.h
+static void
+set_thread_inline_state(heap_t* heap) {
+#if RPMALLOC_INLINE_FAST_PATH
+	rpmalloc_inline_state.heap = 0;
+	rpmalloc_inline_state.free_list = 0;
+#if !ENABLE_STATISTICS
+	// Bit field layout is up to the compiler, check the generic free flag is where the inline fast path tests it
+	page_t page;
+	memset(&page, 0, sizeof(page));
+	page.generic_free = 1;
+	rpmalloc_inline_page_t inline_page;
+	memcpy(&inline_page, &page, sizeof(inline_page));
+	if (!heap || !heap->id || global_cpu_heap_count || global_config.size_class_table ||
+	    (inline_page.flags != RPMALLOC_INLINE_PAGE_GENERIC_FREE))
+		return;
+	rpmalloc_inline_state.heap = heap;
+	// Allocations must count down to the next heap sample
+	if (!ENABLE_SAMPLING || !global_config.sample_interval)
+		rpmalloc_inline_state.free_list = (void**)heap->local_free;
+#else
+	(void)sizeof(heap);
+#endif
+#else
+	(void)sizeof(heap);
+#endif
+}
+
 //! Set the current thread heap
 static void
 set_thread_heap(heap_t* heap) {
 	global_thread_heap = heap;
+	set_thread_inline_state(heap);
 	if (heap && (heap->id != 0)) {
 		rpmalloc_assert(heap->id != 0, "Default heap being used");
 		heap->owner_thread = get_thread_id();
@@ -616,7 +1228,7 @@ set_thread_heap(heap_t* heap) {
 
 static heap_t*
 get_thread_heap_allocate(void) {
-	heap_t* heap = heap_allocate(0);
+	heap_t* heap = heap_allocate(0, os_numa_node_current());
 	set_thread_heap(heap);
 	return heap;
 }
@@ -627,46 +1239,83 @@ get_thread_heap(void) {
 	return global_thread_heap;
 }
 
-//! Get the size class from given size in bytes for tiny blocks (below 16 times the minimum granularity)
-static inline uint32_t
-get_size_class_tiny(size_t size) {
-	return (((uint32_t)size + (SMALL_GRANULARITY - 1)) / SMALL_GRANULARITY);
-}
-
-//! Get the size class from given size in bytes
+//! Get the size class lookup bucket from given size in bytes, which must not exceed the large block size limit
 static inline uint32_t
-get_size_class(size_t size) {
+get_size_class_bucket(size_t size) {
 	uintptr_t minblock_count = (size + (SMALL_GRANULARITY - 1)) / SMALL_GRANULARITY;
-	// For sizes up to 64 times the minimum granularity (i.e 1024 bytes) the size class is equal to number of such
-	// blocks
-	if (size <= (SMALL_GRANULARITY * 64)) {
-		rpmalloc_assert(global_size_class[minblock_count].block_size >= size, "Size class misconfiguration");
-		return (uint32_t)(minblock_count ? minblock_count : 1);
-	}
+	// For sizes up to 512 times the minimum granularity (i.e 8KiB) the bucket is equal to number of such blocks
+	if (minblock_count <= 512)
+		return (uint32_t)minblock_count;
 	--minblock_count;
-	// Calculate position of most significant bit, since minblock_count now guaranteed to be > 64 this position is
-	// guaranteed to be >= 6
+	// Calculate position of most significant bit, since minblock_count now guaranteed to be >= 512 this position is
+	// guaranteed to be >= 9
 #if ARCH_64BIT
 	const uint32_t most_significant_bit = (uint32_t)(63 - (int)rpmalloc_clz(minblock_count));
 #else
 	const uint32_t most_significant_bit = (uint32_t)(31 - (int)rpmalloc_clz(minblock_count));
 #endif
-	// Class sizes are of the bit format [..]000xxx000[..] where we already have the position of the most significant
-	// bit, now calculate the subclass from the remaining two bits
-	const uint32_t subclass_bits = (minblock_count >> (most_significant_bit - 2)) & 0x03;
-	const uint32_t class_idx = (uint32_t)((most_significant_bit << 2) + subclass_bits) + 41;
-	rpmalloc_assert((class_idx >= SIZE_CLASS_COUNT) || (global_size_class[class_idx].block_size >= size),
-	                "Size class misconfiguration");
-	rpmalloc_assert((class_idx >= SIZE_CLASS_COUNT) || (global_size_class[class_idx - 1].block_size < size),
+	// Split each power of two in eight buckets from the three bits following the most significant bit
+	const uint32_t subclass_bits = (minblock_count >> (most_significant_bit - 3)) & 0x07;
+	return ((most_significant_bit - 9) << 3) + subclass_bits + 513;
+}
+
+//! Get the largest size in bytes in the given size class lookup bucket
+static inline size_t
+get_size_class_bucket_limit(uint32_t bucket) {
+	if (bucket <= 512)
+		return (size_t)bucket * SMALL_GRANULARITY;
+	// Invert the bucket calculation to get the largest block count in the bucket
+	const uint32_t most_significant_bit = 9 + ((bucket - 513) >> 3);
+	const size_t subclass_bits = (bucket - 513) & 0x07;
+	return (((0x08 | subclass_bits) + 1) << (most_significant_bit - 3)) * SMALL_GRANULARITY;
+}
+
+//! Get the size class from given size in bytes for tiny blocks (up to 64 times the minimum granularity). Size classes
+//! are multiples of the minimum granularity, so the bucket maps directly to the size class
+static inline uint32_t
+get_size_class_tiny(size_t size) {
+	return global_size_class_bucket[((uint32_t)size + (SMALL_GRANULARITY - 1)) / SMALL_GRANULARITY];
+}
+
+//! Get the size class from given size in bytes
+static inline uint32_t
+get_size_class(size_t size) {
+	if (UNEXPECTED(size > LARGE_BLOCK_SIZE_LIMIT))
+		return SIZE_CLASS_COUNT;
+	// Size classes end at bucket limits, so the bucket gives the size class of all sizes in the bucket
+	uint32_t class_idx = global_size_class_bucket[get_size_class_bucket(size)];
+	rpmalloc_assert(global_size_class[class_idx].block_size >= size, "Size class misconfiguration");
+	rpmalloc_assert((class_idx == 0) || (global_size_class[class_idx - 1].block_size < size),
 	                "Size class misconfiguration");
 	return class_idx;
 }
 
+//! Get the size to allocate for a block with the given alignment. Blocks are aligned to the lowest set bit of the
+//! block size, so the smallest size class with a block size that is a multiple of the alignment gives an aligned
+//! block without padding. Otherwise the alignment is added to the size and the block is realigned after allocation
+static inline size_t
+get_size_aligned(size_t size, size_t alignment) {
+	if (alignment <= SMALL_GRANULARITY)
+		return size;
+	size_t padded_size = size + alignment;
+	size_t aligned_size = (size + (alignment - 1)) & ~(alignment - 1);
+	if (aligned_size > LARGE_BLOCK_SIZE_LIMIT)
+		return padded_size;
+	for (uint32_t size_class = get_size_class(aligned_size); size_class < SIZE_CLASS_COUNT; ++size_class) {
+		size_t block_size = global_size_class[size_class].block_size;
+		if (!(block_size & (alignment - 1)))
+			return block_size;
+		if (block_size >= padded_size)
+			break;
+	}
+	return padded_size;
+}
+
 static inline page_type_t
 get_page_type(uint32_t size_class) {
-	if (size_class < SMALL_SIZE_CLASS_COUNT)
+	if (size_class < global_size_class_page_limit[0])
 		return PAGE_SMALL;
-	else if (size_class < (SMALL_SIZE_CLASS_COUNT + MEDIUM_SIZE_CLASS_COUNT))
+	else if (size_class < global_size_class_page_limit[1])
 		return PAGE_MEDIUM;
 	else if (size_class < SIZE_CLASS_COUNT)
 		return PAGE_LARGE;
@@ -702,9 +1351,208 @@ os_set_page_name(void* address, size_t size) {
 #endif
 }
 
+//! Detect the number of NUMA nodes in the system
+static void
+os_numa_initialize(void) {
+	os_numa_node_count = 1;
+#if OS_HAS_NUMA
+#if PLATFORM_WINDOWS
+	ULONG highest_node = 0;
+	if (GetNumaHighestNodeNumber(&highest_node))
+		os_numa_node_count = (uint32_t)highest_node + 1;
+#else
+	// Read with plain file descriptor IO to avoid allocating memory during initialization
+	int fd = open("/sys/devices/system/node/online", O_RDONLY);
+	if (fd >= 0) {
+		char line[128];
+		ssize_t read_size = read(fd, line, sizeof(line) - 1);
+		close(fd);
+		if (read_size > 0) {
+			// Node list is comma separated ranges like "0-3,8", the last number is the highest node
+			line[read_size] = 0;
+			const char* last = line;
+			for (const char* ch = line; *ch; ++ch) {
+				if ((*ch == ',') || (*ch == '-'))
+					last = ch + 1;
+			}
+			os_numa_node_count = (uint32_t)strtol(last, 0, 10) + 1;
+		}
+	}
+#endif
+	if (os_numa_node_count > NUMA_NODE_LIMIT)
+		os_numa_node_count = NUMA_NODE_LIMIT;
+#endif
+}
+
+//! Get the NUMA node of the processor the calling thread is currently running on
+static uint32_t
+os_numa_node_current(void) {
+#if OS_HAS_NUMA
+	if (os_numa_node_count > 1) {
+#if PLATFORM_WINDOWS
+		PROCESSOR_NUMBER processor;
+		USHORT node = 0;
+		GetCurrentProcessorNumberEx(&processor);
+		if (GetNumaProcessorNodeEx(&processor, &node) && (node < os_numa_node_count))
+			return node;
+#else
+		unsigned int cpu = 0;
+		unsigned int node = 0;
+		if (!syscall(SYS_getcpu, &cpu, &node, 0) && (node < os_numa_node_count))
+			return node;
+#endif
+	}
+#endif
+	return 0;
+}
+
+//! Get the number of processors in the system
+static uint32_t
+os_cpu_count(void) {
+#if PLATFORM_WINDOWS
+	DWORD cpu_count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#else
+	long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+	return (cpu_count > 0) ? (uint32_t)cpu_count : 1;
+}
+
+//! Get the processor the calling thread is running on, read from the restartable sequence area registered by the C
+//! library if available. Falls back to a hash of the thread ID if the platform lacks support. The thread can migrate
+//! at any time, so the result is only a hint to spread threads over heaps
+static uint32_t
+os_cpu_current(void) {
+#if OS_HAS_RSEQ
+	if (EXPECTED(__rseq_size != 0)) {
+		const struct rseq* rseq_area = pointer_offset(__builtin_thread_pointer(), __rseq_offset);
+		int32_t cpu = (int32_t)(*(const volatile uint32_t*)&rseq_area->cpu_id);
+		if (EXPECTED(cpu >= 0))
+			return (uint32_t)cpu;
+	}
+#endif
+#if PLATFORM_WINDOWS
+	return (uint32_t)GetCurrentProcessorNumber();
+#else
+#if defined(__linux__) && defined(__GLIBC__) && defined(_GNU_SOURCE)
+	int cpu = sched_getcpu();
+	if (cpu >= 0)
+		return (uint32_t)cpu;
+#endif
+	uintptr_t thread_id = get_thread_id();
+	return (uint32_t)((thread_id >> 12) ^ (thread_id >> 24));
+#endif
+}
+
+//! Set the preferred NUMA node for memory pages in the given range. Memory pages already faulted in are not moved,
+//! and on Windows the node can only be given when mapping the memory
+static void
+os_numa_bind(void* address, size_t size, uint32_t numa_node) {
+#if OS_HAS_NUMA && !PLATFORM_WINDOWS
+	// Prefer rather than strictly bind to the node, to fall back to other nodes instead of failing when out of memory
+	const int mpol_preferred = 1;
+	unsigned long node_mask[NUMA_NODE_LIMIT / (sizeof(unsigned long) * 8)] = {0};
+	node_mask[numa_node / (sizeof(unsigned long) * 8)] = 1UL << (numa_node % (sizeof(unsigned long) * 8));
+	// Kernel expects the max node argument to be one more than number of bits in the mask
+	long ret = syscall(SYS_mbind, address, size, mpol_preferred, node_mask, NUMA_NODE_LIMIT + 1, 0);
+	(void)ret;
+	rpmalloc_assert(ret == 0, "Failed to bind memory to NUMA node");
+#else
+	(void)sizeof(address);
+	(void)sizeof(size);
+	(void)sizeof(numa_node);
+#endif
+}
+
+//! Read the transparent huge page size
+static void
+os_thp_initialize(void) {
+#if OS_HAS_THP
+	int fd = open("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", O_RDONLY);
+	if (fd >= 0) {
+		char line[64];
+		ssize_t read_size = read(fd, line, sizeof(line) - 1);
+		close(fd);
+		if (read_size > 0) {
+			line[read_size] = 0;
+			size_t thp_size = (size_t)strtoull(line, 0, 10);
+			if (thp_size && !(thp_size & (thp_size - 1)))
+				os_thp_size = thp_size;
+		}
+	}
+#endif
+}
+
+//! Advise the OS to use or avoid transparent huge pages for the given memory range
+static void
+os_thp_advise(void* address, size_t size, uint32_t policy) {
+#if OS_HAS_THP
+	int advice = (policy == RPMALLOC_THP_ENABLE) ? MADV_HUGEPAGE : MADV_NOHUGEPAGE;
+	(void)madvise(address, size, advice);
+#else
+	(void)sizeof(address);
+	(void)sizeof(size);
+	(void)sizeof(policy);
+#endif
+}
+
+//! Fault in the committed memory pages of the given range ahead of first use, keeping the content of the range
+static void
+os_prefault(void* address, size_t size) {
+#if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+	if (!madvise(address, size, MADV_POPULATE_WRITE))
+		return;
+#endif
+	// Kernel lacks support, write to each memory page
+	volatile char* memory_page = (volatile char*)address;
+	for (size_t offset = 0; offset < size; offset += global_config.page_size)
+		memory_page[offset] = memory_page[offset];
+}
+
+//! Check if mapped memory is committed, which is the case when memory pages are never decommitted
+static inline int
+os_commit_on_map(void) {
+#if ENABLE_DECOMMIT
+	return global_config.disable_decommit;
+#else
+	return 1;
+#endif
+}
+
+static inline void
+os_memory_commit_add(size_t size) {
+	atomic_fetch_add_explicit(&global_memory_committed, size, memory_order_relaxed);
+}
+
+static inline void
+os_memory_commit_sub(size_t size) {
+	size_t committed = atomic_fetch_sub_explicit(&global_memory_committed, size, memory_order_relaxed);
+	rpmalloc_assert(committed >= size, "Committed memory accounting out of sync");
+	// Dropping below the soft limit again rearms the memory pressure signal
+	if (UNEXPECTED(atomic_load_explicit(&global_memory_pressure, memory_order_relaxed) != 0) &&
+	    ((committed - size) <= global_config.committed_soft_limit))
+		atomic_store_explicit(&global_memory_pressure, 0, memory_order_relaxed);
+}
+
+//! Check if mapping the given number of bytes more would exceed the mapped memory limit
+static inline int
+os_mapped_limit_exceeded(size_t size) {
+	return UNEXPECTED(global_config.mapped_limit != 0) &&
+	       ((atomic_load_explicit(&global_memory_mapped, memory_order_relaxed) + size) > global_config.mapped_limit);
+}
+
+//! Map memory with the given NUMA node as preferred node, or any node if negative
 static void*
-os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+os_mmap_node(size_t size, size_t alignment, size_t* offset, size_t* mapped_size, int numa_node) {
 	size_t map_size = size + alignment;
+	if (os_mapped_limit_exceeded(size)) {
+		// Address space held by spans queued for deferred release is returned first
+		if (global_release_drain())
+			return os_mmap_node(size, alignment, offset, mapped_size, numa_node);
+		// Mapping beyond the limit fails as if the system was out of memory, without asserting
+		if (global_memory_interface->map_fail_callback && global_memory_interface->map_fail_callback(map_size))
+			return os_mmap_node(size, alignment, offset, mapped_size, numa_node);
+		return 0;
+	}
 #if PLATFORM_WINDOWS
 	// Ok to MEM_COMMIT - according to MSDN, "actual physical pages are not allocated unless/until the virtual addresses
 	// are actually accessed". But if we enable decommit it's better to not immediately commit and instead commit per
@@ -714,8 +1562,14 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 #else
 	DWORD do_commit = MEM_COMMIT;
 #endif
-	void* ptr =
-	    VirtualAlloc(0, map_size, (os_huge_pages ? MEM_LARGE_PAGES : 0) | MEM_RESERVE | do_commit, PAGE_READWRITE);
+	DWORD alloc_type = (os_huge_pages ? MEM_LARGE_PAGES : 0) | MEM_RESERVE | do_commit;
+#if OS_HAS_NUMA
+	void* ptr = (numa_node >= 0) ? VirtualAllocExNuma(GetCurrentProcess(), 0, map_size, alloc_type, PAGE_READWRITE,
+	                                                  (DWORD)numa_node)
+	                             : VirtualAlloc(0, map_size, alloc_type, PAGE_READWRITE);
+#else
+	void* ptr = VirtualAlloc(0, map_size, alloc_type, PAGE_READWRITE);
+#endif
 #else
 	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_UNINITIALIZED;
 #if defined(__APPLE__) && !TARGET_OS_IPHONE && !TARGET_OS_SIMULATOR
@@ -750,11 +1604,13 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 #endif
 	if (ptr == MAP_FAILED)
 		ptr = 0;
+	if (ptr && (numa_node >= 0))
+		os_numa_bind(ptr, map_size, (uint32_t)numa_node);
 #endif
 	if (!ptr) {
 		if (global_memory_interface->map_fail_callback) {
 			if (global_memory_interface->map_fail_callback(map_size))
-				return os_mmap(size, alignment, offset, mapped_size);
+				return os_mmap_node(size, alignment, offset, mapped_size, numa_node);
 		} else {
 			rpmalloc_assert(ptr != 0, "Failed to map more virtual memory");
 		}
@@ -766,34 +1622,57 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 			padding = alignment - padding;
 		rpmalloc_assert(padding <= alignment, "Internal failure in padding");
 		rpmalloc_assert(!(padding % 8), "Internal failure in padding");
+#if ENABLE_UNMAP && !PLATFORM_WINDOWS
+		// Release the alignment slack before and after the aligned region, Windows can only release the full region
+		if (padding)
+			munmap(ptr, padding);
+		if (alignment > padding)
+			munmap(pointer_offset(ptr, padding + size), alignment - padding);
+		ptr = pointer_offset(ptr, padding);
+		map_size = size;
+		padding = 0;
+#else
 		ptr = pointer_offset(ptr, padding);
+#endif
 		*offset = padding;
 	}
 	*mapped_size = map_size;
+	rpmalloc_probe(os_map, ptr, size, map_size, numa_node);
+	atomic_fetch_add_explicit(&global_memory_mapped, map_size, memory_order_relaxed);
+	if (os_commit_on_map())
+		os_memory_commit_add(map_size);
 #if ENABLE_STATISTICS
 	size_t page_count = map_size / global_config.page_size;
-	size_t page_mapped_current =
-	    atomic_fetch_add_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed) + page_count;
-	size_t page_mapped_peak = atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed);
-	while (page_mapped_current > page_mapped_peak) {
-		if (atomic_compare_exchange_weak_explicit(&global_statistics.page_mapped_peak, &page_mapped_peak,
-		                                          page_mapped_current, memory_order_relaxed, memory_order_relaxed))
-			break;
-	}
+	global_statistics_add_peak(&global_statistics.page_mapped, &global_statistics.page_mapped_peak, page_count);
+	atomic_fetch_add_explicit(&global_statistics.page_mapped_total, page_count, memory_order_relaxed);
 #if ENABLE_DECOMMIT
-	size_t page_active_current =
-	    atomic_fetch_add_explicit(&global_statistics.page_active, page_count, memory_order_relaxed) + page_count;
-	size_t page_active_peak = atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed);
-	while (page_active_current > page_active_peak) {
-		if (atomic_compare_exchange_weak_explicit(&global_statistics.page_active_peak, &page_active_peak,
-		                                          page_active_current, memory_order_relaxed, memory_order_relaxed))
-			break;
-	}
+	global_statistics_add_peak(&global_statistics.page_active, &global_statistics.page_active_peak, page_count);
 #endif
 #endif
 	return ptr;
 }
 
+static void*
+os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	return os_mmap_node(size, alignment, offset, mapped_size, -1);
+}
+
+//! Get a monotonic time stamp in milliseconds, wrapping around at 32 bits
+static uint32_t
+os_time_ms(void) {
+#if PLATFORM_WINDOWS
+	return (uint32_t)GetTickCount64();
+#else
+	struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint32_t)(((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000));
+#endif
+}
+
 static void
 os_mcommit(void* address, size_t size) {
 #if ENABLE_DECOMMIT
@@ -810,17 +1689,11 @@ os_mcommit(void* address, size_t size) {
 		}
 		*/
 #endif
+	os_memory_commit_add(size);
 #if ENABLE_STATISTICS
 	size_t page_count = size / global_config.page_size;
 	atomic_fetch_add_explicit(&global_statistics.page_commit, page_count, memory_order_relaxed);
-	size_t page_active_current =
-	    atomic_fetch_add_explicit(&global_statistics.page_active, page_count, memory_order_relaxed) + page_count;
-	size_t page_active_peak = atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed);
-	while (page_active_current > page_active_peak) {
-		if (atomic_compare_exchange_weak_explicit(&global_statistics.page_active_peak, &page_active_peak,
-		                                          page_active_current, memory_order_relaxed, memory_order_relaxed))
-			break;
-	}
+	global_statistics_add_peak(&global_statistics.page_active, &global_statistics.page_active_peak, page_count);
 #endif
 #endif
 	(void)sizeof(address);
@@ -842,7 +1715,14 @@ os_mdecommit(void* address, size_t size) {
 		    rpmalloc_assert(0, "Failed to decommit virtual memory block");
 		}
 		*/
-#if defined(MADV_DONTNEED)
+#if defined(MADV_FREE) && defined(MADV_DONTNEED)
+	// Lazy decommit lets the OS reclaim the pages when under memory pressure, fall back to
+	// immediate decommit on kernels lacking support
+	int ret = -1;
+	if (global_config.decommit_lazy)
+		ret = madvise(address, size, MADV_FREE);
+	if (ret && madvise(address, size, MADV_DONTNEED)) {
+#elif defined(MADV_DONTNEED)
 	if (madvise(address, size, MADV_DONTNEED)) {
 #elif defined(MADV_FREE_REUSABLE)
 	int ret;
@@ -859,6 +1739,7 @@ os_mdecommit(void* address, size_t size) {
 		rpmalloc_assert(0, "Failed to decommit virtual memory block");
 	}
 #endif
+	os_memory_commit_sub(size);
 #if ENABLE_STATISTICS
 	size_t page_count = size / global_config.page_size;
 	atomic_fetch_add_explicit(&global_statistics.page_decommit, page_count, memory_order_relaxed);
@@ -873,10 +1754,22 @@ os_mdecommit(void* address, size_t size) {
 #endif
 }
 
+//! Check if memory decommitted and then committed again by the memory interface reads as zero
+static inline int
+os_decommit_zeroes(void) {
+#if OS_DECOMMIT_ZEROES
+	return !global_config.disable_decommit && !global_config.decommit_lazy &&
+	       (global_memory_interface->memory_decommit == os_mdecommit);
+#else
+	return 0;
+#endif
+}
+
 static void
 os_munmap(void* address, size_t offset, size_t mapped_size) {
 	(void)sizeof(mapped_size);
 	address = pointer_offset(address, -(int32_t)offset);
+	rpmalloc_probe(os_unmap, address, mapped_size, offset, 0);
 #if ENABLE_UNMAP
 #if PLATFORM_WINDOWS
 	if (!VirtualFree(address, 0, MEM_RELEASE)) {
@@ -886,14 +1779,285 @@ os_munmap(void* address, size_t offset, size_t mapped_size) {
 	if (munmap(address, mapped_size))
 		rpmalloc_assert(0, "Failed to unmap virtual memory block");
 #endif
+	atomic_fetch_sub_explicit(&global_memory_mapped, mapped_size, memory_order_relaxed);
+	if (os_commit_on_map())
+		os_memory_commit_sub(mapped_size);
 #if ENABLE_STATISTICS
 	size_t page_count = mapped_size / global_config.page_size;
 	atomic_fetch_sub_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed);
+	atomic_fetch_add_explicit(&global_statistics.page_unmapped_total, page_count, memory_order_relaxed);
 	atomic_fetch_sub_explicit(&global_statistics.page_active, page_count, memory_order_relaxed);
 #endif
 #endif
 }
 
+#if defined(MREMAP_MAYMOVE) && defined(MREMAP_FIXED) && ENABLE_UNMAP && !PLATFORM_WINDOWS
+#define OS_HAS_MREMAP 1
+
+//! Grow a memory region mapped by os_mmap without alignment slack, preserving contents without copying. If the
+//! region cannot be extended in place and moving is allowed, the pages are moved to a new region with the given
+//! alignment. Returns the start of the grown region, or null on failure.
+static void*
+os_mremap(void* address, size_t old_size, size_t new_size, size_t alignment, int may_move) {
+	if (os_mapped_limit_exceeded(new_size - old_size))
+		return 0;
+	void* ptr = mremap(address, old_size, new_size, 0);
+	if (ptr == MAP_FAILED) {
+		if (!may_move)
+			return 0;
+		// Reserve an aligned region and move the pages into it, replacing the reservation
+		size_t offset = 0;
+		size_t mapped_size = 0;
+		void* target = os_mmap(new_size, alignment, &offset, &mapped_size);
+		if (!target)
+			return 0;
+		rpmalloc_assert(!offset && (mapped_size == new_size), "Internal failure in remap target");
+		ptr = mremap(address, old_size, new_size, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+		if (ptr == MAP_FAILED) {
+			os_munmap(target, offset, mapped_size);
+			return 0;
+		}
+		// The remapped pages keep their commit state, the rest of the target region is committed as the block grows
+		atomic_fetch_sub_explicit(&global_memory_mapped, old_size, memory_order_relaxed);
+		if (os_commit_on_map())
+			os_memory_commit_sub(old_size);
+		else
+			os_memory_commit_add(new_size - old_size);
+#if ENABLE_STATISTICS
+		// Mapping of the target region is already accounted for, old region is gone
+		size_t page_count = old_size / global_config.page_size;
+		atomic_fetch_sub_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed);
+		atomic_fetch_add_explicit(&global_statistics.page_unmapped_total, page_count, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&global_statistics.page_active, page_count, memory_order_relaxed);
+#endif
+		return ptr;
+	}
+	atomic_fetch_add_explicit(&global_memory_mapped, new_size - old_size, memory_order_relaxed);
+	os_memory_commit_add(new_size - old_size);
+#if ENABLE_STATISTICS
+	size_t page_count = (new_size - old_size) / global_config.page_size;
+	global_statistics_add_peak(&global_statistics.page_mapped, &global_statistics.page_mapped_peak, page_count);
+	atomic_fetch_add_explicit(&global_statistics.page_mapped_total, page_count, memory_order_relaxed);
+#if ENABLE_DECOMMIT
+	global_statistics_add_peak(&global_statistics.page_active, &global_statistics.page_active_peak, page_count);
+#endif
+#endif
+	return ptr;
+}
+
+#else
+#define OS_HAS_MREMAP 0
+#endif
+
+#if ENABLE_UNMAP && !PLATFORM_WINDOWS
+#define OS_HAS_MAP_EXTEND 1
+
+//! Try to extend a memory mapping in place by mapping the address range directly following it. Fails if any part of
+//! the range is already mapped. Returns non-zero on success.
+static int
+os_mmap_extend(void* address, size_t size, size_t extend_size) {
+	if (os_mapped_limit_exceeded(extend_size))
+		return 0;
+	void* target = pointer_offset(address, size);
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_UNINITIALIZED;
+#if defined(MAP_FIXED_NOREPLACE)
+	flags |= MAP_FIXED_NOREPLACE;
+#endif
+	// Without a no-replace flag the target is only a hint, and kernels not supporting the flag treat it the same
+	void* ptr = mmap(target, extend_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (ptr == MAP_FAILED)
+		return 0;
+	if (ptr != target) {
+		munmap(ptr, extend_size);
+		return 0;
+	}
+	os_set_page_name(ptr, extend_size);
+	atomic_fetch_add_explicit(&global_memory_mapped, extend_size, memory_order_relaxed);
+	if (os_commit_on_map())
+		os_memory_commit_add(extend_size);
+#if ENABLE_STATISTICS
+	size_t page_count = extend_size / global_config.page_size;
+	global_statistics_add_peak(&global_statistics.page_mapped, &global_statistics.page_mapped_peak, page_count);
+	atomic_fetch_add_explicit(&global_statistics.page_mapped_total, page_count, memory_order_relaxed);
+#if ENABLE_DECOMMIT
+	global_statistics_add_peak(&global_statistics.page_active, &global_statistics.page_active_peak, page_count);
+#endif
+#endif
+	return 1;
+}
+
+#else
+#define OS_HAS_MAP_EXTEND 0
+#endif
+
+//! Unmap a memory region through the memory interface, given the size of the memory still committed in the region.
+//! Unmapping releases the committed memory, which must be accounted for when commits are tracked per call.
+static void
+memory_unmap(void* address, size_t offset, size_t mapped_size, size_t committed_size) {
+	global_memory_interface->memory_unmap(address, offset, mapped_size);
+#if ENABLE_UNMAP
+	if (!os_commit_on_map() && (global_memory_interface->memory_commit == os_mcommit))
+		os_memory_commit_sub(committed_size);
+#else
+	(void)sizeof(committed_size);
+#endif
+}
+
+//! Account for memory committed for a first class heap
+static inline void
+heap_commit_add(heap_t* heap, size_t size) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (heap->first_class)
+		heap->memory_committed += size;
+#else
+	(void)sizeof(heap);
+	(void)sizeof(size);
+#endif
+}
+
+//! Account for memory decommitted or released by a first class heap
+static inline void
+heap_commit_sub(heap_t* heap, size_t size) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (heap->first_class) {
+		rpmalloc_assert(heap->memory_committed >= size, "Heap committed memory accounting out of sync");
+		heap->memory_committed -= size;
+	}
+#else
+	(void)sizeof(heap);
+	(void)sizeof(size);
+#endif
+}
+
+////////////
+///
+/// Shared memory interface
+///
+//////
+
+#if OS_HAS_SHARED_MEMORY
+
+static void
+shared_region_lock(shared_region_t* region) {
+	unsigned int lock = 0;
+	while (!atomic_compare_exchange_weak_explicit(&region->lock, &lock, 1, memory_order_acquire,
+	                                              memory_order_relaxed)) {
+		lock = 0;
+		wait_spin();
+	}
+}
+
+static inline void
+shared_region_unlock(shared_region_t* region) {
+	atomic_store_explicit(&region->lock, 0, memory_order_release);
+}
+
+//! Map memory from the first free range of the shared memory region fitting the size at the given alignment. The
+//! memory is part of the mapping of the region file, so no alignment offset is needed
+static void*
+shared_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	shared_region_t* region = global_shared_region;
+	void* ptr = 0;
+	*offset = 0;
+	*mapped_size = size;
+	if (!region)
+		return 0;
+	shared_region_lock(region);
+	for (uint32_t irange = 0; irange < region->range_count; ++irange) {
+		shared_range_t* range = region->range + irange;
+		uintptr_t range_start = region->base + range->offset;
+		uintptr_t start = alignment ? ((range_start + alignment - 1) & ~(uintptr_t)(alignment - 1)) : range_start;
+		size_t head = (size_t)(start - range_start);
+		if ((head >= range->size) || (size > range->size - head))
+			continue;
+		size_t tail = range->size - head - size;
+		if (head && tail) {
+			// Keep the head of the range in place and insert the tail after it
+			if (region->range_count == SHARED_REGION_RANGE_LIMIT)
+				continue;
+			memmove(range + 2, range + 1, sizeof(shared_range_t) * (region->range_count - irange - 1));
+			++region->range_count;
+			range[1].offset = range->offset + head + size;
+			range[1].size = tail;
+			range->size = head;
+		} else if (head) {
+			range->size = head;
+		} else if (tail) {
+			range->offset += size;
+			range->size = tail;
+		} else {
+			memmove(range, range + 1, sizeof(shared_range_t) * (region->range_count - irange - 1));
+			--region->range_count;
+		}
+		ptr = (void*)start;
+		break;
+	}
+	shared_region_unlock(region);
+	return ptr;
+}
+
+//! Memory in the shared memory region is committed by the file system when the pages are first touched
+static void
+shared_mcommit(void* address, size_t size) {
+	(void)sizeof(address);
+	(void)sizeof(size);
+}
+
+//! Release the file pages backing the range, the range reads as zero when touched again
+static void
+shared_mdecommit(void* address, size_t size) {
+#if ENABLE_DECOMMIT && defined(MADV_REMOVE)
+	if (global_config.disable_decommit)
+		return;
+	if (madvise(address, size, MADV_REMOVE))
+		rpmalloc_assert(0, "Failed to decommit shared memory block");
+#else
+	(void)sizeof(address);
+	(void)sizeof(size);
+#endif
+}
+
+//! Release the file pages backing the range and return the range to the free ranges of the shared memory region,
+//! coalescing with adjacent free ranges
+static void
+shared_munmap(void* address, size_t offset, size_t mapped_size) {
+	shared_region_t* region = global_shared_region;
+	address = pointer_offset(address, -(int32_t)offset);
+#if defined(MADV_REMOVE)
+	madvise(address, mapped_size, MADV_REMOVE);
+#endif
+	size_t range_offset = (size_t)((uintptr_t)address - region->base);
+	shared_region_lock(region);
+	uint32_t irange = 0;
+	while ((irange < region->range_count) && (region->range[irange].offset < range_offset))
+		++irange;
+	shared_range_t* prev = irange ? (region->range + irange - 1) : 0;
+	shared_range_t* next = (irange < region->range_count) ? (region->range + irange) : 0;
+	int merge_prev = prev && ((prev->offset + prev->size) == range_offset);
+	int merge_next = next && ((range_offset + mapped_size) == next->offset);
+	if (merge_prev && merge_next) {
+		prev->size += mapped_size + next->size;
+		memmove(next, next + 1, sizeof(shared_range_t) * (region->range_count - irange - 1));
+		--region->range_count;
+	} else if (merge_prev) {
+		prev->size += mapped_size;
+	} else if (merge_next) {
+		next->offset = range_offset;
+		next->size += mapped_size;
+	} else if (region->range_count < SHARED_REGION_RANGE_LIMIT) {
+		memmove(region->range + irange + 1, region->range + irange,
+		        sizeof(shared_range_t) * (region->range_count - irange));
+		region->range[irange].offset = range_offset;
+		region->range[irange].size = mapped_size;
+		++region->range_count;
+	} else {
+		rpmalloc_assert(0, "Shared memory region free range limit exceeded");
+	}
+	shared_region_unlock(region);
+}
+
+#endif
+
 ////////////
 ///
 /// Page interface
@@ -926,14 +2090,23 @@ page_is_thread_heap(page_t* page) {
 #endif
 }
 
+//! Get the offset of the first block in a page. Blocks start at the lowest set bit of the block size if larger than
+//! the page header, which aligns every block in the page to it. Since both the page size and the block size are
+//! multiples of this offset, the page holds as many blocks as with blocks starting right after the page header
+static inline uint32_t
+page_block_offset(uint32_t block_size) {
+	uint32_t block_alignment = block_size & (~block_size + 1);
+	return (block_alignment > PAGE_HEADER_SIZE) ? block_alignment : PAGE_HEADER_SIZE;
+}
+
 static inline block_t*
 page_block_start(page_t* page) {
-	return pointer_offset(page, PAGE_HEADER_SIZE);
+	return pointer_offset(page, page_block_offset(page->block_size));
 }
 
 static inline block_t*
 page_block(page_t* page, uint32_t block_index) {
-	return pointer_offset(page, PAGE_HEADER_SIZE + (page->block_size * block_index));
+	return pointer_offset(page, page_block_offset(page->block_size) + (page->block_size * block_index));
 }
 
 static inline uint32_t
@@ -972,34 +2145,131 @@ page_get_local_free_block(page_t* page) {
 	return block;
 }
 
+//! Get the range of a free page that is decommitted, as offsets from the start of the page. The first memory page
+//! holding the page header is kept committed, and for pages using transparent huge pages the range is shrunk to
+//! whole huge pages to avoid splitting huge pages. The range is empty if the page fits in a single huge page
+static inline void
+page_decommit_range(page_t* page, size_t* start, size_t* end) {
+	size_t page_size = page_get_size(page);
+	*start = global_config.page_size;
+	*end = page_size;
+	if (UNEXPECTED(page->is_thp != 0)) {
+		uintptr_t page_address = (uintptr_t)page;
+		uintptr_t huge_mask = ~(uintptr_t)(os_thp_size - 1);
+		uintptr_t huge_start = (page_address + global_config.page_size + os_thp_size - 1) & huge_mask;
+		uintptr_t huge_end = (page_address + page_size) & huge_mask;
+		*start = (size_t)(huge_start - page_address);
+		*end = (huge_end > huge_start) ? (size_t)(huge_end - page_address) : *start;
+	}
+}
+
 static inline void
 page_decommit_memory_pages(page_t* page) {
 	if (page->is_decommitted)
 		return;
-	void* extra_page = pointer_offset(page, global_config.page_size);
-	size_t extra_page_size = page_get_size(page) - global_config.page_size;
-	global_memory_interface->memory_decommit(extra_page, extra_page_size);
+	size_t start, end;
+	page_decommit_range(page, &start, &end);
+	if (end > start)
+		global_memory_interface->memory_decommit(pointer_offset(page, start), end - start);
 	page->is_decommitted = 1;
 }
 
+//! Decommit the memory pages of a batch of free pages. Address adjacent pages are decommitted in a single call
+//! when using the default memory interface, restoring the headers of the pages inside the range afterwards
+static void
+page_decommit_memory_pages_batch(page_t** pages, uint32_t count) {
+	int coalesce = 0;
+#if ENABLE_DECOMMIT && !PLATFORM_WINDOWS
+	// Windows decommit makes the range inaccessible, custom interfaces might do the same
+	coalesce = !global_config.disable_decommit && (global_memory_interface->memory_decommit == os_mdecommit);
+#endif
+	if (!coalesce) {
+		for (uint32_t ipage = 0; ipage < count; ++ipage)
+			page_decommit_memory_pages(pages[ipage]);
+		return;
+	}
+	for (uint32_t ipage = 1; ipage < count; ++ipage) {
+		page_t* page = pages[ipage];
+		uint32_t iprev = ipage;
+		while (iprev && ((uintptr_t)pages[iprev - 1] > (uintptr_t)page)) {
+			pages[iprev] = pages[iprev - 1];
+			--iprev;
+		}
+		pages[iprev] = page;
+	}
+	page_t page_header[PAGE_DECOMMIT_BATCH_LIMIT];
+	uint32_t ipage = 0;
+	while (ipage < count) {
+		page_t* page = pages[ipage];
+		size_t page_size = page_get_size(page);
+		// Runs never cross into another span, the span header of the first page must stay committed. Pages using
+		// transparent huge pages are decommitted one by one to keep each range aligned to huge pages
+		uint32_t run_count = 1;
+		while (!page->is_thp && ((ipage + run_count) < count) &&
+		       (pages[ipage + run_count] == pointer_offset(pages[ipage + run_count - 1], page_size)) &&
+		       ((uintptr_t)pages[ipage + run_count] & ~SPAN_MASK))
+			++run_count;
+		if (run_count == 1) {
+			page_decommit_memory_pages(page);
+			++ipage;
+			continue;
+		}
+		for (uint32_t irun = 1; irun < run_count; ++irun)
+			memcpy(page_header + irun, pages[ipage + irun], sizeof(page_t));
+		void* extra_page = pointer_offset(page, global_config.page_size);
+		size_t extra_page_size = (page_size * run_count) - global_config.page_size;
+		global_memory_interface->memory_decommit(extra_page, extra_page_size);
+		for (uint32_t irun = 1; irun < run_count; ++irun) {
+			memcpy(pages[ipage + irun], page_header + irun, sizeof(page_t));
+			pages[ipage + irun]->is_decommitted = 1;
+		}
+		os_memory_commit_add((size_t)(run_count - 1) * global_config.page_size);
+#if ENABLE_STATISTICS
+		// Restoring the headers committed the first memory page of each page inside the range again
+		atomic_fetch_sub_explicit(&global_statistics.page_decommit, run_count - 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&global_statistics.page_active, run_count - 1, memory_order_relaxed);
+#endif
+		page->is_decommitted = 1;
+		ipage += run_count;
+	}
+}
+
 static inline void
 page_commit_memory_pages(page_t* page) {
 	if (!page->is_decommitted)
 		return;
-	void* extra_page = pointer_offset(page, global_config.page_size);
-	size_t extra_page_size = page_get_size(page) - global_config.page_size;
-	global_memory_interface->memory_commit(extra_page, extra_page_size);
+	size_t start, end;
+	page_decommit_range(page, &start, &end);
+	if (end > start) {
+		global_memory_interface->memory_commit(pointer_offset(page, start), end - start);
+		heap_commit_add(page->heap, end - start);
+	}
 	page->is_decommitted = 0;
-#if ENABLE_DECOMMIT
-#if !defined(__APPLE__)
-	// When page is recommitted, the blocks in the second memory page and forward
-	// will be zeroed out by OS - take advantage in zalloc/calloc calls and make sure
-	// blocks in first page is zeroed out
-	void* first_page = pointer_offset(page, PAGE_HEADER_SIZE);
-	memset(first_page, 0, global_config.page_size - PAGE_HEADER_SIZE);
-	page->is_zero = 1;
-#endif
-#endif
+	// When page is recommitted, the blocks inside the decommit range will be zeroed out by OS - take advantage in
+	// zalloc/calloc calls, blocks overlapping the memory kept committed are zeroed when allocated
+	if (os_decommit_zeroes()) {
+		page->is_zero = 1;
+		page->is_zero_partial = 1;
+	}
+}
+
+//! Check the free page list of the heap after a committed page was added, decommitting surplus and decayed pages
+static inline void
+heap_page_free_check(heap_t* heap, page_t* page) {
+	uint32_t page_type = page->page_type;
+	uint32_t decay_time = global_config.page_decay_time[page_type];
+	uint32_t current_time = 0;
+	if (decay_time) {
+		current_time = os_time_ms();
+		page->free_time = current_time;
+	}
+	if (++heap->page_free_commit_count[page_type] >= global_page_free_overflow[page_type])
+		heap_page_free_decommit(heap, page_type, global_page_free_retain[page_type]);
+	else if (decay_time)
+		heap_page_free_decay(heap, page_type, current_time);
+	// Memory pressure signalled by another thread is handled when the heap frees a page
+	if (UNEXPECTED(heap->pressure_epoch != atomic_load_explicit(&global_memory_pressure_epoch, memory_order_relaxed)))
+		heap_memory_shed(heap);
 }
 
 static void
@@ -1018,8 +2288,9 @@ page_available_to_free(page_t* page) {
 	page->is_zero = 0;
 	page->next = heap->page_free[page->page_type];
 	heap->page_free[page->page_type] = page;
-	if (++heap->page_free_commit_count[page->page_type] >= global_page_free_overflow[page->page_type])
-		heap_page_free_decommit(heap, page->page_type, global_page_free_retain[page->page_type]);
+	heap_stat_inc(heap, page_use[page->page_type].to_free);
+	heap_stat_dec(heap, page_use[page->page_type].current);
+	heap_page_free_check(heap, page);
 }
 
 static void
@@ -1027,13 +2298,22 @@ page_full_to_available(page_t* page) {
 	rpmalloc_assert(page->is_full == 1, "Page full flag internal failure");
 	rpmalloc_assert(page->is_decommitted == 0, "Page decommitted flag internal failure");
 	heap_t* heap = page->heap;
+	if (heap->page_full[page->page_type] == page) {
+		heap->page_full[page->page_type] = page->next;
+	} else {
+		page->prev->next = page->next;
+		if (page->next)
+			page->next->prev = page->prev;
+	}
 	page->next = heap->page_available[page->size_class];
+	page->prev = 0;
 	if (page->next)
 		page->next->prev = page;
 	heap->page_available[page->size_class] = page;
 	page->is_full = 0;
 	if (page->has_aligned_block == 0)
 		page->generic_free = 0;
+	heap_stat_inc(heap, page_use[page->page_type].from_full);
 }
 
 static void
@@ -1041,14 +2321,21 @@ page_full_to_free_on_new_heap(page_t* page, heap_t* heap) {
 	rpmalloc_assert(heap->id, "Page full to free on default heap");
 	rpmalloc_assert(page->is_full == 1, "Page full flag internal failure");
 	rpmalloc_assert(page->is_decommitted == 0, "Page decommitted flag internal failure");
+	heap_t* page_heap = page->heap;
+	if (page_heap->page_full[page->page_type] == page) {
+		page_heap->page_full[page->page_type] = page->next;
+	} else {
+		page->prev->next = page->next;
+		if (page->next)
+			page->next->prev = page->prev;
+	}
 	page->is_full = 0;
 	page->is_free = 1;
 	page->heap = heap;
 	atomic_store_explicit(&page->thread_free, 0, memory_order_relaxed);
 	page->next = heap->page_free[page->page_type];
 	heap->page_free[page->page_type] = page;
-	if (++heap->page_free_commit_count[page->page_type] >= global_page_free_overflow[page->page_type])
-		heap_page_free_decommit(heap, page->page_type, global_page_free_retain[page->page_type]);
+	heap_page_free_check(heap, page);
 }
 
 static void
@@ -1061,9 +2348,15 @@ page_available_to_full(page_t* page) {
 		if (page->next)
 			page->next->prev = page->prev;
 	}
+	page->next = heap->page_full[page->page_type];
+	page->prev = 0;
+	if (page->next)
+		page->next->prev = page;
+	heap->page_full[page->page_type] = page;
 	page->is_full = 1;
 	page->is_zero = 0;
 	page->generic_free = 1;
+	heap_stat_inc(heap, page_use[page->page_type].to_full);
 }
 
 static inline void
@@ -1091,6 +2384,47 @@ page_adopt_thread_free_block_list(page_t* page) {
 		page->local_free_count = page_block_from_thread_free_list(page, thread_free, &page->local_free);
 		rpmalloc_assert(page->local_free_count <= page->block_used, "Page thread free list count internal failure");
 		page->block_used -= page->local_free_count;
+		heap_stat_adopt(page->heap, page->size_class, page->local_free_count);
+		heap_trace(page->heap, thread_free_adopt, RPMALLOC_EVENT_THREAD_FREE_ADOPT, page->size_class, page->page_type,
+		           (size_t)page->local_free_count * page->block_size);
+	}
+}
+
+//! Adopt all deferred frees of the page into the local free list, and update the page state accordingly
+static void
+page_collect_thread_free_blocks(page_t* page) {
+	if (!atomic_load_explicit(&page->thread_free, memory_order_relaxed))
+		return;
+	unsigned long long thread_free = atomic_exchange_explicit(&page->thread_free, 0, memory_order_acquire);
+	block_t* block = 0;
+	uint32_t list_count = page_block_from_thread_free_list(page, thread_free, &block);
+	if (!list_count)
+		return;
+	// Thread free list is always terminated, splice it in front of the local free list
+	block_t* last_block = block;
+	while (last_block->next)
+		last_block = last_block->next;
+	last_block->next = page->local_free;
+	page->local_free = block;
+	page->local_free_count += list_count;
+	rpmalloc_assert(list_count <= page->block_used, "Page thread free list count internal failure");
+	page->block_used -= list_count;
+	heap_stat_adopt(page->heap, page->size_class, list_count);
+	if (page->is_full)
+		page_full_to_available(page);
+	if (page->block_used == 0)
+		page_available_to_free(page);
+}
+
+//! Put a block freed by another thread in the heap thread free list of the given page type
+static void
+heap_put_thread_free_block(heap_t* heap, uint32_t page_type, block_t* block) {
+	uintptr_t prev_head = atomic_load_explicit(&heap->thread_free[page_type], memory_order_relaxed);
+	block->next = (void*)prev_head;
+	while (!atomic_compare_exchange_weak_explicit(&heap->thread_free[page_type], &prev_head, (uintptr_t)block,
+	                                              memory_order_relaxed, memory_order_relaxed)) {
+		block->next = (void*)prev_head;
+		wait_spin();
 	}
 }
 
@@ -1100,29 +2434,108 @@ page_put_thread_free_block(page_t* page, block_t* block) {
 	if (page->is_full) {
 		// Page is full, put the block in the heap thread free list instead, otherwise
 		// the heap will not pick up the free blocks until a thread local free happens
+		heap_put_thread_free_block(page->heap, page->page_type, block);
+	} else {
+		unsigned long long prev_thread_free = atomic_load_explicit(&page->thread_free, memory_order_relaxed);
+		uint32_t block_index = page_block_index(page, block);
+		rpmalloc_assert(page_block(page, block_index) == block, "Block pointer is not aligned to start of block");
+		uint32_t list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
+		uint64_t thread_free = page_block_to_thread_free_list(page, block_index, list_size);
+		while (!atomic_compare_exchange_weak_explicit(&page->thread_free, &prev_thread_free, thread_free,
+		                                              memory_order_relaxed, memory_order_relaxed)) {
+			list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
+			thread_free = page_block_to_thread_free_list(page, block_index, list_size);
+			wait_spin();
+		}
+	}
+}
+
+//! Put a linked list of blocks of the page freed by the owning thread in the page local free list
+static void
+page_put_local_free_block_list(page_t* page, block_t* block, block_t* last_block, uint32_t count) {
+	last_block->next = page->local_free;
+	page->local_free = block;
+	page->local_free_count += count;
+	rpmalloc_assert(count <= page->block_used, "Page block use counter out of sync");
+	page->block_used -= count;
+	if (UNEXPECTED(page->is_full != 0))
+		page_full_to_available(page);
+	if (UNEXPECTED(page->block_used == 0))
+		page_available_to_free(page);
+}
+
+//! Put a linked list of blocks of the page freed by another thread in the deferred free list with a single CAS
+static void
+page_put_thread_free_block_list(page_t* page, block_t* block, block_t* last_block, uint32_t count) {
+	atomic_thread_fence(memory_order_acquire);
+	if (page->is_full) {
 		heap_t* heap = page->heap;
 		uintptr_t prev_head = atomic_load_explicit(&heap->thread_free[page->page_type], memory_order_relaxed);
-		block->next = (void*)prev_head;
+		last_block->next = (void*)prev_head;
 		while (!atomic_compare_exchange_weak_explicit(&heap->thread_free[page->page_type], &prev_head, (uintptr_t)block,
 		                                              memory_order_relaxed, memory_order_relaxed)) {
-			block->next = (void*)prev_head;
+			last_block->next = (void*)prev_head;
 			wait_spin();
 		}
 	} else {
 		unsigned long long prev_thread_free = atomic_load_explicit(&page->thread_free, memory_order_relaxed);
 		uint32_t block_index = page_block_index(page, block);
-		rpmalloc_assert(page_block(page, block_index) == block, "Block pointer is not aligned to start of block");
-		uint32_t list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
+		uint32_t list_size = page_block_from_thread_free_list(page, prev_thread_free, &last_block->next) + count;
 		uint64_t thread_free = page_block_to_thread_free_list(page, block_index, list_size);
 		while (!atomic_compare_exchange_weak_explicit(&page->thread_free, &prev_thread_free, thread_free,
 		                                              memory_order_relaxed, memory_order_relaxed)) {
-			list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
+			list_size = page_block_from_thread_free_list(page, prev_thread_free, &last_block->next) + count;
 			thread_free = page_block_to_thread_free_list(page, block_index, list_size);
 			wait_spin();
 		}
 	}
 }
 
+//! Flush the buffered chain of blocks in the slot to the deferred free list of the owning page
+static void
+heap_remote_free_flush_slot(remote_free_t* slot) {
+	page_put_thread_free_block_list(slot->page, slot->block, slot->last_block, slot->count);
+	slot->page = 0;
+	slot->block = 0;
+	slot->last_block = 0;
+	slot->count = 0;
+}
+
+//! Flush all buffered chains of blocks freed by the heap to pages owned by other heaps
+static void
+heap_remote_free_flush(heap_t* heap) {
+	for (uint32_t islot = 0; islot < REMOTE_FREE_SLOT_COUNT; ++islot) {
+		if (heap->remote_free[islot].page)
+			heap_remote_free_flush_slot(heap->remote_free + islot);
+	}
+}
+
+//! Buffer a block freed to a page owned by another heap in the calling thread heap, to push blocks to the page in
+//! chains rather than one CAS per block. Blocks of first class heaps are not buffered since the spans are unmapped
+//! on heap free all, and a first class heap set as thread heap does not buffer since it could be freed the same way
+static NOINLINE void
+page_put_remote_free_block(page_t* page, block_t* block) {
+	heap_t* heap = get_thread_heap();
+	if (!heap->id || heap->first_class || page->heap->first_class) {
+		page_put_thread_free_block(page, block);
+		return;
+	}
+	uintptr_t page_address = (uintptr_t)page;
+	uintptr_t slot_hash = (page_address >> SMALL_PAGE_SIZE_SHIFT) ^ (page_address >> MEDIUM_PAGE_SIZE_SHIFT) ^
+	                      (page_address >> LARGE_PAGE_SIZE_SHIFT);
+	remote_free_t* slot = heap->remote_free + (slot_hash & (REMOTE_FREE_SLOT_COUNT - 1));
+	if (slot->page != page) {
+		if (slot->page)
+			heap_remote_free_flush_slot(slot);
+		slot->page = page;
+		slot->last_block = block;
+	}
+	block->next = slot->block;
+	slot->block = block;
+	if (++slot->count >= REMOTE_FREE_BLOCK_LIMIT)
+		heap_remote_free_flush_slot(slot);
+}
+
 static void
 page_push_local_free_to_heap(page_t* page) {
 	// Push the page free list as the fast track list of free blocks for heap
@@ -1165,8 +2578,19 @@ page_initialize_blocks(page_t* page) {
 	return block;
 }
 
+//! Check if a block of the given size in a page with the partial zero flag is zero initialized, which is the case
+//! if inside the decommit range
+static inline int
+page_block_in_decommit_range(page_t* page, void* block, size_t size) {
+	size_t start, end;
+	page_decommit_range(page, &start, &end);
+	size_t block_offset = (size_t)pointer_diff(block, page);
+	return (block_offset >= start) && ((block_offset + size) <= end);
+}
+
+//! Allocate a block from the page, zeroing the given size of the block if requested
 static inline RPMALLOC_ALLOCATOR void*
-page_allocate_block(page_t* page, unsigned int zero) {
+page_allocate_block(page_t* page, size_t size, unsigned int zero) {
 	unsigned int is_zero = 0;
 	block_t* block = (page->local_free != 0) ? page_get_local_free_block(page) : 0;
 	if (UNEXPECTED(block == 0)) {
@@ -1196,15 +2620,52 @@ page_allocate_block(page_t* page, unsigned int zero) {
 	}
 
 	if (zero) {
-		if (!is_zero)
-			memset(block, 0, page->block_size);
-		else
+		// Blocks never initialized in a zero page only need the free list link cleared
+		if (is_zero && (!page->is_zero_partial || page_block_in_decommit_range(page, block, size)))
 			*(uintptr_t*)block = 0;
+		else
+			memory_zero(block, size);
 	}
 
 	return block;
 }
 
+//! Allocate up to the given number of blocks from the page, returns the number of blocks allocated. Uninitialized
+//! blocks are carved in one contiguous run without linking them in the free list.
+static uint32_t
+page_allocate_block_batch(page_t* page, uint32_t count, void** blocks) {
+	uint32_t allocated = 0;
+	while (page->local_free && (allocated < count))
+		blocks[allocated++] = page_get_local_free_block(page);
+	if ((allocated < count) && atomic_load_explicit(&page->thread_free, memory_order_relaxed)) {
+		page_adopt_thread_free_block_list(page);
+		while (page->local_free && (allocated < count))
+			blocks[allocated++] = page_get_local_free_block(page);
+	}
+	if ((allocated < count) && (page->block_initialized < page->block_count)) {
+		uint32_t initialize_count = page->block_count - page->block_initialized;
+		if (initialize_count > (count - allocated))
+			initialize_count = count - allocated;
+		block_t* block = page_block(page, page->block_initialized);
+		for (uint32_t iblock = 0; iblock < initialize_count; ++iblock) {
+			blocks[allocated++] = block;
+			block = pointer_offset(block, page->block_size);
+		}
+		page->block_initialized += initialize_count;
+		page->block_used += initialize_count;
+	}
+
+	rpmalloc_assert(page->block_used <= page->block_count, "Page block use counter out of sync");
+	if (page->block_used == page->block_count)
+		page_adopt_thread_free_block_list(page);
+	if (page->block_used == page->block_count) {
+		rpmalloc_assert(!page->is_full, "Page block use counter out of sync with full flag");
+		page_available_to_full(page);
+	}
+
+	return allocated;
+}
+
 ////////////
 ///
 /// Span interface
@@ -1225,26 +2686,72 @@ span_get_page_from_block(span_t* span, void* block) {
 	return (page_t*)((uintptr_t)block & span->page_address_mask);
 }
 
-//! Find or allocate a page from the given span
-static inline page_t*
-span_allocate_page(span_t* span) {
-	// Allocate path, initialize a new chunk of memory for a page in the given span
-	rpmalloc_assert(span->page_initialized < span->page_count, "Page initialization internal failure");
-	heap_t* heap = span->heap;
+//! Get the size of the address space reserved for the span, starting at the span header
+static inline size_t
+span_reserved_size(span_t* span) {
+	size_t reserved_size = (size_t)span->mapped_size - span->offset;
+	return (reserved_size < SPAN_SIZE) ? reserved_size : SPAN_SIZE;
+}
+
+//! Make sure at least the given size of address space is reserved for the span, extending the reservation in place
+//! in chunks of the configured span reserve size if needed. Returns zero if the reservation could not be extended.
+static NOINLINE int
+span_reserve(span_t* span, size_t size) {
+	size_t reserved_size = span_reserved_size(span);
+	if (reserved_size >= size)
+		return 1;
+#if OS_HAS_MAP_EXTEND
+	if (!global_config.span_reserve_size)
+		return 0;
+	size_t extend_size = global_config.span_reserve_size;
+	if (extend_size < (size - reserved_size))
+		extend_size = size - reserved_size;
+	if (extend_size > (SPAN_SIZE - reserved_size))
+		extend_size = SPAN_SIZE - reserved_size;
+	if (!os_mmap_extend(span, reserved_size, extend_size))
+		return 0;
+	if (os_numa_node_count > 1)
+		os_numa_bind(pointer_offset(span, reserved_size), extend_size, span->numa_node);
+	if (span->thp_policy)
+		os_thp_advise(pointer_offset(span, reserved_size), extend_size, span->thp_policy);
+	span->mapped_size += extend_size;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+//! Find or allocate a page from the given span
+static inline page_t*
+span_allocate_page(span_t* span) {
+	// Allocate path, initialize a new chunk of memory for a page in the given span
+	rpmalloc_assert(span->page_initialized < span->page_count, "Page initialization internal failure");
+	heap_t* heap = span->heap;
 	page_t* page = pointer_offset(span, span->page_size * span->page_initialized);
 
-#if ENABLE_DECOMMIT
 	// The first page is always committed on initial span map of memory
-	if (span->page_initialized)
+	if (span->page_initialized) {
+#if ENABLE_DECOMMIT
 		global_memory_interface->memory_commit(page, span->page_size);
 #endif
+		heap_commit_add(heap, span->page_size);
+	}
 	++span->page_initialized;
 
 	page->page_type = span->page_type;
-	page->is_zero = 1;
+	page->is_zero = span->is_zero;
+	page->is_zero_partial = (page == &span->page);
+	page->is_decommitted = 0;
+	page->is_thp = (span->thp_policy == RPMALLOC_THP_ENABLE);
 	page->heap = heap;
 	rpmalloc_assert(page_is_thread_heap(page), "Page owner thread mismatch");
 
+	if (span->page_initialized < span->page_count) {
+		// Make sure the address space for the next page is reserved, or else limit the span to the reserved pages
+		size_t next_page_end = (size_t)span->page_size * (span->page_initialized + 1);
+		if (UNEXPECTED(next_page_end > span_reserved_size(span)) && !span_reserve(span, next_page_end))
+			span->page_count = span->page_initialized;
+	}
 	if (span->page_initialized == span->page_count) {
 		// Span fully utilized
 		rpmalloc_assert(span == heap->span_partial[span->page_type], "Span partial tracking out of sync");
@@ -1259,8 +2766,26 @@ span_allocate_page(span_t* span) {
 
 static NOINLINE void
 span_deallocate_block(span_t* span, page_t* page, void* block) {
+#if ENABLE_SAMPLING
+	// Sampled blocks are never thread local unless the sample heap is locked by the calling thread
+	if (UNEXPECTED(page->heap == (heap_t*)atomic_load_explicit(&global_sample_heap, memory_order_relaxed)) &&
+	    !page_is_thread_heap(page)) {
+		heap_sample_deallocate_block(page->heap, block);
+		return;
+	}
+#endif
 	if (UNEXPECTED(page->page_type == PAGE_HUGE)) {
-		global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
+		heap_t* heap = span->heap;
+		if (heap->first_class) {
+			// Stop tracking the span for heap free all
+			span_t** span_link = &heap->span_used[PAGE_HUGE];
+			while (*span_link && (*span_link != span))
+				span_link = &(*span_link)->next;
+			if (*span_link)
+				*span_link = span->next;
+			heap_commit_sub(heap, (size_t)span->page_size * (size_t)span->page_count);
+		}
+		heap_release_span(heap, span, 1);
 		return;
 	}
 
@@ -1271,13 +2796,551 @@ span_deallocate_block(span_t* span, page_t* page, void* block) {
 
 	int is_thread_local = page_is_thread_heap(page);
 	if (EXPECTED(is_thread_local != 0)) {
+		heap_stat_free(page->heap, page->size_class, 1);
 		page_put_local_free_block(page, block);
+	} else if (global_config.enable_remote_free_buffer) {
+		// Multithreaded deallocation, buffer until enough blocks are freed to the page
+		page_put_remote_free_block(page, block);
 	} else {
 		// Multithreaded deallocation, push to deferred deallocation list.
 		page_put_thread_free_block(page, block);
 	}
 }
 
+//! Decommit all initialized pages in the span except the span header, coalescing adjacent committed ranges
+static void
+span_decommit_pages(span_t* span) {
+	void* range_start = pointer_offset(span, global_config.page_size);
+	for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+		page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+		if (page->is_decommitted) {
+			// Only the part of a decommitted page outside the decommit range is still committed
+			size_t start, end;
+			page_decommit_range(page, &start, &end);
+			if (end > start) {
+				void* range_end = pointer_offset(page, start);
+				if (range_end > range_start)
+					global_memory_interface->memory_decommit(range_start, (size_t)pointer_diff(range_end, range_start));
+				range_start = pointer_offset(page, end);
+			}
+		}
+	}
+	void* range_end = pointer_offset(span, (size_t)span->page_size * span->page_initialized);
+	if (range_end > range_start)
+		global_memory_interface->memory_decommit(range_start, (size_t)pointer_diff(range_end, range_start));
+	span->is_zero = (uint32_t)os_decommit_zeroes();
+}
+
+//! Get the size of the memory committed in a span which has not been decommitted by span_decommit_pages. Huge spans
+//! and arena spans are committed up to the page size times the page count.
+static size_t
+span_committed_size(span_t* span) {
+	if (span->page_type == PAGE_HUGE)
+		return (size_t)span->page_size * (size_t)span->page_count;
+	size_t committed_size = 0;
+	for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+		page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+		committed_size += span->page_size;
+		if (page->is_decommitted) {
+			size_t start, end;
+			page_decommit_range(page, &start, &end);
+			if (end > start)
+				committed_size -= (end - start);
+		}
+	}
+	return committed_size;
+}
+
+////////////
+///
+/// Deferred release
+///
+//////
+
+//! Unmap all spans queued for deferred release, returns non-zero if any span was unmapped
+static int
+global_release_drain(void) {
+	if (!atomic_load_explicit(&global_release.span, memory_order_relaxed))
+		return 0;
+	span_t* span = (span_t*)atomic_exchange_explicit(&global_release.span, 0, memory_order_acquire);
+	int released = (span != 0);
+	while (span) {
+		span_t* span_next = span->next;
+		size_t mapped_size = (size_t)span->mapped_size;
+		memory_unmap(span, span->offset, mapped_size, (size_t)span->release_committed_size);
+		atomic_fetch_sub_explicit(&global_release.size, mapped_size, memory_order_relaxed);
+		span = span_next;
+	}
+	return released;
+}
+
+//! Unmap a span no longer in use given the size of the memory still committed in the span, or queue it for
+//! deferred release if enabled and the queue has room. The span header must be committed.
+static void
+span_unmap(span_t* span, size_t committed_size) {
+	const size_t release_limit = global_config.release_defer_limit;
+	if (release_limit) {
+		size_t mapped_size = (size_t)span->mapped_size;
+		size_t queued_size = atomic_fetch_add_explicit(&global_release.size, mapped_size, memory_order_relaxed);
+		if ((queued_size + mapped_size) <= release_limit) {
+			span->release_committed_size = committed_size;
+			uintptr_t span_next = atomic_load_explicit(&global_release.span, memory_order_relaxed);
+			do {
+				span->next = (span_t*)span_next;
+			} while (!atomic_compare_exchange_weak_explicit(&global_release.span, &span_next, (uintptr_t)span,
+			                                                memory_order_release, memory_order_relaxed));
+#if !PLATFORM_WINDOWS
+			// Wake the release thread if the queue was empty
+			if (!span_next && atomic_load_explicit(&global_release_thread_active, memory_order_relaxed)) {
+				pthread_mutex_lock(&global_release_lock);
+				pthread_cond_signal(&global_release_signal);
+				pthread_mutex_unlock(&global_release_lock);
+			}
+#endif
+			return;
+		}
+		// The queue is full, unmap the span right away
+		atomic_fetch_sub_explicit(&global_release.size, mapped_size, memory_order_relaxed);
+	}
+	memory_unmap(span, span->offset, (size_t)span->mapped_size, committed_size);
+}
+
+#if !PLATFORM_WINDOWS
+
+//! Entry point of the release thread, unmapping queued spans until stopped
+static void*
+global_release_thread_main(void* arg) {
+	(void)sizeof(arg);
+	pthread_mutex_lock(&global_release_lock);
+	while (!global_release_thread_stop) {
+		if (!atomic_load_explicit(&global_release.span, memory_order_relaxed)) {
+			pthread_cond_wait(&global_release_signal, &global_release_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&global_release_lock);
+		global_release_drain();
+		pthread_mutex_lock(&global_release_lock);
+	}
+	pthread_mutex_unlock(&global_release_lock);
+	return 0;
+}
+
+#endif
+
+//! Start the release thread if enabled, resetting the configuration if not supported or the thread fails to start
+static void
+global_release_thread_start(void) {
+	if (!global_config.release_defer_limit)
+		global_config.enable_release_thread = 0;
+#if !PLATFORM_WINDOWS
+	if (!global_config.enable_release_thread ||
+	    atomic_load_explicit(&global_release_thread_active, memory_order_relaxed))
+		return;
+	global_release_thread_stop = 0;
+	if (pthread_create(&global_release_thread, 0, global_release_thread_main, 0) == 0)
+		atomic_store_explicit(&global_release_thread_active, 1, memory_order_relaxed);
+	else
+		global_config.enable_release_thread = 0;
+#else
+	global_config.enable_release_thread = 0;
+#endif
+}
+
+//! Stop the release thread if running and unmap all queued spans
+static void
+global_release_finalize(void) {
+#if !PLATFORM_WINDOWS
+	if (atomic_load_explicit(&global_release_thread_active, memory_order_relaxed)) {
+		pthread_mutex_lock(&global_release_lock);
+		global_release_thread_stop = 1;
+		pthread_cond_signal(&global_release_signal);
+		pthread_mutex_unlock(&global_release_lock);
+		pthread_join(global_release_thread, 0);
+		atomic_store_explicit(&global_release_thread_active, 0, memory_order_relaxed);
+	}
+#endif
+	global_release_drain();
+}
+
+////////////
+///
+/// Global cache
+///
+//////
+
+#if ENABLE_GLOBAL_CACHE
+
+static inline int
+global_cache_try_lock(global_cache_t* cache) {
+	unsigned int lock = 0;
+	return atomic_compare_exchange_strong_explicit(&cache->lock, &lock, 1, memory_order_acquire, memory_order_relaxed);
+}
+
+static inline void
+global_cache_unlock(global_cache_t* cache) {
+	atomic_store_explicit(&cache->lock, 0, memory_order_release);
+}
+
+//! Get the shard to try at the given step when iterating over all shards. Heaps start at their own shard, and when
+//! NUMA aware the shards are partitioned between nodes so the shards of the heap node are tried first.
+static inline global_cache_t*
+global_cache_shard(heap_t* heap, uint32_t ishard) {
+	uint32_t node_shard_count = GLOBAL_CACHE_SHARD_COUNT / os_numa_node_count;
+	if (node_shard_count < 1)
+		node_shard_count = 1;
+	const uint32_t node_shard = (heap->numa_node * node_shard_count) + ((heap->id + ishard) % node_shard_count);
+	return global_cache + ((node_shard + ((ishard / node_shard_count) * node_shard_count)) % GLOBAL_CACHE_SHARD_COUNT);
+}
+
+#endif
+
+//! Push a free decommitted page to the global cache, returns 0 if all shards are full or busy. Pages in the
+//! global cache have no owning heap, which is only modified while holding the shard lock.
+static int
+global_cache_push_page(heap_t* heap, page_t* page) {
+#if ENABLE_GLOBAL_CACHE
+	rpmalloc_assert(page->is_free && page->is_decommitted, "Global cache page state internal failure");
+	const uint32_t page_type = page->page_type;
+	const uint32_t page_limit = global_cache_page_limit[page_type];
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		// Start at the heap own shard and skip contended shards rather than waiting
+		global_cache_t* cache = global_cache_shard(heap, ishard);
+		uint32_t page_count = atomic_load_explicit(&cache->page_count[page_type], memory_order_relaxed);
+		if ((page_count >= page_limit) || !global_cache_try_lock(cache))
+			continue;
+		page_count = atomic_load_explicit(&cache->page_count[page_type], memory_order_relaxed);
+		int stored = (page_count < page_limit);
+		if (stored) {
+			page->heap = 0;
+			page->next = cache->page[page_type];
+			cache->page[page_type] = page;
+			atomic_store_explicit(&cache->page_count[page_type], page_count + 1, memory_order_relaxed);
+		}
+		global_cache_unlock(cache);
+		if (stored)
+			return 1;
+	}
+#else
+	(void)sizeof(heap);
+	(void)sizeof(page);
+#endif
+	return 0;
+}
+
+//! Pop a free page of the given type from the global cache
+static page_t*
+global_cache_pop_page(heap_t* heap, page_type_t page_type) {
+#if ENABLE_GLOBAL_CACHE
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		global_cache_t* cache = global_cache_shard(heap, ishard);
+		if (!atomic_load_explicit(&cache->page_count[page_type], memory_order_relaxed) || !global_cache_try_lock(cache))
+			continue;
+		page_t* page = cache->page[page_type];
+		if (page) {
+			page->heap = heap;
+			cache->page[page_type] = page->next;
+			atomic_store_explicit(&cache->page_count[page_type],
+			                      atomic_load_explicit(&cache->page_count[page_type], memory_order_relaxed) - 1,
+			                      memory_order_relaxed);
+		}
+		global_cache_unlock(cache);
+		if (page)
+			return page;
+	}
+#else
+	(void)sizeof(heap);
+	(void)sizeof(page_type);
+#endif
+	return 0;
+}
+
+//! Push a span with all memory pages decommitted to the global cache, returns 0 if all shards are full or busy
+static int
+global_cache_push_span(heap_t* heap, span_t* span) {
+#if ENABLE_GLOBAL_CACHE
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		global_cache_t* cache = global_cache_shard(heap, ishard);
+		uint32_t span_count = atomic_load_explicit(&cache->span_count, memory_order_relaxed);
+		if ((span_count >= global_cache_span_limit) || !global_cache_try_lock(cache))
+			continue;
+		span_count = atomic_load_explicit(&cache->span_count, memory_order_relaxed);
+		int stored = (span_count < global_cache_span_limit);
+		if (stored) {
+			span->next = cache->span;
+			cache->span = span;
+			atomic_store_explicit(&cache->span_count, span_count + 1, memory_order_relaxed);
+		}
+		global_cache_unlock(cache);
+		if (stored)
+			return 1;
+	}
+#else
+	(void)sizeof(heap);
+	(void)sizeof(span);
+#endif
+	return 0;
+}
+
+//! Pop a free span from the global cache
+static span_t*
+global_cache_pop_span(heap_t* heap) {
+#if ENABLE_GLOBAL_CACHE
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		global_cache_t* cache = global_cache_shard(heap, ishard);
+		if (!atomic_load_explicit(&cache->span_count, memory_order_relaxed) || !global_cache_try_lock(cache))
+			continue;
+		span_t* span = cache->span;
+		if (span) {
+			cache->span = span->next;
+			atomic_store_explicit(&cache->span_count,
+			                      atomic_load_explicit(&cache->span_count, memory_order_relaxed) - 1,
+			                      memory_order_relaxed);
+		}
+		global_cache_unlock(cache);
+		if (span)
+			return span;
+	}
+#else
+	(void)sizeof(heap);
+#endif
+	return 0;
+}
+
+//! Lock all global cache shards, waiting for contended shards
+static void
+global_cache_lock_all(void) {
+#if ENABLE_GLOBAL_CACHE
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		while (!global_cache_try_lock(global_cache + ishard))
+			wait_spin();
+	}
+#endif
+}
+
+static void
+global_cache_unlock_all(void) {
+#if ENABLE_GLOBAL_CACHE
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard)
+		global_cache_unlock(global_cache + ishard);
+#endif
+}
+
+//! Remove all pages of the given span from the global cache, must be called with all shards locked
+static void
+global_cache_remove_span_pages(span_t* span) {
+#if ENABLE_GLOBAL_CACHE
+	const uint32_t page_type = span->page_type;
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		global_cache_t* cache = global_cache + ishard;
+		uint32_t page_count = atomic_load_explicit(&cache->page_count[page_type], memory_order_relaxed);
+		page_t** page_link = &cache->page[page_type];
+		while (*page_link) {
+			page_t* page = *page_link;
+			if (page_get_span(page) == span) {
+				*page_link = page->next;
+				--page_count;
+			} else {
+				page_link = &page->next;
+			}
+		}
+		atomic_store_explicit(&cache->page_count[page_type], page_count, memory_order_relaxed);
+	}
+#else
+	(void)sizeof(span);
+#endif
+}
+
+//! Unmap all cached spans and clear the global cache, must only be called on finalization
+static void
+global_cache_finalize(void) {
+#if ENABLE_GLOBAL_CACHE
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		global_cache_t* cache = global_cache + ishard;
+		span_t* span = cache->span;
+		while (span) {
+			span_t* span_next = span->next;
+			// Cached spans are decommitted except for the span header
+			memory_unmap(span, span->offset, span->mapped_size, global_config.page_size);
+			span = span_next;
+		}
+		memset(cache, 0, sizeof(global_cache_t));
+	}
+#endif
+}
+
+//! Get the amount of memory in free pages and spans held by the global cache
+static size_t
+global_cache_size(void) {
+	size_t size = 0;
+#if ENABLE_GLOBAL_CACHE
+	for (uint32_t ishard = 0; ishard < GLOBAL_CACHE_SHARD_COUNT; ++ishard) {
+		global_cache_t* cache = global_cache + ishard;
+		for (uint32_t itype = 0; itype < 3; ++itype)
+			size += (size_t)atomic_load_explicit(&cache->page_count[itype], memory_order_relaxed) *
+			        global_page_type_size[itype];
+		size += (size_t)atomic_load_explicit(&cache->span_count, memory_order_relaxed) * SPAN_SIZE;
+	}
+#endif
+#if ENABLE_HUGE_CACHE
+	size += atomic_load_explicit(&global_huge_cache.size, memory_order_relaxed);
+#endif
+	return size;
+}
+
+#if ENABLE_HUGE_CACHE
+
+//! Get the huge cache bucket for a huge span of the given size, each bucket covering a power of two size range
+static inline uint32_t
+global_huge_cache_bucket(size_t size) {
+	return (uint32_t)(rpmalloc_clz(LARGE_BLOCK_SIZE_LIMIT) - rpmalloc_clz(size));
+}
+
+static inline void
+global_huge_cache_lock(void) {
+	unsigned int lock = 0;
+	while (!atomic_compare_exchange_weak_explicit(&global_huge_cache.lock, &lock, 1, memory_order_acquire,
+	                                              memory_order_relaxed)) {
+		lock = 0;
+		wait_spin();
+	}
+}
+
+static inline void
+global_huge_cache_unlock(void) {
+	atomic_store_explicit(&global_huge_cache.lock, 0, memory_order_release);
+}
+
+//! Evict the least recently freed span in the given huge cache bucket, must be called with the lock held
+static span_t*
+global_huge_cache_evict(uint32_t bucket) {
+	span_t** span_link = &global_huge_cache.span[bucket];
+	while ((*span_link)->next)
+		span_link = &(*span_link)->next;
+	span_t* span = *span_link;
+	*span_link = 0;
+	--global_huge_cache.span_count[bucket];
+	atomic_fetch_sub_explicit(&global_huge_cache.size, (size_t)span->page_size * (size_t)span->page_count,
+	                          memory_order_relaxed);
+	return span;
+}
+
+#endif
+
+//! Push a freed huge span to the huge cache for reuse, returns 0 if the span cannot be cached. Recently freed spans
+//! are preferred, making room by evicting the least recently freed span in the bucket if full, and the least
+//! recently freed spans in the largest buckets if the cache size limit is reached.
+static int
+global_huge_cache_push(span_t* span) {
+#if ENABLE_HUGE_CACHE
+	const size_t span_size = (size_t)span->page_size * (size_t)span->page_count;
+	const uint32_t bucket = global_huge_cache_bucket(span_size);
+	if ((bucket >= HUGE_CACHE_BUCKET_COUNT) || (span_size > HUGE_CACHE_SIZE_LIMIT))
+		return 0;
+	span_t* evict_list = 0;
+	global_huge_cache_lock();
+	if (global_huge_cache.span_count[bucket] >= HUGE_CACHE_BUCKET_LIMIT) {
+		span_t* evict_span = global_huge_cache_evict(bucket);
+		evict_span->next = evict_list;
+		evict_list = evict_span;
+	}
+	uint32_t evict_bucket = HUGE_CACHE_BUCKET_COUNT - 1;
+	while ((atomic_load_explicit(&global_huge_cache.size, memory_order_relaxed) + span_size) > HUGE_CACHE_SIZE_LIMIT) {
+		while (!global_huge_cache.span_count[evict_bucket])
+			--evict_bucket;
+		span_t* evict_span = global_huge_cache_evict(evict_bucket);
+		evict_span->next = evict_list;
+		evict_list = evict_span;
+	}
+	span->next = global_huge_cache.span[bucket];
+	global_huge_cache.span[bucket] = span;
+	++global_huge_cache.span_count[bucket];
+	atomic_fetch_add_explicit(&global_huge_cache.size, span_size, memory_order_relaxed);
+	global_huge_cache_unlock();
+	// Unmap evicted spans outside of the lock
+	while (evict_list) {
+		span_t* span_next = evict_list->next;
+		span_unmap(evict_list, span_committed_size(evict_list));
+		evict_list = span_next;
+	}
+	return 1;
+#else
+	(void)sizeof(span);
+	return 0;
+#endif
+}
+
+//! Pop a cached huge span with room for at least the given number of bytes from the huge cache
+static span_t*
+global_huge_cache_pop(size_t size) {
+#if ENABLE_HUGE_CACHE
+	const uint32_t bucket = global_huge_cache_bucket(size);
+	if ((bucket >= HUGE_CACHE_BUCKET_COUNT) || !atomic_load_explicit(&global_huge_cache.size, memory_order_relaxed))
+		return 0;
+	// Spans in the same bucket are less than twice the requested size, take the first one large enough
+	global_huge_cache_lock();
+	span_t** span_link = &global_huge_cache.span[bucket];
+	while (*span_link && (((size_t)(*span_link)->page_size * (size_t)(*span_link)->page_count) < size))
+		span_link = &(*span_link)->next;
+	span_t* span = *span_link;
+	if (span) {
+		*span_link = span->next;
+		--global_huge_cache.span_count[bucket];
+		atomic_fetch_sub_explicit(&global_huge_cache.size, (size_t)span->page_size * (size_t)span->page_count,
+		                          memory_order_relaxed);
+	}
+	global_huge_cache_unlock();
+	return span;
+#else
+	(void)sizeof(size);
+	return 0;
+#endif
+}
+
+//! Unmap all cached huge spans to release their memory under memory pressure
+static void
+global_huge_cache_purge(void) {
+#if ENABLE_HUGE_CACHE
+	if (!atomic_load_explicit(&global_huge_cache.size, memory_order_relaxed))
+		return;
+	span_t* evict_list = 0;
+	global_huge_cache_lock();
+	for (uint32_t ibucket = 0; ibucket < HUGE_CACHE_BUCKET_COUNT; ++ibucket) {
+		span_t* span = global_huge_cache.span[ibucket];
+		while (span) {
+			span_t* span_next = span->next;
+			span->next = evict_list;
+			evict_list = span;
+			span = span_next;
+		}
+		global_huge_cache.span[ibucket] = 0;
+		global_huge_cache.span_count[ibucket] = 0;
+	}
+	atomic_store_explicit(&global_huge_cache.size, 0, memory_order_relaxed);
+	global_huge_cache_unlock();
+	while (evict_list) {
+		span_t* span_next = evict_list->next;
+		memory_unmap(evict_list, evict_list->offset, evict_list->mapped_size, span_committed_size(evict_list));
+		evict_list = span_next;
+	}
+#endif
+}
+
+//! Unmap all cached huge spans, must only be called on finalization
+static void
+global_huge_cache_finalize(void) {
+#if ENABLE_HUGE_CACHE
+	for (uint32_t ibucket = 0; ibucket < HUGE_CACHE_BUCKET_COUNT; ++ibucket) {
+		span_t* span = global_huge_cache.span[ibucket];
+		while (span) {
+			span_t* span_next = span->next;
+			memory_unmap(span, span->offset, span->mapped_size, span_committed_size(span));
+			span = span_next;
+		}
+	}
+	memset(&global_huge_cache, 0, sizeof(global_huge_cache));
+#endif
+}
+
 ////////////
 ///
 /// Block interface
@@ -1300,6 +3363,7 @@ block_deallocate(block_t* block) {
 	if (EXPECTED(is_thread_local != 0)) {
 		if (EXPECTED(page->generic_free == 0)) {
 			// Page is not huge, not full and has no aligned block - fast path
+			heap_stat_free(page->heap, page->size_class, 1);
 			block->next = page->local_free;
 			page->local_free = block;
 			++page->local_free_count;
@@ -1313,12 +3377,77 @@ block_deallocate(block_t* block) {
 	}
 }
 
+//! Deallocate a block given the size of the allocation, with an optional alignment. The size determines the page
+//! type and thereby the page of the block directly from the block address without loading the span header.
+static inline void
+block_deallocate_sized(block_t* block, size_t size, size_t alignment) {
+	size = get_size_aligned(size, alignment);
+	if (EXPECTED(size <= LARGE_BLOCK_SIZE_LIMIT)) {
+		uint32_t size_class = (size <= (SMALL_GRANULARITY * 64)) ? get_size_class_tiny(size) : get_size_class(size);
+		page_t* page = (page_t*)((uintptr_t)block & global_page_type_mask[get_page_type(size_class)]);
+		rpmalloc_assert(page == span_get_page_from_block(block_get_span(block), block),
+		                "Block deallocated with size not matching allocation");
+		if (EXPECTED((page_is_thread_heap(page) != 0) && (page->is_full == 0))) {
+			// Blocks from non-aligned allocations always point to the block start, so only blocks from aligned
+			// allocations need to be realigned
+			if ((alignment > SMALL_GRANULARITY) && page->has_aligned_block)
+				block = page_block_realign(page, block);
+			heap_stat_free(page->heap, page->size_class, 1);
+			block->next = page->local_free;
+			page->local_free = block;
+			++page->local_free_count;
+			if (UNEXPECTED(--page->block_used == 0))
+				page_available_to_free(page);
+			return;
+		}
+	}
+	block_deallocate(block);
+}
+
+//! Deallocate a batch of blocks, splicing each run of consecutive blocks in the same page into the page free lists
+static void
+block_deallocate_batch(void** blocks, size_t count) {
+	size_t iblock = 0;
+	while (iblock < count) {
+		block_t* block = blocks[iblock++];
+		if (UNEXPECTED(block == 0))
+			continue;
+		span_t* span = block_get_span(block);
+		page_t* page = span_get_page_from_block(span, block);
+		if (UNEXPECTED((page->page_type == PAGE_HUGE) || page->has_aligned_block)) {
+			span_deallocate_block(span, page, block);
+			continue;
+		}
+#if ENABLE_SAMPLING
+		if (UNEXPECTED(page->heap == (heap_t*)atomic_load_explicit(&global_sample_heap, memory_order_relaxed))) {
+			span_deallocate_block(span, page, block);
+			continue;
+		}
+#endif
+		block_t* last_block = block;
+		uint32_t list_count = 1;
+		while ((iblock < count) && blocks[iblock] &&
+		       (span_get_page_from_block(block_get_span(blocks[iblock]), blocks[iblock]) == page)) {
+			last_block->next = blocks[iblock++];
+			last_block = last_block->next;
+			++list_count;
+		}
+		if (EXPECTED(page_is_thread_heap(page) != 0)) {
+			heap_stat_free(page->heap, page->size_class, list_count);
+			page_put_local_free_block_list(page, block, last_block, list_count);
+		} else {
+			// Multithreaded deallocation, push run to deferred deallocation list
+			page_put_thread_free_block_list(page, block, last_block, list_count);
+		}
+	}
+}
+
 static inline size_t
 block_usable_size(block_t* block) {
 	span_t* span = (span_t*)((uintptr_t)block & SPAN_MASK);
 	if (EXPECTED(span->page_type <= PAGE_LARGE)) {
 		page_t* page = span_get_page_from_block(span, block);
-		void* blocks_start = pointer_offset(page, PAGE_HEADER_SIZE);
+		void* blocks_start = page_block_start(page);
 		return page->block_size - ((size_t)pointer_diff(block, blocks_start) % page->block_size);
 	} else {
 		return ((size_t)span->page_size * (size_t)span->page_count) - (size_t)pointer_diff(block, span);
@@ -1331,23 +3460,103 @@ block_usable_size(block_t* block) {
 ///
 //////
 
+//! Get the heap pointer from a tagged heap queue head
+static inline heap_t*
+heap_queue_head(unsigned long long head) {
+	return (heap_t*)(uintptr_t)((head & ~HEAP_QUEUE_TAG_MASK) >> HEAP_QUEUE_POINTER_SHIFT);
+}
+
+//! Make a tagged heap queue head from the heap pointer and the tag of the previous head incremented
+static inline unsigned long long
+heap_queue_make_head(heap_t* heap, unsigned long long prev_head) {
+	return ((unsigned long long)(uintptr_t)heap << HEAP_QUEUE_POINTER_SHIFT) | ((prev_head + 1) & HEAP_QUEUE_TAG_MASK);
+}
+
+//! Push a heap to a heap queue. The queue is a lock free stack where the head pointer is tagged with a counter that
+//! is incremented on each push and pop, to detect the head heap being popped and pushed back between reading the
+//! head and swapping it in another thread
 static inline void
-heap_lock_acquire(void) {
-	uintptr_t lock = 0;
-	uintptr_t this_lock = get_thread_id();
-	while (!atomic_compare_exchange_strong(&global_heap_lock, &lock, this_lock)) {
-		lock = 0;
-		wait_spin();
-	}
+heap_queue_push(atomic_ullong* queue, heap_t* heap) {
+	rpmalloc_assert(((uintptr_t)heap & 4095) == 0, "Heap not page aligned");
+	rpmalloc_assert(heap_queue_head(heap_queue_make_head(heap, 0)) == heap, "Heap address exceeds 48 bits");
+	unsigned long long head = atomic_load_explicit(queue, memory_order_relaxed);
+	do {
+		heap->next = heap_queue_head(head);
+	} while (!atomic_compare_exchange_weak_explicit(queue, &head, heap_queue_make_head(heap, head),
+	                                                memory_order_release, memory_order_relaxed));
 }
 
+//! Pop a heap from a heap queue, or null if empty. Heaps are not unmapped while the allocator is initialized, so
+//! reading the next pointer of a head heap popped by another thread is safe and will fail the swap
+static inline heap_t*
+heap_queue_pop(atomic_ullong* queue) {
+	unsigned long long head = atomic_load_explicit(queue, memory_order_acquire);
+	heap_t* heap;
+	unsigned long long next;
+	do {
+		heap = heap_queue_head(head);
+		if (!heap)
+			return 0;
+		next = heap_queue_make_head(heap->next, head);
+	} while (!atomic_compare_exchange_weak_explicit(queue, &head, next, memory_order_acquire, memory_order_acquire));
+	return heap;
+}
+
+//! Add a newly allocated heap to the list of all heaps. Heaps are only removed on finalization, so a plain lock free
+//! stack push suffices
+static inline void
+heap_list_add(heap_t* heap) {
+	uintptr_t head = atomic_load_explicit(&global_heap_list, memory_order_relaxed);
+	do {
+		heap->list_next = (heap_t*)head;
+	} while (!atomic_compare_exchange_weak_explicit(&global_heap_list, &head, (uintptr_t)heap, memory_order_release,
+	                                                memory_order_relaxed));
+}
+
+//! Map memory for a heap, with a preference for the given NUMA node if NUMA awareness is enabled and the default
+//! memory interface is used
+static void*
+heap_memory_map(uint32_t numa_node, size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+#if OS_HAS_NUMA
+	if ((os_numa_node_count > 1) && (global_memory_interface->memory_map == os_mmap))
+		return os_mmap_node(size, alignment, offset, mapped_size, (int)numa_node);
+#else
+	(void)sizeof(numa_node);
+#endif
+	return global_memory_interface->memory_map(size, alignment, offset, mapped_size);
+}
+
+//! Update the preferred NUMA node of memory pages in a span reused by a heap on another node
 static inline void
-heap_lock_release(void) {
-	rpmalloc_assert((uintptr_t)atomic_load_explicit(&global_heap_lock, memory_order_relaxed) == get_thread_id(),
-	                "Bad heap lock");
-	atomic_store_explicit(&global_heap_lock, 0, memory_order_release);
+heap_numa_rebind(heap_t* heap, span_t* span, void* address, size_t size) {
+#if OS_HAS_NUMA
+	if ((span->numa_node != heap->numa_node) && (global_memory_interface->memory_map == os_mmap))
+		os_numa_bind(address, size, heap->numa_node);
+#else
+	(void)sizeof(heap);
+	(void)sizeof(span);
+	(void)sizeof(address);
+	(void)sizeof(size);
+#endif
 }
 
+#if ENABLE_EVENT_LOG
+//! Record a slow path event in the heap event log, overwriting the oldest event once the log is full
+static void
+heap_event_record(heap_t* heap, uint32_t type, uint32_t size_class, uint32_t page_type, size_t size) {
+	// The fallback heap of threads not yet initialized is shared
+	if (!heap->id)
+		return;
+	rpmalloc_event_t* event = heap->event + (heap->event_count++ & (EVENT_LOG_SIZE - 1));
+	event->type = type;
+	event->heap_id = heap->id;
+	event->size_class = size_class;
+	event->page_type = page_type;
+	event->size = size;
+	event->time = os_time_ms();
+}
+#endif
+
 static inline heap_t*
 heap_initialize(void* block) {
 	heap_t* heap = block;
@@ -1357,19 +3566,21 @@ heap_initialize(void* block) {
 }
 
 static heap_t*
-heap_allocate_new(void) {
+heap_allocate_new(uint32_t numa_node) {
 	if (!global_config.page_size)
 		rpmalloc_initialize(0);
 	size_t heap_size = get_page_aligned_size(sizeof(heap_t));
 	size_t offset = 0;
 	size_t mapped_size = 0;
-	block_t* block = global_memory_interface->memory_map(heap_size, 0, &offset, &mapped_size);
+	block_t* block = heap_memory_map(numa_node, heap_size, 0, &offset, &mapped_size);
 #if ENABLE_DECOMMIT
 	global_memory_interface->memory_commit(block, heap_size);
 #endif
 	heap_t* heap = heap_initialize((void*)block);
+	heap->numa_node = numa_node;
 	heap->offset = (uint32_t)offset;
 	heap->mapped_size = mapped_size;
+	heap_list_add(heap);
 #if ENABLE_STATISTICS
 	atomic_fetch_add_explicit(&global_statistics.heap_count, 1, memory_order_relaxed);
 #endif
@@ -1378,62 +3589,255 @@ heap_allocate_new(void) {
 
 static void
 heap_unmap(heap_t* heap) {
-	global_memory_interface->memory_unmap(heap, heap->offset, heap->mapped_size);
+	memory_unmap(heap, heap->offset, heap->mapped_size, get_page_aligned_size(sizeof(heap_t)));
 }
 
 static heap_t*
-heap_allocate(int first_class) {
+heap_allocate(int first_class, uint32_t numa_node) {
 	heap_t* heap = 0;
 	if (!first_class) {
-		heap_lock_acquire();
-		heap = global_heap_queue;
-		global_heap_queue = heap ? heap->next : 0;
-		heap_lock_release();
+		// Prefer heaps released with pages over drained heaps
+		heap = heap_queue_pop(&global_heap_orphan_queue[numa_node]);
+		if (!heap)
+			heap = heap_queue_pop(&global_heap_queue[numa_node]);
+	}
+	if (!heap) {
+		heap = heap_allocate_new(numa_node);
+		if (heap)
+			heap->first_class = (uint32_t)first_class;
 	}
-	if (!heap)
-		heap = heap_allocate_new();
 	if (heap) {
-		uintptr_t current_thread_id = get_thread_id();
-		heap_lock_acquire();
-		heap->next = global_heap_used;
-		heap->prev = 0;
-		if (global_heap_used)
-			global_heap_used->prev = heap;
-		global_heap_used = heap;
-		heap_lock_release();
-		heap->owner_thread = current_thread_id;
+		heap->owner_thread = get_thread_id();
+		heap_trace(heap, heap_acquire, RPMALLOC_EVENT_HEAP_ACQUIRE, 0, 0, 0);
 	}
 	return heap;
 }
 
+//! Release a heap for reuse. A thread reusing the ID of the previous owner thread must not see the pages of the heap as
+//! thread local, and the pages of a released thread heap can be adopted by live heaps until it is reused
 static inline void
 heap_release(heap_t* heap) {
-	heap_lock_acquire();
-	if (heap->prev)
-		heap->prev->next = heap->next;
-	if (heap->next)
-		heap->next->prev = heap->prev;
-	if (global_heap_used == heap)
-		global_heap_used = heap->next;
-	heap->next = global_heap_queue;
-	global_heap_queue = heap;
-	heap_lock_release();
+	heap_trace(heap, heap_release, RPMALLOC_EVENT_HEAP_RELEASE, 0, 0, 0);
+	heap_remote_free_flush(heap);
+	heap->owner_thread = CPU_HEAP_UNOWNED;
+	if (heap->first_class)
+		heap_queue_push(&global_heap_queue[heap->numa_node], heap);
+	else
+		heap_queue_push(&global_heap_orphan_queue[heap->numa_node], heap);
+}
+
+//! Allocate the heap for the given processor slot in per processor heap mode, falling back to the heap of the first
+//! slot which is allocated during initialization if out of memory
+static NOINLINE heap_t*
+heap_cpu_allocate(uint32_t icpu) {
+	heap_t* heap = heap_allocate(0, os_numa_node_current());
+	if (!heap)
+		return (heap_t*)atomic_load_explicit(&global_cpu_heap[0], memory_order_acquire);
+	heap->owner_thread = CPU_HEAP_UNOWNED;
+	uintptr_t expected = 0;
+	if (!atomic_compare_exchange_strong_explicit(&global_cpu_heap[icpu], &expected, (uintptr_t)heap,
+	                                             memory_order_release, memory_order_acquire)) {
+		// Another thread installed a heap for the processor first
+		heap_release(heap);
+		heap = (heap_t*)expected;
+	}
+	return heap;
+}
+
+//! Lock the heap of the processor the calling thread is running on in per processor heap mode. If the heap is locked
+//! by a thread that was preempted or migrated, try the heaps of the following processors instead of waiting
+static heap_t*
+heap_cpu_acquire(void) {
+	uint32_t icpu = os_cpu_current() % global_cpu_heap_count;
+	uint32_t ispin = 0;
+	while (1) {
+		heap_t* heap = (heap_t*)atomic_load_explicit(&global_cpu_heap[icpu], memory_order_acquire);
+		if (UNEXPECTED(!heap))
+			heap = heap_cpu_allocate(icpu);
+		if (EXPECTED(!atomic_load_explicit(&heap->lock, memory_order_relaxed) &&
+		             !atomic_exchange_explicit(&heap->lock, 1, memory_order_acquire))) {
+			// Owning the heap while locked makes frees to the heap by this thread take the local path
+			heap->owner_thread = get_thread_id();
+			return heap;
+		}
+		if (++icpu >= global_cpu_heap_count)
+			icpu = 0;
+		if (++ispin >= global_cpu_heap_count) {
+			ispin = 0;
+			wait_spin();
+		}
+	}
+}
+
+//! Unlock a heap locked with heap_cpu_acquire
+static inline void
+heap_cpu_release(heap_t* heap) {
+	heap->owner_thread = CPU_HEAP_UNOWNED;
+	atomic_store_explicit(&heap->lock, 0, memory_order_release);
+}
+
+//! Get the heap to use for allocations in the calling thread, which must be released with thread_heap_release
+static inline heap_t*
+thread_heap_acquire(void) {
+	if (EXPECTED(!global_cpu_heap_count))
+		return get_thread_heap();
+	return heap_cpu_acquire();
+}
+
+//! Release a heap returned by thread_heap_acquire
+static inline void
+thread_heap_release(heap_t* heap) {
+	if (UNEXPECTED(global_cpu_heap_count != 0))
+		heap_cpu_release(heap);
 }
 
 static void
 heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count) {
-	page_t* page = heap->page_free[page_type];
+	page_t** page_link = &heap->page_free[page_type];
+	page_t* page = *page_link;
 	while (page && page_retain_count) {
+		page_link = &page->next;
 		page = page->next;
 		--page_retain_count;
 	}
-	while (page && (page->is_decommitted == 0)) {
-		page_decommit_memory_pages(page);
+	// Committed pages are kept first in the free list, decommit the surplus in address sorted batches
+	page_t* decommit_batch[PAGE_DECOMMIT_BATCH_LIMIT];
+	uint32_t decommit_count = 0;
+	size_t decommit_size = 0;
+	page_t* decommit_page = page;
+	while (decommit_page && !decommit_page->is_decommitted) {
+		page_t* next_page = decommit_page->next;
+		size_t start, end;
+		page_decommit_range(decommit_page, &start, &end);
+		if (end > start) {
+			heap_commit_sub(heap, end - start);
+			decommit_size += end - start;
+		}
+		decommit_batch[decommit_count++] = decommit_page;
 		--heap->page_free_commit_count[page_type];
-		page = page->next;
+		if (decommit_count == PAGE_DECOMMIT_BATCH_LIMIT) {
+			page_decommit_memory_pages_batch(decommit_batch, decommit_count);
+			decommit_count = 0;
+		}
+		decommit_page = next_page;
+	}
+	if (decommit_count)
+		page_decommit_memory_pages_batch(decommit_batch, decommit_count);
+	if (decommit_size)
+		heap_trace(heap, page_decommit, RPMALLOC_EVENT_PAGE_DECOMMIT, 0, page_type, decommit_size);
+
+	// Pages from first class heaps cannot be shared, the spans are unmapped on heap free all
+	if (heap->first_class)
+		return;
+	while (page) {
+		page_t* next_page = page->next;
+		if (!global_cache_push_page(heap, page))
+			break;
+		// Surplus page moved to global cache for reuse by other heaps
+		*page_link = next_page;
+		heap_stat_inc(heap, page_use[page_type].to_global);
+		heap_stat_add(heap, thread_to_global, global_page_type_size[page_type]);
+		page = next_page;
 	}
 }
 
+//! Decommit the free pages of the given type that have been in the heap free list longer than the decay time. Pages
+//! are added first in the free list, so pages after the first decayed page are decayed as well
+static void
+heap_page_free_decay(heap_t* heap, uint32_t page_type, uint32_t current_time) {
+	uint32_t decay_time = global_config.page_decay_time[page_type];
+	uint32_t page_retain_count = 0;
+	for (page_t* page = heap->page_free[page_type]; page && !page->is_decommitted; page = page->next) {
+		if ((uint32_t)(current_time - (uint32_t)page->free_time) >= decay_time) {
+			heap_page_free_decommit(heap, page_type, page_retain_count);
+			return;
+		}
+		++page_retain_count;
+	}
+}
+
+//! Decommit all free pages of the heap to release memory under memory pressure
+static void
+heap_memory_shed(heap_t* heap) {
+	heap->pressure_epoch = atomic_load_explicit(&global_memory_pressure_epoch, memory_order_relaxed);
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		if (heap->page_free_commit_count[itype])
+			heap_page_free_decommit(heap, itype, 0);
+	}
+}
+
+//! Enforce the memory limits for committing the given number of bytes, see heap_memory_limit_check
+static NOINLINE int
+heap_memory_limit_enforce(heap_t* heap, size_t size) {
+	int shed = 0;
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (heap && (heap->memory_soft_limit || heap->memory_hard_limit)) {
+		if (heap->memory_soft_limit && ((heap->memory_committed + size) > heap->memory_soft_limit)) {
+			if (!heap->memory_pressure) {
+				heap->memory_pressure = 1;
+				heap_memory_shed(heap);
+				shed = 1;
+				if (global_memory_interface->memory_pressure_callback)
+					global_memory_interface->memory_pressure_callback(heap, heap->memory_committed + size,
+					                                                  heap->memory_soft_limit);
+			}
+		} else {
+			heap->memory_pressure = 0;
+		}
+		if (heap->memory_hard_limit && ((heap->memory_committed + size) > heap->memory_hard_limit)) {
+			if (!shed)
+				heap_memory_shed(heap);
+			if ((heap->memory_committed + size) > heap->memory_hard_limit)
+				return 0;
+			shed = 1;
+		}
+	}
+#endif
+	size_t soft_limit = global_config.committed_soft_limit;
+	size_t hard_limit = global_config.committed_limit;
+	size_t committed = atomic_load_explicit(&global_memory_committed, memory_order_relaxed) + size;
+	if (soft_limit && (committed > soft_limit)) {
+		unsigned int pressure = 0;
+		if (atomic_compare_exchange_strong_explicit(&global_memory_pressure, &pressure, 1, memory_order_relaxed,
+		                                            memory_order_relaxed)) {
+			// Other heaps decommit their free pages when they notice the new epoch
+			atomic_fetch_add_explicit(&global_memory_pressure_epoch, 1, memory_order_relaxed);
+			if (heap && !shed)
+				heap_memory_shed(heap);
+			shed = 1;
+			global_huge_cache_purge();
+			global_release_drain();
+			committed = atomic_load_explicit(&global_memory_committed, memory_order_relaxed) + size;
+			if (global_memory_interface->memory_pressure_callback)
+				global_memory_interface->memory_pressure_callback(0, committed, soft_limit);
+		}
+	}
+	if (hard_limit && (committed > hard_limit)) {
+		if (heap && !shed)
+			heap_memory_shed(heap);
+		global_huge_cache_purge();
+		global_release_drain();
+		committed = atomic_load_explicit(&global_memory_committed, memory_order_relaxed) + size;
+		if (committed > hard_limit)
+			return 0;
+	}
+	return 1;
+}
+
+//! Check if the given number of bytes of memory can be committed for the heap without exceeding the hard limits of
+//! committed memory, shedding cached memory and signalling memory pressure if a soft limit is exceeded. The heap is
+//! null if the memory is not committed by the thread owning the heap, since only the owner can shed its free pages.
+static inline int
+heap_memory_limit_check(heap_t* heap, size_t size) {
+	int limited = (global_config.committed_limit | global_config.committed_soft_limit) != 0;
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	limited |= (heap && (heap->memory_soft_limit | heap->memory_hard_limit));
+#endif
+	if (EXPECTED(!limited))
+		return 1;
+	return heap_memory_limit_enforce(heap, size);
+}
+
 static inline void
 heap_make_free_page_available(heap_t* heap, uint32_t size_class, page_t* page) {
 	page->size_class = size_class;
@@ -1457,6 +3861,40 @@ heap_make_free_page_available(heap_t* heap, uint32_t size_class, page_t* page) {
 	heap->page_available[size_class] = page;
 	if (page->is_decommitted)
 		page_commit_memory_pages(page);
+	heap_stat_inc_peak(heap, page_use[page->page_type].current, page_use[page->page_type].peak);
+}
+
+//! Get a span with at least the given size of address space reserved for the heap. Reuse a span released by another
+//! heap, or else map more memory. A reused span with a partial address space reservation must fit the given size.
+static span_t*
+heap_map_span(heap_t* heap, size_t size, int* from_cache) {
+	span_t* span = global_cache_pop_span(heap);
+	if (span && !span_reserve(span, size)) {
+		memory_unmap(span, span->offset, span->mapped_size, global_config.page_size);
+		span = 0;
+	}
+	if (span) {
+		heap_numa_rebind(heap, span, span, span_reserved_size(span));
+		span->numa_node = heap->numa_node;
+		*from_cache = 1;
+		return span;
+	}
+	// Reserve the full span or, if configured, only the initial chunk of the span address space
+	size_t reserve_size = SPAN_SIZE;
+	if (global_config.span_reserve_size)
+		reserve_size = (global_config.span_reserve_size > size) ? global_config.span_reserve_size : size;
+	size_t offset = 0;
+	size_t mapped_size = 0;
+	span = heap_memory_map(heap->numa_node, reserve_size, SPAN_SIZE, &offset, &mapped_size);
+	if (EXPECTED(span != 0)) {
+		span->offset = (uint32_t)offset;
+		span->mapped_size = mapped_size;
+		span->is_zero = 1;
+		span->numa_node = heap->numa_node;
+		span->thp_policy = RPMALLOC_THP_DEFAULT;
+	}
+	*from_cache = 0;
+	return span;
 }
 
 //! Find or allocate a span for the given page type with the given size class
@@ -1466,39 +3904,54 @@ heap_get_span(heap_t* heap, page_type_t page_type) {
 	if (EXPECTED(heap->span_partial[page_type] != 0))
 		return heap->span_partial[page_type];
 
-	// Fallback path, map more memory
-	size_t offset = 0;
-	size_t mapped_size = 0;
-	span_t* span = global_memory_interface->memory_map(SPAN_SIZE, SPAN_SIZE, &offset, &mapped_size);
+	uint32_t page_count = 0;
+	uint32_t page_size = 0;
+	uintptr_t page_address_mask = 0;
+	if (page_type == PAGE_SMALL) {
+		page_count = SPAN_SIZE / SMALL_PAGE_SIZE;
+		page_size = SMALL_PAGE_SIZE;
+		page_address_mask = SMALL_PAGE_MASK;
+	} else if (page_type == PAGE_MEDIUM) {
+		page_count = SPAN_SIZE / MEDIUM_PAGE_SIZE;
+		page_size = MEDIUM_PAGE_SIZE;
+		page_address_mask = MEDIUM_PAGE_MASK;
+	} else {
+		page_count = SPAN_SIZE / LARGE_PAGE_SIZE;
+		page_size = LARGE_PAGE_SIZE;
+		page_address_mask = LARGE_PAGE_MASK;
+	}
+
+	int span_from_cache = 0;
+	span_t* span = heap_map_span(heap, page_size, &span_from_cache);
 	if (EXPECTED(span != 0)) {
-		uint32_t page_count = 0;
-		uint32_t page_size = 0;
-		uintptr_t page_address_mask = 0;
-		if (page_type == PAGE_SMALL) {
-			page_count = SPAN_SIZE / SMALL_PAGE_SIZE;
-			page_size = SMALL_PAGE_SIZE;
-			page_address_mask = SMALL_PAGE_MASK;
-		} else if (page_type == PAGE_MEDIUM) {
-			page_count = SPAN_SIZE / MEDIUM_PAGE_SIZE;
-			page_size = MEDIUM_PAGE_SIZE;
-			page_address_mask = MEDIUM_PAGE_MASK;
-		} else {
-			page_count = SPAN_SIZE / LARGE_PAGE_SIZE;
-			page_size = LARGE_PAGE_SIZE;
-			page_address_mask = LARGE_PAGE_MASK;
+		if (span_from_cache)
+			heap_stat_inc(heap, page_use[page_type].spans_from_global);
+		else
+			heap_stat_inc(heap, page_use[page_type].map_calls);
+		// Advise the span with the page type huge page policy, a span reused from the global cache keeps the advice
+		// of the previous page type if the policy is to use the system default
+		uint32_t thp_policy = (uint32_t)global_config.page_thp_policy[page_type];
+		if (thp_policy && (thp_policy != span->thp_policy)) {
+			os_thp_advise(span, span_reserved_size(span), thp_policy);
+			span->thp_policy = thp_policy;
 		}
 #if ENABLE_DECOMMIT
-		global_memory_interface->memory_commit(span, page_size);
+		// The span header of a span from the global cache is still committed
+		size_t commit_offset = span_from_cache ? global_config.page_size : 0;
+		if (page_size > commit_offset)
+			global_memory_interface->memory_commit(pointer_offset(span, commit_offset), page_size - commit_offset);
 #endif
+		heap_commit_add(heap, page_size);
 		span->heap = heap;
 		span->page_type = page_type;
 		span->page_count = page_count;
 		span->page_size = page_size;
 		span->page_address_mask = page_address_mask;
-		span->offset = (uint32_t)offset;
-		span->mapped_size = mapped_size;
+		span->page_initialized = 0;
+		span->next = 0;
 
 		heap->span_partial[page_type] = span;
+		heap_trace(heap, span_map, RPMALLOC_EVENT_SPAN_MAP, 0, page_type, page_size);
 	}
 
 	return span;
@@ -1510,9 +3963,137 @@ heap_get_page(heap_t* heap, uint32_t size_class);
 static void
 block_deallocate(block_t* block);
 
+//! Deallocate a list of blocks in full pages that were deferred by other threads to the heap
+static void
+heap_deallocate_thread_free_list(block_t* block) {
+	while (block) {
+		block_t* next_block = block->next;
+#if ENABLE_STATISTICS
+		page_t* page = span_get_page_from_block(block_get_span(block), block);
+		if (page->page_type != PAGE_HUGE)
+			heap_stat_inc(page->heap, size_use[page->size_class].free_thread_total);
+#endif
+		block_deallocate(block);
+		block = next_block;
+	}
+}
+
+//! Move the pages of a page list to the front of a page list of the given heap, returns the number of pages moved
+static uint32_t
+heap_adopt_page_list(heap_t* heap, page_t* page, page_t** list) {
+	if (!page)
+		return 0;
+	uint32_t page_count = 1;
+	page_t* last_page = page;
+	last_page->heap = heap;
+	while (last_page->next) {
+		last_page = last_page->next;
+		last_page->heap = heap;
+		++page_count;
+	}
+	last_page->next = *list;
+	if (last_page->next)
+		last_page->next->prev = last_page;
+	*list = page;
+	return page_count;
+}
+
+//! Move the free pages of the given type of a released heap to the free list of the given heap. Committed pages are
+//! kept first in the free list, so the committed pages are added before and the decommitted pages after the pages of
+//! the heap
+static void
+heap_adopt_page_free_list(heap_t* heap, page_t* page, uint32_t page_type) {
+	page_t** page_link = &page;
+	while (*page_link && !(*page_link)->is_decommitted) {
+		(*page_link)->heap = heap;
+		page_link = &(*page_link)->next;
+	}
+	page_t* decommit_page = *page_link;
+	*page_link = heap->page_free[page_type];
+	heap->page_free[page_type] = page;
+	while (*page_link)
+		page_link = &(*page_link)->next;
+	*page_link = decommit_page;
+	for (; decommit_page; decommit_page = decommit_page->next)
+		decommit_page->heap = heap;
+}
+
+//! Adopt the pages and spans of a heap released by a thread, so that memory holding blocks still in use is recycled by
+//! a live heap rather than stranded until a new thread reuses the released heap. Popping the released heap from the
+//! queue gives exclusive access to it. Threads freeing a block to a full page while it is adopted might still defer
+//! the block to the released heap, where it is processed once the drained heap is reused. A partial span is only
+//! adopted if the heap has no partial span of the same page type. Returns zero if no released heap was available
+static NOINLINE int
+heap_reclaim_orphan(heap_t* heap) {
+	heap_t* orphan = heap_queue_pop(&global_heap_orphan_queue[heap->numa_node]);
+	if (!orphan)
+		return 0;
+
+	// Own the released heap while returning its heap local free blocks and deferred frees to the pages
+	orphan->owner_thread = get_thread_id();
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		block_t* block = orphan->local_free[iclass];
+		orphan->local_free[iclass] = 0;
+		while (block) {
+			block_t* next_block = block->next;
+			page_put_local_free_block(span_get_page_from_block(block_get_span(block), block), block);
+			block = next_block;
+		}
+	}
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		block_t* block = (void*)atomic_exchange_explicit(&orphan->thread_free[itype], 0, memory_order_acquire);
+		heap_deallocate_thread_free_list(block);
+	}
+
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		heap_adopt_page_list(heap, orphan->page_available[iclass], heap->page_available + iclass);
+		orphan->page_available[iclass] = 0;
+	}
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		heap_adopt_page_list(heap, orphan->page_full[itype], heap->page_full + itype);
+		orphan->page_full[itype] = 0;
+		heap_adopt_page_free_list(heap, orphan->page_free[itype], itype);
+		orphan->page_free[itype] = 0;
+		heap->page_free_commit_count[itype] += orphan->page_free_commit_count[itype];
+		orphan->page_free_commit_count[itype] = 0;
+		if (heap->page_free_commit_count[itype] >= global_page_free_overflow[itype])
+			heap_page_free_decommit(heap, itype, global_page_free_retain[itype]);
+
+		span_t* span = orphan->span_used[itype];
+		while (span) {
+			span_t* next_span = span->next;
+			span->heap = heap;
+			span->next = heap->span_used[itype];
+			heap->span_used[itype] = span;
+			span = next_span;
+		}
+		orphan->span_used[itype] = 0;
+		if (orphan->span_partial[itype] && !heap->span_partial[itype]) {
+			heap->span_partial[itype] = orphan->span_partial[itype];
+			heap->span_partial[itype]->heap = heap;
+			orphan->span_partial[itype] = 0;
+		}
+	}
+#if ENABLE_STATISTICS
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		heap->stats.page_use[itype].current += orphan->stats.page_use[itype].current;
+		orphan->stats.page_use[itype].current = 0;
+	}
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		heap->stats.size_use[iclass].alloc_current += orphan->stats.size_use[iclass].alloc_current;
+		orphan->stats.size_use[iclass].alloc_current = 0;
+	}
+#endif
+
+	orphan->owner_thread = CPU_HEAP_UNOWNED;
+	heap_queue_push(&global_heap_queue[orphan->numa_node], orphan);
+	return 1;
+}
+
 static page_t*
 heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 	page_type_t page_type = get_page_type(size_class);
+	heap_trace(heap, page_get, RPMALLOC_EVENT_PAGE_GET, size_class, page_type, global_page_type_size[page_type]);
 
 	// Check if there is a free page from multithreaded deallocations
 	uintptr_t block_mt = atomic_load_explicit(&heap->thread_free[page_type], memory_order_relaxed);
@@ -1521,18 +4102,17 @@ heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 		                                              memory_order_relaxed)) {
 			wait_spin();
 		}
-		block_t* block = (void*)block_mt;
-		while (block) {
-			block_t* next_block = block->next;
-			block_deallocate(block);
-			block = next_block;
-		}
+		heap_deallocate_thread_free_list((void*)block_mt);
 		// Retry after processing deferred thread frees
 		return heap_get_page(heap, size_class);
 	}
 
-	// Check if there is a free page
+	// Check if there is a free page, recommitting a decommitted page must stay within the memory limits. Checking
+	// the limits might decommit the free pages of the heap and move them to the global cache
 	page_t* page = heap->page_free[page_type];
+	if (UNEXPECTED(page && page->is_decommitted) && !heap_memory_limit_check(heap, global_page_type_size[page_type]))
+		return 0;
+	page = heap->page_free[page_type];
 	if (EXPECTED(page != 0)) {
 		heap->page_free[page_type] = page->next;
 		if (page->is_decommitted == 0) {
@@ -1540,6 +4120,7 @@ heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 			--heap->page_free_commit_count[page_type];
 		}
 		heap_make_free_page_available(heap, size_class, page);
+		heap_stat_inc(heap, page_use[page_type].from_free);
 		return page;
 	}
 	rpmalloc_assert(heap->page_free_commit_count[page_type] == 0, "Free committed page count out of sync");
@@ -1547,7 +4128,32 @@ heap_get_page_generic(heap_t* heap, uint32_t size_class) {
 	if (heap->id == 0) {
 		// Thread has not yet initialized, assign heap and try again
 		rpmalloc_initialize(0);
-		return heap_get_page(get_thread_heap(), size_class);
+		heap = get_thread_heap();
+		// Lazy initialization in per processor heap mode does not assign a thread heap
+		if (heap->id == 0)
+			heap = get_thread_heap_allocate();
+		return heap_get_page(heap, size_class);
+	}
+
+	// Adopt the pages of a heap released by a thread before committing more memory
+	if (!heap->first_class &&
+	    heap_queue_head(atomic_load_explicit(&global_heap_orphan_queue[heap->numa_node], memory_order_relaxed)) &&
+	    heap_reclaim_orphan(heap))
+		return heap_get_page(heap, size_class);
+
+	if (!heap_memory_limit_check(heap, global_page_type_size[page_type]))
+		return 0;
+
+	// Check if there is a free page released by another heap
+	if (!heap->first_class) {
+		page = global_cache_pop_page(heap, page_type);
+		if (page != 0) {
+			heap_numa_rebind(heap, page_get_span(page), page, global_page_type_size[page_type]);
+			heap_make_free_page_available(heap, size_class, page);
+			heap_stat_inc(heap, page_use[page_type].from_global);
+			heap_stat_add(heap, global_to_thread, global_page_type_size[page_type]);
+			return page;
+		}
 	}
 
 	// Fallback path, find or allocate span for given size class
@@ -1583,65 +4189,146 @@ heap_pop_local_free(heap_t* heap, uint32_t size_class) {
 	return block;
 }
 
+//! Prepare available pages with at least the given number of free blocks of the size class of the given size. The
+//! blocks not yet initialized are linked in the page free lists, and the memory pages holding them are faulted in if
+//! requested. Returns the number of free blocks available, which is zero for huge block sizes
+static size_t
+heap_prepare(heap_t* heap, size_t size, size_t count, unsigned int flags) {
+	uint32_t size_class = get_size_class(size);
+	if (size_class >= SIZE_CLASS_COUNT)
+		return 0;
+	// Take free pages or new pages until enough blocks are available. Processing blocks deferred by other threads
+	// might return a page already available, so count the available blocks again for each page
+	size_t available = 0;
+	while (1) {
+		available = 0;
+		for (page_t* page = heap->page_available[size_class]; page; page = page->next)
+			available += page->block_count - page->block_used;
+		if ((available >= count) || !heap_get_page_generic(heap, size_class))
+			break;
+	}
+
+	size_t remain = count;
+	for (page_t* page = heap->page_available[size_class]; page && remain; page = page->next) {
+		uint32_t page_free = page->block_count - page->block_used;
+		uint32_t page_prepare = (remain < page_free) ? (uint32_t)remain : page_free;
+		remain -= page_prepare;
+		if (page_prepare <= page->local_free_count)
+			continue;
+		uint32_t link_count = page_prepare - page->local_free_count;
+		if (link_count > (page->block_count - page->block_initialized))
+			link_count = page->block_count - page->block_initialized;
+		if (!link_count)
+			continue;
+		block_t* first_block = page_block(page, page->block_initialized);
+		block_t* last_block = page_block(page, page->block_initialized + link_count - 1);
+		void* link_end = pointer_offset(last_block, page->block_size);
+		if (flags & RPMALLOC_PREPARE_PREFAULT) {
+			uintptr_t fault_start = (uintptr_t)first_block & ~(uintptr_t)(global_config.page_size - 1);
+			uintptr_t fault_end = ((uintptr_t)link_end + global_config.page_size - 1) &
+			                      ~(uintptr_t)(global_config.page_size - 1);
+			os_prefault((void*)fault_start, (size_t)(fault_end - fault_start));
+		}
+		for (block_t* block = first_block; block != last_block; block = block->next)
+			block->next = pointer_offset(block, page->block_size);
+		last_block->next = page->local_free;
+		page->local_free = first_block;
+		page->local_free_count += link_count;
+		page->block_initialized += link_count;
+	}
+
+	// Hand the free list of the first page to the heap so the first allocation takes the fast path
+	page_t* page = heap->page_available[size_class];
+	if (page && page->local_free && !heap->local_free[size_class]) {
+		page_push_local_free_to_heap(page);
+		if (page->block_used == page->block_count)
+			page_adopt_thread_free_block_list(page);
+		if (page->block_used == page->block_count)
+			page_available_to_full(page);
+	}
+	return available;
+}
+
 //! Generic allocation path from heap pages, spans or new mapping
 static NOINLINE RPMALLOC_ALLOCATOR void*
-heap_allocate_block_small_to_large(heap_t* heap, uint32_t size_class, unsigned int zero) {
+heap_allocate_block_small_to_large(heap_t* heap, uint32_t size_class, size_t size, unsigned int zero) {
 	page_t* page = heap_get_page(heap, size_class);
-	if (EXPECTED(page != 0))
-		return page_allocate_block(page, zero);
+	if (EXPECTED(page != 0)) {
+		heap_stat_alloc(page->heap, size_class);
+		return page_allocate_block(page, size, zero);
+	}
 	return 0;
 }
 
 //! Generic allocation path from heap pages, spans or new mapping
 static NOINLINE RPMALLOC_ALLOCATOR void*
 heap_allocate_block_huge(heap_t* heap, size_t size, unsigned int zero) {
-	(void)sizeof(heap);
 	size_t alloc_size = get_page_aligned_size(size + SPAN_HEADER_SIZE);
-	size_t offset = 0;
-	size_t mapped_size = 0;
-	void* block = global_memory_interface->memory_map(alloc_size, SPAN_SIZE, &offset, &mapped_size);
-	if (block) {
-		span_t* span = block;
+	if (!heap_memory_limit_check(heap, alloc_size))
+		return 0;
+	// Reuse a recently freed huge span if possible, keeping the capacity of the cached span
+	span_t* span = global_huge_cache_pop(alloc_size);
+	if (span) {
+		memset(&span->page, 0, sizeof(page_t));
+	} else {
+		// Freshly mapped memory is zero initialized by the OS
+		zero = 0;
+		size_t offset = 0;
+		size_t mapped_size = 0;
+		span = heap_memory_map(heap->numa_node, alloc_size, SPAN_SIZE, &offset, &mapped_size);
+		if (!span)
+			return 0;
 #if ENABLE_DECOMMIT
 		global_memory_interface->memory_commit(span, alloc_size);
 #endif
-		span->heap = heap;
 		span->page_type = PAGE_HUGE;
 		span->page_size = (uint32_t)global_config.page_size;
 		span->page_count = (uint32_t)(alloc_size / global_config.page_size);
 		span->page_address_mask = LARGE_PAGE_MASK;
 		span->offset = (uint32_t)offset;
 		span->mapped_size = mapped_size;
-		span->page.heap = heap;
-		span->page.is_full = 1;
-		span->page.generic_free = 1;
-		span->page.page_type = PAGE_HUGE;
-		// Keep track of span if first class heap
-		if (!heap->owner_thread) {
-			span->next = heap->span_used[PAGE_HUGE];
-			heap->span_used[PAGE_HUGE] = span;
-		}
-		void* ptr = pointer_offset(block, SPAN_HEADER_SIZE);
-		if (zero)
-			memset(ptr, 0, size);
-		return ptr;
+		span->numa_node = heap->numa_node;
 	}
-	return 0;
+	span->heap = heap;
+	span->page.heap = heap;
+	span->page.is_full = 1;
+	span->page.generic_free = 1;
+	span->page.page_type = PAGE_HUGE;
+	heap_commit_add(heap, (size_t)span->page_size * (size_t)span->page_count);
+	heap_trace(heap, huge_alloc, RPMALLOC_EVENT_HUGE_ALLOC, 0, PAGE_HUGE,
+	           (size_t)span->page_size * (size_t)span->page_count);
+#if ENABLE_STATISTICS
+	global_statistics_add_peak(&global_statistics.huge_alloc, &global_statistics.huge_alloc_peak,
+	                           (size_t)span->page_size * (size_t)span->page_count);
+#endif
+	// Keep track of span if first class heap
+	if (heap->first_class) {
+		span->next = heap->span_used[PAGE_HUGE];
+		heap->span_used[PAGE_HUGE] = span;
+	}
+	void* ptr = pointer_offset(span, SPAN_HEADER_SIZE);
+	if (zero)
+		memory_zero(ptr, size);
+	return ptr;
 }
 
 static RPMALLOC_ALLOCATOR NOINLINE void*
 heap_allocate_block_generic(heap_t* heap, size_t size, unsigned int zero) {
+	// Size classes are set up during initialization
+	if (UNEXPECTED(!global_rpmalloc_initialized))
+		rpmalloc_initialize(0);
 	uint32_t size_class = get_size_class(size);
 	if (EXPECTED(size_class < SIZE_CLASS_COUNT)) {
 		block_t* block = heap_pop_local_free(heap, size_class);
 		if (EXPECTED(block != 0)) {
 			// Fast track with small block available in heap level local free list
+			heap_stat_alloc(heap, size_class);
 			if (zero)
-				memset(block, 0, global_size_class[size_class].block_size);
+				memory_zero(block, size);
 			return block;
 		}
 
-		return heap_allocate_block_small_to_large(heap, size_class, zero);
+		return heap_allocate_block_small_to_large(heap, size_class, size, zero);
 	}
 
 	return heap_allocate_block_huge(heap, size, zero);
@@ -1650,17 +4337,83 @@ heap_allocate_block_generic(heap_t* heap, size_t size, unsigned int zero) {
 //! Find or allocate a block of the given size
 static inline RPMALLOC_ALLOCATOR void*
 heap_allocate_block(heap_t* heap, size_t size, unsigned int zero) {
+	heap_stat_request(heap, size, 1);
+#if ENABLE_SAMPLING
+	if (UNEXPECTED((heap->sample_countdown -= (int64_t)size) < 0))
+		return heap_allocate_block_sampled(heap, size, 0, zero);
+#endif
 	if (size <= (SMALL_GRANULARITY * 64)) {
 		uint32_t size_class = get_size_class_tiny(size);
 		block_t* block = heap_pop_local_free(heap, size_class);
 		if (EXPECTED(block != 0)) {
 			// Fast track with small block available in heap level local free list
+			heap_stat_alloc(heap, size_class);
 			if (zero)
-				memset(block, 0, global_size_class[size_class].block_size);
+				memset(block, 0, size);
 			return block;
 		}
 	}
-	return heap_allocate_block_generic(heap, size, zero);
+	return heap_allocate_block_generic(heap, size, zero);
+}
+
+//! Allocate a batch of blocks of the given size, returns the number of blocks allocated
+static size_t
+heap_allocate_block_batch(heap_t* heap, size_t size, size_t count, void** blocks) {
+	if (UNEXPECTED(!global_rpmalloc_initialized))
+		rpmalloc_initialize(0);
+	heap_stat_request(heap, size, count);
+	uint32_t size_class = get_size_class(size);
+	size_t allocated = 0;
+	if (UNEXPECTED(size_class >= SIZE_CLASS_COUNT)) {
+		// Huge blocks are mapped individually
+		while (allocated < count) {
+			blocks[allocated] = heap_allocate_block_huge(heap, size, 0);
+			if (!blocks[allocated])
+				break;
+			++allocated;
+		}
+		return allocated;
+	}
+
+	// Unlink a chain of blocks from the heap local free list
+	block_t* block = heap->local_free[size_class];
+	while (block && (allocated < count)) {
+		blocks[allocated++] = block;
+		block = block->next;
+	}
+	heap->local_free[size_class] = block;
+	heap_stat_alloc_count(heap, size_class, allocated);
+
+	while (allocated < count) {
+		page_t* page = heap_get_page(heap, size_class);
+		if (UNEXPECTED(page == 0))
+			break;
+		// Heap might have been assigned if the thread was not initialized
+		heap = page->heap;
+		size_t remain = count - allocated;
+		uint32_t page_allocated =
+		    page_allocate_block_batch(page, (remain > UINT32_MAX) ? UINT32_MAX : (uint32_t)remain, blocks + allocated);
+		rpmalloc_assert(page_allocated != 0, "Available page has no free blocks");
+		heap_stat_alloc_count(heap, size_class, page_allocated);
+		allocated += page_allocated;
+	}
+	return allocated;
+}
+
+//! Align a block allocated with the alignment added to the requested size, marking the page as having aligned blocks
+//! if the block was moved
+static inline void*
+block_align(block_t* block, size_t alignment) {
+	size_t align_mask = alignment ? (alignment - 1) : 0;
+	if ((uintptr_t)block & align_mask) {
+		block = (void*)(((uintptr_t)block & ~(uintptr_t)align_mask) + alignment);
+		// Mark as having aligned blocks
+		span_t* span = block_get_span(block);
+		page_t* page = span_get_page_from_block(span, block);
+		page->has_aligned_block = 1;
+		page->generic_free = 1;
+	}
+	return block;
 }
 
 static RPMALLOC_ALLOCATOR void*
@@ -1682,18 +4435,270 @@ heap_allocate_block_aligned(heap_t* heap, size_t alignment, size_t size, unsigne
 		errno = EINVAL;
 		return 0;
 	}
+	// Size classes are set up during initialization
+	if (UNEXPECTED(!global_rpmalloc_initialized))
+		rpmalloc_initialize(0);
 
-	size_t align_mask = alignment - 1;
-	block_t* block = heap_allocate_block(heap, size + alignment, zero);
-	if ((uintptr_t)block & align_mask) {
-		block = (void*)(((uintptr_t)block & ~(uintptr_t)align_mask) + alignment);
-		// Mark as having aligned blocks
-		span_t* span = block_get_span(block);
-		page_t* page = span_get_page_from_block(span, block);
-		page->has_aligned_block = 1;
-		page->generic_free = 1;
+#if ENABLE_SAMPLING
+	if (UNEXPECTED((heap->sample_countdown -= (int64_t)size) < 0))
+		return heap_allocate_block_sampled(heap, size, alignment, zero);
+#endif
+	size_t aligned_size = get_size_aligned(size, alignment);
+#if ENABLE_SAMPLING
+	// Only the requested size counts towards the next sample, not the alignment padding
+	heap->sample_countdown += (int64_t)aligned_size;
+#endif
+	return block_align(heap_allocate_block(heap, aligned_size, zero), alignment);
+}
+
+#if ENABLE_SAMPLING
+
+//! Capture the return addresses of the calling stack frames, returns the number of frames captured
+static size_t
+os_stack_trace(void** frame, size_t capacity) {
+#if PLATFORM_WINDOWS
+	return (size_t)RtlCaptureStackBackTrace(1, (DWORD)capacity, frame, 0);
+#elif OS_HAS_BACKTRACE
+	int count = backtrace(frame, (int)capacity);
+	return (count > 0) ? (size_t)count : 0;
+#else
+	(void)sizeof(frame);
+	(void)sizeof(capacity);
+	return 0;
+#endif
+}
+
+//! Draw the number of bytes to allocate until the next sample. Intervals are exponentially distributed around the
+//! configured mean, making sampling a Poisson process which pprof assumes when scaling samples to estimated totals
+static int64_t
+heap_sample_interval(heap_t* heap) {
+	uint64_t x = heap->sample_random;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	heap->sample_random = x;
+	// -ln(u) for uniform u in (0, 1) from the log2 of a random 32 bit integer, with a linear approximation of the
+	// mantissa log2 which is accurate enough for sampling
+	uint32_t value = (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32) | 1;
+	uint32_t most_significant_bit = (uint32_t)((sizeof(uintptr_t) * 8 - 1) - rpmalloc_clz(value));
+	double value_log2 = (double)most_significant_bit + ((double)value / (double)(1ULL << most_significant_bit)) - 1.0;
+	double interval = (32.0 - value_log2) * 0.6931471805599453 * (double)global_config.sample_interval;
+	return (int64_t)interval + 1;
+}
+
+//! Get the heap holding sampled blocks, allocating it on first use
+static heap_t*
+heap_sample_heap(void) {
+	heap_t* heap = (heap_t*)atomic_load_explicit(&global_sample_heap, memory_order_acquire);
+	if (EXPECTED(heap != 0))
+		return heap;
+	heap = heap_allocate_new(0);
+	if (!heap)
+		return 0;
+	heap->owner_thread = CPU_HEAP_UNOWNED;
+	uintptr_t expected = 0;
+	if (!atomic_compare_exchange_strong_explicit(&global_sample_heap, &expected, (uintptr_t)heap, memory_order_release,
+	                                             memory_order_acquire)) {
+		// Another thread installed the sample heap first
+		heap_release(heap);
+		heap = (heap_t*)expected;
 	}
-	return block;
+	return heap;
+}
+
+//! Lock the sample heap, owning it while locked so blocks are allocated and freed through the local paths
+static void
+heap_sample_lock(heap_t* heap) {
+	unsigned int lock = 0;
+	while (!atomic_compare_exchange_weak_explicit(&heap->lock, &lock, 1, memory_order_acquire, memory_order_relaxed)) {
+		lock = 0;
+		wait_spin();
+	}
+	heap->owner_thread = get_thread_id();
+}
+
+static void
+heap_sample_unlock(heap_t* heap) {
+	heap->owner_thread = CPU_HEAP_UNOWNED;
+	atomic_store_explicit(&heap->lock, 0, memory_order_release);
+}
+
+static inline size_t
+heap_sample_slot(void* block) {
+	return (size_t)(((uint64_t)(uintptr_t)block * 0x9E3779B97F4A7C15ULL) >> 32) & (SAMPLE_TABLE_SIZE - 1);
+}
+
+//! Find the table slot of a sampled block, must be called with the sample heap locked. Returns the table size if
+//! the block is not in the table
+static size_t
+heap_sample_find(void* block) {
+	if (!global_sample_table)
+		return SAMPLE_TABLE_SIZE;
+	size_t slot = heap_sample_slot(block);
+	while (global_sample_table[slot].block) {
+		if (global_sample_table[slot].block == block)
+			return slot;
+		slot = (slot + 1) & (SAMPLE_TABLE_SIZE - 1);
+	}
+	return SAMPLE_TABLE_SIZE;
+}
+
+//! Insert a sample in the table, must be called with the sample heap locked and the table not full
+static void
+heap_sample_insert(const heap_sample_t* sample) {
+	size_t slot = heap_sample_slot(sample->block);
+	while (global_sample_table[slot].block)
+		slot = (slot + 1) & (SAMPLE_TABLE_SIZE - 1);
+	memcpy(global_sample_table + slot, sample, sizeof(heap_sample_t));
+	++global_sample_count;
+}
+
+//! Remove the sample in the given table slot, must be called with the sample heap locked. Following samples are
+//! shifted back to keep the probe sequences unbroken
+static void
+heap_sample_remove(size_t slot) {
+	global_sample_table[slot].block = 0;
+	--global_sample_count;
+	size_t next = (slot + 1) & (SAMPLE_TABLE_SIZE - 1);
+	while (global_sample_table[next].block) {
+		size_t home = heap_sample_slot(global_sample_table[next].block);
+		// Move the sample to the empty slot unless its home slot lies cyclically between the empty slot and itself
+		if (((next - home) & (SAMPLE_TABLE_SIZE - 1)) >= ((next - slot) & (SAMPLE_TABLE_SIZE - 1))) {
+			memcpy(global_sample_table + slot, global_sample_table + next, sizeof(heap_sample_t));
+			global_sample_table[next].block = 0;
+			slot = next;
+		}
+		next = (next + 1) & (SAMPLE_TABLE_SIZE - 1);
+	}
+}
+
+//! Allocate a block selected by the sample countdown of the heap, recording the block and the calling stack in the
+//! sample table. Allocations from the fallback heap and from first class heaps are not sampled, since first class
+//! heaps release their blocks without freeing them individually. If sampling is disabled the countdown is parked out
+//! of reach, and if the sample table is full the block is allocated from the given heap without being sampled
+static NOINLINE RPMALLOC_ALLOCATOR void*
+heap_allocate_block_sampled(heap_t* heap, size_t size, size_t alignment, unsigned int zero) {
+	heap_t* sample_heap = 0;
+	heap_sample_t sample;
+	if (UNEXPECTED(!heap->id || heap->first_class || !global_config.sample_interval)) {
+		heap->sample_countdown = INT64_MAX / 2;
+	} else if (UNEXPECTED(!heap->sample_random)) {
+		// Start the sampling sequence of the heap without sampling the first block
+		heap->sample_random = 0x9E3779B97F4A7C15ULL * heap->id;
+		heap->sample_countdown = heap_sample_interval(heap);
+	} else {
+		// Reset the countdown before capturing the stack, which might allocate memory
+		heap->sample_countdown = heap_sample_interval(heap);
+		sample.block = 0;
+		sample.size = size;
+		sample.frame_count = os_stack_trace(sample.frame, SAMPLE_FRAME_LIMIT);
+		sample_heap = heap_sample_heap();
+	}
+
+	if (sample_heap) {
+		heap_sample_lock(sample_heap);
+		if (!global_sample_table) {
+			size_t table_size = sizeof(heap_sample_t) * SAMPLE_TABLE_SIZE;
+			global_sample_table = global_memory_interface->memory_map(
+			    table_size, 0, &global_sample_table_offset, &global_sample_table_mapped_size);
+			if (global_sample_table) {
+#if ENABLE_DECOMMIT
+				global_memory_interface->memory_commit(global_sample_table, table_size);
+#endif
+				memset(global_sample_table, 0, table_size);
+			}
+		}
+		if (global_sample_table && (global_sample_count < ((SAMPLE_TABLE_SIZE / 4) * 3))) {
+			sample.block = block_align(
+			    heap_allocate_block_generic(sample_heap, get_size_aligned(size, alignment), zero), alignment);
+			if (sample.block)
+				heap_sample_insert(&sample);
+		}
+		heap_sample_unlock(sample_heap);
+		if (sample.block)
+			return sample.block;
+	}
+
+	return block_align(heap_allocate_block_generic(heap, get_size_aligned(size, alignment), zero), alignment);
+}
+
+//! Free a sampled block and remove it from the sample table
+static NOINLINE void
+heap_sample_deallocate_block(heap_t* sample_heap, void* block) {
+	heap_sample_lock(sample_heap);
+	size_t slot = heap_sample_find(block);
+	if (slot < SAMPLE_TABLE_SIZE)
+		heap_sample_remove(slot);
+	// Owning the locked heap makes the block thread local
+	block_deallocate(block);
+	heap_sample_unlock(sample_heap);
+}
+
+//! Update the sample table after a block was moved in place by a reallocation, if the block is sampled
+static NOINLINE void
+heap_sample_move(heap_t* sample_heap, void* block, void* new_block) {
+	if (sample_heap != (heap_t*)atomic_load_explicit(&global_sample_heap, memory_order_relaxed))
+		return;
+	heap_sample_lock(sample_heap);
+	size_t slot = heap_sample_find(block);
+	if (slot < SAMPLE_TABLE_SIZE) {
+		heap_sample_t sample;
+		memcpy(&sample, global_sample_table + slot, sizeof(heap_sample_t));
+		heap_sample_remove(slot);
+		sample.block = new_block;
+		heap_sample_insert(&sample);
+	}
+	heap_sample_unlock(sample_heap);
+}
+
+#endif
+
+//! Try to grow a huge block without copying, either by committing memory in the reserved alignment slack or by
+//! remapping the memory pages. Unless RPMALLOC_GROW_OR_FAIL is given the block might move. Returns the grown block,
+//! or null if the block could not be grown.
+static void*
+heap_reallocate_block_huge(span_t* span, void* block, size_t size, unsigned int flags) {
+	const size_t block_offset = (size_t)pointer_diff(block, span);
+	const size_t capacity = (size_t)span->page_size * (size_t)span->page_count;
+	const size_t alloc_size = get_page_aligned_size(size + block_offset);
+	if (alloc_size <= capacity)
+		return block;
+	heap_t* heap = span->heap;
+	if (!heap_memory_limit_check(page_is_thread_heap(&span->page) ? heap : 0, alloc_size - capacity))
+		return 0;
+	span_t* new_span = 0;
+	if ((span->mapped_size - span->offset) >= alloc_size) {
+		// Region reserved when mapped has room, commit the additional memory pages
+#if ENABLE_DECOMMIT
+		global_memory_interface->memory_commit(pointer_offset(span, capacity), alloc_size - capacity);
+#endif
+		new_span = span;
+	}
+#if OS_HAS_MREMAP
+	else if ((global_memory_interface->memory_map == os_mmap) && !span->offset) {
+		new_span = os_mremap(span, span->mapped_size, alloc_size, SPAN_SIZE, !(flags & RPMALLOC_GROW_OR_FAIL));
+		if (new_span)
+			new_span->mapped_size = alloc_size;
+	}
+#endif
+	if (!new_span)
+		return 0;
+	new_span->page_count = (uint32_t)(alloc_size / new_span->page_size);
+	heap_commit_add(heap, alloc_size - capacity);
+#if ENABLE_STATISTICS
+	global_statistics_add_peak(&global_statistics.huge_alloc, &global_statistics.huge_alloc_peak,
+	                           alloc_size - capacity);
+#endif
+	if ((new_span != span) && heap->first_class) {
+		// Replace the link to the moved span in the first class heap huge span list
+		span_t** span_link = &heap->span_used[PAGE_HUGE];
+		while (*span_link && (*span_link != span))
+			span_link = &(*span_link)->next;
+		if (*span_link)
+			*span_link = new_span;
+	}
+	(void)sizeof(flags);
+	return pointer_offset(new_span, block_offset);
 }
 
 static void*
@@ -1704,7 +4709,7 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 		if (EXPECTED(span->page_type <= PAGE_LARGE)) {
 			// Normal sized block
 			page_t* page = span_get_page_from_block(span, block);
-			void* blocks_start = pointer_offset(page, PAGE_HEADER_SIZE);
+			void* blocks_start = page_block_start(page);
 			uint32_t block_offset = (uint32_t)pointer_diff(block, blocks_start);
 			uint32_t block_idx = block_offset / page->block_size;
 			void* block_origin = pointer_offset(blocks_start, (size_t)block_idx * page->block_size);
@@ -1714,6 +4719,10 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 				// Still fits in block, never mind trying to save memory, but preserve data if alignment changed
 				if ((block != block_origin) && !(flags & RPMALLOC_NO_PRESERVE))
 					memmove(block_origin, block, old_size);
+#if ENABLE_SAMPLING
+				if (UNEXPECTED(block != block_origin))
+					heap_sample_move(page->heap, block, block_origin);
+#endif
 				return block_origin;
 			}
 		} else {
@@ -1726,8 +4735,24 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 				// but preserve data if alignment changed
 				if ((block_start != block) && !(flags & RPMALLOC_NO_PRESERVE))
 					memmove(block_start, block, old_size);
+#if ENABLE_SAMPLING
+				if (UNEXPECTED(block_start != block))
+					heap_sample_move(span->heap, block, block_start);
+#endif
 				return block_start;
 			}
+			if (size > LARGE_BLOCK_SIZE_LIMIT) {
+				// Still huge, try to grow without copying
+				heap_t* span_heap = span->heap;
+				void* grown_block = heap_reallocate_block_huge(span, block, size, flags);
+#if ENABLE_SAMPLING
+				if (grown_block && UNEXPECTED(grown_block != block))
+					heap_sample_move(span_heap, block, grown_block);
+#endif
+				(void)sizeof(span_heap);
+				if (grown_block)
+					return grown_block;
+			}
 		}
 	} else {
 		old_size = 0;
@@ -1778,13 +4803,171 @@ heap_reallocate_block_aligned(heap_t* heap, void* block, size_t alignment, size_
 	return block;
 }
 
+//! Release a span no longer used by the given heap, either to the global or huge cache, or by unmapping it
+static void
+heap_release_span(heap_t* heap, span_t* span, int cache_span) {
+	if (span->page_type == PAGE_HUGE) {
+#if ENABLE_STATISTICS
+		atomic_fetch_sub_explicit(&global_statistics.huge_alloc, (size_t)span->page_size * (size_t)span->page_count,
+		                          memory_order_relaxed);
+#endif
+		if (cache_span && global_huge_cache_push(span))
+			return;
+	} else {
+		heap_stat_inc(heap, page_use[span->page_type].spans_released);
+		if (cache_span) {
+			span_decommit_pages(span);
+			if (global_cache_push_span(heap, span))
+				return;
+			span_unmap(span, global_config.page_size);
+			return;
+		}
+	}
+	span_unmap(span, span_committed_size(span));
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Release an arena span, either to the global cache with only the span header committed or by unmapping it. The
+//! page size of an arena span is the size of the committed memory at the start of the span.
+static void
+heap_arena_release_span(heap_t* heap, span_t* span, int cache_span) {
+	if (cache_span) {
+		if (span->page_size > global_config.page_size) {
+			global_memory_interface->memory_decommit(pointer_offset(span, global_config.page_size),
+			                                         span->page_size - global_config.page_size);
+			span->page_size = (uint32_t)global_config.page_size;
+		}
+		span->is_zero = (uint32_t)os_decommit_zeroes();
+		if (global_cache_push_span(heap, span))
+			return;
+	}
+	span_unmap(span, span->page_size);
+}
+
+//! Release the arena spans of the heap, optionally keeping the current span and its committed memory for reuse
+static void
+heap_arena_reset(heap_t* heap, int retain_span, int cache_spans) {
+	span_t* span = heap->arena_span;
+	if (span && retain_span) {
+		heap->arena_current = (uintptr_t)span + SPAN_HEADER_SIZE;
+		span = span->next;
+		heap->arena_span->next = 0;
+	} else {
+		heap->arena_span = 0;
+		heap->arena_current = 0;
+		heap->arena_commit = 0;
+	}
+	while (span) {
+		span_t* span_next = span->next;
+		heap_arena_release_span(heap, span, cache_spans);
+		span = span_next;
+	}
+}
+
+//! Get a new arena span for the heap with at least the given size available for bump allocation. The span is a
+//! single page of bump allocated memory, memory is committed as the bump pointer advances. Unless the reservation
+//! of the span can be extended the full span must be reserved, otherwise a partially reserved span from the cache
+//! would be abandoned long before it is filled.
+static span_t*
+heap_arena_map_span(heap_t* heap, size_t size) {
+	int span_from_cache = 0;
+	size_t reserve_size = global_config.span_reserve_size ? (SPAN_HEADER_SIZE + size) : SPAN_SIZE;
+	span_t* span = heap_map_span(heap, reserve_size, &span_from_cache);
+	if (EXPECTED(span != 0)) {
+		span->page.heap = heap;
+		span->heap = heap;
+		span->page_type = PAGE_HUGE;
+		span->page_count = 1;
+		// The span header of a span from the global cache is still committed
+		span->page_size = span_from_cache ? (uint32_t)global_config.page_size : 0;
+		span->page_address_mask = SPAN_MASK;
+		span->page_initialized = 1;
+		span->next = heap->arena_span;
+		heap->arena_span = span;
+		heap->arena_current = (uintptr_t)span + SPAN_HEADER_SIZE;
+		heap->arena_commit = (uintptr_t)span + span->page_size;
+		heap_commit_add(heap, span->page_size);
+	}
+	return span;
+}
+
+//! Bump allocate a block which does not fit in the committed memory of the current arena span, committing more
+//! memory or mapping a new arena span. Blocks too large for arena spans are allocated as huge blocks of the heap.
+static NOINLINE void*
+heap_arena_allocate_slow(heap_t* heap, size_t size, size_t alignment) {
+	if (size > LARGE_BLOCK_SIZE_LIMIT)
+		return heap_allocate_block_aligned(heap, alignment, size, 0);
+	const uintptr_t align_mask = (uintptr_t)alignment - 1;
+	span_t* span = heap->arena_span;
+	while (1) {
+		if (span) {
+			uintptr_t block = (heap->arena_current + align_mask) & ~align_mask;
+			size_t block_end = (size_t)(block - (uintptr_t)span) + size;
+			if ((block_end <= SPAN_SIZE) && span_reserve(span, block_end)) {
+				size_t commit_start = (size_t)(heap->arena_commit - (uintptr_t)span);
+				size_t commit_end = (block_end + (ARENA_COMMIT_GRANULARITY - 1)) & ~(size_t)(ARENA_COMMIT_GRANULARITY - 1);
+				size_t reserved_size = span_reserved_size(span);
+				if (commit_end > reserved_size)
+					commit_end = reserved_size;
+				if (commit_end > commit_start) {
+					if (!heap_memory_limit_check(heap, commit_end - commit_start))
+						return 0;
+#if ENABLE_DECOMMIT
+					global_memory_interface->memory_commit(pointer_offset(span, commit_start), commit_end - commit_start);
+#endif
+					heap_commit_add(heap, commit_end - commit_start);
+					heap->arena_commit = (uintptr_t)span + commit_end;
+					span->page_size = (uint32_t)commit_end;
+				}
+				heap->arena_current = block + size;
+				return (void*)block;
+			}
+		}
+		// The remainder of the current span is abandoned until the arena is reset
+		span = heap_arena_map_span(heap, size + alignment);
+		if (UNEXPECTED(span == 0))
+			return 0;
+	}
+}
+
+//! Bump allocate a block from the arena of the heap, the size is rounded to keep the bump pointer aligned to the
+//! default granularity
+static inline void*
+heap_arena_allocate(heap_t* heap, size_t size, size_t alignment) {
+	size = size ? ((size + (SMALL_GRANULARITY - 1)) & ~(size_t)(SMALL_GRANULARITY - 1)) : SMALL_GRANULARITY;
+	uintptr_t block = (heap->arena_current + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	if (EXPECTED((block + size) <= heap->arena_commit)) {
+		heap->arena_current = block + size;
+		return (void*)block;
+	}
+	return heap_arena_allocate_slow(heap, size, alignment);
+}
+
+#endif
+
+//! Account for all blocks of the heap being implicitly freed
+static void
+heap_stat_free_all(heap_t* heap) {
+#if ENABLE_STATISTICS
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		heap->stats.size_use[iclass].free_total += heap->stats.size_use[iclass].alloc_current;
+		heap->stats.size_use[iclass].alloc_current = 0;
+	}
+	for (uint32_t itype = 0; itype < 3; ++itype)
+		heap->stats.page_use[itype].current = 0;
+#else
+	(void)sizeof(heap);
+#endif
+}
+
 static void
-heap_free_all(heap_t* heap) {
+heap_free_all(heap_t* heap, int cache_spans) {
 	for (int itype = 0; itype < 3; ++itype) {
 		span_t* span = heap->span_partial[itype];
 		while (span) {
 			span_t* span_next = span->next;
-			global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
+			heap_release_span(heap, span, cache_spans);
 			span = span_next;
 		}
 		heap->span_partial[itype] = 0;
@@ -1796,17 +4979,377 @@ heap_free_all(heap_t* heap) {
 		span_t* span = heap->span_used[itype];
 		while (span) {
 			span_t* span_next = span->next;
-			global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
+			heap_release_span(heap, span, cache_spans);
 			span = span_next;
 		}
 		heap->span_used[itype] = 0;
 	}
 	memset(heap->local_free, 0, sizeof(heap->local_free));
 	memset(heap->page_available, 0, sizeof(heap->page_available));
+	memset(heap->page_full, 0, sizeof(heap->page_full));
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	heap_arena_reset(heap, cache_spans, cache_spans);
+	// Only the committed memory of a retained arena span is left
+	heap->memory_committed = heap->arena_span ? heap->arena_span->page_size : 0;
+	heap->memory_pressure = 0;
+#endif
+	heap_stat_free_all(heap);
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Return all pages of a span to the heap free list, keeping pages committed while the given number of bytes to
+//! retain allows and decommitting the rest. Decommitted pages are added to the given list of decommitted pages, to
+//! be appended after the committed pages in the free list. Returns the number of bytes kept committed.
+static size_t
+heap_reset_span(heap_t* heap, span_t* span, size_t retain_size, page_t** decommit_list) {
+	const uint32_t page_type = span->page_type;
+	const uint32_t current_time = global_config.page_decay_time[page_type] ? os_time_ms() : 0;
+	page_t* decommit_batch[PAGE_DECOMMIT_BATCH_LIMIT];
+	uint32_t decommit_count = 0;
+	size_t decommit_size = 0;
+	size_t committed_size = 0;
+	for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+		page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+		page->block_used = 0;
+		page->block_initialized = 0;
+		page->local_free = 0;
+		page->local_free_count = 0;
+		page->is_full = 0;
+		page->is_free = 1;
+		page->is_zero = 0;
+		page->has_aligned_block = 0;
+		page->generic_free = 0;
+		page->heap = heap;
+		atomic_store_explicit(&page->thread_free, 0, memory_order_relaxed);
+		if (page->is_decommitted) {
+			page->next = *decommit_list;
+			*decommit_list = page;
+		} else if ((committed_size + span->page_size) > retain_size) {
+			// Pages of a span are in address order, so the pages to decommit are already sorted
+			size_t start, end;
+			page_decommit_range(page, &start, &end);
+			if (end > start)
+				decommit_size += end - start;
+			decommit_batch[decommit_count++] = page;
+			if (decommit_count == PAGE_DECOMMIT_BATCH_LIMIT) {
+				page_decommit_memory_pages_batch(decommit_batch, decommit_count);
+				decommit_count = 0;
+			}
+			page->next = *decommit_list;
+			*decommit_list = page;
+		} else {
+			committed_size += span->page_size;
+			page->free_time = current_time;
+			page->next = heap->page_free[page_type];
+			heap->page_free[page_type] = page;
+			++heap->page_free_commit_count[page_type];
+		}
+	}
+	if (decommit_count)
+		page_decommit_memory_pages_batch(decommit_batch, decommit_count);
+	if (decommit_size)
+		heap_trace(heap, page_decommit, RPMALLOC_EVENT_PAGE_DECOMMIT, 0, page_type, decommit_size);
+	return committed_size;
+}
+
+//! Free all memory allocated by the heap but keep spans mapped with up to the given number of bytes committed, with
+//! all pages of the kept spans in the heap free lists. Other spans are released as by heap free all.
+static void
+heap_reset(heap_t* heap, size_t retain_size) {
+	size_t committed_size = 0;
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		heap->page_free[itype] = 0;
+		heap->page_free_commit_count[itype] = 0;
+		heap->page_full[itype] = 0;
+		atomic_store_explicit(&heap->thread_free[itype], 0, memory_order_relaxed);
+	}
+	memset(heap->local_free, 0, sizeof(heap->local_free));
+	memset(heap->page_available, 0, sizeof(heap->page_available));
+
+	page_t* decommit_list[3] = {0, 0, 0};
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		span_t* span = heap->span_partial[itype];
+		if (span) {
+			if (committed_size < retain_size) {
+				committed_size += heap_reset_span(heap, span, retain_size - committed_size, decommit_list + itype);
+			} else {
+				heap->span_partial[itype] = 0;
+				heap_release_span(heap, span, 1);
+			}
+		}
+		span_t** span_link = &heap->span_used[itype];
+		while (*span_link) {
+			span = *span_link;
+			if (committed_size < retain_size) {
+				committed_size += heap_reset_span(heap, span, retain_size - committed_size, decommit_list + itype);
+				span_link = &span->next;
+			} else {
+				*span_link = span->next;
+				heap_release_span(heap, span, 1);
+			}
+		}
+	}
+	// Committed pages are kept first in the free list
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		page_t** page_link = &heap->page_free[itype];
+		while (*page_link)
+			page_link = &(*page_link)->next;
+		*page_link = decommit_list[itype];
+	}
+
+	// Huge blocks are not reused as pages
+	span_t* span = heap->span_used[PAGE_HUGE];
+	heap->span_used[PAGE_HUGE] = 0;
+	while (span) {
+		span_t* span_next = span->next;
+		heap_release_span(heap, span, 1);
+		span = span_next;
+	}
+
+	// Keep the current arena span if the committed memory of it fits in the remaining bytes to retain
+	span = heap->arena_span;
+	int retain_arena = span && ((committed_size + span->page_size) <= retain_size);
+	heap_arena_reset(heap, retain_arena, 1);
+	heap->memory_committed = 0;
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		if (heap->span_partial[itype])
+			heap->memory_committed += span_committed_size(heap->span_partial[itype]);
+		for (span = heap->span_used[itype]; span; span = span->next)
+			heap->memory_committed += span_committed_size(span);
+	}
+	if (heap->arena_span)
+		heap->memory_committed += heap->arena_span->page_size;
+	heap->memory_pressure = 0;
+	heap_stat_free_all(heap);
+}
+
+#endif
+
+//! Check if all pages in the span are free, either in the heap free list or in the global cache. Only
+//! conclusive while holding all global cache locks.
+static int
+heap_span_is_free(heap_t* heap, span_t* span) {
+	for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+		page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+		if (((page->heap != heap) && (page->heap != 0)) || !page->is_free)
+			return 0;
+	}
+	return 1;
+}
+
+//! Try to take back all pages of the span from the heap free list and global cache, returns non-zero on success
+static int
+heap_reclaim_free_span(heap_t* heap, span_t* span) {
+	if (!heap_span_is_free(heap, span))
+		return 0;
+	// No other heap can pick up the span pages from the global cache while holding all locks
+	global_cache_lock_all();
+	int is_free = heap_span_is_free(heap, span);
+	if (is_free)
+		global_cache_remove_span_pages(span);
+	global_cache_unlock_all();
+	if (!is_free)
+		return 0;
+
+	page_type_t page_type = span->page_type;
+	page_t** page_link = &heap->page_free[page_type];
+	while (*page_link) {
+		page_t* page = *page_link;
+		if (page_get_span(page) == span) {
+			if (!page->is_decommitted) {
+				rpmalloc_assert(heap->page_free_commit_count[page_type] > 0, "Free committed page count out of sync");
+				--heap->page_free_commit_count[page_type];
+			}
+			*page_link = page->next;
+		} else {
+			page_link = &page->next;
+		}
+	}
+	return 1;
+}
+
+//! Process all pending deferred frees, release fully free spans and decommit free pages down to the given retain
+//! count for each page type
+static void
+heap_collect(heap_t* heap, const unsigned int* page_retain) {
+	// Return blocks in heap local free lists to the owning pages
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		block_t* block = heap->local_free[iclass];
+		heap->local_free[iclass] = 0;
+		while (block) {
+			block_t* next_block = block->next;
+			page_put_local_free_block(span_get_page_from_block(block_get_span(block), block), block);
+			block = next_block;
+		}
+	}
+
+	// Process deferred frees of pages that were full
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		block_t* block = (void*)atomic_exchange_explicit(&heap->thread_free[itype], 0, memory_order_acquire);
+		heap_deallocate_thread_free_list(block);
+	}
+
+	// Process deferred frees of available pages
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		page_t* page = heap->page_available[iclass];
+		while (page) {
+			page_t* next_page = page->next;
+			page_collect_thread_free_blocks(page);
+			page = next_page;
+		}
+	}
+
+	// Process deferred frees that raced the pages becoming full
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		page_t* page = heap->page_full[itype];
+		while (page) {
+			page_t* next_page = page->next;
+			page_collect_thread_free_blocks(page);
+			page = next_page;
+		}
+	}
+
+	// Release spans where all pages are free
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		span_t* span = heap->span_partial[itype];
+		if (span && heap_reclaim_free_span(heap, span)) {
+			heap->span_partial[itype] = 0;
+			heap_release_span(heap, span, 1);
+		}
+		span_t** span_link = &heap->span_used[itype];
+		while (*span_link) {
+			span = *span_link;
+			if (heap_reclaim_free_span(heap, span)) {
+				*span_link = span->next;
+				heap_release_span(heap, span, 1);
+			} else {
+				span_link = &span->next;
+			}
+		}
+	}
+
+	// Decommit decayed and surplus free pages, making them available to other heaps
+	uint32_t current_time = os_time_ms();
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		if (global_config.page_decay_time[itype])
+			heap_page_free_decay(heap, itype, current_time);
+		heap_page_free_decommit(heap, itype, page_retain[itype]);
+	}
+}
+
+//! Add the blocks of a page holding blocks to the report
+static void
+heap_report_page(page_t* page, rpmalloc_heap_report_t* report) {
+	uint64_t thread_free = atomic_load_explicit(&page->thread_free, memory_order_relaxed);
+	uint32_t thread_free_count = (uint32_t)(thread_free >> 32ULL);
+	if (thread_free_count > page->block_used)
+		thread_free_count = page->block_used;
+	++report->page_type[page->page_type].page_used;
+	++report->size_class[page->size_class].page_count;
+	report->size_class[page->size_class].block_used += page->block_used - thread_free_count;
+	report->size_class[page->size_class].block_free += (page->block_initialized - page->block_used) + thread_free_count;
+	report->size_class[page->size_class].block_thread_free += thread_free_count;
+	report->size_class[page->size_class].block_uninitialized += page->block_count - page->block_initialized;
+}
+
+//! Move a block counted as used by the report to the free blocks
+static inline void
+heap_report_block_free(block_t* block, rpmalloc_heap_report_t* report, int thread_free) {
+	page_t* page = span_get_page_from_block(block_get_span(block), block);
+	// Huge blocks freed from another process are reported with the huge spans until released
+	if (page->page_type == PAGE_HUGE)
+		return;
+	if (report->size_class[page->size_class].block_used) {
+		--report->size_class[page->size_class].block_used;
+		++report->size_class[page->size_class].block_free;
+		if (thread_free)
+			++report->size_class[page->size_class].block_thread_free;
+	}
+}
+
+//! Add the memory of a heap owned by the calling thread, or locked by it, to the report
+static void
+heap_report_walk(heap_t* heap, rpmalloc_heap_report_t* report) {
+	++report->heap_count;
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		if (heap->span_partial[itype])
+			++report->page_type[itype].span_count;
+		for (span_t* span = heap->span_used[itype]; span; span = span->next)
+			++report->page_type[itype].span_count;
+		for (page_t* page = heap->page_free[itype]; page; page = page->next) {
+			if (page->is_decommitted)
+				++report->page_type[itype].page_free_decommitted;
+			else
+				++report->page_type[itype].page_free_committed;
+		}
+		for (page_t* page = heap->page_full[itype]; page; page = page->next)
+			heap_report_page(page, report);
+	}
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		for (page_t* page = heap->page_available[iclass]; page; page = page->next)
+			heap_report_page(page, report);
+	}
+	// Blocks in the heap local free lists and blocks freed by other threads to full pages are counted as used
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		for (block_t* block = heap->local_free[iclass]; block; block = block->next)
+			heap_report_block_free(block, report, 0);
+	}
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		block_t* block = (block_t*)atomic_load_explicit(&heap->thread_free[itype], memory_order_acquire);
+		for (; block; block = block->next)
+			heap_report_block_free(block, report, 1);
+	}
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	for (span_t* span = heap->span_used[PAGE_HUGE]; span; span = span->next) {
+		++report->huge_count;
+		report->huge_bytes += (size_t)span->page_size * (size_t)span->page_count;
+	}
+	for (span_t* span = heap->arena_span; span; span = span->next)
+		report->arena_bytes += span->page_size;
+#endif
+}
+
+//! Add the memory of a heap used by another thread to the report, from counters which are safe to read while the
+//! heap is in use. The page lists of the heap cannot be walked since spans might be released concurrently
+static void
+heap_report_estimate(heap_t* heap, rpmalloc_heap_report_t* report) {
+	++report->heap_count;
+	++report->heap_estimated_count;
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		report->page_type[itype].page_free_committed += heap->page_free_commit_count[itype];
+#if ENABLE_STATISTICS
+		report->page_type[itype].page_used += heap->stats.page_use[itype].current;
+#endif
+	}
+#if ENABLE_STATISTICS
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass)
+		report->size_class[iclass].block_used += heap->stats.size_use[iclass].alloc_current;
+#endif
+}
+
+static void
+heap_report_initialize(rpmalloc_heap_report_t* report) {
+	memset(report, 0, sizeof(rpmalloc_heap_report_t));
+	for (uint32_t itype = 0; itype < 3; ++itype)
+		report->page_type[itype].page_size = global_page_type_size[itype];
+	report->size_class_count = SIZE_CLASS_COUNT;
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass)
+		report->size_class[iclass].block_size = global_size_class[iclass].block_size;
+}
 
-#if ENABLE_STATISTICS
-	// TODO: Fix
-#endif
+//! Calculate the fragmentation of the memory committed for pages, as the fraction not holding allocated blocks
+static void
+heap_report_finalize(rpmalloc_heap_report_t* report) {
+	size_t committed = 0;
+	size_t used = 0;
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		committed += (report->page_type[itype].page_used + report->page_type[itype].page_free_committed) *
+		             report->page_type[itype].page_size;
+	}
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass)
+		used += report->size_class[iclass].block_used * report->size_class[iclass].block_size;
+	report->fragmentation = (committed > used) ? (double)(committed - used) / (double)committed : 0.0;
 }
 
 ////////////
@@ -1817,6 +5360,8 @@ heap_free_all(heap_t* heap) {
 
 int
 rpmalloc_is_thread_initialized(void) {
+	if (global_cpu_heap_count)
+		return 1;
 	return (get_thread_heap() != global_heap_default) ? 1 : 0;
 }
 
@@ -1828,8 +5373,10 @@ rpmalloc(size_t size) {
 		return 0;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block(heap, size, 0);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block(heap, size, 0);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1840,8 +5387,10 @@ rpzalloc(size_t size) {
 		return 0;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block(heap, size, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block(heap, size, 1);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern inline void
@@ -1851,6 +5400,39 @@ rpfree(void* ptr) {
 	block_deallocate(ptr);
 }
 
+extern inline void
+rpfree_sized(void* ptr, size_t size) {
+	if (UNEXPECTED(ptr == 0))
+		return;
+	block_deallocate_sized(ptr, size, 0);
+}
+
+extern inline void
+rpfree_aligned_sized(void* ptr, size_t alignment, size_t size) {
+	if (UNEXPECTED(ptr == 0))
+		return;
+	block_deallocate_sized(ptr, size, alignment);
+}
+
+extern size_t
+rpmalloc_batch_alloc(size_t size, size_t count, void** blocks) {
+#if ENABLE_VALIDATE_ARGS
+	if (size >= MAX_ALLOC_SIZE) {
+		errno = EINVAL;
+		return 0;
+	}
+#endif
+	heap_t* heap = thread_heap_acquire();
+	size_t allocated = heap_allocate_block_batch(heap, size, count, blocks);
+	thread_heap_release(heap);
+	return allocated;
+}
+
+extern void
+rpfree_batch(void** blocks, size_t count) {
+	block_deallocate_batch(blocks, count);
+}
+
 extern inline RPMALLOC_ALLOCATOR void*
 rpcalloc(size_t num, size_t size) {
 	size_t total;
@@ -1871,8 +5453,10 @@ rpcalloc(size_t num, size_t size) {
 #else
 	total = num * size;
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block(heap, total, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block(heap, total, 1);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1883,8 +5467,10 @@ rprealloc(void* ptr, size_t size) {
 		return ptr;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_reallocate_block(heap, ptr, size, 0, 0);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_reallocate_block(heap, ptr, size, 0, 0);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern RPMALLOC_ALLOCATOR void*
@@ -1895,20 +5481,26 @@ rpaligned_realloc(void* ptr, size_t alignment, size_t size, size_t oldsize, unsi
 		return 0;
 	}
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_reallocate_block_aligned(heap, ptr, alignment, size, oldsize, flags);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_reallocate_block_aligned(heap, ptr, alignment, size, oldsize, flags);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern RPMALLOC_ALLOCATOR void*
 rpaligned_alloc(size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, size, 0);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, size, 0);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern RPMALLOC_ALLOCATOR void*
 rpaligned_zalloc(size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, size, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, size, 1);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
@@ -1931,23 +5523,27 @@ rpaligned_calloc(size_t alignment, size_t num, size_t size) {
 #else
 	total = num * size;
 #endif
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, total, 1);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, total, 1);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern inline RPMALLOC_ALLOCATOR void*
 rpmemalign(size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	return heap_allocate_block_aligned(heap, alignment, size, 0);
+	heap_t* heap = thread_heap_acquire();
+	void* block = heap_allocate_block_aligned(heap, alignment, size, 0);
+	thread_heap_release(heap);
+	return block;
 }
 
 extern inline int
 rpposix_memalign(void** memptr, size_t alignment, size_t size) {
-	heap_t* heap = get_thread_heap();
-	if (memptr)
-		*memptr = heap_allocate_block_aligned(heap, alignment, size, 0);
-	else
+	if (!memptr)
 		return EINVAL;
+	heap_t* heap = thread_heap_acquire();
+	*memptr = heap_allocate_block_aligned(heap, alignment, size, 0);
+	thread_heap_release(heap);
 	return *memptr ? 0 : ENOMEM;
 }
 
@@ -1962,6 +5558,100 @@ rpmalloc_usable_size(void* ptr) {
 ///
 //////
 
+//! Set up the size classes from the custom size class table in the configuration, or the default size classes if no
+//! valid table is given, and build the size class lookup buckets
+static void
+size_class_initialize(void) {
+	uint32_t class_count = 0;
+	if (global_config.size_class_table) {
+		// Round block sizes up to the limit of their lookup bucket, merging size classes ending in the same bucket so
+		// the bucket maps directly to the size class, and skip sizes not in ascending order
+		for (uint32_t isize = 0; (isize < global_config.size_class_count) && (class_count < SIZE_CLASS_COUNT); ++isize) {
+			size_t block_size = global_config.size_class_table[isize];
+			if (!block_size || (block_size > LARGE_BLOCK_SIZE_LIMIT))
+				continue;
+			block_size = get_size_class_bucket_limit(get_size_class_bucket(block_size));
+			if (class_count && (block_size <= global_size_class_table[class_count - 1]))
+				continue;
+			global_size_class_table[class_count++] = (unsigned int)block_size;
+		}
+		// Last size class must end at the large block size limit, larger blocks are huge blocks
+		if (class_count && (global_size_class_table[class_count - 1] != LARGE_BLOCK_SIZE_LIMIT)) {
+			if (class_count == SIZE_CLASS_COUNT)
+				--class_count;
+			global_size_class_table[class_count++] = LARGE_BLOCK_SIZE_LIMIT;
+		}
+	}
+	size_class_t size_class[SIZE_CLASS_COUNT];
+	if (class_count) {
+		memset(size_class, 0, sizeof(size_class));
+		for (uint32_t iclass = 0; iclass < class_count; ++iclass) {
+			uint32_t block_size = global_size_class_table[iclass];
+			page_type_t page_type = (block_size <= SMALL_BLOCK_SIZE_LIMIT)    ? PAGE_SMALL
+			                        : (block_size <= MEDIUM_BLOCK_SIZE_LIMIT) ? PAGE_MEDIUM
+			                                                                  : PAGE_LARGE;
+			size_class[iclass].block_size = block_size;
+			size_class[iclass].block_count =
+			    (uint32_t)((global_page_type_size[page_type] - PAGE_HEADER_SIZE) / block_size);
+		}
+		global_config.size_class_table = global_size_class_table;
+	} else {
+		memcpy(size_class, global_size_class_default, sizeof(size_class));
+		global_config.size_class_table = 0;
+	}
+	global_config.size_class_count = class_count;
+
+	// Pages of heaps released before the size classes changed are bound to the previous size classes, so the heaps
+	// are not reused. Their blocks can still be freed, and they are unmapped on finalization with unmap_on_finalize
+	if (memcmp(size_class, global_size_class, sizeof(size_class))) {
+		for (uint32_t inode = 0; inode < NUMA_NODE_LIMIT; ++inode) {
+			atomic_store_explicit(&global_heap_queue[inode], 0, memory_order_relaxed);
+			atomic_store_explicit(&global_heap_orphan_queue[inode], 0, memory_order_relaxed);
+		}
+		memcpy(global_size_class, size_class, sizeof(size_class));
+	}
+
+	global_size_class_page_limit[0] = 0;
+	global_size_class_page_limit[1] = 0;
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		uint32_t block_size = global_size_class[iclass].block_size;
+		if (block_size && (block_size <= SMALL_BLOCK_SIZE_LIMIT))
+			global_size_class_page_limit[0] = iclass + 1;
+		if (block_size && (block_size <= MEDIUM_BLOCK_SIZE_LIMIT))
+			global_size_class_page_limit[1] = iclass + 1;
+	}
+
+	// Map each bucket to the lowest size class fitting the largest size in the bucket. All size classes end at bucket
+	// limits, so this is also the lowest size class fitting the smallest size in the bucket
+	uint32_t class_idx = 0;
+	for (uint32_t ibucket = 0; ibucket < SIZE_CLASS_BUCKET_COUNT; ++ibucket) {
+		size_t bucket_limit = get_size_class_bucket_limit(ibucket);
+		while (global_size_class[class_idx].block_size < bucket_limit)
+			++class_idx;
+		rpmalloc_assert(!class_idx || (global_size_class[class_idx - 1].block_size <=
+		                               get_size_class_bucket_limit(ibucket ? ibucket - 1 : 0)),
+		                "Size class ends within lookup bucket");
+		global_size_class_bucket[ibucket] = (uint8_t)class_idx;
+	}
+}
+
+//! Stop reusing the heaps and cached memory kept from a previous initialization, which were mapped by another memory
+//! interface. The memory is left mapped since blocks in it might still be in use, and freeing them is still safe
+static void
+global_memory_abandon(void) {
+	for (uint32_t inode = 0; inode < NUMA_NODE_LIMIT; ++inode) {
+		atomic_store_explicit(&global_heap_queue[inode], 0, memory_order_relaxed);
+		atomic_store_explicit(&global_heap_orphan_queue[inode], 0, memory_order_relaxed);
+	}
+	atomic_store_explicit(&global_heap_list, 0, memory_order_relaxed);
+#if ENABLE_GLOBAL_CACHE
+	memset(global_cache, 0, sizeof(global_cache));
+#endif
+#if ENABLE_HUGE_CACHE
+	memset(&global_huge_cache, 0, sizeof(global_huge_cache));
+#endif
+}
+
 static void
 rpmalloc_thread_destructor(void* value) {
 	// If this is called on main thread assume it means rpmalloc_finalize
@@ -2009,6 +5699,14 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 		global_memory_interface->memory_unmap = os_munmap;
 	}
 
+	// Memory mapped by another memory interface must not be handed out, like private memory after switching to the
+	// shared memory interface
+	if (global_memory_map && (global_memory_map != global_memory_interface->memory_map))
+		global_memory_abandon();
+	global_memory_map = global_memory_interface->memory_map;
+
+	size_class_initialize();
+
 #if PLATFORM_WINDOWS
 	SYSTEM_INFO system_info;
 	memset(&system_info, 0, sizeof(system_info));
@@ -2087,17 +5785,51 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 
 	global_config.enable_huge_pages = os_huge_pages;
 
+	// Partial span reservation needs in place extension of mappings from the default memory interface
+	if (!OS_HAS_MAP_EXTEND || os_huge_pages || (global_memory_interface->memory_map != os_mmap))
+		global_config.span_reserve_size = 0;
+	global_config.span_reserve_size += SMALL_PAGE_SIZE - 1;
+	global_config.span_reserve_size -= global_config.span_reserve_size % SMALL_PAGE_SIZE;
+	if (global_config.span_reserve_size >= SPAN_SIZE)
+		global_config.span_reserve_size = 0;
+
+	if (global_config.enable_numa)
+		os_numa_initialize();
+	else
+		os_numa_node_count = 1;
+	global_config.enable_numa = (os_numa_node_count > 1);
+
 	if (!memory_interface || (global_config.page_size < os_page_size))
 		global_config.page_size = os_page_size;
 
 	if (global_config.enable_huge_pages || global_config.page_size > (256 * 1024))
 		global_config.disable_decommit = 1;
 
+	// Lazy decommit is only implemented by the default memory interface
+#if PLATFORM_WINDOWS || !defined(MADV_FREE) || !defined(MADV_DONTNEED)
+	global_config.decommit_lazy = 0;
+#endif
+	if (global_memory_interface->memory_decommit != os_mdecommit)
+		global_config.decommit_lazy = 0;
+
 #if defined(__linux__) || defined(__ANDROID__)
 	if (global_config.disable_thp)
 		(void)prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0);
 #endif
 
+	// Transparent huge page policies advise regular pages mapped by the default memory interface
+	int thp_supported = OS_HAS_THP && !os_huge_pages && (global_memory_interface->memory_map == os_mmap);
+#if defined(__linux__) || defined(__ANDROID__)
+	if (global_config.disable_thp)
+		thp_supported = 0;
+#endif
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		if (!thp_supported || ((unsigned int)global_config.page_thp_policy[itype] > RPMALLOC_THP_DISABLE))
+			global_config.page_thp_policy[itype] = RPMALLOC_THP_DEFAULT;
+		if (global_config.page_thp_policy[itype] == RPMALLOC_THP_ENABLE)
+			os_thp_initialize();
+	}
+
 #ifdef _WIN32
 	fls_key = FlsAlloc(&rpmalloc_thread_destructor);
 #else
@@ -2106,8 +5838,36 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 
 	global_main_thread_id = get_thread_id();
 
+#if ENABLE_SAMPLING
+	// Restart the sample countdown of heaps kept from a previous initialization, the interval might have changed
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_relaxed); heap;
+	     heap = heap->list_next) {
+		heap->sample_countdown = 0;
+		heap->sample_random = 0;
+	}
+#else
+	global_config.sample_interval = 0;
+#endif
+
+	if (global_config.enable_per_cpu_heaps) {
+		// Heap of the first slot is the fallback if a heap for another slot cannot be allocated
+		uint32_t cpu_heap_count = os_cpu_count();
+		if (heap_cpu_allocate(0))
+			global_cpu_heap_count = (cpu_heap_count < CPU_HEAP_LIMIT) ? cpu_heap_count : CPU_HEAP_LIMIT;
+		else
+			global_config.enable_per_cpu_heaps = 0;
+	}
+
+	global_release_thread_start();
+
 	rpmalloc_thread_initialize();
 
+#if ENABLE_SAMPLING
+	// Stack capture might allocate memory on first use, which must not happen while the heap of the thread is locked
+	void* frame[SAMPLE_FRAME_LIMIT];
+	os_stack_trace(frame, SAMPLE_FRAME_LIMIT);
+#endif
+
 	return 0;
 }
 
@@ -2116,30 +5876,55 @@ rpmalloc_config(void) {
 	return &global_config;
 }
 
+extern unsigned int
+rpmalloc_numa_node_count(void) {
+	return os_numa_node_count;
+}
+
 extern void
 rpmalloc_finalize(void) {
 	rpmalloc_thread_finalize();
 
+	uint32_t cpu_heap_count = global_cpu_heap_count;
+	global_cpu_heap_count = 0;
+	for (uint32_t icpu = 0; icpu < cpu_heap_count; ++icpu) {
+		heap_t* heap = (heap_t*)atomic_exchange_explicit(&global_cpu_heap[icpu], 0, memory_order_acquire);
+		if (heap)
+			heap_release(heap);
+	}
+
+#if ENABLE_SAMPLING
+	// Blocks still held by the sample heap are freed as regular blocks after finalization
+	heap_t* sample_heap = (heap_t*)atomic_exchange_explicit(&global_sample_heap, 0, memory_order_acquire);
+	if (sample_heap)
+		heap_release(sample_heap);
+	if (global_sample_table)
+		memory_unmap(global_sample_table, global_sample_table_offset, global_sample_table_mapped_size,
+		             sizeof(heap_sample_t) * SAMPLE_TABLE_SIZE);
+	global_sample_table = 0;
+	global_sample_count = 0;
+#endif
+
 	if (global_config.unmap_on_finalize) {
-		heap_t* heap = global_heap_queue;
-		global_heap_queue = 0;
-		while (heap) {
-			heap_t* heap_next = heap->next;
-			heap_free_all(heap);
-			heap_unmap(heap);
-			heap = heap_next;
+		for (uint32_t inode = 0; inode < NUMA_NODE_LIMIT; ++inode) {
+			atomic_store_explicit(&global_heap_queue[inode], 0, memory_order_relaxed);
+			atomic_store_explicit(&global_heap_orphan_queue[inode], 0, memory_order_relaxed);
 		}
-		heap = global_heap_used;
-		global_heap_used = 0;
+		heap_t* heap = (heap_t*)atomic_exchange_explicit(&global_heap_list, 0, memory_order_acquire);
 		while (heap) {
-			heap_t* heap_next = heap->next;
-			heap_free_all(heap);
+			heap_t* heap_next = heap->list_next;
+			heap_free_all(heap, 0);
 			heap_unmap(heap);
 			heap = heap_next;
 		}
+		global_release_finalize();
+		global_cache_finalize();
+		global_huge_cache_finalize();
 #if ENABLE_STATISTICS
 		memset(&global_statistics, 0, sizeof(global_statistics));
 #endif
+	} else {
+		global_release_finalize();
 	}
 
 #ifdef _WIN32
@@ -2156,7 +5941,8 @@ rpmalloc_finalize(void) {
 
 extern void
 rpmalloc_thread_initialize(void) {
-	if (get_thread_heap() == global_heap_default)
+	// Heaps are not bound to threads in per processor heap mode
+	if (!global_cpu_heap_count && (get_thread_heap() == global_heap_default))
 		get_thread_heap_allocate();
 }
 
@@ -2169,8 +5955,230 @@ rpmalloc_thread_finalize(void) {
 	}
 }
 
+extern size_t
+rpmalloc_thread_prepare(size_t size, size_t count, unsigned int flags) {
+	if (UNEXPECTED(!global_rpmalloc_initialized))
+		rpmalloc_initialize(0);
+	rpmalloc_thread_initialize();
+	heap_t* heap = thread_heap_acquire();
+	size_t available = heap->id ? heap_prepare(heap, size, count, flags) : 0;
+	thread_heap_release(heap);
+	return available;
+}
+
+extern void
+rpmalloc_thread_report(rpmalloc_heap_report_t* report) {
+	heap_report_initialize(report);
+	heap_t* heap = thread_heap_acquire();
+	if (heap->id)
+		heap_report_walk(heap, report);
+	thread_heap_release(heap);
+	heap_report_finalize(report);
+}
+
+extern void
+rpmalloc_global_report(rpmalloc_heap_report_t* report) {
+	heap_report_initialize(report);
+	heap_t* thread_heap = global_cpu_heap_count ? 0 : get_thread_heap();
+	for (heap_t* heap = (heap_t*)atomic_load_explicit(&global_heap_list, memory_order_acquire); heap;
+	     heap = heap->list_next) {
+		if (heap == thread_heap) {
+			heap_report_walk(heap, report);
+			continue;
+		}
+		uint32_t icpu = 0;
+		while ((icpu < global_cpu_heap_count) &&
+		       ((heap_t*)atomic_load_explicit(&global_cpu_heap[icpu], memory_order_relaxed) != heap))
+			++icpu;
+		if (icpu < global_cpu_heap_count) {
+			// Per processor heaps are only used while locked
+			while (atomic_load_explicit(&heap->lock, memory_order_relaxed) ||
+			       atomic_exchange_explicit(&heap->lock, 1, memory_order_acquire))
+				wait_spin();
+			heap_report_walk(heap, report);
+			atomic_store_explicit(&heap->lock, 0, memory_order_release);
+		} else {
+			heap_report_estimate(heap, report);
+		}
+	}
+	heap_report_finalize(report);
+}
+
 extern void
 rpmalloc_thread_collect(void) {
+	heap_t* heap = thread_heap_acquire();
+	if (heap->id) {
+		heap_remote_free_flush(heap);
+		// Adopt the pages of all heaps released by threads, to process the pending frees to them below
+		int reclaimed = !heap->first_class;
+		while (reclaimed)
+			reclaimed = heap_reclaim_orphan(heap);
+		heap_collect(heap, global_config.collect_page_retain);
+	}
+	thread_heap_release(heap);
+	global_release_drain();
+}
+
+extern void
+rpmalloc_thread_statistics(rpmalloc_thread_statistics_t* stats) {
+	heap_t* heap = thread_heap_acquire();
+#if ENABLE_STATISTICS
+	memcpy(stats, &heap->stats, sizeof(rpmalloc_thread_statistics_t));
+#else
+	memset(stats, 0, sizeof(rpmalloc_thread_statistics_t));
+#endif
+	stats->pagecache = 0;
+	for (uint32_t itype = 0; itype < 3; ++itype)
+		stats->pagecache += (size_t)heap->page_free_commit_count[itype] * global_page_type_size[itype];
+	thread_heap_release(heap);
+}
+
+extern void
+rpmalloc_global_statistics(rpmalloc_global_statistics_t* stats) {
+	memset(stats, 0, sizeof(rpmalloc_global_statistics_t));
+#if ENABLE_STATISTICS
+	size_t page_size = global_config.page_size;
+	stats->mapped = atomic_load_explicit(&global_statistics.page_mapped, memory_order_relaxed) * page_size;
+	stats->mapped_peak = atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed) * page_size;
+	stats->committed = atomic_load_explicit(&global_statistics.page_active, memory_order_relaxed) * page_size;
+	stats->committed_peak = atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed) * page_size;
+	stats->huge_alloc = atomic_load_explicit(&global_statistics.huge_alloc, memory_order_relaxed);
+	stats->huge_alloc_peak = atomic_load_explicit(&global_statistics.huge_alloc_peak, memory_order_relaxed);
+	stats->mapped_total = atomic_load_explicit(&global_statistics.page_mapped_total, memory_order_relaxed) * page_size;
+	stats->unmapped_total =
+	    atomic_load_explicit(&global_statistics.page_unmapped_total, memory_order_relaxed) * page_size;
+	stats->heap_count = atomic_load_explicit(&global_statistics.heap_count, memory_order_relaxed);
+#endif
+	stats->cached = global_cache_size();
+	stats->release_deferred = atomic_load_explicit(&global_release.size, memory_order_relaxed);
+}
+
+extern size_t
+rpmalloc_size_class_recommend(const rpmalloc_thread_statistics_t* stats, unsigned int* size_class, size_t capacity) {
+	// Candidates are the default size classes and the limit of each size lookup bucket with requests, weighted by the
+	// number of allocations in the bucket. Size classes must end at bucket limits, which are ascending
+	unsigned int block_size[SIZE_CLASS_COUNT + SIZE_CLASS_BUCKET_COUNT];
+	size_t weight[SIZE_CLASS_COUNT + SIZE_CLASS_BUCKET_COUNT];
+	uint32_t count = 0;
+	uint32_t class_idx = 1;
+	for (uint32_t ibucket = 0; ibucket <= SIZE_CLASS_BUCKET_COUNT; ++ibucket) {
+		size_t request_size = 0;
+		if (ibucket < SIZE_CLASS_BUCKET_COUNT) {
+			if (!stats->size_request[ibucket].alloc_total)
+				continue;
+			request_size = get_size_class_bucket_limit(ibucket);
+			if (!request_size)
+				request_size = SMALL_GRANULARITY;
+		} else {
+			request_size = LARGE_BLOCK_SIZE_LIMIT;
+		}
+		while ((class_idx < SIZE_CLASS_COUNT) && (global_size_class_default[class_idx].block_size <= request_size)) {
+			block_size[count] = global_size_class_default[class_idx++].block_size;
+			weight[count++] = 0;
+		}
+		if (ibucket == SIZE_CLASS_BUCKET_COUNT)
+			break;
+		if (count && (block_size[count - 1] == request_size)) {
+			weight[count - 1] += stats->size_request[ibucket].alloc_total;
+		} else {
+			block_size[count] = (unsigned int)request_size;
+			weight[count++] = stats->size_request[ibucket].alloc_total;
+		}
+	}
+	rpmalloc_assert(block_size[count - 1] == LARGE_BLOCK_SIZE_LIMIT, "Size class recommendation misconfiguration");
+
+	// Drop size classes until the table fits, each time dropping the size class with the least memory wasted by
+	// moving its allocations to the next size class. Among unused size classes drop the one with the smallest ratio
+	// between its neighbours, bounding the overhead for other sizes. The last size class is always kept
+	size_t limit = (capacity < SIZE_CLASS_COUNT) ? capacity : SIZE_CLASS_COUNT;
+	if (!limit)
+		return 0;
+	while (count > limit) {
+		uint32_t drop_idx = 0;
+		size_t drop_waste = 0;
+		size_t drop_prev = 0;
+		size_t drop_next = 0;
+		for (uint32_t iclass = 0; iclass < count - 1; ++iclass) {
+			size_t prev = iclass ? block_size[iclass - 1] : 0;
+			size_t next = block_size[iclass + 1];
+			size_t waste = weight[iclass] * (next - block_size[iclass]);
+			if (!iclass || (waste < drop_waste) || ((waste == drop_waste) && (next * drop_prev < drop_next * prev))) {
+				drop_idx = iclass;
+				drop_waste = waste;
+				drop_prev = prev;
+				drop_next = next;
+			}
+		}
+		--count;
+		memmove(block_size + drop_idx, block_size + drop_idx + 1, sizeof(unsigned int) * (count - drop_idx));
+		memmove(weight + drop_idx, weight + drop_idx + 1, sizeof(size_t) * (count - drop_idx));
+	}
+	memcpy(size_class, block_size, sizeof(unsigned int) * count);
+	return count;
+}
+
+void
+rpmalloc_memory_usage(size_t* mapped, size_t* committed) {
+	if (mapped)
+		*mapped = atomic_load_explicit(&global_memory_mapped, memory_order_relaxed);
+	if (committed)
+		*committed = atomic_load_explicit(&global_memory_committed, memory_order_relaxed);
+}
+
+void
+rpmalloc_dump_report(void* file, const rpmalloc_heap_report_t* report) {
+	fprintf(file,
+	        "{\"heap_count\":%llu,\"heap_estimated_count\":%llu,\"huge_count\":%llu,\"huge_bytes\":%llu,"
+	        "\"arena_bytes\":%llu,\"fragmentation\":%.4f,\"page_type\":[",
+	        (unsigned long long)report->heap_count, (unsigned long long)report->heap_estimated_count,
+	        (unsigned long long)report->huge_count, (unsigned long long)report->huge_bytes,
+	        (unsigned long long)report->arena_bytes, report->fragmentation);
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		fprintf(file,
+		        "%s{\"page_size\":%llu,\"span_count\":%llu,\"page_used\":%llu,\"page_free_committed\":%llu,"
+		        "\"page_free_decommitted\":%llu}",
+		        itype ? "," : "", (unsigned long long)report->page_type[itype].page_size,
+		        (unsigned long long)report->page_type[itype].span_count,
+		        (unsigned long long)report->page_type[itype].page_used,
+		        (unsigned long long)report->page_type[itype].page_free_committed,
+		        (unsigned long long)report->page_type[itype].page_free_decommitted);
+	}
+	fprintf(file, "],\"size_class\":[");
+	int first = 1;
+	for (size_t iclass = 0; iclass < report->size_class_count; ++iclass) {
+		if (!report->size_class[iclass].page_count && !report->size_class[iclass].block_used)
+			continue;
+		fprintf(file,
+		        "%s{\"size_class\":%llu,\"block_size\":%llu,\"page_count\":%llu,\"block_used\":%llu,"
+		        "\"block_free\":%llu,\"block_thread_free\":%llu,\"block_uninitialized\":%llu}",
+		        first ? "" : ",", (unsigned long long)iclass, (unsigned long long)report->size_class[iclass].block_size,
+		        (unsigned long long)report->size_class[iclass].page_count,
+		        (unsigned long long)report->size_class[iclass].block_used,
+		        (unsigned long long)report->size_class[iclass].block_free,
+		        (unsigned long long)report->size_class[iclass].block_thread_free,
+		        (unsigned long long)report->size_class[iclass].block_uninitialized);
+		first = 0;
+	}
+	fprintf(file, "]}\n");
+}
+
+extern size_t
+rpmalloc_thread_events(rpmalloc_event_t* events, size_t capacity) {
+	size_t count = 0;
+#if ENABLE_EVENT_LOG
+	heap_t* heap = thread_heap_acquire();
+	uint32_t event_count = heap->event_count;
+	count = (event_count < EVENT_LOG_SIZE) ? event_count : EVENT_LOG_SIZE;
+	if (count > capacity)
+		count = capacity;
+	for (size_t ievent = 0; ievent < count; ++ievent)
+		events[ievent] = heap->event[(event_count - count + ievent) & (EVENT_LOG_SIZE - 1)];
+	thread_heap_release(heap);
+#else
+	(void)sizeof(events);
+	(void)sizeof(capacity);
+#endif
+	return count;
 }
 
 void
@@ -2190,11 +6198,252 @@ rpmalloc_dump_statistics(void* file) {
 	        (unsigned long long)atomic_load_explicit(&global_statistics.page_decommit, memory_order_relaxed));
 	fprintf(file, "Heaps created:       %llu\n",
 	        (unsigned long long)atomic_load_explicit(&global_statistics.heap_count, memory_order_relaxed));
+	fprintf(file, "Huge (KiB):          %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.huge_alloc, memory_order_relaxed) / 1024);
+	fprintf(file, "Huge peak (KiB):     %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.huge_alloc_peak, memory_order_relaxed) / 1024);
+	fprintf(file, "Global cache (KiB):  %llu\n", (unsigned long long)global_cache_size() / 1024);
+
+	heap_t* heap = get_thread_heap();
+	fprintf(file, "Page type  Current     Peak  ToFull  FromFull  ToFree  FromFree  ToGlobal  FromGlobal  MapCalls\n");
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		fprintf(file, "%9u  %7llu  %7llu  %6llu  %8llu  %6llu  %8llu  %8llu  %10llu  %8llu\n", itype,
+		        (unsigned long long)heap->stats.page_use[itype].current,
+		        (unsigned long long)heap->stats.page_use[itype].peak,
+		        (unsigned long long)heap->stats.page_use[itype].to_full,
+		        (unsigned long long)heap->stats.page_use[itype].from_full,
+		        (unsigned long long)heap->stats.page_use[itype].to_free,
+		        (unsigned long long)heap->stats.page_use[itype].from_free,
+		        (unsigned long long)heap->stats.page_use[itype].to_global,
+		        (unsigned long long)heap->stats.page_use[itype].from_global,
+		        (unsigned long long)heap->stats.page_use[itype].map_calls);
+	}
+	fprintf(file, "Size class  Block size  AllocCurrent  AllocPeak   AllocTotal    FreeTotal  FreeThread\n");
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		if (!heap->stats.size_use[iclass].alloc_total)
+			continue;
+		fprintf(file, "%10u  %10u  %12llu  %9llu  %11llu  %11llu  %10llu\n", iclass,
+		        global_size_class[iclass].block_size, (unsigned long long)heap->stats.size_use[iclass].alloc_current,
+		        (unsigned long long)heap->stats.size_use[iclass].alloc_peak,
+		        (unsigned long long)heap->stats.size_use[iclass].alloc_total,
+		        (unsigned long long)heap->stats.size_use[iclass].free_total,
+		        (unsigned long long)heap->stats.size_use[iclass].free_thread_total);
+	}
+	fprintf(file, "Size request  Max size   AllocTotal\n");
+	for (uint32_t ibucket = 0; ibucket < SIZE_CLASS_BUCKET_COUNT; ++ibucket) {
+		if (!heap->stats.size_request[ibucket].alloc_total)
+			continue;
+		fprintf(file, "%12u  %8llu  %11llu\n", ibucket, (unsigned long long)heap->stats.size_request[ibucket].size_max,
+		        (unsigned long long)heap->stats.size_request[ibucket].alloc_total);
+	}
+	unsigned int size_class[SIZE_CLASS_COUNT];
+	size_t size_class_count = rpmalloc_size_class_recommend(&heap->stats, size_class, SIZE_CLASS_COUNT);
+	fprintf(file, "Recommended size class table:");
+	for (size_t iclass = 0; iclass < size_class_count; ++iclass)
+		fprintf(file, "%s%u", (iclass % 12) ? ", " : (iclass ? ",\n    " : "\n    "), size_class[iclass]);
+	fprintf(file, "\n");
+
+	rpmalloc_heap_report_t report;
+	rpmalloc_thread_report(&report);
+	fprintf(file, "Page type  Spans  PagesUsed  FreeCommitted  FreeDecommitted\n");
+	for (uint32_t itype = 0; itype < 3; ++itype) {
+		fprintf(file, "%9u  %5llu  %9llu  %13llu  %15llu\n", itype,
+		        (unsigned long long)report.page_type[itype].span_count,
+		        (unsigned long long)report.page_type[itype].page_used,
+		        (unsigned long long)report.page_type[itype].page_free_committed,
+		        (unsigned long long)report.page_type[itype].page_free_decommitted);
+	}
+	fprintf(file, "Size class  Pages  BlocksUsed  BlocksFree  ThreadFree  Uninitialized\n");
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		if (!report.size_class[iclass].page_count)
+			continue;
+		fprintf(file, "%10u  %5llu  %10llu  %10llu  %10llu  %13llu\n", iclass,
+		        (unsigned long long)report.size_class[iclass].page_count,
+		        (unsigned long long)report.size_class[iclass].block_used,
+		        (unsigned long long)report.size_class[iclass].block_free,
+		        (unsigned long long)report.size_class[iclass].block_thread_free,
+		        (unsigned long long)report.size_class[iclass].block_uninitialized);
+	}
+	fprintf(file, "Fragmentation:       %.1f%%\n", report.fragmentation * 100.0);
 #else
 	(void)sizeof(file);
 #endif
 }
 
+void
+rpmalloc_dump_samples(void* file) {
+	size_t sample_count = 0;
+	size_t sample_bytes = 0;
+	size_t sample_interval = global_config.sample_interval;
+#if ENABLE_SAMPLING
+	// Copy the samples to memory mapped outside the heaps and write them with the lock released, since writing to
+	// the file might allocate memory which could be sampled
+	heap_sample_t* sample = 0;
+	size_t buffer_size = 0;
+	size_t buffer_offset = 0;
+	size_t buffer_mapped_size = 0;
+	heap_t* sample_heap = (heap_t*)atomic_load_explicit(&global_sample_heap, memory_order_acquire);
+	if (sample_heap) {
+		heap_sample_lock(sample_heap);
+		buffer_size = get_page_aligned_size(sizeof(heap_sample_t) * global_sample_count);
+		if (global_sample_count)
+			sample = global_memory_interface->memory_map(buffer_size, 0, &buffer_offset, &buffer_mapped_size);
+		if (sample) {
+#if ENABLE_DECOMMIT
+			global_memory_interface->memory_commit(sample, buffer_size);
+#endif
+			for (size_t islot = 0; islot < SAMPLE_TABLE_SIZE; ++islot) {
+				if (global_sample_table[islot].block)
+					memcpy(sample + sample_count++, global_sample_table + islot, sizeof(heap_sample_t));
+			}
+		}
+		heap_sample_unlock(sample_heap);
+	}
+	for (size_t isample = 0; isample < sample_count; ++isample)
+		sample_bytes += sample[isample].size;
+#endif
+	// Legacy heap profile format as written by gperftools and read by pprof, where the allocated counts are the same
+	// as the in use counts since only live samples are kept
+	fprintf(file, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu\n", (unsigned long long)sample_count,
+	        (unsigned long long)sample_bytes, (unsigned long long)sample_count, (unsigned long long)sample_bytes,
+	        (unsigned long long)sample_interval);
+#if ENABLE_SAMPLING
+	for (size_t isample = 0; isample < sample_count; ++isample) {
+		fprintf(file, "1: %llu [1: %llu] @", (unsigned long long)sample[isample].size,
+		        (unsigned long long)sample[isample].size);
+		for (size_t iframe = 0; iframe < sample[isample].frame_count; ++iframe)
+			fprintf(file, " 0x%llx", (unsigned long long)(uintptr_t)sample[isample].frame[iframe]);
+		fprintf(file, "\n");
+	}
+	if (sample)
+		memory_unmap(sample, buffer_offset, buffer_mapped_size, buffer_size);
+#endif
+#if defined(__linux__)
+	// Mapped libraries are needed by pprof to symbolize the addresses
+	FILE* maps = fopen("/proc/self/maps", "r");
+	if (maps) {
+		char line[512];
+		fprintf(file, "\nMAPPED_LIBRARIES:\n");
+		while (fgets(line, sizeof(line), maps))
+			fputs(line, file);
+		fclose(maps);
+	}
+#endif
+}
+
+int
+rpmalloc_shared_map(int fd, size_t size) {
+#if OS_HAS_SHARED_MEMORY
+	if (global_shared_region) {
+		errno = EBUSY;
+		return -1;
+	}
+	void* address = 0;
+	if (size) {
+		size = (size + SPAN_SIZE - 1) & SPAN_MASK;
+		if (ftruncate(fd, (off_t)size))
+			return -1;
+		// Reserve address space with room to align the region to the span size, since spans are found by masking
+		// block addresses, then map the file over the aligned part and release the rest
+		size_t reserve_size = size + SPAN_SIZE;
+		void* reserve = mmap(0, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (reserve == MAP_FAILED)
+			return -1;
+		uintptr_t base = ((uintptr_t)reserve + SPAN_SIZE - 1) & SPAN_MASK;
+		address = mmap((void*)base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+		if (address == MAP_FAILED) {
+			munmap(reserve, reserve_size);
+			return -1;
+		}
+		size_t head = (size_t)(base - (uintptr_t)reserve);
+		if (head)
+			munmap(reserve, head);
+		if (reserve_size - head - size)
+			munmap(pointer_offset(address, size), reserve_size - head - size);
+		shared_region_t* region = address;
+		region->base = base;
+		region->size = size;
+		atomic_store_explicit(&region->lock, 0, memory_order_relaxed);
+		region->range_count = 1;
+		region->range[0].offset = SHARED_REGION_HEADER_SIZE;
+		region->range[0].size = size - SHARED_REGION_HEADER_SIZE;
+		atomic_thread_fence(memory_order_release);
+		region->magic = SHARED_REGION_MAGIC;
+	} else {
+		// Attach at the address the region was created at, failing if any part of the range is already mapped
+		shared_region_t header;
+		size_t header_size = offsetof(shared_region_t, lock);
+		if (pread(fd, &header, header_size, 0) != (ssize_t)header_size)
+			return -1;
+		if ((header.magic != SHARED_REGION_MAGIC) || (header.base & ~SPAN_MASK)) {
+			errno = EINVAL;
+			return -1;
+		}
+		int flags = MAP_SHARED;
+#if defined(MAP_FIXED_NOREPLACE)
+		flags |= MAP_FIXED_NOREPLACE;
+#endif
+		address = mmap((void*)header.base, header.size, PROT_READ | PROT_WRITE, flags, fd, 0);
+		if (address == MAP_FAILED)
+			return -1;
+		if (address != (void*)header.base) {
+			munmap(address, header.size);
+			errno = EEXIST;
+			return -1;
+		}
+	}
+	global_shared_region = address;
+	return 0;
+#else
+	(void)sizeof(fd);
+	(void)sizeof(size);
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void
+rpmalloc_shared_unmap(void) {
+#if OS_HAS_SHARED_MEMORY
+	shared_region_t* region = global_shared_region;
+	if (!region)
+		return;
+	global_shared_region = 0;
+	munmap(region, region->size);
+#endif
+}
+
+rpmalloc_interface_t*
+rpmalloc_shared_interface(void) {
+#if OS_HAS_SHARED_MEMORY
+	global_memory_interface_shared.memory_map = shared_mmap;
+	global_memory_interface_shared.memory_commit = shared_mcommit;
+	global_memory_interface_shared.memory_decommit = shared_mdecommit;
+	global_memory_interface_shared.memory_unmap = shared_munmap;
+	return &global_memory_interface_shared;
+#else
+	return 0;
+#endif
+}
+
+void
+rpmalloc_shared_free(void* ptr) {
+	if (!ptr)
+		return;
+	// The heap owning the block might be in another process where thread IDs mean nothing, always defer the free
+	// to the owning heap through the lock free thread free lists in the shared memory
+	block_t* block = ptr;
+	page_t* page = span_get_page_from_block(block_get_span(block), block);
+	if (page->page_type == PAGE_HUGE) {
+		// The owning heap releases huge blocks when processing the deferred frees of large pages
+		heap_put_thread_free_block(page->heap, PAGE_LARGE, block);
+		return;
+	}
+	if (page->has_aligned_block)
+		block = page_block_realign(page, block);
+	page_put_thread_free_block(page, block);
+}
+
 #if RPMALLOC_FIRST_CLASS_HEAPS
 
 rpmalloc_heap_t*
@@ -2203,7 +6452,17 @@ rpmalloc_heap_acquire(void) {
 	// could already be allocated from the heap which would (wrongly) be released when
 	// heap is cleared with rpmalloc_heap_free_all(). Also heaps guaranteed to be
 	// pristine from the dedicated orphan list can be used.
-	heap_t* heap = heap_allocate(1);
+	heap_t* heap = heap_allocate(1, os_numa_node_current());
+	rpmalloc_assume(heap != 0);
+	heap->owner_thread = 0;
+	return heap;
+}
+
+rpmalloc_heap_t*
+rpmalloc_heap_acquire_node(unsigned int numa_node) {
+	if (numa_node >= os_numa_node_count)
+		return rpmalloc_heap_acquire();
+	heap_t* heap = heap_allocate(1, numa_node);
 	rpmalloc_assume(heap != 0);
 	heap->owner_thread = 0;
 	return heap;
@@ -2211,8 +6470,20 @@ rpmalloc_heap_acquire(void) {
 
 void
 rpmalloc_heap_release(rpmalloc_heap_t* heap) {
-	if (heap)
+	if (heap) {
+		// Release the arena span kept by rpmalloc_heap_free_all, the heap can be reused as a thread heap
+		span_t* arena_span = heap->arena_span;
+		if (arena_span && !arena_span->next && (heap->arena_current == (uintptr_t)arena_span + SPAN_HEADER_SIZE))
+			heap_arena_reset(heap, 0, 1);
+		heap->memory_soft_limit = 0;
+		heap->memory_hard_limit = 0;
+		heap->memory_pressure = 0;
+		// Without huge blocks or arena spans to track the heap is reused as a regular thread heap, which can adopt
+		// pages from the global cache and from heaps released by threads
+		if (!heap->span_used[PAGE_HUGE] && !heap->arena_span)
+			heap->first_class = 0;
 		heap_release(heap);
+	}
 }
 
 RPMALLOC_ALLOCATOR void*
@@ -2226,6 +6497,17 @@ rpmalloc_heap_alloc(rpmalloc_heap_t* heap, size_t size) {
 	return heap_allocate_block(heap, size, 0);
 }
 
+size_t
+rpmalloc_heap_batch_alloc(rpmalloc_heap_t* heap, size_t size, size_t count, void** blocks) {
+#if ENABLE_VALIDATE_ARGS
+	if (size >= MAX_ALLOC_SIZE) {
+		errno = EINVAL;
+		return 0;
+	}
+#endif
+	return heap_allocate_block_batch(heap, size, count, blocks);
+}
+
 RPMALLOC_ALLOCATOR void*
 rpmalloc_heap_aligned_alloc(rpmalloc_heap_t* heap, size_t alignment, size_t size) {
 #if ENABLE_VALIDATE_ARGS
@@ -2237,6 +6519,32 @@ rpmalloc_heap_aligned_alloc(rpmalloc_heap_t* heap, size_t alignment, size_t size
 	return heap_allocate_block_aligned(heap, alignment, size, 0);
 }
 
+RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_arena_alloc(rpmalloc_heap_t* heap, size_t size) {
+#if ENABLE_VALIDATE_ARGS
+	if (size >= MAX_ALLOC_SIZE) {
+		errno = EINVAL;
+		return 0;
+	}
+#endif
+	return heap_arena_allocate(heap, size, SMALL_GRANULARITY);
+}
+
+RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_arena_aligned_alloc(rpmalloc_heap_t* heap, size_t alignment, size_t size) {
+#if ENABLE_VALIDATE_ARGS
+	if ((size >= MAX_ALLOC_SIZE) || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return 0;
+	}
+#endif
+	if (alignment >= RPMALLOC_MAX_ALIGNMENT) {
+		errno = EINVAL;
+		return 0;
+	}
+	return heap_arena_allocate(heap, size, (alignment > SMALL_GRANULARITY) ? alignment : SMALL_GRANULARITY);
+}
+
 RPMALLOC_ALLOCATOR void*
 rpmalloc_heap_calloc(rpmalloc_heap_t* heap, size_t num, size_t size) {
 	size_t total;
@@ -2314,7 +6622,36 @@ rpmalloc_heap_free(rpmalloc_heap_t* heap, void* ptr) {
 //! Free all memory allocated by the heap
 void
 rpmalloc_heap_free_all(rpmalloc_heap_t* heap) {
-	heap_free_all(heap);
+	heap_free_all(heap, 1);
+}
+
+extern void
+rpmalloc_heap_reset(rpmalloc_heap_t* heap, size_t retain_bytes) {
+	heap_reset(heap, retain_bytes);
+}
+
+void
+rpmalloc_heap_report(rpmalloc_heap_t* heap, rpmalloc_heap_report_t* report) {
+	heap_report_initialize(report);
+	heap_report_walk(heap, report);
+	heap_report_finalize(report);
+}
+
+size_t
+rpmalloc_heap_prepare(rpmalloc_heap_t* heap, size_t size, size_t count, unsigned int flags) {
+	return heap_prepare(heap, size, count, flags);
+}
+
+void
+rpmalloc_heap_set_memory_limit(rpmalloc_heap_t* heap, size_t soft_limit, size_t hard_limit) {
+	heap->memory_soft_limit = soft_limit;
+	heap->memory_hard_limit = hard_limit;
+	heap->memory_pressure = 0;
+}
+
+size_t
+rpmalloc_heap_memory_committed(rpmalloc_heap_t* heap) {
+	return heap->memory_committed;
 }
 
 extern inline void
@@ -2322,7 +6659,7 @@ rpmalloc_heap_thread_set_current(rpmalloc_heap_t* heap) {
 	heap_t* prev_heap = get_thread_heap();
 	if (prev_heap != heap) {
 		set_thread_heap(heap);
-		if (prev_heap)
+		if (prev_heap && (prev_heap != global_heap_default))
 			heap_release(prev_heap);
 	}
 }
@@ -65,6 +65,36 @@ extern "C" {
 //  in which case the original pointer is still valid (just like a call to realloc which failes to allocate
 //  a new block).
 #define RPMALLOC_GROW_OR_FAIL 2
+//! Flag to rpmalloc_thread_prepare and rpmalloc_heap_prepare to fault in the memory pages of the prepared blocks
+#define RPMALLOC_PREPARE_PREFAULT 1
+
+//! Maximum number of size classes in a custom size class table in rpmalloc_config_t
+#define RPMALLOC_SIZE_CLASS_COUNT_MAX 117
+
+//! Recommended mean number of bytes allocated between heap samples in rpmalloc_config_t
+#define RPMALLOC_SAMPLE_INTERVAL_DEFAULT (2 * 1024 * 1024)
+
+//! Transparent huge page policy in rpmalloc_config_t to keep the system default for spans of the page type
+#define RPMALLOC_THP_DEFAULT 0
+//! Transparent huge page policy in rpmalloc_config_t to advise the use of huge pages for spans of the page type
+#define RPMALLOC_THP_ENABLE 1
+//! Transparent huge page policy in rpmalloc_config_t to advise against huge pages for spans of the page type
+#define RPMALLOC_THP_DISABLE 2
+
+//! A heap took the slow path to find a page for a size class, size is the page size
+#define RPMALLOC_EVENT_PAGE_GET 1
+//! A heap mapped or reused a span for pages of the page type, size is the memory committed for the first page
+#define RPMALLOC_EVENT_SPAN_MAP 2
+//! A heap adopted the blocks of a page freed by other threads, size is the number of bytes adopted
+#define RPMALLOC_EVENT_THREAD_FREE_ADOPT 3
+//! A heap decommitted free pages of the page type, size is the number of bytes decommitted
+#define RPMALLOC_EVENT_PAGE_DECOMMIT 4
+//! A heap allocated a huge block, size is the memory committed for the block
+#define RPMALLOC_EVENT_HUGE_ALLOC 5
+//! A heap was acquired by a thread or as a first class heap
+#define RPMALLOC_EVENT_HEAP_ACQUIRE 6
+//! A heap was released for reuse
+#define RPMALLOC_EVENT_HEAP_RELEASE 7
 
 typedef struct rpmalloc_global_statistics_t {
 	//! Current amount of virtual memory mapped, all of which might not have been committed (only if
@@ -72,50 +102,61 @@ typedef struct rpmalloc_global_statistics_t {
 	size_t mapped;
 	//! Peak amount of virtual memory mapped, all of which might not have been committed (only if ENABLE_STATISTICS=1)
 	size_t mapped_peak;
-	//! Current amount of memory in global caches for small and medium sizes (<32KiB)
+	//! Current amount of memory committed (only if ENABLE_STATISTICS=1)
+	size_t committed;
+	//! Peak amount of memory committed (only if ENABLE_STATISTICS=1)
+	size_t committed_peak;
+	//! Current amount of memory in free pages and spans in the global cache, available to all heaps
 	size_t cached;
-	//! Current amount of memory allocated in huge allocations, i.e larger than LARGE_SIZE_LIMIT which is 2MiB by
+	//! Current amount of virtual memory mapped by spans queued for deferred release
+	size_t release_deferred;
+	//! Current amount of memory allocated in huge allocations, i.e larger than LARGE_SIZE_LIMIT which is 8MiB by
 	//! default (only if ENABLE_STATISTICS=1)
 	size_t huge_alloc;
-	//! Peak amount of memory allocated in huge allocations, i.e larger than LARGE_SIZE_LIMIT which is 2MiB by default
+	//! Peak amount of memory allocated in huge allocations, i.e larger than LARGE_SIZE_LIMIT which is 8MiB by default
 	//! (only if ENABLE_STATISTICS=1)
 	size_t huge_alloc_peak;
 	//! Total amount of memory mapped since initialization (only if ENABLE_STATISTICS=1)
 	size_t mapped_total;
 	//! Total amount of memory unmapped since initialization  (only if ENABLE_STATISTICS=1)
 	size_t unmapped_total;
+	//! Number of heaps created (only if ENABLE_STATISTICS=1)
+	size_t heap_count;
 } rpmalloc_global_statistics_t;
 
 typedef struct rpmalloc_thread_statistics_t {
-	//! Current number of bytes available in thread size class caches for small and medium sizes (<32KiB)
-	size_t sizecache;
-	//! Current number of bytes available in thread span caches for small and medium sizes (<32KiB)
-	size_t spancache;
-	//! Total number of bytes transitioned from thread cache to global cache (only if ENABLE_STATISTICS=1)
+	//! Current number of bytes in free but still committed pages in the thread heap
+	size_t pagecache;
+	//! Total number of bytes in free pages transitioned from thread heap to global cache (only if ENABLE_STATISTICS=1)
 	size_t thread_to_global;
-	//! Total number of bytes transitioned from global cache to thread cache (only if ENABLE_STATISTICS=1)
+	//! Total number of bytes in free pages transitioned from global cache to thread heap (only if ENABLE_STATISTICS=1)
 	size_t global_to_thread;
-	//! Per span count statistics (only if ENABLE_STATISTICS=1)
+	//! Per page type statistics for small, medium and large pages (only if ENABLE_STATISTICS=1)
 	struct {
-		//! Currently used number of spans
+		//! Currently used number of pages (available or full)
 		size_t current;
-		//! High water mark of spans used
+		//! High water mark of pages used
 		size_t peak;
-		//! Number of spans transitioned to global cache
+		//! Number of pages transitioned from available to full
+		size_t to_full;
+		//! Number of pages transitioned from full to available
+		size_t from_full;
+		//! Number of pages transitioned to free
+		size_t to_free;
+		//! Number of pages transitioned from free in the thread heap
+		size_t from_free;
+		//! Number of free pages transitioned to global cache
 		size_t to_global;
-		//! Number of spans transitioned from global cache
+		//! Number of free pages transitioned from global cache
 		size_t from_global;
-		//! Number of spans transitioned to thread cache
-		size_t to_cache;
-		//! Number of spans transitioned from thread cache
-		size_t from_cache;
-		//! Number of spans transitioned to reserved state
-		size_t to_reserved;
-		//! Number of spans transitioned from reserved state
-		size_t from_reserved;
-		//! Number of raw memory map calls (not hitting the reserve spans but resulting in actual OS mmap calls)
+		//! Number of spans transitioned from global cache
+		size_t spans_from_global;
+		//! Number of spans released, either to global cache or unmapped
+		size_t spans_released;
+		//! Number of raw memory map calls for new spans (not hitting the global cache but resulting in actual OS mmap
+		//! calls)
 		size_t map_calls;
-	} span_use[64];
+	} page_use[3];
 	//! Per size class statistics (only if ENABLE_STATISTICS=1)
 	struct {
 		//! Current number of allocations
@@ -124,19 +165,84 @@ typedef struct rpmalloc_thread_statistics_t {
 		size_t alloc_peak;
 		//! Total number of allocations
 		size_t alloc_total;
-		//! Total number of frees
+		//! Total number of frees, including frees by other threads
 		size_t free_total;
-		//! Number of spans transitioned to cache
-		size_t spans_to_cache;
-		//! Number of spans transitioned from cache
-		size_t spans_from_cache;
-		//! Number of spans transitioned from reserved state
-		size_t spans_from_reserved;
-		//! Number of raw memory map calls (not hitting the reserve spans but resulting in actual OS mmap calls)
-		size_t map_calls;
+		//! Total number of frees by other threads, adopted from deferred free lists
+		size_t free_thread_total;
+		//! Number of deferred free lists adopted from other threads
+		size_t thread_free_adopt;
 	} size_use[128];
+	//! Per requested size statistics, in buckets of 16 bytes up to 8KiB and eight buckets for each power of two above
+	//! up to 8MiB (only if ENABLE_STATISTICS=1)
+	struct {
+		//! Total number of allocations with a requested size in the bucket
+		size_t alloc_total;
+		//! Largest requested size in the bucket
+		size_t size_max;
+	} size_request[593];
 } rpmalloc_thread_statistics_t;
 
+typedef struct rpmalloc_heap_report_t {
+	//! Number of heaps in the report
+	size_t heap_count;
+	//! Number of heaps in the report owned by other threads, which cannot be walked safely while in use. Only the
+	//! used page and block counts (only if ENABLE_STATISTICS=1) and the free committed page count are reported
+	size_t heap_estimated_count;
+	//! Number of huge blocks in first class heaps
+	size_t huge_count;
+	//! Memory committed for huge blocks in first class heaps
+	size_t huge_bytes;
+	//! Memory committed for arena allocations in first class heaps
+	size_t arena_bytes;
+	//! Fraction of the memory committed for used and free pages not holding allocated blocks
+	double fragmentation;
+	//! Per page type report for small, medium and large pages
+	struct {
+		//! Size of the pages
+		size_t page_size;
+		//! Number of spans mapped by the heaps, pages in the spans might be used by other heaps
+		size_t span_count;
+		//! Number of pages holding blocks
+		size_t page_used;
+		//! Number of free pages still committed
+		size_t page_free_committed;
+		//! Number of free pages decommitted
+		size_t page_free_decommitted;
+	} page_type[3];
+	//! Number of size classes in the report
+	size_t size_class_count;
+	//! Per size class report
+	struct {
+		//! Size of the blocks
+		size_t block_size;
+		//! Number of pages holding blocks
+		size_t page_count;
+		//! Number of allocated blocks
+		size_t block_used;
+		//! Number of free blocks ready for allocation, including blocks freed by other threads
+		size_t block_free;
+		//! Number of blocks freed by other threads which are not yet returned to the free lists
+		size_t block_thread_free;
+		//! Number of blocks in the pages never used
+		size_t block_uninitialized;
+	} size_class[RPMALLOC_SIZE_CLASS_COUNT_MAX];
+} rpmalloc_heap_report_t;
+
+typedef struct rpmalloc_event_t {
+	//! Event type, one of the RPMALLOC_EVENT_* values
+	unsigned int type;
+	//! ID of the heap
+	unsigned int heap_id;
+	//! Size class, zero if not applicable
+	unsigned int size_class;
+	//! Page type, 0 for small, 1 for medium and 2 for large pages and 3 for huge blocks
+	unsigned int page_type;
+	//! Number of bytes, see the event types
+	size_t size;
+	//! Monotonic time stamp in milliseconds, wrapping around at 32 bits
+	unsigned int time;
+} rpmalloc_event_t;
+
 typedef struct rpmalloc_interface_t {
 	//! Map memory pages for the given number of bytes. The returned address MUST be aligned to the given alignment,
 	//! which will always be either 0 or the span size. The function can store an alignment offset in the offset
@@ -160,6 +266,13 @@ typedef struct rpmalloc_interface_t {
 	//! be retried. The argument passed is the number of bytes that was requested in the map call. Only used if the
 	//! default system memory map function is used (memory_map callback is not set).
 	int (*map_fail_callback)(size_t size);
+	//! Called when committed memory exceeds the soft limit given by committed_soft_limit in the configuration, with a
+	//! null heap, or the soft limit of a first class heap set by rpmalloc_heap_set_memory_limit, with the heap. The
+	//! free pages cached by the calling heap and the huge block cache are released before the call, other heaps
+	//! release their free pages on their next page free. Called once each time the limit is crossed, with the
+	//! committed memory including the request that crossed the limit. The callback must not allocate or free memory
+	//! with this allocator. Only used if the default system memory map function is used.
+	void (*memory_pressure_callback)(void* heap, size_t committed, size_t limit);
 	//! Called when an assert fails, if asserts are enabled. Will use the standard assert() if this is not set.
 	void (*error_callback)(const char* message);
 } rpmalloc_interface_t;
@@ -188,6 +301,93 @@ typedef struct rpmalloc_config_t {
 	//  when process exits, but if using rpmalloc in a dynamic library you might want to unmap
 	//  all pages when the dynamic library unloads to avoid process memory leaks and bloat.
 	int unmap_on_finalize;
+	//! Number of free pages of each page type (small, medium and large) to keep committed in the
+	//  calling thread heap when calling rpmalloc_thread_collect. Remaining free pages are decommitted
+	//  and made available to other threads. Set to 0 to release all free pages.
+	unsigned int collect_page_retain[3];
+	//! Enable NUMA awareness if set to non-zero. Thread heaps are then reused from per node queues based on the
+	//  node the thread is running on when assigned a heap, and memory for a heap is mapped with a preference for
+	//  the node of the heap. Memory is only bound to nodes when using the default memory interface. Reset to zero
+	//  during initialization if the system has a single NUMA node or the platform lacks support.
+	int enable_numa;
+	//! Size of the address space initially reserved for each span of memory pages, rounded up to a multiple of 64KiB
+	//  and to at least the page size of the span page type. The reservation is extended in place as pages in the
+	//  span are used, up to the full span size of 256MiB, and if the address range following the span is already in
+	//  use the span is limited to the pages reserved so far. Set to 0 to reserve full spans up front. Only supported
+	//  with the default memory interface on POSIX systems without huge pages, otherwise reset to 0.
+	size_t span_reserve_size;
+	//! Time in milliseconds a free page of each page type (small, medium and large) is kept committed in the heap
+	//  free page list before being decommitted and made available to other threads. Decayed pages are purged when
+	//  pages are freed and when calling rpmalloc_thread_collect. Set to 0 to only decommit free pages when the free
+	//  page list overflows.
+	unsigned int page_decay_time[3];
+	//! Decommit pages lazily if set to non-zero (MADV_FREE on Linux and BSD). The OS reclaims the physical memory
+	//  only under memory pressure, making recommits cheaper but memory usage measured by RSS less accurate. Only
+	//  applies to the default memory interface, ignored if the platform lacks support for lazy decommit.
+	int decommit_lazy;
+	//! Buffer blocks freed by a thread to pages owned by other threads if set to non-zero, pushing the blocks to
+	//  the owning page in chains of up to 64 blocks rather than one at a time to reduce contention on the page
+	//  deferred free list in producer-consumer scenarios. Buffered blocks are flushed when the freeing thread
+	//  calls rpmalloc_thread_collect or rpmalloc_thread_finalize, until then the memory is not reusable.
+	int enable_remote_free_buffer;
+	//! Share heaps between threads based on the processor the calling thread is running on if set to non-zero,
+	//  rather than binding a heap to each thread. Heap count and cached memory then scale with the number of
+	//  processors instead of the number of threads. A processor heap is locked for the duration of each allocation,
+	//  if already locked by a preempted or migrated thread the heap of another processor is used. Frees are lock
+	//  free and always take the deferred free path. Thread specific heap calls like rpmalloc_thread_finalize and
+	//  rpmalloc_heap_thread_set_current have no effect on allocations in this mode.
+	int enable_per_cpu_heaps;
+	//! Transparent huge page policy for spans of each page type (small, medium and large), one of RPMALLOC_THP_DEFAULT,
+	//  RPMALLOC_THP_ENABLE or RPMALLOC_THP_DISABLE. Spans are advised with MADV_HUGEPAGE or MADV_NOHUGEPAGE when taken
+	//  into use for the page type. Decommitting free pages in spans using huge pages only releases whole huge pages,
+	//  keeping the huge page holding the page header committed, to avoid splitting huge pages. Only supported on
+	//  Linux with the default memory interface, otherwise reset to RPMALLOC_THP_DEFAULT, and also reset if huge
+	//  pages or disable_thp are enabled.
+	int page_thp_policy[3];
+	//! Custom size classes, given as block sizes in ascending order. Block sizes are rounded up to the end of their
+	//  size lookup bucket, a multiple of 16 bytes up to 8KiB and of an eighth of the power of two above, so sizes in
+	//  the same bucket are merged. Sizes not larger than the previous size or larger than 8MiB are skipped, and the
+	//  table always ends with a size class of 8MiB which is appended if missing. At most RPMALLOC_SIZE_CLASS_COUNT_MAX
+	//  size classes are used. Blocks up to 4KiB use small pages, blocks up to 256KiB medium pages and larger blocks
+	//  large pages. A table can be derived from the statistics of a real run with rpmalloc_size_class_recommend. Set to
+	//  null to use the default size classes. If the size classes change on a later initialization all threads must have
+	//  been finalized and all first class heaps released, and heaps released before the change are not reused. Blocks
+	//  allocated before the change must be freed with rpfree. After initialization the table points to the size classes
+	//  in use, or null if the default size classes are used.
+	const unsigned int* size_class_table;
+	//! Number of block sizes in the custom size class table
+	unsigned int size_class_count;
+	//! Mean number of bytes allocated between heap samples, if the library is built with ENABLE_SAMPLING=1. Sampled
+	//  blocks are recorded together with the calling stack until freed, and the live samples are written in pprof
+	//  compatible format by rpmalloc_dump_samples. Sampled blocks are kept in a heap of their own, so frees of other
+	//  blocks are unaffected. Allocations from first class heaps and batch allocations are not sampled. Set to 0 to
+	//  disable sampling, RPMALLOC_SAMPLE_INTERVAL_DEFAULT is a rate that keeps the overhead well below one percent.
+	//  Reset to 0 if sampling is not built in.
+	size_t sample_interval;
+	//! Hard limit of address space mapped by the allocator in bytes. Mapping beyond the limit fails as if the system
+	//  was out of memory, calling map_fail_callback in the memory interface if set. Set to 0 for no limit. Only used
+	//  if the default system memory map function is used.
+	size_t mapped_limit;
+	//! Hard limit of memory committed by the allocator in bytes. An allocation needing to commit more memory first
+	//  releases the free pages cached by the calling heap and the huge block cache, and returns a null pointer if
+	//  still above the limit. Concurrent allocations might overshoot the limit by the memory of a page each. Set to
+	//  0 for no limit. Only used if the default system memory map function is used.
+	size_t committed_limit;
+	//! Soft limit of memory committed by the allocator in bytes. Exceeding the limit makes all heaps decommit their
+	//  cached free pages, releases the huge block cache and calls memory_pressure_callback in the memory interface.
+	//  Set to 0 for no limit. Only used if the default system memory map function is used.
+	size_t committed_soft_limit;
+	//! Maximum mapped size in bytes of the spans queued for deferred release. Huge blocks and spans which would be
+	//  unmapped when freed, including spans evicted from the huge block cache, are instead queued and unmapped when
+	//  any thread calls rpmalloc_thread_collect, or by the release thread if enabled, taking the unmap and the TLB
+	//  shootdown off the freeing thread. Spans are unmapped right away while the queue is full, and the queue is
+	//  drained when a memory limit is exceeded and on finalization. Queued memory is still counted as mapped and
+	//  committed. Set to 0 to unmap spans when freed.
+	size_t release_defer_limit;
+	//! Start a background thread unmapping spans as they are queued for deferred release if set to non-zero and
+	//  release_defer_limit is non-zero. The thread is stopped by rpmalloc_finalize. Only supported on POSIX systems,
+	//  otherwise reset to 0.
+	int enable_release_thread;
 #if defined(__linux__) || defined(__ANDROID__)
 	///! Allows to disable the Transparent Huge Page feature on Linux on a process basis,
 	///  rather than enabling/disabling system-wise (done via /sys/kernel/mm/transparent_hugepage/enabled).
@@ -209,6 +409,10 @@ rpmalloc_initialize_config(rpmalloc_interface_t* memory_interface, rpmalloc_conf
 RPMALLOC_EXPORT const rpmalloc_config_t*
 rpmalloc_config(void);
 
+//! Get the number of NUMA nodes used by the allocator, which is one unless NUMA awareness is enabled
+RPMALLOC_EXPORT unsigned int
+rpmalloc_numa_node_count(void);
+
 //! Finalize allocator
 RPMALLOC_EXPORT void
 rpmalloc_finalize(void);
@@ -221,10 +425,21 @@ rpmalloc_thread_initialize(void);
 RPMALLOC_EXPORT void
 rpmalloc_thread_finalize(void);
 
-//! Perform deferred deallocations pending for the calling thread heap
+//! Perform deferred deallocations pending for the calling thread heap, release spans where all
+//  pages are free and decommit free pages down to the configured retain count (see collect_page_retain).
+//  The pages of heaps released by threads that have finalized are adopted by the calling thread heap first,
+//  and spans queued for deferred release are unmapped last (see release_defer_limit)
 RPMALLOC_EXPORT void
 rpmalloc_thread_collect(void);
 
+//! Prepare the calling thread heap for allocating the given number of blocks of the given size without taking the
+//  slow path, for threads sensitive to latency from the start. Memory pages are mapped and committed and the blocks
+//  linked in free lists up front, and with the RPMALLOC_PREPARE_PREFAULT flag the memory pages of the blocks are
+//  also faulted in. Call once for each block size needed. Huge blocks are mapped individually and cannot be
+//  prepared. Returns the number of free blocks available for the size, less than requested if out of memory
+RPMALLOC_EXPORT size_t
+rpmalloc_thread_prepare(size_t size, size_t count, unsigned int flags);
+
 //! Query if allocator is initialized for calling thread
 RPMALLOC_EXPORT int
 rpmalloc_is_thread_initialized(void);
@@ -241,6 +456,43 @@ rpmalloc_global_statistics(rpmalloc_global_statistics_t* stats);
 RPMALLOC_EXPORT void
 rpmalloc_dump_statistics(void* file);
 
+//! Report how the memory of the calling thread heap is used, by walking the spans and pages of the heap
+RPMALLOC_EXPORT void
+rpmalloc_thread_report(rpmalloc_heap_report_t* report);
+
+//! Report how the memory of all heaps is used. The calling thread heap and, in per processor heap mode, the per
+//  processor heaps are walked, locking each per processor heap briefly. Other heaps are reported from counters
+//  without locking, so the report can be taken while other threads keep allocating
+RPMALLOC_EXPORT void
+rpmalloc_global_report(rpmalloc_heap_report_t* report);
+
+//! Write a heap report as JSON to file (should be a FILE*), leaving out empty size classes
+RPMALLOC_EXPORT void
+rpmalloc_dump_report(void* file, const rpmalloc_heap_report_t* report);
+
+//! Get the most recent slow path events of the calling thread heap (only recorded if ENABLE_EVENT_LOG=1), oldest
+//  first. Stores at most the given number of events in the given array and returns the number of events stored
+RPMALLOC_EXPORT size_t
+rpmalloc_thread_events(rpmalloc_event_t* events, size_t capacity);
+
+//! Get the memory currently mapped and committed by the default system memory map functions in bytes, as tracked
+//  for the memory limits in rpmalloc_config_t. Either pointer can be null
+RPMALLOC_EXPORT void
+rpmalloc_memory_usage(size_t* mapped, size_t* committed);
+
+//! Write the live heap samples (only recorded if ENABLE_SAMPLING=1) to file (should be a FILE*) as a legacy heap
+//  profile readable by pprof, scaled to estimated totals by the sample interval. On Linux the mapped libraries are
+//  included for symbolization
+RPMALLOC_EXPORT void
+rpmalloc_dump_samples(void* file);
+
+//! Derive a custom size class table from the requested sizes in the given statistics (only recorded if
+//  ENABLE_STATISTICS=1), to use as size_class_table in rpmalloc_config_t. The limit of each size request bucket with
+//  requests is added to the default size classes, then size classes wasting the least memory are merged until
+//  the table fits the given capacity. Stores the block sizes in the given array and returns the number of sizes stored
+RPMALLOC_EXPORT size_t
+rpmalloc_size_class_recommend(const rpmalloc_thread_statistics_t* stats, unsigned int* size_class, size_t capacity);
+
 //! Allocate a memory block of at least the given size
 RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
 rpmalloc(size_t size) RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(1);
@@ -305,6 +557,26 @@ rpposix_memalign(void** memptr, size_t alignment, size_t size);
 RPMALLOC_EXPORT void
 rpfree(void* ptr);
 
+//! Free the given memory block, given the size that was requested when the block was allocated. The block must not
+//  have been reallocated. Avoids looking up the page of the block through the span header
+RPMALLOC_EXPORT void
+rpfree_sized(void* ptr, size_t size);
+
+//! Free the given memory block, given the alignment and size that were requested when the block was allocated with
+//  one of the aligned allocation functions. The block must not have been reallocated
+RPMALLOC_EXPORT void
+rpfree_aligned_sized(void* ptr, size_t alignment, size_t size);
+
+//! Allocate a batch of memory blocks of at least the given size, storing the block pointers in the given
+//  array. Returns the number of blocks allocated, which is less than the requested count only if out of memory
+RPMALLOC_EXPORT size_t
+rpmalloc_batch_alloc(size_t size, size_t count, void** blocks);
+
+//! Free a batch of memory blocks. Null pointers in the array are ignored. Consecutive blocks from the same
+//  memory page are freed together, so arrays grouped by allocation order or size free faster
+RPMALLOC_EXPORT void
+rpfree_batch(void** blocks, size_t count);
+
 //! Query the usable size of the given memory block (from given pointer to the end of block)
 RPMALLOC_EXPORT size_t
 rpmalloc_usable_size(void* ptr);
@@ -313,6 +585,33 @@ rpmalloc_usable_size(void* ptr);
 RPMALLOC_EXPORT void
 rpmalloc_linker_reference(void);
 
+//! Map a shared memory region from the given file descriptor, such as a memfd, a file in a hugetlbfs mount or a
+//  POSIX shared memory object, for use with the memory interface returned by rpmalloc_shared_interface. With a
+//  non-zero size the file is resized and the region is created at a span aligned address, with a zero size an
+//  existing region is attached at the same address in the calling process. The region is carved into spans of
+//  256MiB, so the size should be several spans. The file descriptor can be closed once mapped. Only one region can
+//  be mapped per process. Returns 0 on success, -1 with errno set on failure (ENOSYS if not supported)
+RPMALLOC_EXPORT int
+rpmalloc_shared_map(int fd, size_t size);
+
+//! Unmap the shared memory region mapped by rpmalloc_shared_map, after finalizing the allocator if it was
+//  initialized with the shared memory interface
+RPMALLOC_EXPORT void
+rpmalloc_shared_unmap(void);
+
+//! Get the memory interface mapping memory from the shared memory region, to pass to rpmalloc_initialize. All
+//  heaps, spans and blocks are then placed in the region, readable by all processes attaching it. Heaps and free
+//  memory mapped by another memory interface in a previous initialization are not reused. Returns a null pointer if
+//  not supported
+RPMALLOC_EXPORT rpmalloc_interface_t*
+rpmalloc_shared_interface(void);
+
+//! Free a block allocated from the shared memory region, from any process attaching the region. The block is
+//  deferred to the heap owning it, in the same way as a block freed by another thread, and is reused once the
+//  owning heap collects its deferred frees. The calling process does not need to initialize the allocator
+RPMALLOC_EXPORT void
+rpmalloc_shared_free(void* ptr);
+
 #if RPMALLOC_FIRST_CLASS_HEAPS
 
 //! Heap type
@@ -324,6 +623,11 @@ typedef struct heap_t rpmalloc_heap_t;
 RPMALLOC_EXPORT rpmalloc_heap_t*
 rpmalloc_heap_acquire(void);
 
+//! Acquire a new heap bound to the given NUMA node, mapping memory with a preference for that node. If the node
+//  is not less than the node count given by rpmalloc_numa_node_count this is equivalent to rpmalloc_heap_acquire
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_heap_acquire_node(unsigned int numa_node);
+
 //! Release a heap (does NOT free the memory allocated by the heap, use rpmalloc_heap_free_all before destroying the
 //! heap).
 //  Releasing a heap will enable it to be reused by other threads. Safe to pass a null pointer.
@@ -370,15 +674,63 @@ RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
 rpmalloc_heap_aligned_realloc(rpmalloc_heap_t* heap, void* ptr, size_t alignment, size_t size,
                               unsigned int flags) RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(4);
 
+//! Allocate a batch of memory blocks of at least the given size using the given heap, storing the block
+//  pointers in the given array. Returns the number of blocks allocated
+RPMALLOC_EXPORT size_t
+rpmalloc_heap_batch_alloc(rpmalloc_heap_t* heap, size_t size, size_t count, void** blocks);
+
 //! Free the given memory block from the given heap. The memory block MUST be allocated
 //  by the same heap given to this function.
 RPMALLOC_EXPORT void
 rpmalloc_heap_free(rpmalloc_heap_t* heap, void* ptr);
 
-//! Free all memory allocated by the heap
+//! Free all memory allocated by the heap, including arena blocks. The current arena span of the heap and its
+//  committed memory is kept for subsequent arena allocations.
 RPMALLOC_EXPORT void
 rpmalloc_heap_free_all(rpmalloc_heap_t* heap);
 
+//! Free all memory allocated by the heap like rpmalloc_heap_free_all, but keep spans of memory pages mapped with up
+//  to the given number of bytes committed for reuse by the heap. All pages of the kept spans are put in the heap
+//  free lists, pages beyond the number of bytes to retain are decommitted, and the remaining spans and all huge
+//  blocks are released. The current arena span is kept if its committed memory fits in the remaining bytes to
+//  retain. Resetting a heap used for a repeated task with the peak memory of the task as the number of bytes to
+//  retain reaches a steady state without mapping, committing or unmapping memory.
+RPMALLOC_EXPORT void
+rpmalloc_heap_reset(rpmalloc_heap_t* heap, size_t retain_bytes);
+
+//! Allocate a memory block of at least the given size from the arena of the given heap, by bumping a pointer through
+//  committed memory. Arena blocks have no block header and MUST NOT be passed to free, realloc or usable size
+//  functions, all arena blocks are released at once by rpmalloc_heap_free_all.
+RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_arena_alloc(rpmalloc_heap_t* heap, size_t size) RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(2);
+
+//! Allocate a memory block of at least the given size and with the requested alignment from the arena of the given
+//  heap. Alignment must either be zero, or a power of two less than RPMALLOC_MAX_ALIGNMENT. Arena blocks MUST NOT be
+//  passed to free, realloc or usable size functions.
+RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_arena_aligned_alloc(rpmalloc_heap_t* heap, size_t alignment, size_t size) RPMALLOC_ATTRIB_MALLOC
+    RPMALLOC_ATTRIB_ALLOC_SIZE(3);
+
+//! Report how the memory of the given heap is used, see rpmalloc_thread_report
+RPMALLOC_EXPORT void
+rpmalloc_heap_report(rpmalloc_heap_t* heap, rpmalloc_heap_report_t* report);
+
+//! Prepare the given heap for allocating the given number of blocks of the given size without taking the slow path,
+//  see rpmalloc_thread_prepare
+RPMALLOC_EXPORT size_t
+rpmalloc_heap_prepare(rpmalloc_heap_t* heap, size_t size, size_t count, unsigned int flags);
+
+//! Set limits of the memory committed for pages, huge blocks and arenas of the given heap, in bytes, or 0 for no
+//  limit. Exceeding the soft limit decommits the free pages of the heap and calls memory_pressure_callback in the
+//  memory interface with the heap. Allocations from the heap needing to commit memory beyond the hard limit return
+//  a null pointer. The limits are cleared when the heap is released
+RPMALLOC_EXPORT void
+rpmalloc_heap_set_memory_limit(rpmalloc_heap_t* heap, size_t soft_limit, size_t hard_limit);
+
+//! Get the memory committed for pages, huge blocks and arenas of the given heap in bytes
+RPMALLOC_EXPORT size_t
+rpmalloc_heap_memory_committed(rpmalloc_heap_t* heap);
+
 //! Set the given heap as the current heap for the calling thread. A heap MUST only be current heap
 //  for a single thread, a heap can never be shared between multiple threads. The previous
 //  current heap for the calling thread is released to be reused by other threads.
@@ -0,0 +1,116 @@
+/* rpmalloc_inline.h  -  Memory allocator  -  Public Domain  -  2016-2024 Mattias Jansson
+ *
+ * This library provides a cross-platform lock free thread caching malloc
+ * implementation in C11. The latest source code is always available at
+ *
+ * https://github.com/mjansson/rpmalloc
+ *
+ * This library is put in the public domain; you can redistribute it and/or
+ * modify it without any restrictions.
+ *
+ */
+
+#pragma once
+
+#include "rpmalloc.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Inline fast path for small allocations, taking blocks from and returning blocks to the free lists of the calling
+//  thread heap without a call into the library. Needs thread local variables exported from the library and a little
+//  endian target, elsewhere the inline functions are plain calls to rpmalloc and rpfree_sized
+#if (defined(__clang__) || defined(__GNUC__)) && !defined(_WIN32) && defined(__BYTE_ORDER__) && \
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define RPMALLOC_INLINE_FAST_PATH 1
+#else
+#define RPMALLOC_INLINE_FAST_PATH 0
+#endif
+
+//! Largest size served by the inline fast path, larger sizes call rpmalloc and rpfree_sized
+#define RPMALLOC_INLINE_SIZE_LIMIT 1024
+//! Size class of the given size up to the inline size limit, with the default size classes
+#define RPMALLOC_INLINE_SIZE_CLASS(size) (((size_t)(size) + 15) >> 4)
+//! Size and alignment of the pages holding blocks up to the inline size limit
+#define RPMALLOC_INLINE_PAGE_SIZE (64 * 1024)
+//! Page flag set if a free must take the generic path, for full pages and pages with aligned blocks
+#define RPMALLOC_INLINE_PAGE_GENERIC_FREE (1U << 7)
+
+#if RPMALLOC_INLINE_FAST_PATH
+
+//! Thread local state of the inline fast path
+typedef struct rpmalloc_inline_state_t {
+	//! Heap of the calling thread, null if the inline fast path is disabled
+	void* heap;
+	//! Heap local free lists of the calling thread heap indexed by size class, null if inline allocation is disabled
+	void** free_list;
+} rpmalloc_inline_state_t;
+
+//! Leading fields of the page header, checked against the page header layout when the library is built
+typedef struct rpmalloc_inline_page_t {
+	unsigned int size_class;
+	unsigned int block_size;
+	unsigned int block_count;
+	unsigned int block_initialized;
+	unsigned int block_used;
+	unsigned int page_type;
+	unsigned int flags;
+	unsigned int local_free_count;
+	void* local_free;
+	void* heap;
+} rpmalloc_inline_page_t;
+
+//! Inline fast path state of the calling thread, maintained by the library. The fast path is disabled in threads
+//  without a thread heap, in per processor heap mode, with a custom size class table, and if built with
+//  ENABLE_STATISTICS=1. Inline allocation is also disabled while heap sampling is enabled
+extern RPMALLOC_EXPORT __thread rpmalloc_inline_state_t rpmalloc_inline_state;
+
+#endif
+
+//! Allocate a memory block of at least the given size, inline for small sizes known at compile time
+static inline RPMALLOC_ALLOCATOR void*
+rpmalloc_inline(size_t size) {
+#if RPMALLOC_INLINE_FAST_PATH
+	if (size <= RPMALLOC_INLINE_SIZE_LIMIT) {
+		void** free_list = rpmalloc_inline_state.free_list;
+		if (free_list) {
+			free_list += RPMALLOC_INLINE_SIZE_CLASS(size);
+			void* block = *free_list;
+			if (block) {
+				*free_list = *(void**)block;
+				return block;
+			}
+		}
+	}
+#endif
+	return rpmalloc(size);
+}
+
+//! Free a memory block allocated with the given size, inline for small sizes known at compile time if the block is
+//  owned by the calling thread heap. Same requirements as rpfree_sized
+static inline void
+rpfree_inline(void* ptr, size_t size) {
+#if RPMALLOC_INLINE_FAST_PATH
+	void* heap = rpmalloc_inline_state.heap;
+	if ((size <= RPMALLOC_INLINE_SIZE_LIMIT) && ptr && heap) {
+		rpmalloc_inline_page_t* page =
+		    (rpmalloc_inline_page_t*)((uintptr_t)ptr & ~(uintptr_t)(RPMALLOC_INLINE_PAGE_SIZE - 1));
+		// The last used block of a page moves the page to the free list, which takes the call
+		if ((page->heap == heap) && !(page->flags & RPMALLOC_INLINE_PAGE_GENERIC_FREE) && (page->block_used > 1)) {
+			*(void**)ptr = page->local_free;
+			page->local_free = ptr;
+			++page->local_free_count;
+			--page->block_used;
+			return;
+		}
+	}
+#endif
+	rpfree_sized(ptr, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
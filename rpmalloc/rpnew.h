@@ -44,14 +44,12 @@ operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
 
 extern void __CRTDECL
 operator delete(void* p, std::size_t size) noexcept {
-	(void)sizeof(size);
-	rpfree(p);
+	rpfree_sized(p, size);
 }
 
 extern void __CRTDECL
 operator delete[](void* p, std::size_t size) noexcept {
-	(void)sizeof(size);
-	rpfree(p);
+	rpfree_sized(p, size);
 }
 
 #endif
@@ -72,16 +70,12 @@ operator delete[](void* p, std::align_val_t align) noexcept {
 
 extern void __CRTDECL
 operator delete(void* p, std::size_t size, std::align_val_t align) noexcept {
-	(void)sizeof(size);
-	(void)sizeof(align);
-	rpfree(p);
+	rpfree_aligned_sized(p, static_cast<size_t>(align), size);
 }
 
 extern void __CRTDECL
 operator delete[](void* p, std::size_t size, std::align_val_t align) noexcept {
-	(void)sizeof(size);
-	(void)sizeof(align);
-	rpfree(p);
+	rpfree_aligned_sized(p, static_cast<size_t>(align), size);
 }
 
 extern void* __CRTDECL
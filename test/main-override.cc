@@ -13,6 +13,7 @@
 #ifdef _WIN32
 #include <rpnew.h>
 #endif
+#include <rpallocator.h>
 
 extern "C" {
 #include "test.h"
@@ -25,6 +26,10 @@ extern "C" {
 #include <memory.h>
 #include <inttypes.h>
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #if defined(_WIN32)
 extern "C" void*
 rpvalloc(size_t size);
@@ -56,6 +61,9 @@ test_free(int print_log);
 extern "C" int
 test_malloc_thread(void);
 
+extern "C" int
+test_allocator(void);
+
 int
 test_malloc(int print_log) {
 	const rpmalloc_config_t* config = rpmalloc_config();
@@ -176,3 +184,120 @@ test_malloc_thread(void) {
 	printf("Memory override thread tests passed\n");
 	return 0;
 }
+
+struct pool_object {
+	explicit pool_object(int init) : value(init) {
+	}
+	int value;
+	char payload[52];
+};
+
+struct alignas(128) aligned_object {
+	char payload[128];
+};
+
+int
+test_allocator(void) {
+	rpmalloc_initialize(0);
+
+	std::vector<int, rp::allocator<int>> thread_vector;
+	for (int i = 0; i < 10000; ++i)
+		thread_vector.push_back(i);
+	for (int i = 0; i < 10000; ++i) {
+		if (thread_vector[static_cast<size_t>(i)] != i)
+			return test_fail("Bad vector content with thread heap allocator");
+	}
+
+	// A container bound to a first class heap is dropped with the heap, without running destructors
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, rp::allocator<std::pair<const int, int>>>
+	    map_type;
+	void* map_memory = rpmalloc_heap_alloc(heap, sizeof(map_type));
+	map_type* map = new (map_memory) map_type(16, std::hash<int>(), std::equal_to<int>(),
+	                                          rp::allocator<std::pair<const int, int>>(heap));
+	for (int i = 0; i < 10000; ++i)
+		(*map)[i] = i * 3;
+	for (int i = 0; i < 10000; ++i) {
+		auto it = map->find(i);
+		if ((it == map->end()) || (it->second != i * 3))
+			return test_fail("Bad map content with heap allocator");
+		if (rpmalloc_get_heap_for_ptr(&*it) != heap)
+			return test_fail("Map node not allocated from heap");
+	}
+	if (map->get_allocator() != rp::allocator<int>(heap))
+		return test_fail("Rebound allocator not bound to heap");
+
+	std::vector<aligned_object, rp::allocator<aligned_object>> aligned_vector{rp::allocator<aligned_object>(heap)};
+	aligned_vector.resize(100);
+	if ((reinterpret_cast<uintptr_t>(aligned_vector.data()) & (alignof(aligned_object) - 1)) ||
+	    (rpmalloc_get_heap_for_ptr(aligned_vector.data()) != heap))
+		return test_fail("Bad over-aligned allocation with heap allocator");
+	aligned_vector.clear();
+	aligned_vector.shrink_to_fit();
+
+	rp::object_pool<pool_object, 16> pool(heap);
+	if (rp::object_pool<pool_object, 16>::block_size != 64)
+		return test_fail("Bad object pool block size");
+	pool_object* object[100];
+	for (int i = 0; i < 100; ++i) {
+		object[i] = pool.create(i);
+		if (!object[i] || (object[i]->value != i) || (reinterpret_cast<uintptr_t>(object[i]) & 15) ||
+		    (rpmalloc_get_heap_for_ptr(object[i]) != heap))
+			return test_fail("Bad object pool allocation");
+		memset(object[i]->payload, i, sizeof(object[i]->payload));
+	}
+	for (int i = 0; i < 100; ++i) {
+		if (object[i]->value != i)
+			return test_fail("Object pool object corrupted");
+		for (size_t ibyte = 0; ibyte < sizeof(object[i]->payload); ++ibyte) {
+			if (object[i]->payload[ibyte] != static_cast<char>(i))
+				return test_fail("Object pool object corrupted");
+		}
+	}
+	for (int i = 0; i < 100; ++i)
+		pool.destroy(object[i]);
+	pool_object* reused = pool.create(1);
+	if (reused != object[99])
+		return test_fail("Object pool did not reuse block");
+	pool.destroy(reused);
+	pool.release();
+
+#if RPMALLOC_HAS_MEMORY_RESOURCE
+	{
+		rp::memory_resource resource(heap);
+		std::pmr::vector<std::pmr::string> strings(&resource);
+		for (int i = 0; i < 1000; ++i)
+			strings.emplace_back(static_cast<size_t>(64 + i), static_cast<char>('a' + (i % 26)));
+		for (int i = 0; i < 1000; ++i) {
+			if ((strings[static_cast<size_t>(i)].size() != static_cast<size_t>(64 + i)) ||
+			    (rpmalloc_get_heap_for_ptr(const_cast<char*>(strings[static_cast<size_t>(i)].data())) != heap))
+				return test_fail("Bad string allocated from heap memory resource");
+		}
+		void* aligned = resource.allocate(1000, 4096);
+		if (!aligned || (reinterpret_cast<uintptr_t>(aligned) & 4095))
+			return test_fail("Bad aligned allocation from heap memory resource");
+		resource.deallocate(aligned, 1000, 4096);
+		if (!rp::thread_resource()->is_equal(*rp::thread_resource()) || resource.is_equal(*rp::thread_resource()))
+			return test_fail("Bad memory resource equality");
+		std::pmr::vector<int> thread_ints(1000, 7, rp::thread_resource());
+		if (thread_ints[999] != 7)
+			return test_fail("Bad vector content with thread memory resource");
+	}
+#endif
+
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_report_t report;
+	rpmalloc_heap_report(heap, &report);
+	for (size_t iclass = 0; iclass < report.size_class_count; ++iclass) {
+		if (report.size_class[iclass].block_used)
+			return test_fail("Blocks left in heap after free all");
+	}
+	rpmalloc_heap_release(heap);
+
+	thread_vector.clear();
+	thread_vector.shrink_to_fit();
+	rpmalloc_finalize();
+
+	printf("C++ allocator tests passed\n");
+	return 0;
+}
@@ -18,6 +18,7 @@
 #endif
 
 #include <rpmalloc.h>
+#include <rpmalloc_inline.h>
 #include <thread.h>
 #include <test.h>
 
@@ -32,6 +33,10 @@
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 #define pointer_offset(ptr, ofs) (void*)((char*)(ptr) + (ptrdiff_t)(ofs))
 #define pointer_diff(first, second) (ptrdiff_t)((const char*)(first) - (const char*)(second))
@@ -448,6 +453,26 @@ test_superalign(void) {
 		}
 	}
 
+	// Alignments matching the alignment of blocks in a size class are served without padding the block
+	size_t natural_alignment[] = {64, 128, 4096, 65536};
+	for (size_t ialign = 0; ialign < sizeof(natural_alignment) / sizeof(natural_alignment[0]); ++ialign) {
+		size_t align = natural_alignment[ialign];
+		void* ptr[16];
+		for (size_t iptr = 0; iptr < 16; ++iptr) {
+			ptr[iptr] = rpaligned_alloc(align, align - iptr);
+			if (!ptr[iptr] || ((uintptr_t)ptr[iptr] & (align - 1)))
+				return test_fail("Natural alignment allocation failed");
+			if (rpmalloc_usable_size(ptr[iptr]) != align)
+				return test_fail("Natural alignment allocation was padded");
+		}
+		for (size_t iptr = 0; iptr < 16; ++iptr) {
+			if (iptr & 1)
+				rpfree_aligned_sized(ptr[iptr], align, align - iptr);
+			else
+				rpfree(ptr[iptr]);
+		}
+	}
+
 	rpmalloc_finalize();
 
 	printf("Memory super aligned tests passed\n");
@@ -975,6 +1000,197 @@ test_crossthread(void) {
 	return 0;
 }
 
+typedef struct remote_free_thread_arg_t {
+	void** pointers;
+	size_t count;
+} remote_free_thread_arg_t;
+
+static void
+remote_free_thread(void* argp) {
+	remote_free_thread_arg_t* arg = argp;
+	rpmalloc_thread_initialize();
+	for (size_t iptr = 0; iptr < arg->count; ++iptr)
+		rpfree(arg->pointers[iptr]);
+	// Finalizing the thread flushes the blocks still buffered
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_remote_free(void) {
+	uintptr_t thread[32];
+	allocator_thread_arg_t arg[32];
+	thread_arg targ[32];
+
+	rpmalloc_config_t config = {0};
+	config.enable_remote_free_buffer = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	// Blocks freed by another thread should all be returned to the owning heap once the freeing thread is done,
+	// including blocks in chains not filled up to the flush limit
+	const size_t pointer_count = 1000;
+	void** pointers = rpmalloc(sizeof(void*) * pointer_count);
+	const size_t sizes[] = {16, 1000, 7000, 60000};
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+		pointers[iptr] = rpmalloc(sizes[iptr % 4]);
+		if (!pointers[iptr])
+			return test_fail("Allocation failed");
+	}
+#if ENABLE_STATISTICS
+	// Adopt the pages of heaps released by threads in previous tests up front, which moves their statistics
+	rpmalloc_thread_collect();
+	rpmalloc_thread_statistics_t stats_before, stats_after;
+	rpmalloc_thread_statistics(&stats_before);
+#endif
+	remote_free_thread_arg_t remote_arg = {pointers, pointer_count};
+	thread_arg remote_targ = {remote_free_thread, &remote_arg};
+	uintptr_t remote_thread = thread_run(&remote_targ);
+	if (thread_join(remote_thread) != 0)
+		return test_fail("Remote free thread failed");
+	rpmalloc_thread_collect();
+#if ENABLE_STATISTICS
+	rpmalloc_thread_statistics(&stats_after);
+	size_t current_before = 0, current_after = 0;
+	for (size_t iclass = 0; iclass < 128; ++iclass) {
+		current_before += stats_before.size_use[iclass].alloc_current;
+		current_after += stats_after.size_use[iclass].alloc_current;
+	}
+	if ((current_before - current_after) != pointer_count)
+		return test_fail("Buffered remote frees were not returned to owning heap");
+#endif
+	rpfree(pointers);
+
+	// Cross thread producer-consumer stress with buffered remote frees
+	size_t num_alloc_threads = hardware_threads;
+	if (num_alloc_threads < 2)
+		num_alloc_threads = 2;
+	if (num_alloc_threads > 16)
+		num_alloc_threads = 16;
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
+		unsigned int iadd = (ithread * (16 + ithread) + ithread) % 128;
+		arg[ithread].loops = 20;
+		arg[ithread].passes = 200;
+		arg[ithread].pointers = rpmalloc(sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
+		memset(arg[ithread].pointers, 0, sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
+		arg[ithread].datasize[0] = 19 + iadd;
+		arg[ithread].datasize[1] = 249 + iadd;
+		arg[ithread].datasize[2] = 797 + iadd;
+		arg[ithread].datasize[3] = 3892 + iadd;
+		arg[ithread].datasize[4] = 9723 + iadd;
+		arg[ithread].datasize[5] = 32493 + iadd;
+		arg[ithread].num_datasize = 6;
+
+		targ[ithread].fn = crossallocator_thread;
+		targ[ithread].arg = &arg[ithread];
+	}
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+		arg[ithread].crossthread_pointers = arg[(ithread + 1) % num_alloc_threads].pointers;
+
+	for (int iloop = 0; iloop < 8; ++iloop) {
+		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+			thread[ithread] = thread_run(&targ[ithread]);
+
+		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
+			if (thread_join(thread[ithread]) != 0)
+				return -1;
+		}
+	}
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+		rpfree(arg[ithread].pointers);
+
+	rpmalloc_finalize();
+
+	// Restore default remote free handling for later tests
+	memset(&config, 0, sizeof(config));
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_finalize();
+
+	printf("Remote free buffer tests passed\n");
+	return 0;
+}
+
+static int
+test_per_cpu_heaps(void) {
+	uintptr_t thread[32];
+	allocator_thread_arg_t arg[32];
+	thread_arg targ[32];
+
+	rpmalloc_config_t config = {0};
+	config.enable_per_cpu_heaps = 1;
+	rpmalloc_initialize_config(0, &config);
+	if (!rpmalloc_config()->enable_per_cpu_heaps)
+		return test_fail("Per processor heap mode not enabled");
+#if ENABLE_STATISTICS
+	rpmalloc_global_statistics_t before, after;
+	rpmalloc_global_statistics(&before);
+#endif
+
+	// Use more threads than processors, the heap count should be bounded by the processor count
+	size_t num_alloc_threads = hardware_threads * 4;
+	if (num_alloc_threads < 4)
+		num_alloc_threads = 4;
+	if (num_alloc_threads > 32)
+		num_alloc_threads = 32;
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
+		unsigned int iadd = (ithread * (16 + ithread) + ithread) % 128;
+		arg[ithread].loops = 20;
+		arg[ithread].passes = 200;
+		arg[ithread].pointers = rpmalloc(sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
+		memset(arg[ithread].pointers, 0, sizeof(void*) * arg[ithread].loops * arg[ithread].passes);
+		arg[ithread].datasize[0] = 19 + iadd;
+		arg[ithread].datasize[1] = 249 + iadd;
+		arg[ithread].datasize[2] = 797 + iadd;
+		arg[ithread].datasize[3] = 3892 + iadd;
+		arg[ithread].datasize[4] = 9723 + iadd;
+		arg[ithread].datasize[5] = 32493 + iadd;
+		arg[ithread].datasize[6] = 2000000 + iadd;
+		arg[ithread].num_datasize = 7;
+
+		targ[ithread].fn = crossallocator_thread;
+		targ[ithread].arg = &arg[ithread];
+	}
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+		arg[ithread].crossthread_pointers = arg[(ithread + 1) % num_alloc_threads].pointers;
+
+	for (int iloop = 0; iloop < 4; ++iloop) {
+		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+			thread[ithread] = thread_run(&targ[ithread]);
+
+		for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread) {
+			if (thread_join(thread[ithread]) != 0)
+				return -1;
+		}
+	}
+
+	for (unsigned int ithread = 0; ithread < num_alloc_threads; ++ithread)
+		rpfree(arg[ithread].pointers);
+
+	if (!rpmalloc_is_thread_initialized())
+		return test_fail("Thread not initialized in per processor heap mode");
+	rpmalloc_thread_collect();
+
+#if ENABLE_STATISTICS
+	rpmalloc_global_statistics(&after);
+	if ((after.heap_count - before.heap_count) > hardware_threads)
+		return test_fail("Heap count not bounded by processor count in per processor heap mode");
+#endif
+
+	rpmalloc_finalize();
+
+	// Restore thread heaps for later tests
+	memset(&config, 0, sizeof(config));
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_finalize();
+
+	printf("Per processor heap tests passed\n");
+	return 0;
+}
+
 static int
 test_threadspam(void) {
 	uintptr_t thread[64];
@@ -1044,129 +1260,2021 @@ test_threadspam(void) {
 	return 0;
 }
 
-static int
-test_first_class_heaps(void) {
-#if RPMALLOC_FIRST_CLASS_HEAPS
-	uintptr_t thread[32];
-	uintptr_t threadres[32];
-	unsigned int i;
-	size_t num_alloc_threads;
-	allocator_thread_arg_t arg[32];
+typedef struct collect_thread_arg_t {
+	void** pointers;
+	size_t count;
+} collect_thread_arg_t;
+
+static void
+collect_free_thread(void* argp) {
+	collect_thread_arg_t* arg = argp;
+	rpmalloc_thread_initialize();
+	for (size_t iptr = 0; iptr < arg->count; iptr += 2)
+		rpfree(arg->pointers[iptr]);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
 
+static int
+test_thread_collect(void) {
 	rpmalloc_config_t config = {0};
-	//config.unmap_on_finalize = 1;
 	rpmalloc_initialize_config(0, &config);
 
-	num_alloc_threads = hardware_threads * 2;
-	if (num_alloc_threads < 2)
-		num_alloc_threads = 2;
-	if (num_alloc_threads > 16)
-		num_alloc_threads = 16;
+	const size_t pointer_count = 4096;
+	void** pointers = rpmalloc(sizeof(void*) * pointer_count);
+	for (int iloop = 0; iloop < 8; ++iloop) {
+		for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+			size_t size = 16 + ((iptr * 37 + (size_t)iloop * 7919) % ((iptr % 16) ? 4096 : 300000));
+			pointers[iptr] = rpmalloc(size);
+			if (!pointers[iptr])
+				return test_fail("Allocation failed");
+			memset(pointers[iptr], (int)(iptr & 0xFF), size);
+		}
 
-	for (i = 0; i < num_alloc_threads; ++i) {
-		arg[i].datasize[0] = 19;
-		arg[i].datasize[1] = 249;
-		arg[i].datasize[2] = 797;
-		arg[i].datasize[3] = 3058;
-		arg[i].datasize[4] = 47892;
-		arg[i].datasize[5] = 173932;
-		arg[i].datasize[6] = 389;
-		arg[i].datasize[7] = 19;
-		arg[i].datasize[8] = 2493;
-		arg[i].datasize[9] = 7979;
-		arg[i].datasize[10] = 3;
-		arg[i].datasize[11] = 79374;
-		arg[i].datasize[12] = 3432;
-		arg[i].datasize[13] = 548;
-		arg[i].datasize[14] = 38934;
-		arg[i].datasize[15] = 234;
-		arg[i].num_datasize = 16;
-#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
-		arg[i].loops = 100;
-		arg[i].passes = 4000;
-#else
-		arg[i].loops = 50;
-		arg[i].passes = 1000;
-#endif
-		arg[i].init_fini_each_loop = 1;
+		// Free every other block in another thread, which ends up in deferred free lists
+		collect_thread_arg_t arg = {pointers, pointer_count};
+		thread_arg targ = {collect_free_thread, &arg};
+		uintptr_t thread = thread_run(&targ);
+		if (thread_join(thread) != 0)
+			return test_fail("Free thread failed");
 
-		thread_arg targ;
-		targ.fn = heap_allocator_thread;
-		if ((i % 2) != 0)
-			targ.fn = allocator_thread;
-		targ.arg = &arg[i];
+		for (size_t iptr = 1; iptr < pointer_count; iptr += 2)
+			rpfree(pointers[iptr]);
 
-		thread[i] = thread_run(&targ);
+		rpmalloc_thread_collect();
+		// Collecting an already collected heap must be a no-op
+		rpmalloc_thread_collect();
 	}
 
-	thread_sleep(1000);
-
-	for (i = 0; i < num_alloc_threads; ++i)
-		threadres[i] = thread_join(thread[i]);
+	// Verify heap is still fully functional after collections
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+		pointers[iptr] = rpzalloc(16 + (iptr % 8192));
+		if (!pointers[iptr])
+			return test_fail("Allocation failed");
+		for (size_t ibyte = 0; ibyte < 16 + (iptr % 8192); ++ibyte) {
+			if (((char*)pointers[iptr])[ibyte])
+				return test_fail("Zero allocation not zero after collect");
+		}
+		memset(pointers[iptr], (int)(iptr & 0xFF), 16 + (iptr % 8192));
+	}
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+		if (*(unsigned char*)pointers[iptr] != (unsigned char)(iptr & 0xFF))
+			return test_fail("Data corrupted after collect");
+		rpfree(pointers[iptr]);
+	}
+	rpfree(pointers);
+	rpmalloc_thread_collect();
 
 	rpmalloc_finalize();
 
-	for (i = 0; i < num_alloc_threads; ++i) {
-		if (threadres[i])
-			return -1;
-	}
-
-	printf("First class heap tests passed\n");
-#endif
+	printf("Thread collect tests passed\n");
 	return 0;
 }
 
 static int
-test_large_pages(void) {
-	int ret = 0;
+test_statistics(void) {
+#if ENABLE_STATISTICS
+	rpmalloc_initialize(0);
 
-	rpmalloc_config_t config = {0};
-	config.page_size = 16 * 1024 * 1024;
+	const size_t pointer_count = 1024;
+	void** pointers = rpmalloc(sizeof(void*) * pointer_count);
 
-	rpmalloc_initialize_config(0, &config);
+	// Adopt the pages of heaps released by threads in previous tests up front, which moves their statistics
+	rpmalloc_thread_collect();
 
-	ret = test_thread_implementation();
+	rpmalloc_thread_statistics_t thread_before, thread_after;
+	size_t current_before = 0, current_after = 0, total_before = 0, total_after = 0;
+	rpmalloc_thread_statistics(&thread_before);
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+		pointers[iptr] = rpmalloc(100);
+		if (!pointers[iptr])
+			return test_fail("Allocation failed");
+	}
+	rpmalloc_thread_statistics(&thread_after);
+	for (size_t iclass = 0; iclass < 128; ++iclass) {
+		current_before += thread_before.size_use[iclass].alloc_current;
+		current_after += thread_after.size_use[iclass].alloc_current;
+		total_before += thread_before.size_use[iclass].alloc_total;
+		total_after += thread_after.size_use[iclass].alloc_total;
+	}
+	if (current_after != current_before + pointer_count)
+		return test_fail("Bad current allocation count statistics");
+	if (total_after != total_before + pointer_count)
+		return test_fail("Bad total allocation count statistics");
+	if (thread_after.page_use[0].current < 1)
+		return test_fail("Bad page use statistics");
 
-	rpmalloc_finalize();
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr)
+		rpfree(pointers[iptr]);
+	rpmalloc_thread_statistics(&thread_after);
+	current_after = 0;
+	size_t free_before = 0, free_after = 0;
+	for (size_t iclass = 0; iclass < 128; ++iclass) {
+		current_after += thread_after.size_use[iclass].alloc_current;
+		free_before += thread_before.size_use[iclass].free_total;
+		free_after += thread_after.size_use[iclass].free_total;
+	}
+	if (current_after != current_before)
+		return test_fail("Bad current allocation count statistics after free");
+	if (free_after != free_before + pointer_count)
+		return test_fail("Bad total free count statistics");
+
+	rpmalloc_global_statistics_t global_before, global_after;
+	rpmalloc_global_statistics(&global_before);
+	void* huge = rpmalloc(20 * 1024 * 1024);
+	if (!huge)
+		return test_fail("Huge allocation failed");
+	rpmalloc_global_statistics(&global_after);
+	if (global_after.huge_alloc < global_before.huge_alloc + 20 * 1024 * 1024)
+		return test_fail("Bad huge allocation statistics");
+	if (global_after.huge_alloc_peak < global_after.huge_alloc)
+		return test_fail("Bad huge allocation peak statistics");
+	if (global_after.mapped < 20 * 1024 * 1024)
+		return test_fail("Bad mapped memory statistics");
+	rpfree(huge);
+	rpmalloc_global_statistics(&global_after);
+	if (global_after.huge_alloc != global_before.huge_alloc)
+		return test_fail("Bad huge allocation statistics after free");
 
-	if (ret == 0)
-		printf("Large page config test passed\n");
+	rpfree(pointers);
 
-	return ret;
+	rpmalloc_finalize();
+
+	printf("Statistics tests passed\n");
+#endif
+	return 0;
 }
 
 static int
-test_named_pages(void) {
+test_size_class(void) {
+	// Sparse custom table, sizes above 8KiB are rounded up to their lookup bucket and the 8MiB size class is appended
+	const unsigned int size_class_table[] = {16, 72, 200, 1100, 4200, 10000, 64 * 1024};
 	rpmalloc_config_t config = {0};
-	char page_name[64] = {0};
-	snprintf(page_name, sizeof(page_name), "rpmalloc ::%s::", __func__);
-	config.page_name = page_name;
-	//config.unmap_on_finalize = 1;
+	config.size_class_table = size_class_table;
+	config.size_class_count = sizeof(size_class_table) / sizeof(size_class_table[0]);
 	rpmalloc_initialize_config(0, &config);
+	if (rpmalloc_config()->size_class_count != 8)
+		return test_fail("Custom size class table not used");
+
+	const size_t size_usable[][2] = {{0, 16},       {16, 16},       {17, 80},     {72, 80},
+	                                 {200, 208},    {1100, 1104},   {1105, 4208}, {4200, 4208},
+	                                 {5000, 10240}, {10241, 65536}, {65537, 8 * 1024 * 1024}};
+	for (size_t isize = 0; isize < sizeof(size_usable) / sizeof(size_usable[0]); ++isize) {
+		void* block = rpmalloc(size_usable[isize][0]);
+		if (rpmalloc_usable_size(block) != size_usable[isize][1])
+			return test_fail("Bad usable size with custom size classes");
+		rpfree_sized(block, size_usable[isize][0]);
+	}
+	void* blocks[64];
+	if (rpmalloc_batch_alloc(1100, 64, blocks) != 64)
+		return test_fail("Batch allocation failed with custom size classes");
+	for (size_t iblock = 0; iblock < 64; ++iblock) {
+		if (rpmalloc_usable_size(blocks[iblock]) != 1104)
+			return test_fail("Bad batch usable size with custom size classes");
+	}
+	rpfree_batch(blocks, 64);
+	rpmalloc_finalize();
 
-	void* testptr = rpmalloc(16 * 1024 * 1024);
-#if defined(__linux__)
-	char name[256], buf[4096] = {0};
-	int pid = getpid();
-	snprintf(name, sizeof(name), "/proc/%d/maps", pid);
-	int fd = open(name, O_RDONLY);
-	if (fd != -1) {
-		ssize_t was_read = read(fd, buf, sizeof(buf));
-		(void)sizeof(was_read);
-		close(fd);
+#if ENABLE_STATISTICS
+	// Derive a table from a workload dominated by a few odd sizes
+	memset(&config, 0, sizeof(config));
+	rpmalloc_initialize_config(0, &config);
+	const size_t request_size[] = {72, 200, 1100, 4200};
+	for (size_t ipass = 0; ipass < 64; ++ipass) {
+		for (size_t isize = 0; isize < sizeof(request_size) / sizeof(request_size[0]); ++isize)
+			rpfree(rpmalloc(request_size[isize]));
+	}
+	rpmalloc_thread_statistics_t stats;
+	rpmalloc_thread_statistics(&stats);
+	rpmalloc_finalize();
+
+	unsigned int recommended[RPMALLOC_SIZE_CLASS_COUNT_MAX];
+	size_t recommended_count = rpmalloc_size_class_recommend(&stats, recommended, RPMALLOC_SIZE_CLASS_COUNT_MAX);
+	if (recommended_count != RPMALLOC_SIZE_CLASS_COUNT_MAX)
+		return test_fail("Bad recommended size class count");
+	config.size_class_table = recommended;
+	config.size_class_count = (unsigned int)recommended_count;
+	rpmalloc_initialize_config(0, &config);
+	for (size_t isize = 0; isize < sizeof(request_size) / sizeof(request_size[0]); ++isize) {
+		void* block = rpmalloc(request_size[isize]);
+		if (rpmalloc_usable_size(block) != ((request_size[isize] + 15) & ~(size_t)15))
+			return test_fail("Bad usable size with recommended size classes");
+		rpfree(block);
+	}
+	for (size_t size = 128; size <= 128 * 1024; ++size) {
+		void* block = rpmalloc(size);
+		if ((double)rpmalloc_usable_size(block) / (double)size > 1.255)
+			return test_fail("Bad overhead with recommended size classes");
+		rpfree(block);
 	}
+	rpmalloc_finalize();
 #endif
-	rpfree(testptr);
 
+	// Restore default size classes for later tests
+	memset(&config, 0, sizeof(config));
+	rpmalloc_initialize_config(0, &config);
+	if (rpmalloc_config()->size_class_table)
+		return test_fail("Default size classes not restored");
 	rpmalloc_finalize();
 
-	printf("Named pages test passed\n");
-#if defined(__linux__)
-	// Since it is kernel version and config dependent
-	// we do not make an issue out of it.
-	if (!strstr(buf, page_name))
-		printf("\tbut the page did not get an id as expected\n");
-#endif
+	printf("Size class tests passed\n");
+	return 0;
+}
+
+static int
+test_sampling(void) {
+#if ENABLE_SAMPLING
+	rpmalloc_config_t config;
+	memset(&config, 0, sizeof(config));
+	config.sample_interval = 64 * 1024;
+	rpmalloc_initialize_config(0, &config);
+	if (config.sample_interval != 64 * 1024)
+		return test_fail("Sample interval not kept");
+
+	FILE* file = tmpfile();
+	if (!file)
+		return 0;
+
+	// Roughly one in 64 blocks of 1KiB should be sampled, and a block larger than the interval almost always
+	void* block[4096];
+	for (size_t iblock = 0; iblock < 4096; ++iblock) {
+		if (iblock & 1)
+			block[iblock] = rpaligned_alloc(256, 1000);
+		else
+			block[iblock] = rpmalloc(1000);
+		if (!block[iblock] || ((iblock & 1) && ((uintptr_t)block[iblock] & 255)))
+			return test_fail("Bad allocation while sampling");
+		memset(block[iblock], (int)iblock, 1000);
+	}
+	void* huge = rpmalloc(16 * 1024 * 1024);
+	huge = rprealloc(huge, 64 * 1024 * 1024);
+	if (!huge)
+		return test_fail("Huge allocation failed while sampling");
+
+	unsigned long long sample_count = 0, sample_bytes = 0, alloc_count = 0, alloc_bytes = 0, interval = 0;
+	char line[4096];
+	rpmalloc_dump_samples(file);
+	rewind(file);
+	if (!fgets(line, sizeof(line), file) ||
+	    (sscanf(line, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu", &sample_count, &sample_bytes,
+	            &alloc_count, &alloc_bytes, &interval) != 5))
+		return test_fail("Bad heap profile header");
+	if (interval != 64 * 1024)
+		return test_fail("Bad heap profile sample interval");
+	if ((sample_count < 16) || (sample_count > 256))
+		return test_fail("Unexpected number of heap samples");
+	unsigned long long line_count = 0, line_bytes = 0, huge_count = 0;
+	while (fgets(line, sizeof(line), file) && (line[0] != '\n')) {
+		unsigned long long count = 0, bytes = 0;
+		if ((sscanf(line, "%llu: %llu [", &count, &bytes) != 2) || !strstr(line, "@ 0x"))
+			return test_fail("Bad heap profile sample");
+		line_count += count;
+		line_bytes += bytes;
+		if (bytes >= 16 * 1024 * 1024)
+			++huge_count;
+	}
+	if ((line_count != sample_count) || (line_bytes != sample_bytes))
+		return test_fail("Heap profile samples do not match header");
+	if (huge_count > 1)
+		return test_fail("Reallocated block sampled twice");
+
+	for (size_t iblock = 0; iblock < 4096; ++iblock) {
+		for (size_t ibyte = 0; ibyte < 1000; ++ibyte) {
+			if (((unsigned char*)block[iblock])[ibyte] != (unsigned char)iblock)
+				return test_fail("Sampled block data corrupted");
+		}
+	}
+	// Free half the blocks in batch and the rest from another thread
+	rpfree_batch(block, 2048);
+	thread_arg targ;
+	targ.fn = defer_free_thread;
+	for (size_t iblock = 2048; iblock < 4096; ++iblock) {
+		targ.arg = block[iblock];
+		thread_join(thread_run(&targ));
+	}
+	rpfree(huge);
+
+	rewind(file);
+	rpmalloc_dump_samples(file);
+	rewind(file);
+	if (!fgets(line, sizeof(line), file) ||
+	    (sscanf(line, "heap profile: %llu: %llu [", &sample_count, &sample_bytes) != 2))
+		return test_fail("Bad heap profile header");
+	if (sample_count || sample_bytes)
+		return test_fail("Freed blocks still sampled");
+	fclose(file);
+
+	rpmalloc_finalize();
+
+	printf("Heap sampling tests passed\n");
+#endif
+	return 0;
+}
+
+static int
+test_event_log(void) {
+#if ENABLE_EVENT_LOG
+	rpmalloc_initialize(0);
+
+	// A huge block always takes the slow path, the events of the large block depend on the state of the heap
+	void* huge = rpmalloc(40 * 1024 * 1024);
+	void* large = rpmalloc(7 * 1024 * 1024);
+	if (!huge || !large)
+		return test_fail("Allocation failed while logging events");
+
+	rpmalloc_event_t event[128];
+	size_t count = rpmalloc_thread_events(event, 128);
+	if (!count || (count > 64))
+		return test_fail("Unexpected number of logged events");
+	size_t huge_event = count;
+	for (size_t ievent = 0; ievent < count; ++ievent) {
+		if ((event[ievent].type < RPMALLOC_EVENT_PAGE_GET) || (event[ievent].type > RPMALLOC_EVENT_HEAP_RELEASE) ||
+		    (event[ievent].page_type > 3))
+			return test_fail("Bad logged event");
+		if (!event[ievent].heap_id || (event[ievent].heap_id != event[0].heap_id))
+			return test_fail("Bad heap ID in logged event");
+		if (ievent && ((int)(event[ievent].time - event[ievent - 1].time) < 0))
+			return test_fail("Logged events not in order");
+		if ((event[ievent].type == RPMALLOC_EVENT_HUGE_ALLOC) && (event[ievent].size >= 40 * 1024 * 1024))
+			huge_event = ievent;
+	}
+	if ((huge_event == count) || (event[huge_event].page_type != 3))
+		return test_fail("Huge allocation not logged");
+
+	rpmalloc_event_t last_event;
+	if ((rpmalloc_thread_events(&last_event, 1) != 1) || (last_event.type != event[count - 1].type) ||
+	    (last_event.size != event[count - 1].size))
+		return test_fail("Bad most recent logged event");
+
+	rpfree(large);
+	rpfree(huge);
+	rpmalloc_finalize();
+
+	printf("Event log tests passed\n");
+#endif
+	return 0;
+}
+
+static int
+test_huge_cache(void) {
+	rpmalloc_config_t config = {0};
+	rpmalloc_initialize_config(0, &config);
+
+	const size_t huge_size = 20 * 1024 * 1024;
+	void* warmup = rpmalloc(16);
+#if ENABLE_STATISTICS
+	rpmalloc_global_statistics_t global_before, global_after;
+	rpmalloc_global_statistics(&global_before);
+#endif
+	void* huge = rpmalloc(huge_size);
+	if (!huge)
+		return test_fail("Huge allocation failed");
+	memset(huge, 0xFF, huge_size);
+#if ENABLE_STATISTICS && !defined(_WIN32)
+	// Alignment slack should not remain mapped
+	rpmalloc_global_statistics(&global_after);
+	if ((global_after.mapped_total - global_before.mapped_total) >= (2 * huge_size))
+		return test_fail("Huge allocation alignment slack not released");
+#endif
+	rpfree(huge);
+
+#if ENABLE_STATISTICS
+	rpmalloc_global_statistics(&global_before);
+#endif
+	// Smaller block in the same size range should reuse the freed huge block
+	void* reuse = rpzalloc(huge_size - (2 * 1024 * 1024));
+	if (!reuse)
+		return test_fail("Huge allocation failed");
+	if (rpmalloc_usable_size(reuse) < huge_size - (2 * 1024 * 1024))
+		return test_fail("Bad usable size for reused huge block");
+	for (size_t ioffset = 0; ioffset < huge_size - (2 * 1024 * 1024); ioffset += 4096) {
+		if (((char*)reuse)[ioffset])
+			return test_fail("Zero allocation not zero for reused huge block");
+	}
+#if ENABLE_STATISTICS
+	rpmalloc_global_statistics(&global_after);
+	if (global_after.mapped_total != global_before.mapped_total)
+		return test_fail("Freed huge block not reused");
+#endif
+	rpfree(reuse);
+	rpfree(warmup);
+
+	rpmalloc_finalize();
+
+	printf("Huge cache tests passed\n");
+	return 0;
+}
+
+static int
+test_huge_realloc(void) {
+	rpmalloc_config_t config = {0};
+	rpmalloc_initialize_config(0, &config);
+
+	size_t size = 20 * 1024 * 1024;
+	uint32_t* block = rpmalloc(size);
+	if (!block)
+		return test_fail("Huge allocation failed");
+	for (size_t iword = 0; iword < size / sizeof(uint32_t); ++iword)
+		block[iword] = (uint32_t)iword;
+
+	// Grow in steps, data must be preserved whether or not the block moved
+	for (int istep = 0; istep < 4; ++istep) {
+		size_t new_size = size * 2;
+		uint32_t* new_block = rprealloc(block, new_size);
+		if (!new_block)
+			return test_fail("Huge reallocation failed");
+		if (rpmalloc_usable_size(new_block) < new_size)
+			return test_fail("Bad usable size after huge reallocation");
+		for (size_t iword = 0; iword < size / sizeof(uint32_t); iword += 1024) {
+			if (new_block[iword] != (uint32_t)iword)
+				return test_fail("Data not preserved in huge reallocation");
+		}
+		for (size_t iword = size / sizeof(uint32_t); iword < new_size / sizeof(uint32_t); ++iword)
+			new_block[iword] = (uint32_t)iword;
+		block = new_block;
+		size = new_size;
+	}
+
+	// Growing in place must either keep the block or fail and leave it untouched
+	uint32_t* same_block = rpaligned_realloc(block, 16, size + (8 * 1024 * 1024), 0, RPMALLOC_GROW_OR_FAIL);
+	if (same_block && (same_block != block))
+		return test_fail("Huge grow or fail reallocation moved block");
+	if (same_block && (rpmalloc_usable_size(same_block) < size + (8 * 1024 * 1024)))
+		return test_fail("Bad usable size after huge grow or fail reallocation");
+	if (block[(size / sizeof(uint32_t)) - 1] != (uint32_t)((size / sizeof(uint32_t)) - 1))
+		return test_fail("Data not preserved in huge grow or fail reallocation");
+	rpfree(block);
+
+	rpmalloc_finalize();
+
+	printf("Huge reallocation tests passed\n");
+	return 0;
+}
+
+static int
+test_deferred_release(void) {
+	// Huge blocks above the huge cache size limit are unmapped when freed
+	const size_t huge_size = 300 * 1024 * 1024;
+	const size_t count = 3;
+	void* block[3];
+	size_t mapped_before, mapped_after;
+
+	rpmalloc_config_t config = {0};
+	config.release_defer_limit = 2 * huge_size + (64 * 1024 * 1024);
+	rpmalloc_initialize_config(0, &config);
+
+	rpmalloc_memory_usage(&mapped_before, 0);
+	for (size_t iblock = 0; iblock < count; ++iblock) {
+		block[iblock] = rpmalloc(huge_size);
+		if (!block[iblock])
+			return test_fail("Huge allocation failed");
+		memset(block[iblock], 0xFF, 4096);
+	}
+	for (size_t iblock = 0; iblock < count; ++iblock)
+		rpfree(block[iblock]);
+
+	// Only two blocks fit in the queue, the last is unmapped right away
+	rpmalloc_global_statistics_t stats;
+	rpmalloc_global_statistics(&stats);
+	if ((stats.release_deferred < 2 * huge_size) || (stats.release_deferred > config.release_defer_limit))
+		return test_fail("Huge blocks not queued for deferred release");
+	rpmalloc_memory_usage(&mapped_after, 0);
+	if (mapped_after < mapped_before + stats.release_deferred)
+		return test_fail("Queued huge blocks not counted as mapped");
+
+	rpmalloc_thread_collect();
+	rpmalloc_global_statistics(&stats);
+	if (stats.release_deferred)
+		return test_fail("Deferred release not drained by collect");
+	rpmalloc_memory_usage(&mapped_after, 0);
+	if (mapped_after >= mapped_before + huge_size)
+		return test_fail("Deferred release did not unmap huge blocks");
+
+	rpmalloc_finalize();
+
+	// Release thread unmaps queued spans without any collect call
+	config.enable_release_thread = 1;
+	rpmalloc_initialize_config(0, &config);
+#ifndef _WIN32
+	if (!config.enable_release_thread)
+		return test_fail("Release thread not started");
+#endif
+
+	block[0] = rpmalloc(huge_size);
+	if (!block[0])
+		return test_fail("Huge allocation failed");
+	rpfree(block[0]);
+	if (!config.enable_release_thread)
+		rpmalloc_thread_collect();
+	for (int iwait = 0; iwait < 100; ++iwait) {
+		rpmalloc_global_statistics(&stats);
+		if (!stats.release_deferred)
+			break;
+		thread_sleep(10);
+	}
+	rpmalloc_global_statistics(&stats);
+	if (stats.release_deferred)
+		return test_fail("Deferred release not drained by release thread");
+
+	// Blocks queued by other threads are unmapped on finalize
+	block[0] = rpmalloc(huge_size);
+	if (!block[0])
+		return test_fail("Huge allocation failed");
+	rpfree(block[0]);
+	rpmalloc_finalize();
+	rpmalloc_global_statistics(&stats);
+	if (stats.release_deferred)
+		return test_fail("Deferred release not drained by finalize");
+
+	// Restore immediate release for later tests
+	config.release_defer_limit = 0;
+	config.enable_release_thread = 0;
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_finalize();
+
+	printf("Deferred release tests passed\n");
+	return 0;
+}
+
+typedef struct batch_thread_arg_t {
+	void** pointers;
+	size_t count;
+} batch_thread_arg_t;
+
+static void
+batch_free_thread(void* argp) {
+	batch_thread_arg_t* arg = argp;
+	rpmalloc_thread_initialize();
+	rpfree_batch(arg->pointers, arg->count);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_batch(void) {
+	rpmalloc_config_t config = {0};
+	rpmalloc_initialize_config(0, &config);
+
+	const size_t pointer_count = 8192;
+	const size_t sizes[] = {8, 48, 1000, 12000, 300000};
+	void** pointers = rpmalloc(sizeof(void*) * pointer_count);
+	for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+		const size_t size = sizes[isize];
+		const size_t count = (size > 100000) ? 128 : pointer_count;
+		for (int iloop = 0; iloop < 4; ++iloop) {
+			size_t allocated = rpmalloc_batch_alloc(size, count, pointers);
+			if (allocated != count)
+				return test_fail("Batch allocation failed");
+			for (size_t iptr = 0; iptr < count; ++iptr) {
+				if (rpmalloc_usable_size(pointers[iptr]) < size)
+					return test_fail("Bad usable size for batch allocated block");
+				memset(pointers[iptr], (int)(iptr & 0xFF), size);
+			}
+			for (size_t iptr = 0; iptr < count; ++iptr) {
+				if ((*(unsigned char*)pointers[iptr] != (unsigned char)(iptr & 0xFF)) ||
+				    (((unsigned char*)pointers[iptr])[size - 1] != (unsigned char)(iptr & 0xFF)))
+					return test_fail("Batch allocated blocks overlap");
+			}
+
+			// Free first half in another thread and second half in this thread, with holes in the array
+			batch_thread_arg_t arg = {pointers, count / 2};
+			thread_arg targ = {batch_free_thread, &arg};
+			uintptr_t thread = thread_run(&targ);
+			if (thread_join(thread) != 0)
+				return test_fail("Batch free thread failed");
+			for (size_t iptr = count / 2; iptr < count; iptr += 7)
+				rpfree(pointers[iptr]);
+			for (size_t iptr = count / 2; iptr < count; iptr += 7)
+				pointers[iptr] = 0;
+			rpfree_batch(pointers + (count / 2), count - (count / 2));
+		}
+	}
+
+	// Mixed sizes including huge and aligned blocks in one batch
+	for (size_t iptr = 0; iptr < 64; ++iptr) {
+		if (iptr == 13)
+			pointers[iptr] = rpmalloc(10 * 1024 * 1024);
+		else if (iptr % 5)
+			pointers[iptr] = rpmalloc(16 + (iptr * 1024));
+		else
+			pointers[iptr] = rpaligned_alloc(256, 100 + iptr);
+	}
+	rpfree_batch(pointers, 64);
+
+	// Blocks must still be usable after batch frees
+	size_t allocated = rpmalloc_batch_alloc(48, pointer_count, pointers);
+	if (allocated != pointer_count)
+		return test_fail("Batch allocation failed");
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr)
+		memset(pointers[iptr], 0xFF, 48);
+	rpfree_batch(pointers, pointer_count);
+	rpfree(pointers);
+
+	rpmalloc_finalize();
+
+	printf("Batch allocation tests passed\n");
+	return 0;
+}
+
+typedef struct sized_thread_arg_t {
+	void** pointers;
+	size_t count;
+	size_t size;
+} sized_thread_arg_t;
+
+static void
+sized_free_thread(void* argp) {
+	sized_thread_arg_t* arg = argp;
+	rpmalloc_thread_initialize();
+	for (size_t iptr = 0; iptr < arg->count; ++iptr)
+		rpfree_sized(arg->pointers[iptr], arg->size);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_sized_free(void) {
+	rpmalloc_config_t config = {0};
+	rpmalloc_initialize_config(0, &config);
+
+	const size_t pointer_count = 4096;
+	const size_t sizes[] = {0,     1,      16,     17,      1024,    1025,    4000,
+	                        32000, 65000,  200000, 1048576, 4194304, 8388608, 12582912};
+	void** pointers = rpmalloc(sizeof(void*) * pointer_count);
+	rpfree_sized(0, 16);
+	rpfree_aligned_sized(0, 64, 16);
+
+	for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+		const size_t size = sizes[isize];
+		const size_t count = (size > 100000) ? 32 : pointer_count;
+		for (int iloop = 0; iloop < 3; ++iloop) {
+			// Allocate enough blocks to fill pages, then free every other block locally to
+			// exercise both full and available pages, and the rest in another thread
+			for (size_t iptr = 0; iptr < count; ++iptr) {
+				pointers[iptr] = rpmalloc(size);
+				if (!pointers[iptr])
+					return test_fail("Allocation failed");
+				if (size)
+					memset(pointers[iptr], (int)(iptr & 0xFF), size);
+			}
+			for (size_t iptr = 0; iptr < count; iptr += 2)
+				rpfree_sized(pointers[iptr], size);
+			size_t remain = 0;
+			for (size_t iptr = 1; iptr < count; iptr += 2) {
+				if (size && (*(unsigned char*)pointers[iptr] != (unsigned char)(iptr & 0xFF)))
+					return test_fail("Sized free corrupted live block");
+				pointers[remain++] = pointers[iptr];
+			}
+			sized_thread_arg_t arg = {pointers, remain, size};
+			thread_arg targ = {sized_free_thread, &arg};
+			uintptr_t thread = thread_run(&targ);
+			if (thread_join(thread) != 0)
+				return test_fail("Sized free thread failed");
+		}
+	}
+
+	// Aligned blocks, with pages mixing aligned and unaligned blocks
+	for (size_t align = 32; align <= 8192; align <<= 1) {
+		for (size_t iptr = 0; iptr < 512; ++iptr) {
+			const size_t size = 8 + ((iptr * 37) % 3000);
+			if (iptr % 3)
+				pointers[iptr] = rpaligned_alloc(align, size);
+			else
+				pointers[iptr] = rpmalloc(size);
+			if (!pointers[iptr])
+				return test_fail("Allocation failed");
+			if ((iptr % 3) && ((uintptr_t)pointers[iptr] & (align - 1)))
+				return test_fail("Bad aligned block");
+			memset(pointers[iptr], 0, size);
+		}
+		for (size_t iptr = 0; iptr < 512; ++iptr) {
+			const size_t size = 8 + ((iptr * 37) % 3000);
+			if (iptr % 3)
+				rpfree_aligned_sized(pointers[iptr], align, size);
+			else
+				rpfree_sized(pointers[iptr], size);
+		}
+	}
+
+	// Freed blocks must be reused
+	void* block = rpmalloc(100);
+	rpfree_sized(block, 100);
+	size_t reused = pointer_count;
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+		pointers[iptr] = rpmalloc(100);
+		if (pointers[iptr] == block)
+			reused = iptr;
+	}
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr)
+		rpfree_sized(pointers[iptr], 100);
+	if (reused == pointer_count)
+		return test_fail("Sized free block not reused");
+
+#if ENABLE_STATISTICS
+	rpmalloc_thread_statistics_t before, after;
+	rpmalloc_thread_statistics(&before);
+	for (size_t iptr = 0; iptr < 100; ++iptr)
+		pointers[iptr] = rpmalloc(48);
+	for (size_t iptr = 0; iptr < 100; ++iptr)
+		rpfree_sized(pointers[iptr], 48);
+	rpmalloc_thread_statistics(&after);
+	size_t freed = 0, allocated = 0;
+	for (size_t iclass = 0; iclass < sizeof(after.size_use) / sizeof(after.size_use[0]); ++iclass) {
+		freed += after.size_use[iclass].free_total - before.size_use[iclass].free_total;
+		allocated += after.size_use[iclass].alloc_total - before.size_use[iclass].alloc_total;
+	}
+	if ((freed != 100) || (allocated != 100))
+		return test_fail("Bad statistics for sized free");
+#endif
+
+	rpfree_sized(pointers, sizeof(void*) * pointer_count);
+
+	rpmalloc_finalize();
+
+	printf("Sized free tests passed\n");
+	return 0;
+}
+
+static void
+inline_free_thread(void* argp) {
+	sized_thread_arg_t* arg = argp;
+	rpmalloc_thread_initialize();
+	for (size_t iptr = 0; iptr < arg->count; ++iptr)
+		rpfree_inline(arg->pointers[iptr], arg->size);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_inline(void) {
+	rpmalloc_config_t config = {0};
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_thread_initialize();
+
+#if RPMALLOC_INLINE_FAST_PATH && !ENABLE_STATISTICS
+	if (!rpmalloc_inline_state.heap || !rpmalloc_inline_state.free_list)
+		return test_fail("Inline fast path not enabled");
+
+	// Inline free pushes to the page local free list, inline allocation pops the heap local free list
+	void* first = rpmalloc_inline(48);
+	void* second = rpmalloc_inline(48);
+	rpfree_inline(first, 48);
+	rpmalloc_inline_page_t* inline_page =
+	    (rpmalloc_inline_page_t*)((uintptr_t)first & ~(uintptr_t)(RPMALLOC_INLINE_PAGE_SIZE - 1));
+	if (inline_page->local_free != first)
+		return test_fail("Block not freed inline");
+	rpfree_inline(second, 48);
+	void** free_list = rpmalloc_inline_state.free_list + RPMALLOC_INLINE_SIZE_CLASS(48);
+	void* head = *free_list;
+	if (head && (rpmalloc_inline(48) != head))
+		return test_fail("Block not allocated inline");
+	if (head)
+		rpfree_inline(head, 48);
+#endif
+
+	// Fill pages of a small size class, free every other block inline and the rest in another thread, mixed with
+	// blocks freed by the library and sizes above the inline limit
+	const size_t sizes[] = {0, 16, 48, 1000, 1024, 1025, 4000};
+	void* pointers[4096];
+	for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+		const size_t size = sizes[isize];
+		for (int iloop = 0; iloop < 3; ++iloop) {
+			for (size_t iptr = 0; iptr < 4096; ++iptr) {
+				pointers[iptr] = rpmalloc_inline(size);
+				if (!pointers[iptr] || (rpmalloc_usable_size(pointers[iptr]) < size))
+					return test_fail("Inline allocation failed");
+				if (size)
+					memset(pointers[iptr], (int)(iptr & 0xFF), size);
+			}
+			for (size_t iptr = 0; iptr < 4096; iptr += 2) {
+				if (iptr & 2)
+					rpfree(pointers[iptr]);
+				else
+					rpfree_inline(pointers[iptr], size);
+			}
+			size_t remain = 0;
+			for (size_t iptr = 1; iptr < 4096; iptr += 2) {
+				if (size && (*(unsigned char*)pointers[iptr] != (unsigned char)(iptr & 0xFF)))
+					return test_fail("Inline free corrupted live block");
+				pointers[remain++] = pointers[iptr];
+			}
+			sized_thread_arg_t arg = {pointers, remain / 2, size};
+			thread_arg targ = {inline_free_thread, &arg};
+			uintptr_t thread = thread_run(&targ);
+			if (thread_join(thread) != 0)
+				return test_fail("Inline free thread failed");
+			for (size_t iptr = remain / 2; iptr < remain; ++iptr)
+				rpfree_inline(pointers[iptr], size);
+		}
+	}
+	rpfree_inline(0, 16);
+
+	// Blocks of other heaps are freed through the library
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	for (size_t iptr = 0; iptr < 64; ++iptr)
+		pointers[iptr] = rpmalloc_heap_alloc(heap, 64);
+	for (size_t iptr = 0; iptr < 64; ++iptr)
+		rpfree_inline(pointers[iptr], 64);
+	rpmalloc_heap_report_t report;
+	rpmalloc_heap_report(heap, &report);
+	for (size_t iclass = 0; iclass < report.size_class_count; ++iclass) {
+		if (report.size_class[iclass].block_used)
+			return test_fail("Inline free of first class heap block not returned to heap");
+	}
+	rpmalloc_heap_release(heap);
+
+	// All blocks freed inline are returned to the pages, sizes of the thread library allocations are not checked
+	rpmalloc_thread_collect();
+	rpmalloc_thread_report(&report);
+	if (report.size_class[RPMALLOC_INLINE_SIZE_CLASS(48)].block_used ||
+	    report.size_class[RPMALLOC_INLINE_SIZE_CLASS(1000)].block_used)
+		return test_fail("Blocks freed inline still used");
+
+	rpmalloc_finalize();
+
+	printf("Inline fast path tests passed\n");
+	return 0;
+}
+
+//! Check that the requested size of a zero allocation is zero after the memory of the size class was dirtied
+static int
+test_zero_dirty(size_t size, size_t count) {
+	void* pointers[64];
+	for (size_t iptr = 0; iptr < count; ++iptr) {
+		pointers[iptr] = rpmalloc(size);
+		if (!pointers[iptr])
+			return test_fail("Allocation failed");
+		memset(pointers[iptr], 0xFF, rpmalloc_usable_size(pointers[iptr]));
+	}
+	for (size_t iptr = 0; iptr < count; ++iptr)
+		rpfree(pointers[iptr]);
+	rpmalloc_thread_collect();
+	for (size_t iptr = 0; iptr < count; ++iptr) {
+		pointers[iptr] = rpcalloc(1, size - (iptr % 7));
+		if (!pointers[iptr])
+			return test_fail("Zero allocation failed");
+		for (size_t ibyte = 0; ibyte < size - (iptr % 7); ++ibyte) {
+			if (((unsigned char*)pointers[iptr])[ibyte])
+				return test_fail("Zero allocation not zero");
+		}
+	}
+	for (size_t iptr = 0; iptr < count; ++iptr)
+		rpfree(pointers[iptr]);
+	return 0;
+}
+
+static int
+test_zero(void) {
+	rpmalloc_config_t config = {0};
+	for (int imode = 0; imode < 3; ++imode) {
+		// Recommitted pages are only known to be zero with immediate decommit
+		memset(&config, 0, sizeof(config));
+		config.decommit_lazy = (imode == 1);
+		config.disable_decommit = (imode == 2);
+		config.page_decay_time[0] = 1;
+		config.page_decay_time[1] = 1;
+		config.page_decay_time[2] = 1;
+		rpmalloc_initialize_config(0, &config);
+		const size_t sizes[] = {48, 3000, 200000, 3 * 1024 * 1024, 20 * 1024 * 1024};
+		const size_t counts[] = {64, 64, 64, 24, 4};
+		for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+			for (int iloop = 0; iloop < 2; ++iloop) {
+				if (test_zero_dirty(sizes[isize], counts[isize]))
+					return -1;
+				thread_sleep(2);
+			}
+		}
+		rpmalloc_finalize();
+	}
+	memset(&config, 0, sizeof(config));
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_finalize();
+
+	printf("Zero allocation tests passed\n");
+	return 0;
+}
+
+static int
+test_prepare(void) {
+	static void* pointers[16384];
+	rpmalloc_initialize(0);
+	const size_t sizes[] = {64, 3000, 200000, 3 * 1024 * 1024};
+	const size_t counts[] = {16384, 1000, 100, 10};
+	for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+		if (rpmalloc_thread_prepare(sizes[isize], counts[isize], RPMALLOC_PREPARE_PREFAULT) < counts[isize])
+			return test_fail("Failed to prepare thread heap");
+	}
+	if (rpmalloc_thread_prepare(64 * 1024 * 1024, 1, 0))
+		return test_fail("Prepared huge blocks");
+
+	// Allocating the prepared blocks must not map or commit more memory
+	size_t mapped, committed, mapped_after, committed_after;
+	for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+		rpmalloc_memory_usage(&mapped, &committed);
+		for (size_t iptr = 0; iptr < counts[isize]; ++iptr) {
+			pointers[iptr] = rpmalloc(sizes[isize]);
+			if (!pointers[iptr])
+				return test_fail("Allocation of prepared block failed");
+			memset(pointers[iptr], (int)(iptr & 0xFF), sizes[isize]);
+		}
+		for (size_t iptr = 0; iptr < counts[isize]; ++iptr) {
+			if (((unsigned char*)pointers[iptr])[sizes[isize] - 1] != (unsigned char)(iptr & 0xFF))
+				return test_fail("Prepared block data corrupted");
+		}
+		rpmalloc_memory_usage(&mapped_after, &committed_after);
+		if ((mapped_after != mapped) || (committed_after != committed))
+			return test_fail("Allocation of prepared blocks mapped memory");
+		for (size_t iptr = 0; iptr < counts[isize]; ++iptr)
+			rpfree(pointers[iptr]);
+	}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	if (rpmalloc_heap_prepare(heap, 3000, 1000, 0) < 1000)
+		return test_fail("Failed to prepare heap");
+	size_t heap_committed = rpmalloc_heap_memory_committed(heap);
+	for (size_t iptr = 0; iptr < 1000; ++iptr) {
+		pointers[iptr] = rpmalloc_heap_alloc(heap, 3000);
+		if (!pointers[iptr])
+			return test_fail("Allocation of prepared heap block failed");
+		memset(pointers[iptr], 1, 3000);
+	}
+	if (rpmalloc_heap_memory_committed(heap) != heap_committed)
+		return test_fail("Allocation of prepared heap blocks committed memory");
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+#endif
+
+	rpmalloc_finalize();
+
+	printf("Prepare tests passed\n");
+	return 0;
+}
+
+static int
+test_report(void) {
+	static void* pointers[1050];
+	rpmalloc_heap_report_t report;
+	rpmalloc_initialize(0);
+
+	for (size_t iptr = 0; iptr < 1050; ++iptr)
+		pointers[iptr] = rpmalloc((iptr < 1000) ? 100 : 200000);
+	for (size_t iptr = 0; iptr < 1000; iptr += 2)
+		rpfree(pointers[iptr]);
+	rpmalloc_thread_report(&report);
+	size_t block_used = 0;
+	for (size_t iclass = 0; iclass < report.size_class_count; ++iclass)
+		block_used += report.size_class[iclass].block_used;
+	if ((report.heap_count != 1) || (block_used < 550) || !report.page_type[0].page_used ||
+	    !report.page_type[1].page_used)
+		return test_fail("Bad thread heap report");
+	if ((report.fragmentation <= 0.0) || (report.fragmentation >= 1.0))
+		return test_fail("Bad thread heap fragmentation");
+	for (size_t iptr = 1; iptr < 1050; iptr += (iptr < 1000) ? 2 : 1)
+		rpfree(pointers[iptr]);
+
+	rpmalloc_global_report(&report);
+	if (!report.heap_count || (report.heap_estimated_count >= report.heap_count))
+		return test_fail("Bad global heap report");
+
+	FILE* file = tmpfile();
+	if (file) {
+		char buffer[64] = {0};
+		rpmalloc_dump_report(file, &report);
+		rewind(file);
+		size_t read = fread(buffer, 1, sizeof(buffer) - 1, file);
+		fclose(file);
+		if (!read || strncmp(buffer, "{\"heap_count\":", 14))
+			return test_fail("Bad heap report dump");
+	}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	// First class heaps report exact block counts
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	for (size_t iptr = 0; iptr < 1050; ++iptr)
+		pointers[iptr] = rpmalloc_heap_alloc(heap, (iptr < 1000) ? 100 : 200000);
+	for (size_t iptr = 0; iptr < 1000; iptr += 2)
+		rpmalloc_heap_free(heap, pointers[iptr]);
+	void* huge = rpmalloc_heap_alloc(heap, 20 * 1024 * 1024);
+	rpmalloc_heap_report(heap, &report);
+	size_t small_used = 0;
+	size_t small_free = 0;
+	size_t medium_used = 0;
+	for (size_t iclass = 0; iclass < report.size_class_count; ++iclass) {
+		if ((report.size_class[iclass].block_size >= 100) && (report.size_class[iclass].block_size < 200)) {
+			small_used += report.size_class[iclass].block_used;
+			small_free += report.size_class[iclass].block_free;
+		} else if (report.size_class[iclass].block_size >= 200000) {
+			medium_used += report.size_class[iclass].block_used;
+		}
+	}
+	if ((small_used != 500) || (small_free < 500) || (medium_used != 50))
+		return test_fail("Bad first class heap report block counts");
+	if ((report.huge_count != 1) || (report.huge_bytes < 20 * 1024 * 1024))
+		return test_fail("Bad first class heap report huge blocks");
+	rpmalloc_heap_free(heap, huge);
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+#endif
+
+	rpmalloc_finalize();
+
+	printf("Heap report tests passed\n");
+	return 0;
+}
+
+static int
+test_numa(void) {
+	rpmalloc_config_t config = {0};
+	config.enable_numa = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	const unsigned int node_count = rpmalloc_numa_node_count();
+	if (!node_count)
+		return test_fail("Bad NUMA node count");
+	if (rpmalloc_config()->enable_numa != (node_count > 1))
+		return test_fail("Bad NUMA configuration");
+
+	if (test_thread_implementation())
+		return -1;
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	// Heaps for each node, including out of range node, with blocks freed from this thread
+	void* blocks[256];
+	for (unsigned int inode = 0; inode <= node_count; ++inode) {
+		rpmalloc_heap_t* heap = rpmalloc_heap_acquire_node(inode);
+		if (!heap)
+			return test_fail("Failed to acquire NUMA node heap");
+		for (size_t iblock = 0; iblock < 256; ++iblock) {
+			blocks[iblock] = rpmalloc_heap_alloc(heap, 16 + (iblock * 1931) % 300000);
+			if (!blocks[iblock])
+				return test_fail("Failed to allocate from NUMA node heap");
+			memset(blocks[iblock], 0xAA, 16);
+		}
+		for (size_t iblock = 0; iblock < 256; iblock += 2)
+			rpfree(blocks[iblock]);
+		void* huge = rpmalloc_heap_alloc(heap, 12 * 1024 * 1024);
+		if (!huge)
+			return test_fail("Failed to allocate huge block from NUMA node heap");
+		rpmalloc_heap_free_all(heap);
+		rpmalloc_heap_release(heap);
+	}
+#endif
+
+	rpmalloc_finalize();
+
+	printf("NUMA tests passed\n");
+	return 0;
+}
+
+static void
+heap_queue_thread(void* argp) {
+	unsigned int loops = *(unsigned int*)argp;
+	uintptr_t ret = 0;
+	for (unsigned int iloop = 0; !ret && (iloop < loops); ++iloop) {
+		// Acquire a heap from the queue and make sure no other thread uses it concurrently
+		rpmalloc_thread_initialize();
+		uint32_t* block[16];
+		for (unsigned int iblock = 0; iblock < 16; ++iblock) {
+			block[iblock] = rpmalloc(16 + (iblock * 24));
+			*block[iblock] = iloop + iblock;
+		}
+		thread_yield();
+		for (unsigned int iblock = 0; iblock < 16; ++iblock) {
+			if (*block[iblock] != (iloop + iblock))
+				ret = 1;
+			rpfree(block[iblock]);
+		}
+		rpmalloc_thread_finalize();
+	}
+	thread_exit(ret);
+}
+
+static void
+heap_queue_wrap_thread(void* argp) {
+	unsigned int loops = *(unsigned int*)argp;
+	uintptr_t ret = 0;
+	for (unsigned int iloop = 0; !ret && (iloop < loops); ++iloop) {
+		rpmalloc_thread_initialize();
+		if (!(iloop % 4096)) {
+			uint32_t* block = rpmalloc(16);
+			*block = iloop;
+			thread_yield();
+			if (*block != iloop)
+				ret = 1;
+			rpfree(block);
+		}
+		rpmalloc_thread_finalize();
+	}
+	thread_exit(ret);
+}
+
+static int
+test_heap_queue(void) {
+	rpmalloc_config_t config = {0};
+	rpmalloc_initialize_config(0, &config);
+
+	// Threads started one after another should all reuse a released heap
+	unsigned int loops = 1;
+	thread_arg targ = {heap_queue_thread, &loops};
+	rpmalloc_global_statistics_t before, after;
+	rpmalloc_global_statistics(&before);
+	for (unsigned int ithread = 0; ithread < 64; ++ithread) {
+		if (thread_join(thread_run(&targ)) != 0)
+			return test_fail("Heap queue thread failed");
+	}
+	rpmalloc_global_statistics(&after);
+#if ENABLE_STATISTICS
+	if (after.heap_count > before.heap_count + 1)
+		return test_fail("Released heaps not reused");
+#endif
+
+	// Concurrent acquire and release of heaps
+	uintptr_t thread[32];
+	size_t num_threads = hardware_threads * 2;
+	if (num_threads < 4)
+		num_threads = 4;
+	if (num_threads > 32)
+		num_threads = 32;
+	loops = 2000;
+	for (size_t ithread = 0; ithread < num_threads; ++ithread)
+		thread[ithread] = thread_run(&targ);
+	for (size_t ithread = 0; ithread < num_threads; ++ithread) {
+		if (thread_join(thread[ithread]) != 0)
+			return test_fail("Heap shared between threads");
+	}
+
+	// Each thread initialization and finalization pops and pushes the released heap queue, cycle the 28 bit queue
+	// tag past its wrap point with concurrent acquire and release
+	targ.fn = heap_queue_wrap_thread;
+	loops = ((1U << 27) / 4) + 4096;
+	for (size_t ithread = 0; ithread < 4; ++ithread)
+		thread[ithread] = thread_run(&targ);
+	for (size_t ithread = 0; ithread < 4; ++ithread) {
+		if (thread_join(thread[ithread]) != 0)
+			return test_fail("Heap shared between threads after queue tag wrap");
+	}
+
+	rpmalloc_finalize();
+
+	printf("Heap queue tests passed\n");
+	return 0;
+}
+
+static void
+orphan_thread(void* argp) {
+	void** pointers = argp;
+	rpmalloc_thread_initialize();
+	for (size_t iptr = 0; iptr < 4096; ++iptr)
+		pointers[iptr] = rpmalloc(272);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static size_t
+orphan_block_used(size_t block_size) {
+	rpmalloc_heap_report_t report;
+	rpmalloc_thread_report(&report);
+	for (size_t iclass = 0; iclass < report.size_class_count; ++iclass) {
+		if (report.size_class[iclass].block_size >= block_size)
+			return report.size_class[iclass].block_used;
+	}
+	return 0;
+}
+
+static int
+test_orphan(void) {
+	static void* pointers[4096];
+	rpmalloc_initialize(0);
+
+	// Adopt heaps released in previous tests first
+	rpmalloc_thread_collect();
+	size_t block_used = orphan_block_used(272);
+
+	// Blocks of a thread that exited and freed by another thread are recycled by the heap adopting the pages
+	thread_arg targ = {orphan_thread, pointers};
+	if (thread_join(thread_run(&targ)) != 0)
+		return test_fail("Orphan thread failed");
+	for (size_t iptr = 0; iptr < 4096; ++iptr) {
+		if (!pointers[iptr])
+			return test_fail("Orphan thread allocation failed");
+		if (iptr % 64)
+			rpfree(pointers[iptr]);
+	}
+	rpmalloc_thread_collect();
+	if (orphan_block_used(272) != block_used + 64)
+		return test_fail("Pages of released heap not adopted");
+	for (size_t iptr = 0; iptr < 4096; iptr += 64)
+		rpfree(pointers[iptr]);
+	if (orphan_block_used(272) != block_used)
+		return test_fail("Blocks in adopted pages not freed");
+
+	rpmalloc_finalize();
+
+	printf("Orphan heap tests passed\n");
+	return 0;
+}
+
+// Small pages hold 15 blocks of 4KiB, and the global cache holds 8 shards of 256 free small pages
+#define ORPHAN_FREE_BLOCK_COUNT (15 * (8 * 256 + 64))
+
+static void
+orphan_free_thread(void* argp) {
+	void** pointers = argp;
+	rpmalloc_thread_initialize();
+	for (size_t iptr = 0; iptr < ORPHAN_FREE_BLOCK_COUNT; ++iptr)
+		pointers[iptr] = rpmalloc(4096);
+	// Keep the first block so the span is not released. Decommitted free pages fill the global cache and the rest
+	// stay in the free list after the committed free pages
+	for (size_t iptr = 1; iptr < ORPHAN_FREE_BLOCK_COUNT; ++iptr)
+		rpfree(pointers[iptr]);
+	rpmalloc_thread_finalize();
+	thread_exit(0);
+}
+
+static int
+test_orphan_page_free(void) {
+	void* block[61];
+	rpmalloc_initialize(0);
+	rpmalloc_thread_collect();
+
+	// Leave committed free pages in the heap, then adopt a released heap with both committed and decommitted free
+	// pages. Collecting must decommit all committed free pages of both heaps
+	void** pointers = rpmalloc(sizeof(void*) * ORPHAN_FREE_BLOCK_COUNT);
+	for (size_t iblock = 0; iblock < 61; ++iblock)
+		block[iblock] = rpmalloc(4096);
+	for (size_t iblock = 1; iblock < 61; ++iblock)
+		rpfree(block[iblock]);
+	thread_arg targ = {orphan_free_thread, pointers};
+	if (thread_join(thread_run(&targ)) != 0)
+		return test_fail("Orphan thread failed");
+	if (!pointers[0])
+		return test_fail("Orphan thread allocation failed");
+	rpmalloc_thread_collect();
+	rpmalloc_thread_statistics_t stats;
+	rpmalloc_thread_statistics(&stats);
+	if (stats.pagecache)
+		return test_fail("Committed free pages not decommitted after adopting released heap");
+
+	rpfree(block[0]);
+	rpfree(pointers[0]);
+	rpfree(pointers);
+	rpmalloc_finalize();
+
+	printf("Orphan heap free page tests passed\n");
+	return 0;
+}
+
+static int
+test_span_reserve(void) {
+	rpmalloc_config_t config = {0};
+	config.span_reserve_size = 1024 * 1024;
+	rpmalloc_initialize_config(0, &config);
+	if (!rpmalloc_config()->span_reserve_size) {
+		// Not supported on this platform
+		rpmalloc_finalize();
+		printf("Span reserve tests passed\n");
+		return 0;
+	}
+
+	const size_t pointer_count = 16384;
+	void** pointers = rpmalloc(sizeof(void*) * pointer_count);
+
+#if RPMALLOC_FIRST_CLASS_HEAPS && defined(__linux__) && defined(MAP_FIXED_NOREPLACE)
+	// The global cache holds a bounded number of spans, so some of these heaps must map new spans which should
+	// only have the initial part of the span address space reserved
+	const size_t span_size = 256 * 1024 * 1024;
+	rpmalloc_heap_t* heap[32];
+	void* guard = 0;
+	size_t guard_heap = 0;
+	for (size_t iheap = 0; iheap < 32; ++iheap) {
+		heap[iheap] = rpmalloc_heap_acquire();
+		void* block = rpmalloc_heap_alloc(heap[iheap], 1000);
+		if (!block)
+			return test_fail("Allocation failed with partial span reservation");
+		void* span = (void*)((uintptr_t)block & ~(uintptr_t)(span_size - 1));
+		// Block the address range after the initial reservation, the span has to be limited to the reserved pages
+		void* target = pointer_offset(span, 2 * 1024 * 1024);
+		void* probe = mmap(target, 65536, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (probe == MAP_FAILED)
+			continue;
+		if (guard || (probe != target)) {
+			munmap(probe, 65536);
+			continue;
+		}
+		guard = probe;
+		guard_heap = iheap;
+	}
+	if (!guard)
+		return test_fail("No span with partial address space reservation");
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+		pointers[iptr] = rpmalloc_heap_alloc(heap[guard_heap], 1000);
+		if (!pointers[iptr])
+			return test_fail("Allocation failed with partial span reservation");
+		if ((pointers[iptr] < pointer_offset(guard, 65536)) && (pointer_offset(pointers[iptr], 1000) > guard))
+			return test_fail("Block overlaps memory mapped after span reservation");
+		memset(pointers[iptr], (int)(iptr & 0xFF), 1000);
+	}
+	for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+		if (((unsigned char*)pointers[iptr])[999] != (unsigned char)(iptr & 0xFF))
+			return test_fail("Data corrupted with partial span reservation");
+	}
+	for (size_t iheap = 0; iheap < 32; ++iheap) {
+		rpmalloc_heap_free_all(heap[iheap]);
+		rpmalloc_heap_release(heap[iheap]);
+	}
+	munmap(guard, 65536);
+#endif
+
+	// Use enough pages of each type to require extending the reservations
+	const size_t sizes[] = {1000, 60000, 2000000};
+	const size_t counts[] = {pointer_count, 512, 64};
+	for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+		for (size_t iptr = 0; iptr < counts[isize]; ++iptr) {
+			pointers[iptr] = rpmalloc(sizes[isize]);
+			if (!pointers[iptr])
+				return test_fail("Allocation failed with partial span reservation");
+			memset(pointers[iptr], (int)(iptr & 0xFF), sizes[isize]);
+		}
+		for (size_t iptr = 0; iptr < counts[isize]; ++iptr) {
+			if (((unsigned char*)pointers[iptr])[sizes[isize] - 1] != (unsigned char)(iptr & 0xFF))
+				return test_fail("Data corrupted with partial span reservation");
+		}
+		for (size_t iptr = 0; iptr < counts[isize]; ++iptr)
+			rpfree(pointers[iptr]);
+	}
+	rpfree(pointers);
+
+	if (test_thread_implementation())
+		return -1;
+
+	rpmalloc_finalize();
+
+	// Restore full span reservation for later tests
+	config.span_reserve_size = 0;
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_finalize();
+
+	printf("Span reserve tests passed\n");
+	return 0;
+}
+
+#if defined(__linux__)
+//! Count the pages in the given list that are no longer resident, not including the page header
+static size_t
+decay_count_purged_pages(void** page, size_t page_count) {
+	size_t os_page_size = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char residency[1];
+	size_t purged_count = 0;
+	for (size_t ipage = 0; ipage < page_count; ++ipage) {
+		if (mincore(pointer_offset(page[ipage], os_page_size), os_page_size, residency))
+			continue;
+		if (!(residency[0] & 1))
+			++purged_count;
+	}
+	return purged_count;
+}
+#endif
+
+static int
+test_decay(void) {
+	const size_t pointer_count = 512;
+	const size_t page_size = 65536;
+	void* pointers[512];
+	void* page[512];
+
+	for (int ilazy = 0; ilazy < 2; ++ilazy) {
+		rpmalloc_config_t config = {0};
+		config.page_decay_time[0] = 20;
+		config.page_decay_time[1] = 20;
+		config.page_decay_time[2] = 20;
+		config.decommit_lazy = ilazy;
+		rpmalloc_initialize_config(0, &config);
+
+		// Use a number of small pages and free them, less than the free page list overflow threshold
+		size_t page_count = 0;
+		for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+			pointers[iptr] = rpmalloc(1000);
+			if (!pointers[iptr])
+				return test_fail("Allocation failed with page decay");
+			memset(pointers[iptr], (int)(iptr & 0xFF), 1000);
+			void* block_page = (void*)((uintptr_t)pointers[iptr] & ~(uintptr_t)(page_size - 1));
+			if (!page_count || (page[page_count - 1] != block_page))
+				page[page_count++] = block_page;
+		}
+		for (size_t iptr = 0; iptr < pointer_count; ++iptr)
+			rpfree(pointers[iptr]);
+
+		// Freeing a page after the decay time should purge the pages freed earlier
+		thread_sleep(100);
+		for (size_t iptr = 0; iptr < 16; ++iptr)
+			pointers[iptr] = rpmalloc(2000);
+		for (size_t iptr = 0; iptr < 16; ++iptr)
+			rpfree(pointers[iptr]);
+
+#if defined(__linux__)
+		if (!ilazy && !rpmalloc_config()->disable_decommit) {
+			// All but the page reused for the new allocations should be purged
+			size_t purged_count = decay_count_purged_pages(page, page_count);
+			if ((purged_count + 1) < page_count)
+				return test_fail("Decayed free pages were not purged");
+		}
+#endif
+
+		// Reuse the purged pages
+		for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+			pointers[iptr] = rpmalloc(1000);
+			if (!pointers[iptr])
+				return test_fail("Allocation failed with page decay");
+			memset(pointers[iptr], (int)(iptr & 0xFF), 1000);
+		}
+		for (size_t iptr = 0; iptr < pointer_count; ++iptr) {
+			if (((unsigned char*)pointers[iptr])[999] != (unsigned char)(iptr & 0xFF))
+				return test_fail("Data corrupted with page decay");
+		}
+		for (size_t iptr = 0; iptr < pointer_count; ++iptr)
+			rpfree(pointers[iptr]);
+
+		rpmalloc_thread_collect();
+		rpmalloc_finalize();
+
+		// Restore default decay settings for later tests
+		memset(&config, 0, sizeof(config));
+		rpmalloc_initialize_config(0, &config);
+		rpmalloc_finalize();
+	}
+
+	printf("Page decay tests passed\n");
+	return 0;
+}
+
+#if defined(__linux__)
+//! Check if the memory mapping containing the address has the given flag in /proc/self/smaps
+static int
+thp_mapping_has_flag(void* address, const char* flag) {
+	FILE* smaps = fopen("/proc/self/smaps", "r");
+	if (!smaps)
+		return -1;
+	char line[512];
+	int in_mapping = 0;
+	int has_flag = 0;
+	while (fgets(line, sizeof(line), smaps)) {
+		unsigned long long start = 0, end = 0;
+		if (sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+			in_mapping = ((uintptr_t)address >= start) && ((uintptr_t)address < end);
+		} else if (in_mapping && !strncmp(line, "VmFlags:", 8)) {
+			has_flag = (strstr(line, flag) != 0);
+			break;
+		}
+	}
+	fclose(smaps);
+	return has_flag;
+}
+#endif
+
+static int
+test_thp_policy(void) {
+	rpmalloc_config_t config = {0};
+	config.page_thp_policy[0] = RPMALLOC_THP_DISABLE;
+	config.page_thp_policy[1] = RPMALLOC_THP_ENABLE;
+	config.page_thp_policy[2] = RPMALLOC_THP_ENABLE;
+	rpmalloc_initialize_config(0, &config);
+	if (rpmalloc_config()->page_thp_policy[1] != RPMALLOC_THP_ENABLE) {
+		// Not supported on this platform
+		rpmalloc_finalize();
+		printf("THP policy tests passed\n");
+		return 0;
+	}
+
+#if defined(__linux__) && RPMALLOC_FIRST_CLASS_HEAPS
+	// Use a new heap, a reused thread heap might have partially used spans advised before the policy was set
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	void* small = rpmalloc_heap_alloc(heap, 1000);
+	void* medium = rpmalloc_heap_alloc(heap, 200000);
+	if (!thp_mapping_has_flag(small, " nh"))
+		return test_fail("Small page span not advised against huge pages");
+	if (!thp_mapping_has_flag(medium, " hg"))
+		return test_fail("Medium page span not advised to use huge pages");
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+#endif
+
+	// Free enough medium and large pages to overflow the free page lists and decommit pages in huge page spans
+	const size_t sizes[] = {200000, 4000000};
+	const size_t counts[] = {256, 40};
+	void* pointers[256];
+	for (int iloop = 0; iloop < 2; ++iloop) {
+		for (size_t isize = 0; isize < sizeof(sizes) / sizeof(sizes[0]); ++isize) {
+			for (size_t iptr = 0; iptr < counts[isize]; ++iptr) {
+				pointers[iptr] = rpmalloc(sizes[isize]);
+				if (!pointers[iptr])
+					return test_fail("Allocation failed with huge page policy");
+				memset(pointers[iptr], (int)(iptr & 0xFF), sizes[isize]);
+			}
+			for (size_t iptr = 0; iptr < counts[isize]; ++iptr) {
+				if (((unsigned char*)pointers[iptr])[sizes[isize] - 1] != (unsigned char)(iptr & 0xFF))
+					return test_fail("Data corrupted with huge page policy");
+			}
+			for (size_t iptr = 0; iptr < counts[isize]; ++iptr)
+				rpfree(pointers[iptr]);
+		}
+		rpmalloc_thread_collect();
+	}
+
+	void* zeroed = rpzalloc(200000);
+	for (size_t ibyte = 0; ibyte < 200000; ++ibyte) {
+		if (((unsigned char*)zeroed)[ibyte])
+			return test_fail("Zero allocation not zeroed with huge page policy");
+	}
+	rpfree(zeroed);
+
+	rpmalloc_finalize();
+
+	// Restore default huge page policy for later tests
+	memset(&config, 0, sizeof(config));
+	rpmalloc_initialize_config(0, &config);
+	rpmalloc_finalize();
+
+	printf("THP policy tests passed\n");
+	return 0;
+}
+
+static int
+test_first_class_heaps(void) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	uintptr_t thread[32];
+	uintptr_t threadres[32];
+	unsigned int i;
+	size_t num_alloc_threads;
+	allocator_thread_arg_t arg[32];
+
+	rpmalloc_config_t config = {0};
+	//config.unmap_on_finalize = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	num_alloc_threads = hardware_threads * 2;
+	if (num_alloc_threads < 2)
+		num_alloc_threads = 2;
+	if (num_alloc_threads > 16)
+		num_alloc_threads = 16;
+
+	for (i = 0; i < num_alloc_threads; ++i) {
+		arg[i].datasize[0] = 19;
+		arg[i].datasize[1] = 249;
+		arg[i].datasize[2] = 797;
+		arg[i].datasize[3] = 3058;
+		arg[i].datasize[4] = 47892;
+		arg[i].datasize[5] = 173932;
+		arg[i].datasize[6] = 389;
+		arg[i].datasize[7] = 19;
+		arg[i].datasize[8] = 2493;
+		arg[i].datasize[9] = 7979;
+		arg[i].datasize[10] = 3;
+		arg[i].datasize[11] = 79374;
+		arg[i].datasize[12] = 3432;
+		arg[i].datasize[13] = 548;
+		arg[i].datasize[14] = 38934;
+		arg[i].datasize[15] = 234;
+		arg[i].num_datasize = 16;
+#if defined(__LLP64__) || defined(__LP64__) || defined(_WIN64)
+		arg[i].loops = 100;
+		arg[i].passes = 4000;
+#else
+		arg[i].loops = 50;
+		arg[i].passes = 1000;
+#endif
+		arg[i].init_fini_each_loop = 1;
+
+		thread_arg targ;
+		targ.fn = heap_allocator_thread;
+		if ((i % 2) != 0)
+			targ.fn = allocator_thread;
+		targ.arg = &arg[i];
+
+		thread[i] = thread_run(&targ);
+	}
+
+	thread_sleep(1000);
+
+	for (i = 0; i < num_alloc_threads; ++i)
+		threadres[i] = thread_join(thread[i]);
+
+	rpmalloc_finalize();
+
+	for (i = 0; i < num_alloc_threads; ++i) {
+		if (threadres[i])
+			return -1;
+	}
+
+	printf("First class heap tests passed\n");
+#endif
+	return 0;
+}
+
+static int
+test_arena(void) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_initialize(0);
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	if (!heap)
+		return test_fail("Failed to acquire heap");
+
+	// Bump allocations are contiguous and aligned to the default granularity
+	char* first = rpmalloc_heap_arena_alloc(heap, 20);
+	char* second = rpmalloc_heap_arena_alloc(heap, 0);
+	char* third = rpmalloc_heap_arena_alloc(heap, 16);
+	if (!first || ((uintptr_t)first & 15))
+		return test_fail("Bad arena block alignment");
+	if ((second != first + 32) || (third != second + 16))
+		return test_fail("Arena blocks not bump allocated");
+	if (rpmalloc_get_heap_for_ptr(first) != heap)
+		return test_fail("Bad heap for arena block");
+
+	char* aligned = rpmalloc_heap_arena_aligned_alloc(heap, 4096, 100);
+	if (!aligned || ((uintptr_t)aligned & 4095) || (aligned < third + 16))
+		return test_fail("Bad aligned arena block");
+	if (rpmalloc_heap_arena_aligned_alloc(heap, 0, 16) != aligned + 112)
+		return test_fail("Bad default arena alignment");
+
+	// Fill blocks with a pattern, crossing several commit chunks, and verify no blocks overlap
+	char* block[1024];
+	for (unsigned int iblock = 0; iblock < 1024; ++iblock) {
+		size_t size = 1 + ((iblock * 7919) % 4093);
+		block[iblock] = rpmalloc_heap_arena_alloc(heap, size);
+		if (!block[iblock])
+			return test_fail("Arena allocation failed");
+		memset(block[iblock], (int)(iblock & 0xFF), size);
+	}
+	for (unsigned int iblock = 0; iblock < 1024; ++iblock) {
+		size_t size = 1 + ((iblock * 7919) % 4093);
+		for (size_t ibyte = 0; ibyte < size; ++ibyte) {
+			if (block[iblock][ibyte] != (char)(iblock & 0xFF))
+				return test_fail("Arena block data corrupted");
+		}
+	}
+
+	// Reset keeps the arena span and rewinds to the start of it
+	rpmalloc_heap_free_all(heap);
+	char* reset = rpmalloc_heap_arena_alloc(heap, 20);
+	if (reset != first)
+		return test_fail("Arena not rewound on reset");
+
+	// Allocations exceeding an arena span continue in new spans, and blocks too large for arena spans are allocated
+	// as huge blocks of the heap, all released by reset
+	for (unsigned int iblock = 0; iblock < 40; ++iblock) {
+		char* large = rpmalloc_heap_arena_alloc(heap, 8 * 1024 * 1024);
+		if (!large)
+			return test_fail("Large arena allocation failed");
+		large[0] = 1;
+		large[8 * 1024 * 1024 - 1] = 1;
+	}
+	char* huge = rpmalloc_heap_arena_alloc(heap, 32 * 1024 * 1024);
+	if (!huge)
+		return test_fail("Huge arena allocation failed");
+	huge[32 * 1024 * 1024 - 1] = 1;
+	rpmalloc_heap_free_all(heap);
+
+	if (rpmalloc_heap_arena_alloc(heap, 64) == 0)
+		return test_fail("Arena allocation after reset failed");
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+
+	rpmalloc_finalize();
+
+	printf("Arena tests passed\n");
+#endif
+	return 0;
+}
+
+static int
+test_heap_reset(void) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_initialize(0);
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	if (!heap)
+		return test_fail("Failed to acquire heap");
+
+	// Repeated tasks on a heap reset with enough memory retained reach a steady state where no memory is mapped or
+	// committed, and blocks of later tasks reuse the retained pages
+	const size_t retain_size = 64 * 1024 * 1024;
+	void* block[2048];
+	size_t mapped[4], committed[4];
+	for (int itask = 0; itask < 4; ++itask) {
+		for (size_t iblock = 0; iblock < 2048; ++iblock) {
+			size_t size = (iblock % 100) ? 100 : 200000;
+			block[iblock] = rpmalloc_heap_alloc(heap, size);
+			if (!block[iblock])
+				return test_fail("Heap allocation failed");
+			memset(block[iblock], (int)(iblock & 0xFF), size);
+		}
+		void* huge = rpmalloc_heap_alloc(heap, 20 * 1024 * 1024);
+		if (!huge)
+			return test_fail("Huge heap allocation failed");
+		for (size_t iblock = 0; iblock < 2048; ++iblock) {
+			size_t size = (iblock % 100) ? 100 : 200000;
+			if ((*(unsigned char*)block[iblock] != (unsigned char)(iblock & 0xFF)) ||
+			    (((unsigned char*)block[iblock])[size - 1] != (unsigned char)(iblock & 0xFF)))
+				return test_fail("Heap blocks overlap after reset");
+		}
+		// Free some blocks individually, leaving blocks in the heap local free lists
+		for (size_t iblock = 0; iblock < 2048; iblock += 3)
+			rpmalloc_heap_free(heap, block[iblock]);
+
+		rpmalloc_heap_reset(heap, retain_size);
+		rpmalloc_memory_usage(mapped + itask, committed + itask);
+		if (!rpmalloc_heap_memory_committed(heap) || (rpmalloc_heap_memory_committed(heap) > retain_size))
+			return test_fail("Bad committed memory after heap reset");
+
+		rpmalloc_heap_report_t report;
+		rpmalloc_heap_report(heap, &report);
+		for (size_t iclass = 0; iclass < report.size_class_count; ++iclass) {
+			if (report.size_class[iclass].block_used)
+				return test_fail("Used blocks remaining after heap reset");
+		}
+		if (report.huge_count)
+			return test_fail("Huge blocks remaining after heap reset");
+	}
+	if ((mapped[3] != mapped[1]) || (committed[3] != committed[1]))
+		return test_fail("Heap reset did not reach a steady state");
+
+	// Retaining less memory than the heap uses decommits surplus pages and releases surplus spans
+	const size_t small_page = 64 * 1024;
+	for (size_t iblock = 0; iblock < 2048; ++iblock)
+		block[iblock] = rpmalloc_heap_alloc(heap, (iblock % 100) ? 100 : 200000);
+	rpmalloc_heap_reset(heap, small_page);
+	if (rpmalloc_heap_memory_committed(heap) > 2 * small_page)
+		return test_fail("Heap reset retained too much memory");
+	for (size_t iblock = 0; iblock < 2048; ++iblock) {
+		size_t size = (iblock % 100) ? 100 : 200000;
+		block[iblock] = rpmalloc_heap_alloc(heap, size);
+		if (!block[iblock])
+			return test_fail("Heap allocation after partial reset failed");
+		memset(block[iblock], 0xAA, size);
+	}
+
+	// Arena spans are kept only if the committed memory fits
+	char* arena = rpmalloc_heap_arena_alloc(heap, 1024);
+	if (!arena)
+		return test_fail("Arena allocation failed");
+	rpmalloc_heap_reset(heap, retain_size);
+	if (rpmalloc_heap_arena_alloc(heap, 1024) != arena)
+		return test_fail("Arena span not kept by heap reset");
+	rpmalloc_heap_reset(heap, 0);
+	if (rpmalloc_heap_memory_committed(heap))
+		return test_fail("Heap reset without retain kept memory");
+
+	rpmalloc_heap_release(heap);
+
+	rpmalloc_finalize();
+
+	printf("Heap reset tests passed\n");
+#endif
+	return 0;
+}
+
+static size_t memory_pressure_count;
+static void* memory_pressure_heap;
+
+static void
+memory_pressure_callback(void* heap, size_t committed, size_t limit) {
+	(void)sizeof(committed);
+	(void)sizeof(limit);
+	memory_pressure_heap = heap;
+	++memory_pressure_count;
+}
+
+static int
+test_memory_limit(void) {
+	static void* block[4096];
+	size_t mapped = 0;
+	size_t committed = 0;
+	rpmalloc_initialize(0);
+	rpmalloc_memory_usage(&mapped, &committed);
+	if (!mapped || !committed || (committed > mapped))
+		return test_fail("Bad memory usage");
+	rpmalloc_finalize();
+
+	size_t medium_page = 4 * 1024 * 1024;
+	rpmalloc_interface_t memory_interface = {0};
+	memory_interface.memory_pressure_callback = memory_pressure_callback;
+	rpmalloc_config_t config = {0};
+	config.mapped_limit = mapped + (size_t)2048 * 1024 * 1024;
+	config.committed_soft_limit = committed + 64 * 1024 * 1024;
+	config.committed_limit = committed + 128 * 1024 * 1024;
+	rpmalloc_initialize_config(&memory_interface, &config);
+
+	// Allocate until the hard limit is hit, the soft limit must have been signalled on the way
+	size_t count = 0;
+	while (count < 4096) {
+		block[count] = rpmalloc(256 * 1024);
+		if (!block[count])
+			break;
+		memset(block[count], 1, 256 * 1024);
+		++count;
+	}
+	if (count == 4096)
+		return test_fail("Hard memory limit not enforced");
+	rpmalloc_memory_usage(&mapped, &committed);
+	if (committed > config.committed_limit + medium_page)
+		return test_fail("Committed memory exceeds hard limit");
+	if (committed > mapped)
+		return test_fail("Committed memory exceeds mapped memory");
+	if (!memory_pressure_count || memory_pressure_heap)
+		return test_fail("Memory pressure callback not called for soft limit");
+
+	// Freed memory can be allocated again, allowing for some difference in page overhead
+	for (size_t iblock = 0; iblock < count; ++iblock)
+		rpfree(block[iblock]);
+	for (size_t iblock = 0; iblock < count / 2; ++iblock) {
+		block[iblock] = rpmalloc(256 * 1024);
+		if (!block[iblock])
+			return test_fail("Allocation failed after freeing memory");
+	}
+	for (size_t iblock = 0; iblock < count / 2; ++iblock)
+		rpfree(block[iblock]);
+
+	// Mapping beyond the mapped limit fails
+	if (rpmalloc((size_t)4096 * 1024 * 1024))
+		return test_fail("Mapped memory limit not enforced");
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	rpmalloc_heap_set_memory_limit(heap, 16 * 1024 * 1024, 32 * 1024 * 1024);
+	memory_pressure_count = 0;
+	count = 0;
+	while (count < 4096) {
+		block[count] = rpmalloc_heap_alloc(heap, 64 * 1024);
+		if (!block[count])
+			break;
+		++count;
+	}
+	if (count == 4096)
+		return test_fail("Heap hard memory limit not enforced");
+	if (rpmalloc_heap_memory_committed(heap) > 32 * 1024 * 1024)
+		return test_fail("Heap committed memory exceeds hard limit");
+	if ((memory_pressure_count != 1) || (memory_pressure_heap != heap))
+		return test_fail("Memory pressure callback not called for heap soft limit");
+	rpmalloc_heap_free_all(heap);
+	if (rpmalloc_heap_memory_committed(heap) >= 16 * 1024 * 1024)
+		return test_fail("Heap committed memory not released by reset");
+	if (!rpmalloc_heap_alloc(heap, 64 * 1024))
+		return test_fail("Heap allocation failed after reset");
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+#endif
+
+	rpmalloc_finalize();
+	memory_pressure_count = 0;
+	memory_pressure_heap = 0;
+
+	printf("Memory limit tests passed\n");
+	return 0;
+}
+
+static int
+test_shared_memory(void) {
+#if defined(__linux__) && RPMALLOC_FIRST_CLASS_HEAPS
+	// The memory interface is set when initializing, allocations made since the last test might have initialized
+	// the allocator already
+	rpmalloc_initialize(0);
+	rpmalloc_finalize();
+
+	int fd = memfd_create("rpmalloc-test", 0);
+	if (fd < 0)
+		return test_fail("Failed to create memfd");
+	if (rpmalloc_shared_map(fd, (size_t)2048 * 1024 * 1024))
+		return test_fail("Failed to map shared memory region");
+	rpmalloc_initialize(rpmalloc_shared_interface());
+
+	// Producer writes messages to blocks of a first class heap in the shared memory region
+	static void* message[256];
+	size_t message_size = 1000;
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	for (size_t imsg = 0; imsg < 256; ++imsg) {
+		message[imsg] = (imsg % 16) ? rpmalloc_heap_alloc(heap, message_size) :
+		                              rpmalloc_heap_aligned_alloc(heap, 256, message_size);
+		if (!message[imsg])
+			return test_fail("Failed to allocate message in shared memory");
+		memset(message[imsg], (int)imsg, message_size);
+	}
+	void* huge = rpmalloc_heap_alloc(heap, 20 * 1024 * 1024);
+	if (!huge)
+		return test_fail("Failed to allocate huge message in shared memory");
+	memset(huge, 0x5a, 20 * 1024 * 1024);
+
+	// Consumer process attaches the region on its own, reads the messages in place and frees them
+	pid_t pid = fork();
+	if (pid == 0) {
+		rpmalloc_shared_unmap();
+		if (rpmalloc_shared_map(fd, 0))
+			_exit(1);
+		for (size_t imsg = 0; imsg < 256; ++imsg) {
+			const unsigned char* data = message[imsg];
+			if ((data[0] != (unsigned char)imsg) || (data[message_size - 1] != (unsigned char)imsg))
+				_exit(2);
+			rpmalloc_shared_free(message[imsg]);
+		}
+		if (((const unsigned char*)huge)[20 * 1024 * 1024 - 1] != 0x5a)
+			_exit(2);
+		rpmalloc_shared_free(huge);
+		_exit(0);
+	}
+	int status = 0;
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid))
+		return test_fail("Failed to run consumer process");
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) == 1))
+		return test_fail("Consumer process failed to attach shared memory region");
+	if (WEXITSTATUS(status))
+		return test_fail("Consumer process read bad message data");
+
+	// Blocks freed by the consumer are deferred to the producer heap
+	rpmalloc_heap_report_t report;
+	rpmalloc_heap_report(heap, &report);
+	size_t message_used = 0;
+	size_t message_thread_free = 0;
+	for (size_t iclass = 0; iclass < report.size_class_count; ++iclass) {
+		message_used += report.size_class[iclass].block_used;
+		message_thread_free += report.size_class[iclass].block_thread_free;
+	}
+	if (message_used || (message_thread_free != 256))
+		return test_fail("Blocks freed by consumer process not deferred to producer heap");
+
+	// The producer heap reuses the blocks, and releases the huge block when collecting the large page frees
+	size_t page_used = report.page_type[0].page_used;
+	for (size_t imsg = 0; imsg < 256; ++imsg) {
+		if (!rpmalloc_heap_alloc(heap, message_size))
+			return test_fail("Failed to allocate message in shared memory");
+	}
+	rpmalloc_heap_report(heap, &report);
+	if (report.page_type[0].page_used != page_used)
+		return test_fail("Blocks freed by consumer process not reused by producer heap");
+	if (!rpmalloc_heap_alloc(heap, 1024 * 1024))
+		return test_fail("Failed to allocate large block in shared memory");
+	rpmalloc_heap_report(heap, &report);
+	if (report.huge_count)
+		return test_fail("Huge block freed by consumer process not released");
+
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+	rpmalloc_finalize();
+	rpmalloc_shared_unmap();
+	close(fd);
+#endif
+	printf("Shared memory tests passed\n");
+	return 0;
+}
+
+static int
+test_large_pages(void) {
+	int ret = 0;
+
+	rpmalloc_config_t config = {0};
+	config.page_size = 16 * 1024 * 1024;
+
+	rpmalloc_initialize_config(0, &config);
+
+	ret = test_thread_implementation();
+
+	rpmalloc_finalize();
+
+	if (ret == 0)
+		printf("Large page config test passed\n");
+
+	return ret;
+}
+
+static int
+test_named_pages(void) {
+	rpmalloc_config_t config = {0};
+	char page_name[64] = {0};
+	snprintf(page_name, sizeof(page_name), "rpmalloc ::%s::", __func__);
+	config.page_name = page_name;
+	//config.unmap_on_finalize = 1;
+	rpmalloc_initialize_config(0, &config);
+
+	void* testptr = rpmalloc(16 * 1024 * 1024);
+#if defined(__linux__)
+	char name[256], buf[4096] = {0};
+	int pid = getpid();
+	snprintf(name, sizeof(name), "/proc/%d/maps", pid);
+	int fd = open(name, O_RDONLY);
+	if (fd != -1) {
+		ssize_t was_read = read(fd, buf, sizeof(buf));
+		(void)sizeof(was_read);
+		close(fd);
+	}
+#endif
+	rpfree(testptr);
+
+	rpmalloc_finalize();
+
+	printf("Named pages test passed\n");
+#if defined(__linux__)
+	// Since it is kernel version and config dependent
+	// we do not make an issue out of it.
+	if (!strstr(buf, page_name))
+		printf("\tbut the page did not get an id as expected\n");
+#endif
 	return 0;
 }
 
@@ -1179,6 +3287,9 @@ test_free(int print_log);
 extern int
 test_malloc_thread(void);
 
+extern int
+test_allocator(void);
+
 int
 test_run(int argc, char** argv) {
 	(void)sizeof(argc);
@@ -1192,6 +3303,10 @@ test_run(int argc, char** argv) {
 		return -1;
 	if (test_crossthread())
 		return -1;
+	if (test_remote_free())
+		return -1;
+	if (test_per_cpu_heaps())
+		return -1;
 	if (test_threaded())
 		return -1;
 	if (test_malloc(1))
@@ -1200,12 +3315,64 @@ test_run(int argc, char** argv) {
 		return -1;
 	if (test_malloc_thread())
 		return -1;
+	if (test_allocator())
+		return -1;
 	if (test_threadspam())
 		return -1;
+	if (test_thread_collect())
+		return -1;
+	if (test_statistics())
+		return -1;
+	if (test_size_class())
+		return -1;
+	if (test_sampling())
+		return -1;
+	if (test_event_log())
+		return -1;
+	if (test_huge_cache())
+		return -1;
+	if (test_huge_realloc())
+		return -1;
+	if (test_deferred_release())
+		return -1;
+	if (test_batch())
+		return -1;
+	if (test_sized_free())
+		return -1;
+	if (test_inline())
+		return -1;
+	if (test_zero())
+		return -1;
+	if (test_prepare())
+		return -1;
+	if (test_report())
+		return -1;
+	if (test_numa())
+		return -1;
+	if (test_heap_queue())
+		return -1;
+	if (test_orphan())
+		return -1;
+	if (test_orphan_page_free())
+		return -1;
+	if (test_span_reserve())
+		return -1;
+	if (test_decay())
+		return -1;
+	if (test_thp_policy())
+		return -1;
 	if (test_large_pages())
 		return -1;
 	if (test_first_class_heaps())
 		return -1;
+	if (test_arena())
+		return -1;
+	if (test_heap_reset())
+		return -1;
+	if (test_memory_limit())
+		return -1;
+	if (test_shared_memory())
+		return -1;
 	if (test_named_pages())
 		return -1;
 	printf("All tests passed\n");